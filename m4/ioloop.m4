@@ -2,6 +2,23 @@ dnl * I/O loop function
 AC_DEFUN([DOVECOT_IOLOOP], [
   have_ioloop=no
   
+  dnl * io_uring is used only when explicitly requested. It falls back to
+  dnl * epoll at runtime if the kernel doesn't support it.
+  if test "$ioloop" = "uring"; then
+    AC_CHECK_HEADER([linux/io_uring.h], [
+      AC_CHECK_DECL([__NR_io_uring_setup], [
+        AC_DEFINE(IOLOOP_URING,, [Implement I/O loop with Linux io_uring])
+        have_ioloop=yes
+      ], [
+        AC_MSG_ERROR([uring ioloop requested but io_uring syscalls are not available])
+      ], [
+        #include <sys/syscall.h>
+      ])
+    ], [
+      AC_MSG_ERROR([uring ioloop requested but linux/io_uring.h is not available])
+    ])
+  fi
+
   if test "$ioloop" = "best" || test "$ioloop" = "epoll"; then
     AC_CACHE_CHECK([whether we can use epoll],i_cv_epoll_works,[
       AC_TRY_RUN([
@@ -50,4 +67,16 @@ AC_DEFUN([DOVECOT_IOLOOP], [
     AC_DEFINE(IOLOOP_SELECT,, [Implement I/O loop with select()])
     ioloop="select"
   fi
+
+  dnl * The io_uring handler and its epoll fallback are tested even when
+  dnl * another ioloop is used.
+  have_io_uring=no
+  AC_CHECK_HEADER([linux/io_uring.h], [
+    AC_CHECK_DECL([__NR_io_uring_setup], [
+      have_io_uring=yes
+    ], [], [
+      #include <sys/syscall.h>
+    ])
+  ])
+  AM_CONDITIONAL(BUILD_IOLOOP_URING_TEST, test "$have_io_uring" = "yes")
 ]) 
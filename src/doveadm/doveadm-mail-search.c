@@ -1,13 +1,69 @@
 /* Copyright (c) 2010-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
+#include "env-util.h"
+#include "execv-const.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "str.h"
+#include "write-full.h"
+#include "master-interface.h"
+#include "master-service.h"
+#include "mail-namespace.h"
 #include "mail-storage.h"
 #include "doveadm-print.h"
 #include "doveadm-mailbox-list-iter.h"
 #include "doveadm-mail-iter.h"
 #include "doveadm-mail.h"
+#include "doveadm-search-results.h"
 
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define SEARCH_MAX_PARALLEL_PROCESSES 256
+
+struct search_cmd_context {
+	struct doveadm_mail_cmd_context ctx;
+	unsigned int parallel_count;
+	/* We're a worker process started by a parallel search. The
+	   mailboxes to search are read from stdin. */
+	bool parallel_worker;
+};
+
+struct search_parallel_context {
+	struct search_cmd_context *ctx;
+	struct doveadm_search_results *results;
+
+	unsigned int workers_running;
+	bool failed;
+};
+
+struct search_worker {
+	struct search_parallel_context *pctx;
+	pid_t pid;
+	int fd;
+	struct istream *input;
+	struct io *io;
+};
+
+static int
+cmd_search_box_get_guid(struct doveadm_mail_cmd_context *ctx,
+			struct mailbox *box, const char **guid_r)
+{
+	struct mailbox_metadata metadata;
+
+	if (mailbox_get_metadata(box, MAILBOX_METADATA_GUID, &metadata) < 0) {
+		i_error("Couldn't get mailbox '%s' GUID: %s",
+			mailbox_get_vname(box),
+			mailbox_get_last_internal_error(box, NULL));
+		doveadm_mail_failed_mailbox(ctx, box);
+		return -1;
+	}
+	*guid_r = guid_128_to_string(metadata.guid);
+	return 0;
+}
 
 static int
 cmd_search_box(struct doveadm_mail_cmd_context *ctx,
@@ -16,7 +72,6 @@ cmd_search_box(struct doveadm_mail_cmd_context *ctx,
 	struct doveadm_mail_iter *iter;
 	struct mailbox *box;
 	struct mail *mail;
-	struct mailbox_metadata metadata;
 	const char *guid_str;
 	int ret = 0;
 
@@ -25,14 +80,9 @@ cmd_search_box(struct doveadm_mail_cmd_context *ctx,
 		return -1;
 	box = doveadm_mail_iter_get_mailbox(iter);
 
-	if (mailbox_get_metadata(box, MAILBOX_METADATA_GUID, &metadata) < 0) {
-		i_error("Couldn't get mailbox '%s' GUID: %s",
-			mailbox_get_vname(box),
-			mailbox_get_last_internal_error(box, NULL));
+	if (cmd_search_box_get_guid(ctx, box, &guid_str) < 0)
 		ret = -1;
-		doveadm_mail_failed_mailbox(ctx, box);
-	} else {
-		guid_str = guid_128_to_string(metadata.guid);
+	else {
 		while (doveadm_mail_iter_next(iter, &mail)) {
 			doveadm_print(guid_str);
 			T_BEGIN {
@@ -46,8 +96,299 @@ cmd_search_box(struct doveadm_mail_cmd_context *ctx,
 }
 
 static int
-cmd_search_run(struct doveadm_mail_cmd_context *ctx, struct mail_user *user)
+cmd_search_box_worker(struct doveadm_mail_cmd_context *ctx,
+		      const struct mailbox_info *info, unsigned int idx)
 {
+	struct doveadm_mail_iter *iter;
+	struct mailbox *box;
+	struct mail *mail;
+	ARRAY_TYPE(seq_range) uids;
+	const char *guid_str;
+	string_t *str;
+	int ret = 0;
+
+	if (doveadm_mail_iter_init(ctx, info, ctx->search_args, 0, NULL, FALSE,
+				   &iter) < 0)
+		return -1;
+	box = doveadm_mail_iter_get_mailbox(iter);
+
+	t_array_init(&uids, 32);
+	if (cmd_search_box_get_guid(ctx, box, &guid_str) < 0)
+		ret = -1;
+	else {
+		while (doveadm_mail_iter_next(iter, &mail))
+			seq_range_array_add(&uids, mail->uid);
+	}
+	if (doveadm_mail_iter_deinit(&iter) < 0)
+		ret = -1;
+
+	if (ret == 0 && array_count(&uids) > 0) {
+		str = t_str_new(128);
+		doveadm_search_results_append_line(str, idx, guid_str, &uids);
+		if (write_full(STDOUT_FILENO, str_data(str), str_len(str)) < 0) {
+			i_error("write(search parent) failed: %m");
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static int
+cmd_search_worker_run(struct doveadm_mail_cmd_context *ctx,
+		      struct mail_user *user)
+{
+	ARRAY_TYPE(doveadm_search_mailbox) mailboxes;
+	const struct doveadm_search_mailbox *box;
+	struct mailbox_info info;
+	const char *error;
+	int ret = 0;
+
+	/* read all the mailboxes before searching, so the parent never blocks
+	   writing to us while we're blocked writing results to it */
+	t_array_init(&mailboxes, 64);
+	if (doveadm_search_mailboxes_read(STDIN_FILENO, pool_datastack_create(),
+					  &mailboxes, &error) < 0) {
+		i_error("Search parent sent invalid input: %s", error);
+		ret = -1;
+	}
+	array_foreach(&mailboxes, box) T_BEGIN {
+		i_zero(&info);
+		info.vname = box->vname;
+		info.ns = mail_namespace_find(user->namespaces, info.vname);
+		if (cmd_search_box_worker(ctx, &info, box->idx) < 0)
+			ret = -1;
+	} T_END;
+
+	if (ret < 0 && ctx->exit_code == 0)
+		ctx->exit_code = EX_TEMPFAIL;
+	return ret;
+}
+
+static void search_worker_input(struct search_worker *worker)
+{
+	struct search_parallel_context *pctx = worker->pctx;
+	const char *line, *error;
+
+	while ((line = i_stream_read_next_line(worker->input)) != NULL) {
+		if (doveadm_search_results_add_line(pctx->results, line,
+						    &error) < 0) {
+			i_error("Search worker sent invalid input: %s: %s",
+				error, line);
+			pctx->failed = TRUE;
+		}
+	}
+	if (worker->input->stream_errno != 0) {
+		i_error("read(search worker) failed: %s",
+			i_stream_get_error(worker->input));
+		pctx->failed = TRUE;
+	} else if (!worker->input->eof) {
+		return;
+	}
+
+	io_remove(&worker->io);
+	i_stream_destroy(&worker->input);
+	i_close_fd(&worker->fd);
+	i_assert(pctx->workers_running > 0);
+	if (--pctx->workers_running == 0)
+		io_loop_stop(current_ioloop);
+}
+
+static const char *const *
+search_worker_get_args(struct search_cmd_context *ctx)
+{
+	ARRAY_TYPE(const_string) args;
+	const char *const *overrides;
+	const char *arg;
+	unsigned int i, count;
+
+	t_array_init(&args, 16);
+	arg = BINDIR"/doveadm";
+	array_push_back(&args, &arg);
+	if (doveadm_debug) {
+		arg = "-D";
+		array_push_back(&args, &arg);
+	} else if (doveadm_verbose) {
+		arg = "-v";
+		array_push_back(&args, &arg);
+	}
+	overrides = master_service_get_config_overrides(master_service, &count);
+	for (i = 0; i < count; i++) {
+		arg = "-o";
+		array_push_back(&args, &arg);
+		array_push_back(&args, &overrides[i]);
+	}
+	arg = "search";
+	array_push_back(&args, &arg);
+	arg = "-W";
+	array_push_back(&args, &arg);
+	if ((ctx->ctx.service_flags &
+	     MAIL_STORAGE_SERVICE_FLAG_USERDB_LOOKUP) != 0) {
+		arg = "-u";
+		array_push_back(&args, &arg);
+		array_push_back(&args, &ctx->ctx.cctx->username);
+	}
+	arg = "--";
+	array_push_back(&args, &arg);
+	for (i = 0; ctx->ctx.args[i] != NULL; i++)
+		array_push_back(&args, &ctx->ctx.args[i]);
+	array_append_zero(&args);
+	return array_front(&args);
+}
+
+static int
+search_worker_start(struct search_parallel_context *pctx,
+		    struct search_worker *worker, const char *const *args,
+		    const char *const *vnames, unsigned int worker_idx,
+		    unsigned int worker_count)
+{
+	unsigned int i, count = str_array_length(vnames);
+	int fd_in[2], fd_out[2], ret = 0;
+	string_t *str;
+
+	if (pipe(fd_in) < 0 || pipe(fd_out) < 0)
+		i_fatal("pipe() failed: %m");
+
+	worker->pid = fork();
+	if (worker->pid < 0)
+		i_fatal("fork() failed: %m");
+	if (worker->pid == 0) {
+		/* child: execute a new doveadm process, so nothing that this
+		   process has already opened (ioloop, stats connection,
+		   mail user) gets shared with it. */
+		if (dup2(fd_in[0], STDIN_FILENO) < 0 ||
+		    dup2(fd_out[1], STDOUT_FILENO) < 0)
+			i_fatal("dup2() failed: %m");
+		i_close_fd(&fd_in[0]);
+		i_close_fd(&fd_in[1]);
+		i_close_fd(&fd_out[0]);
+		i_close_fd(&fd_out[1]);
+		env_put(t_strconcat(MASTER_CONFIG_FILE_ENV"=",
+			master_service_get_config_path(master_service), NULL));
+		execv_const(args[0], args);
+	}
+	i_close_fd(&fd_in[0]);
+	i_close_fd(&fd_out[1]);
+
+	worker->pctx = pctx;
+	worker->fd = fd_out[0];
+	pctx->workers_running++;
+
+	/* go through the mailboxes round-robin, so large mailboxes next to
+	   each others get spread between the workers. The worker reads all
+	   of its input before it writes anything, so this can't block
+	   forever. */
+	str = t_str_new(256);
+	for (i = worker_idx; i < count; i += worker_count)
+		doveadm_search_mailbox_append_line(str, i, vnames[i]);
+	if (write_full(fd_in[1], str_data(str), str_len(str)) < 0) {
+		i_error("write(search worker) failed: %m");
+		ret = -1;
+	}
+	i_close_fd(&fd_in[1]);
+	return ret;
+}
+
+static void search_worker_wait(struct search_parallel_context *pctx,
+			       struct search_worker *worker)
+{
+	struct doveadm_mail_cmd_context *ctx = &pctx->ctx->ctx;
+	int status;
+
+	if (waitpid(worker->pid, &status, 0) < 0) {
+		i_error("waitpid(search worker) failed: %m");
+		pctx->failed = TRUE;
+	} else if (WIFSIGNALED(status)) {
+		i_error("Search worker %s killed with signal %d",
+			dec2str(worker->pid), WTERMSIG(status));
+		pctx->failed = TRUE;
+	} else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+		if (ctx->exit_code == 0)
+			ctx->exit_code = WEXITSTATUS(status);
+		pctx->failed = TRUE;
+	}
+}
+
+static void search_parallel_print(const char *guid, uint32_t uid,
+				  void *context ATTR_UNUSED)
+{
+	doveadm_print(guid);
+	T_BEGIN {
+		doveadm_print(dec2str(uid));
+	} T_END;
+}
+
+static int
+cmd_search_run_parallel(struct search_cmd_context *ctx,
+			struct mail_user *user)
+{
+	const enum mailbox_list_iter_flags iter_flags =
+		MAILBOX_LIST_ITER_NO_AUTO_BOXES |
+		MAILBOX_LIST_ITER_RETURN_NO_FLAGS;
+	struct search_parallel_context pctx;
+	struct doveadm_mailbox_list_iter *iter;
+	const struct mailbox_info *info;
+	ARRAY_TYPE(const_string) vnames;
+	const char *const *args, *vname;
+	struct search_worker *workers;
+	struct ioloop *ioloop;
+	unsigned int i, count, worker_count;
+	int ret = 0;
+
+	t_array_init(&vnames, 64);
+	iter = doveadm_mailbox_list_iter_init(&ctx->ctx, user,
+					      ctx->ctx.search_args, iter_flags);
+	while ((info = doveadm_mailbox_list_iter_next(iter)) != NULL) {
+		vname = t_strdup(info->vname);
+		array_push_back(&vnames, &vname);
+	}
+	if (doveadm_mailbox_list_iter_deinit(&iter) < 0)
+		ret = -1;
+	count = array_count(&vnames);
+	array_append_zero(&vnames);
+	if (count == 0)
+		return ret;
+
+	i_zero(&pctx);
+	pctx.ctx = ctx;
+	pctx.results = doveadm_search_results_init(count);
+	worker_count = I_MIN(ctx->parallel_count, count);
+	workers = t_new(struct search_worker, worker_count);
+	args = search_worker_get_args(ctx);
+
+	for (i = 0; i < worker_count; i++) {
+		if (search_worker_start(&pctx, &workers[i], args,
+					array_front(&vnames), i,
+					worker_count) < 0)
+			pctx.failed = TRUE;
+	}
+
+	ioloop = io_loop_create();
+	for (i = 0; i < worker_count; i++) {
+		workers[i].input = i_stream_create_fd(workers[i].fd, SIZE_MAX);
+		workers[i].io = io_add(workers[i].fd, IO_READ,
+				       search_worker_input, &workers[i]);
+	}
+	if (pctx.workers_running > 0)
+		io_loop_run(ioloop);
+	io_loop_destroy(&ioloop);
+
+	for (i = 0; i < worker_count; i++)
+		search_worker_wait(&pctx, &workers[i]);
+
+	/* print the results in the same order as they would have been
+	   printed without parallel searching */
+	doveadm_search_results_foreach(pctx.results,
+				       search_parallel_print, NULL);
+	doveadm_search_results_deinit(&pctx.results);
+	if (pctx.failed)
+		ret = -1;
+	return ret;
+}
+
+static int
+cmd_search_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user)
+{
+	struct search_cmd_context *ctx = (struct search_cmd_context *)_ctx;
 	const enum mailbox_list_iter_flags iter_flags =
 		MAILBOX_LIST_ITER_NO_AUTO_BOXES |
 		MAILBOX_LIST_ITER_RETURN_NO_FLAGS;
@@ -55,10 +396,15 @@ cmd_search_run(struct doveadm_mail_cmd_context *ctx, struct mail_user *user)
 	const struct mailbox_info *info;
 	int ret = 0;
 
-	iter = doveadm_mailbox_list_iter_init(ctx, user, ctx->search_args,
+	if (ctx->parallel_worker)
+		return cmd_search_worker_run(_ctx, user);
+	if (ctx->parallel_count > 1 && !doveadm_server)
+		return cmd_search_run_parallel(ctx, user);
+
+	iter = doveadm_mailbox_list_iter_init(_ctx, user, _ctx->search_args,
 					      iter_flags);
 	while ((info = doveadm_mailbox_list_iter_next(iter)) != NULL) T_BEGIN {
-		if (cmd_search_box(ctx, info) < 0)
+		if (cmd_search_box(_ctx, info) < 0)
 			ret = -1;
 	} T_END;
 	if (doveadm_mailbox_list_iter_deinit(&iter) < 0)
@@ -80,23 +426,49 @@ static void cmd_search_init(struct doveadm_mail_cmd_context *ctx,
 	ctx->search_args = doveadm_mail_build_search_args(args);
 }
 
+static bool
+cmd_search_parse_arg(struct doveadm_mail_cmd_context *_ctx, int c)
+{
+	struct search_cmd_context *ctx = (struct search_cmd_context *)_ctx;
+
+	switch (c) {
+	case 'P':
+		if (str_to_uint(optarg, &ctx->parallel_count) < 0 ||
+		    ctx->parallel_count > SEARCH_MAX_PARALLEL_PROCESSES) {
+			i_fatal_status(EX_USAGE,
+				"Invalid -P parameter number: %s", optarg);
+		}
+		break;
+	case 'W':
+		ctx->parallel_worker = TRUE;
+		break;
+	default:
+		return FALSE;
+	}
+	return TRUE;
+}
+
 static struct doveadm_mail_cmd_context *cmd_search_alloc(void)
 {
-	struct doveadm_mail_cmd_context *ctx;
+	struct search_cmd_context *ctx;
 
-	ctx = doveadm_mail_cmd_alloc(struct doveadm_mail_cmd_context);
-	ctx->v.init = cmd_search_init;
-	ctx->v.run = cmd_search_run;
+	ctx = doveadm_mail_cmd_alloc(struct search_cmd_context);
+	ctx->ctx.getopt_args = "P:W";
+	ctx->ctx.v.parse_arg = cmd_search_parse_arg;
+	ctx->ctx.v.init = cmd_search_init;
+	ctx->ctx.v.run = cmd_search_run;
 	doveadm_print_init(DOVEADM_PRINT_TYPE_FLOW);
-	return ctx;
+	return &ctx->ctx;
 }
 
 struct doveadm_cmd_ver2 doveadm_cmd_search_ver2 = {
 	.name = "search",
 	.mail_cmd = cmd_search_alloc,
-	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "<search query>",
+	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "[-P <processes>] <search query>",
 DOVEADM_CMD_PARAMS_START
 DOVEADM_CMD_MAIL_COMMON
+DOVEADM_CMD_PARAM('P', "parallel", CMD_PARAM_INT64, 0)
+DOVEADM_CMD_PARAM('W', "parallel-worker", CMD_PARAM_BOOL, CMD_PARAM_FLAG_DO_NOT_EXPOSE)
 DOVEADM_CMD_PARAM('\0', "query", CMD_PARAM_ARRAY, CMD_PARAM_FLAG_POSITIONAL)
 DOVEADM_CMD_PARAMS_END
 };
@@ -1120,6 +1120,11 @@ doveadm_cmd_ver2_to_mail_cmd_wrapper(struct doveadm_cmd_context *cctx)
 			if (arg->type == CMD_PARAM_STR)
 				array_push_back(&full_args,
 						&arg->value.v_string);
+			else if (arg->type == CMD_PARAM_INT64) {
+				const char *value_str = p_strdup(mctx->pool,
+					dec2str(arg->value.v_int64));
+				array_push_back(&full_args, &value_str);
+			}
 		} else if ((arg->flags & CMD_PARAM_FLAG_POSITIONAL) != 0) {
 			/* feed this into pargv */
 			if (arg->type == CMD_PARAM_ARRAY)
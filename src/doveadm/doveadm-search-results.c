@@ -0,0 +1,152 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "istream.h"
+#include "str.h"
+#include "strescape.h"
+#include "strnum.h"
+#include "imap-seqset.h"
+#include "imap-util.h"
+#include "doveadm-search-results.h"
+
+struct doveadm_search_box_result {
+	const char *guid;
+	ARRAY_TYPE(seq_range) uids;
+};
+
+struct doveadm_search_results {
+	pool_t pool;
+	/* indexed by the mailbox index */
+	struct doveadm_search_box_result *boxes;
+	unsigned int mailbox_count;
+};
+
+struct doveadm_search_results *
+doveadm_search_results_init(unsigned int mailbox_count)
+{
+	struct doveadm_search_results *results;
+	pool_t pool;
+
+	pool = pool_alloconly_create("doveadm search results", 4096);
+	results = p_new(pool, struct doveadm_search_results, 1);
+	results->pool = pool;
+	results->mailbox_count = mailbox_count;
+	results->boxes = p_new(pool, struct doveadm_search_box_result,
+			       mailbox_count);
+	return results;
+}
+
+void doveadm_search_results_deinit(struct doveadm_search_results **_results)
+{
+	struct doveadm_search_results *results = *_results;
+
+	*_results = NULL;
+	pool_unref(&results->pool);
+}
+
+void doveadm_search_mailbox_append_line(string_t *dest,
+					unsigned int mailbox_idx,
+					const char *vname)
+{
+	str_printfa(dest, "%u\t", mailbox_idx);
+	str_append_tabescaped(dest, vname);
+	str_append_c(dest, '\n');
+}
+
+int doveadm_search_mailboxes_read(int fd, pool_t pool,
+				  ARRAY_TYPE(doveadm_search_mailbox) *mailboxes,
+				  const char **error_r)
+{
+	struct doveadm_search_mailbox *box;
+	struct istream *input;
+	const char *line, *const *args;
+	unsigned int idx;
+	int ret = 0;
+
+	input = i_stream_create_fd(fd, SIZE_MAX);
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		args = t_strsplit_tabescaped(line);
+		if (str_array_length(args) != 2 ||
+		    str_to_uint(args[0], &idx) < 0) {
+			*error_r = t_strdup_printf("Invalid input: %s", line);
+			ret = -1;
+			break;
+		}
+		box = array_append_space(mailboxes);
+		box->idx = idx;
+		box->vname = p_strdup(pool, args[1]);
+	}
+	if (ret == 0 && input->stream_errno != 0) {
+		*error_r = t_strdup_printf("read() failed: %s",
+					   i_stream_get_error(input));
+		ret = -1;
+	}
+	i_stream_destroy(&input);
+	return ret;
+}
+
+void doveadm_search_results_append_line(string_t *dest,
+					unsigned int mailbox_idx,
+					const char *guid,
+					const ARRAY_TYPE(seq_range) *uids)
+{
+	str_printfa(dest, "%u\t", mailbox_idx);
+	str_append_tabescaped(dest, guid);
+	str_append_c(dest, '\t');
+	imap_write_seq_range(dest, uids);
+	str_append_c(dest, '\n');
+}
+
+int doveadm_search_results_add_line(struct doveadm_search_results *results,
+				    const char *line, const char **error_r)
+{
+	struct doveadm_search_box_result *box;
+	const char *const *args = t_strsplit_tabescaped(line);
+	unsigned int idx;
+
+	if (str_array_length(args) != 3 || str_to_uint(args[0], &idx) < 0) {
+		*error_r = "Invalid input";
+		return -1;
+	}
+	if (idx >= results->mailbox_count) {
+		*error_r = "Invalid mailbox index";
+		return -1;
+	}
+
+	box = &results->boxes[idx];
+	if (box->guid != NULL) {
+		*error_r = "Duplicate mailbox index";
+		return -1;
+	}
+	p_array_init(&box->uids, results->pool, 8);
+	if (imap_seq_set_nostar_parse(args[2], &box->uids) < 0) {
+		*error_r = "Invalid UID set";
+		return -1;
+	}
+	box->guid = p_strdup(results->pool, args[1]);
+	return 0;
+}
+
+void doveadm_search_results_foreach(struct doveadm_search_results *results,
+				    doveadm_search_result_callback_t *callback,
+				    void *context)
+{
+	const struct doveadm_search_box_result *box;
+	const struct seq_range *range;
+	unsigned int i;
+	uint32_t uid;
+
+	for (i = 0; i < results->mailbox_count; i++) {
+		box = &results->boxes[i];
+		if (box->guid == NULL)
+			continue;
+		array_foreach(&box->uids, range) {
+			for (uid = range->seq1;; uid++) {
+				callback(box->guid, uid, context);
+				if (uid == range->seq2)
+					break;
+			}
+		}
+	}
+}
@@ -0,0 +1,62 @@
+#ifndef DOVEADM_SEARCH_RESULTS_H
+#define DOVEADM_SEARCH_RESULTS_H
+
+#include "seq-range-array.h"
+
+/* Search results received from parallel search workers. Each worker sends
+   one line per mailbox that had matches:
+
+   <mailbox index> TAB <mailbox GUID> TAB <UID set>
+
+   The mailbox index is the mailbox's position in the parent's mailbox
+   list, so the results can be returned in the same order as a sequential
+   search would have returned them. */
+
+/* The parent sends each worker its mailboxes as lines of:
+
+   <mailbox index> TAB <mailbox vname>
+
+   The worker reads all of them before it searches anything, so the parent
+   can write the whole list without reading the worker's results. */
+struct doveadm_search_mailbox {
+	unsigned int idx;
+	const char *vname;
+};
+ARRAY_DEFINE_TYPE(doveadm_search_mailbox, struct doveadm_search_mailbox);
+
+typedef void
+doveadm_search_result_callback_t(const char *guid, uint32_t uid,
+				 void *context);
+
+struct doveadm_search_results *
+doveadm_search_results_init(unsigned int mailbox_count);
+void doveadm_search_results_deinit(struct doveadm_search_results **_results);
+
+/* Append a mailbox line sent to a worker to dest, including the LF. */
+void doveadm_search_mailbox_append_line(string_t *dest,
+					unsigned int mailbox_idx,
+					const char *vname);
+/* Read mailbox lines from fd until EOF and add them to mailboxes, allocated
+   from pool. Returns 0 if ok, -1 if reading failed or the input was
+   invalid. */
+int doveadm_search_mailboxes_read(int fd, pool_t pool,
+				  ARRAY_TYPE(doveadm_search_mailbox) *mailboxes,
+				  const char **error_r);
+
+/* Append a result line for the mailbox to dest, including the LF. */
+void doveadm_search_results_append_line(string_t *dest,
+					unsigned int mailbox_idx,
+					const char *guid,
+					const ARRAY_TYPE(seq_range) *uids);
+/* Add a result line received from a worker (without the LF). Returns 0 if
+   ok, -1 if the line is invalid or the mailbox already has results. */
+int doveadm_search_results_add_line(struct doveadm_search_results *results,
+				    const char *line, const char **error_r);
+
+/* Call the callback for each matching UID, ordered by the mailbox index
+   and UID. */
+void doveadm_search_results_foreach(struct doveadm_search_results *results,
+				    doveadm_search_result_callback_t *callback,
+				    void *context);
+
+#endif
@@ -0,0 +1,232 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "istream.h"
+#include "str.h"
+#include "write-full.h"
+#include "test-common.h"
+#include "doveadm-search-results.h"
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define TEST_MAILBOX_COUNT 2000
+
+static void test_result_append(const char *guid, uint32_t uid, void *context)
+{
+	string_t *str = context;
+
+	str_printfa(str, "%s:%u ", guid, uid);
+}
+
+static const char *
+test_results_get(struct doveadm_search_results *results)
+{
+	string_t *str = t_str_new(128);
+
+	doveadm_search_results_foreach(results, test_result_append, str);
+	return str_c(str);
+}
+
+static void test_search_results_order(void)
+{
+	struct doveadm_search_results *results;
+	const char *error;
+
+	test_begin("search results order");
+	results = doveadm_search_results_init(4);
+
+	/* workers finish in a different order than the mailboxes were
+	   listed, and each worker sends its own mailboxes */
+	test_assert(doveadm_search_results_add_line(results,
+		"3\tguid3\t7", &error) == 0);
+	test_assert(doveadm_search_results_add_line(results,
+		"1\tguid1\t5,1:3", &error) == 0);
+	test_assert(doveadm_search_results_add_line(results,
+		"0\tguid0\t10", &error) == 0);
+	/* mailbox 2 had no matches, so its worker sent nothing */
+	test_assert_strcmp(test_results_get(results),
+		"guid0:10 guid1:1 guid1:2 guid1:3 guid1:5 guid3:7 ");
+
+	doveadm_search_results_deinit(&results);
+	test_end();
+}
+
+static void test_search_results_line(void)
+{
+	struct doveadm_search_results *results;
+	ARRAY_TYPE(seq_range) uids;
+	string_t *str = t_str_new(128);
+	const char *error;
+
+	test_begin("search results line");
+	t_array_init(&uids, 4);
+	seq_range_array_add_range(&uids, 1, 3);
+	seq_range_array_add(&uids, 10);
+	seq_range_array_add(&uids, (uint32_t)-2);
+	doveadm_search_results_append_line(str, 1, "guid1", &uids);
+	test_assert_strcmp(str_c(str), "1\tguid1\t1:3,10,4294967294\n");
+
+	results = doveadm_search_results_init(2);
+	str_truncate(str, str_len(str) - 1);
+	test_assert(doveadm_search_results_add_line(results, str_c(str),
+						    &error) == 0);
+	test_assert_strcmp(test_results_get(results),
+		"guid1:1 guid1:2 guid1:3 guid1:10 guid1:4294967294 ");
+	doveadm_search_results_deinit(&results);
+	test_end();
+}
+
+static void test_search_results_invalid(void)
+{
+	static const char *invalid_lines[] = {
+		"",
+		"0",
+		"0\tguid",
+		"0\tguid\t1\textra",
+		"x\tguid\t1",
+		"2\tguid\t1",
+		"0\tguid\t*",
+		"0\tguid\t1:",
+	};
+	struct doveadm_search_results *results;
+	const char *error;
+	unsigned int i;
+
+	test_begin("search results invalid");
+	results = doveadm_search_results_init(2);
+	for (i = 0; i < N_ELEMENTS(invalid_lines); i++) {
+		test_assert_idx(doveadm_search_results_add_line(results,
+				invalid_lines[i], &error) < 0, i);
+	}
+	test_assert(doveadm_search_results_add_line(results,
+		"1\tguid\t1", &error) == 0);
+	test_assert(doveadm_search_results_add_line(results,
+		"1\tguid\t2", &error) < 0);
+	test_assert_strcmp(error, "Duplicate mailbox index");
+	test_assert_strcmp(test_results_get(results), "guid:1 ");
+	doveadm_search_results_deinit(&results);
+	test_end();
+}
+
+static void test_search_worker(int fd_in, int fd_out)
+{
+	ARRAY_TYPE(doveadm_search_mailbox) mailboxes;
+	const struct doveadm_search_mailbox *box;
+	ARRAY_TYPE(seq_range) uids;
+	string_t *str = t_str_new(256);
+	const char *error;
+
+	t_array_init(&mailboxes, TEST_MAILBOX_COUNT);
+	if (doveadm_search_mailboxes_read(fd_in, pool_datastack_create(),
+					  &mailboxes, &error) < 0)
+		i_fatal("%s", error);
+	t_array_init(&uids, 1);
+	seq_range_array_add(&uids, 1);
+	array_foreach(&mailboxes, box) {
+		/* results are written after each mailbox, like the worker
+		   does */
+		str_truncate(str, 0);
+		doveadm_search_results_append_line(str, box->idx, box->vname,
+						   &uids);
+		if (write_full(fd_out, str_data(str), str_len(str)) < 0)
+			i_fatal("write() failed: %m");
+	}
+}
+
+static void test_search_mailboxes_large(void)
+{
+	struct doveadm_search_results *results;
+	struct istream *input;
+	string_t *str = t_str_new(1024 * 256);
+	const char *line, *error;
+	char vname[101];
+	int fd_in[2], fd_out[2], status;
+	unsigned int i;
+	pid_t pid;
+
+	test_begin("search mailboxes large");
+	/* both the mailbox list and the results are larger than the pipe
+	   buffers */
+	memset(vname, 'x', sizeof(vname) - 1);
+	vname[sizeof(vname) - 1] = '\0';
+	for (i = 0; i < TEST_MAILBOX_COUNT; i++) {
+		doveadm_search_mailbox_append_line(str, i,
+			t_strdup_printf("%s\t%u", vname, i));
+	}
+	test_assert(str_len(str) > 64 * 1024);
+
+	if (pipe(fd_in) < 0 || pipe(fd_out) < 0)
+		i_fatal("pipe() failed: %m");
+	pid = fork();
+	if (pid < 0)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		i_close_fd(&fd_in[1]);
+		i_close_fd(&fd_out[0]);
+		test_search_worker(fd_in[0], fd_out[1]);
+		exit(0);
+	}
+	i_close_fd(&fd_in[0]);
+	i_close_fd(&fd_out[1]);
+
+	/* the parent writes the whole list before reading anything. If the
+	   worker didn't read all of it first, this would hang. */
+	alarm(30);
+	if (write_full(fd_in[1], str_data(str), str_len(str)) < 0)
+		i_fatal("write() failed: %m");
+	i_close_fd(&fd_in[1]);
+
+	results = doveadm_search_results_init(TEST_MAILBOX_COUNT);
+	input = i_stream_create_fd_autoclose(&fd_out[0], SIZE_MAX);
+	i = 0;
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		test_assert_idx(doveadm_search_results_add_line(results, line,
+								&error) == 0, i);
+		i++;
+	}
+	test_assert(input->stream_errno == 0);
+	test_assert(i == TEST_MAILBOX_COUNT);
+	i_stream_destroy(&input);
+	alarm(0);
+
+	test_assert(waitpid(pid, &status, 0) == pid);
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	doveadm_search_results_deinit(&results);
+	test_end();
+}
+
+static void test_search_mailboxes_invalid(void)
+{
+	ARRAY_TYPE(doveadm_search_mailbox) mailboxes;
+	const char *error;
+	int fd[2];
+
+	test_begin("search mailboxes invalid");
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	if (write_full(fd[1], "0\tINBOX\nfoo\n", 12) < 0)
+		i_fatal("write() failed: %m");
+	i_close_fd(&fd[1]);
+	t_array_init(&mailboxes, 4);
+	test_assert(doveadm_search_mailboxes_read(fd[0],
+			pool_datastack_create(), &mailboxes, &error) < 0);
+	test_assert_strcmp(error, "Invalid input: foo");
+	test_assert(array_count(&mailboxes) == 1);
+	i_close_fd(&fd[0]);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_search_results_order,
+		test_search_results_line,
+		test_search_results_invalid,
+		test_search_mailboxes_large,
+		test_search_mailboxes_invalid,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -124,6 +124,32 @@ indexer_client_request_optimize(struct indexer_client *client,
 	return 0;
 }
 
+static int
+indexer_client_request_fragmentation(struct indexer_client *client,
+				     const char *const *args,
+				     const char **error_r)
+{
+	unsigned int tag, fragmentation;
+
+	/* <tag> <user> <mailbox> <fragmentation percentage> */
+	if (str_array_length(args) != 4) {
+		*error_r = "Wrong parameter count";
+		return -1;
+	}
+	if (str_to_uint(args[0], &tag) < 0) {
+		*error_r = "Invalid tag";
+		return -1;
+	}
+	if (str_to_uint(args[3], &fragmentation) < 0 || fragmentation > 100) {
+		*error_r = "Invalid fragmentation";
+		return -1;
+	}
+
+	indexer_set_fragmentation(args[1], args[2], fragmentation);
+	o_stream_nsend_str(client->output, t_strdup_printf("%u\tOK\n", tag));
+	return 0;
+}
+
 static int
 indexer_client_request(struct indexer_client *client,
 		       const char *const *args, const char **error_r)
@@ -138,6 +164,8 @@ indexer_client_request(struct indexer_client *client,
 		return indexer_client_request_queue(client, FALSE, args, error_r);
 	else if (strcmp(cmd, "OPTIMIZE") == 0)
 		return indexer_client_request_optimize(client, args, error_r);
+	else if (strcmp(cmd, "FRAGMENTATION") == 0)
+		return indexer_client_request_fragmentation(client, args, error_r);
 	else {
 		*error_r = t_strconcat("Unknown command: ", cmd, NULL);
 		return -1;
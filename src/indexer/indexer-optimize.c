@@ -0,0 +1,178 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "hash.h"
+#include "time-util.h"
+#include "indexer-queue.h"
+#include "indexer-optimize.h"
+
+struct indexer_optimize_user {
+	char *username;
+	/* the mailbox that last reported the fragmentation. the optimize
+	   request is sent for it, but the backends optimize the whole
+	   user's index. */
+	char *mailbox;
+	unsigned int fragmentation;
+};
+
+struct indexer_optimize {
+	struct indexer_queue *queue;
+	struct event *event;
+
+	HASH_TABLE(char *, struct indexer_optimize_user *) users;
+	struct timeout *to;
+	/* don't start optimizing before this time */
+	struct timeval next_allowed_time;
+
+	bool idle:1;
+};
+
+static void indexer_optimize_timeout(struct indexer_optimize *opt);
+
+static void indexer_optimize_user_free(struct indexer_optimize_user *ouser)
+{
+	i_free(ouser->username);
+	i_free(ouser->mailbox);
+	i_free(ouser);
+}
+
+static void indexer_optimize_timeout_update(struct indexer_optimize *opt)
+{
+	int wait_msecs, msecs = INDEXER_OPTIMIZE_IDLE_MSECS;
+
+	if (!opt->idle || hash_table_count(opt->users) == 0) {
+		timeout_remove(&opt->to);
+		return;
+	}
+	if (opt->to != NULL)
+		return;
+
+	wait_msecs = timeval_diff_msecs(&opt->next_allowed_time,
+					&ioloop_timeval);
+	if (wait_msecs > msecs)
+		msecs = wait_msecs;
+	opt->to = timeout_add(msecs, indexer_optimize_timeout, opt);
+}
+
+static void indexer_optimize_timeout(struct indexer_optimize *opt)
+{
+	struct hash_iterate_context *iter;
+	struct indexer_optimize_user *ouser, *best = NULL;
+	char *username;
+
+	timeout_remove(&opt->to);
+
+	iter = hash_table_iterate_init(opt->users);
+	while (hash_table_iterate(iter, opt->users, &username, &ouser)) {
+		if (best == NULL ||
+		    ouser->fragmentation > best->fragmentation)
+			best = ouser;
+	}
+	hash_table_iterate_deinit(&iter);
+	i_assert(best != NULL);
+
+	hash_table_remove(opt->users, best->username);
+	e_debug(event_create_passthrough(opt->event)->
+		set_name("indexer_optimize_started")->
+		add_str("user", best->username)->
+		add_str("mailbox", best->mailbox)->
+		add_int("fragmentation", best->fragmentation)->event(),
+		"Optimizing idle user %s (mailbox %s, %u%% fragmented)",
+		best->username, best->mailbox, best->fragmentation);
+	/* this calls the listen callback, which updates the idle state */
+	indexer_queue_append_optimize(opt->queue, best->username,
+				      best->mailbox, NULL);
+	indexer_optimize_user_free(best);
+	indexer_optimize_timeout_update(opt);
+}
+
+struct indexer_optimize *indexer_optimize_init(struct indexer_queue *queue)
+{
+	struct indexer_optimize *opt;
+
+	opt = i_new(struct indexer_optimize, 1);
+	opt->queue = queue;
+	opt->event = event_create(NULL);
+	event_set_append_log_prefix(opt->event, "optimize: ");
+	hash_table_create(&opt->users, default_pool, 0, str_hash, strcmp);
+	return opt;
+}
+
+void indexer_optimize_deinit(struct indexer_optimize **_opt)
+{
+	struct indexer_optimize *opt = *_opt;
+	struct hash_iterate_context *iter;
+	struct indexer_optimize_user *ouser;
+	char *username;
+
+	*_opt = NULL;
+
+	iter = hash_table_iterate_init(opt->users);
+	while (hash_table_iterate(iter, opt->users, &username, &ouser))
+		indexer_optimize_user_free(ouser);
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&opt->users);
+
+	timeout_remove(&opt->to);
+	event_unref(&opt->event);
+	i_free(opt);
+}
+
+void indexer_optimize_set_fragmentation(struct indexer_optimize *opt,
+					const char *username,
+					const char *mailbox,
+					unsigned int fragmentation)
+{
+	struct indexer_optimize_user *ouser;
+
+	ouser = hash_table_lookup(opt->users, username);
+	if (fragmentation < INDEXER_OPTIMIZE_MIN_FRAGMENTATION) {
+		if (ouser != NULL) {
+			hash_table_remove(opt->users, username);
+			indexer_optimize_user_free(ouser);
+		}
+	} else if (ouser != NULL) {
+		ouser->fragmentation = fragmentation;
+		if (strcmp(ouser->mailbox, mailbox) != 0) {
+			i_free(ouser->mailbox);
+			ouser->mailbox = i_strdup(mailbox);
+		}
+	} else if (hash_table_count(opt->users) >=
+		   INDEXER_OPTIMIZE_MAX_USERS) {
+		e_debug(opt->event, "Too many users waiting for optimizing"
+			" - ignoring user %s", username);
+	} else {
+		ouser = i_new(struct indexer_optimize_user, 1);
+		ouser->username = i_strdup(username);
+		ouser->mailbox = i_strdup(mailbox);
+		ouser->fragmentation = fragmentation;
+		hash_table_insert(opt->users, ouser->username, ouser);
+	}
+	indexer_optimize_timeout_update(opt);
+}
+
+void indexer_optimize_set_idle(struct indexer_optimize *opt, bool idle)
+{
+	/* the idle wait restarts whenever the indexer becomes busy */
+	opt->idle = idle;
+	indexer_optimize_timeout_update(opt);
+}
+
+void indexer_optimize_request_finished(struct indexer_optimize *opt,
+				       const struct indexer_request *request)
+{
+	long long work_usecs, delay_usecs;
+
+	if (!request->optimize)
+		return;
+
+	work_usecs = timeval_diff_usecs(&ioloop_timeval,
+					&request->work_start_time);
+	if (work_usecs <= 0)
+		return;
+	delay_usecs = work_usecs * (100 - INDEXER_OPTIMIZE_TIME_BUDGET_PERCENT) /
+		INDEXER_OPTIMIZE_TIME_BUDGET_PERCENT;
+	opt->next_allowed_time = ioloop_timeval;
+	timeval_add_usecs(&opt->next_allowed_time, delay_usecs);
+}
@@ -0,0 +1,43 @@
+#ifndef INDEXER_OPTIMIZE_H
+#define INDEXER_OPTIMIZE_H
+
+struct indexer_queue;
+struct indexer_request;
+
+/* Users with a lower FTS index fragmentation percentage aren't optimized
+   automatically. */
+#define INDEXER_OPTIMIZE_MIN_FRAGMENTATION 25
+/* Maximum number of users waiting to be optimized. */
+#define INDEXER_OPTIMIZE_MAX_USERS 1024
+/* The indexer must have been idle this long before optimizing starts.
+   The unit test overrides this. */
+#ifndef INDEXER_OPTIMIZE_IDLE_MSECS
+#  define INDEXER_OPTIMIZE_IDLE_MSECS (30*1000)
+#endif
+/* Percentage of the time that can be spent on automatic optimizing. */
+#define INDEXER_OPTIMIZE_TIME_BUDGET_PERCENT 10
+
+/* Indexer workers report the FTS index fragmentation after indexing a
+   mailbox. The FTS backends optimize the whole user's index at once, so the
+   fragmentation is tracked per user. When the indexer has no other work,
+   the most fragmented user is added to the queue as a single optimize
+   request. The time spent optimizing is
+   limited so that after an optimize request finishes, the next one is
+   delayed by the time it took multiplied by
+   (100 - budget) / budget. */
+struct indexer_optimize *indexer_optimize_init(struct indexer_queue *queue);
+void indexer_optimize_deinit(struct indexer_optimize **opt);
+
+/* Update the user's fragmentation percentage (0..100), reported after
+   indexing the mailbox. */
+void indexer_optimize_set_fragmentation(struct indexer_optimize *opt,
+					const char *username,
+					const char *mailbox,
+					unsigned int fragmentation);
+/* Set whether the indexer is currently idle. */
+void indexer_optimize_set_idle(struct indexer_optimize *opt, bool idle);
+/* Called when a request finishes in a worker. */
+void indexer_optimize_request_finished(struct indexer_optimize *opt,
+				       const struct indexer_request *request);
+
+#endif
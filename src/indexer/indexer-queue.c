@@ -4,15 +4,66 @@
 #include "array.h"
 #include "llist.h"
 #include "hash.h"
+#include "ioloop.h"
+#include "priorityq.h"
+#include "time-util.h"
 #include "indexer-queue.h"
 
+/* The virtual time of a user advances by the time spent working on the
+   user's requests divided by the class weight. */
+static const unsigned int indexer_request_class_weights[] = {
+	[INDEXER_REQUEST_CLASS_INTERACTIVE] = 4,
+	[INDEXER_REQUEST_CLASS_BACKGROUND] = 1,
+};
+
+static const char *const indexer_request_class_names[] = {
+	[INDEXER_REQUEST_CLASS_INTERACTIVE] = "interactive",
+	[INDEXER_REQUEST_CLASS_BACKGROUND] = "background",
+};
+
+struct indexer_user_sched {
+	/* must be first */
+	struct priorityq_item item;
+
+	struct indexer_user *user;
+	enum indexer_request_class class;
+	/* item is in the queue's priorityq */
+	bool queued;
+};
+
+struct indexer_user {
+	struct indexer_queue *queue;
+	char *username;
+
+	/* Queued requests for each class */
+	struct indexer_request *head[INDEXER_REQUEST_CLASS_COUNT];
+	struct indexer_request *tail[INDEXER_REQUEST_CLASS_COUNT];
+	struct indexer_user_sched sched[INDEXER_REQUEST_CLASS_COUNT];
+
+	/* usecs of work done, weighted by the request classes */
+	uint64_t vtime;
+	unsigned int queued_count;
+	unsigned int working_count;
+};
+
 struct indexer_queue {
 	indexer_status_callback_t *callback;
 	void (*listen_callback)(struct indexer_queue *);
+	struct event *event;
 
 	/* username+mailbox -> indexer_request */
 	HASH_TABLE(struct indexer_request *, struct indexer_request *) requests;
-	struct indexer_request *head, *tail;
+	/* username -> indexer_user */
+	HASH_TABLE(char *, struct indexer_user *) users;
+	/* Users that have queued requests of the class and that can start
+	   working on them, sorted by virtual time */
+	struct priorityq *pq[INDEXER_REQUEST_CLASS_COUNT];
+
+	/* Virtual time of the most recently scheduled user. Users that
+	   become active start from here. */
+	uint64_t vtime;
+	int64_t last_seq;
+	unsigned int queued_count;
 };
 
 static unsigned int
@@ -28,27 +79,55 @@ static int indexer_request_cmp(const struct indexer_request *r1,
 		strcmp(r1->mailbox, r2->mailbox) == 0 ? 0 : 1;
 }
 
+static int indexer_user_sched_cmp(const void *p1, const void *p2)
+{
+	const struct indexer_user_sched *s1 = p1, *s2 = p2;
+	const struct indexer_request *r1 = s1->user->head[s1->class];
+	const struct indexer_request *r2 = s2->user->head[s2->class];
+
+	if (s1->user->vtime < s2->user->vtime)
+		return -1;
+	if (s1->user->vtime > s2->user->vtime)
+		return 1;
+	if (r1->queue_seq < r2->queue_seq)
+		return -1;
+	if (r1->queue_seq > r2->queue_seq)
+		return 1;
+	return 0;
+}
+
 struct indexer_queue *
 indexer_queue_init(indexer_status_callback_t *callback)
 {
 	struct indexer_queue *queue;
+	unsigned int i;
 	
 	queue = i_new(struct indexer_queue, 1);
 	queue->callback = callback;
+	queue->event = event_create(NULL);
 	hash_table_create(&queue->requests, default_pool, 0,
 			  indexer_request_hash, indexer_request_cmp);
+	hash_table_create(&queue->users, default_pool, 0, str_hash, strcmp);
+	for (i = 0; i < INDEXER_REQUEST_CLASS_COUNT; i++)
+		queue->pq[i] = priorityq_init(indexer_user_sched_cmp, 16);
 	return queue;
 }
 
 void indexer_queue_deinit(struct indexer_queue **_queue)
 {
 	struct indexer_queue *queue = *_queue;
+	unsigned int i;
 
 	*_queue = NULL;
 
 	i_assert(indexer_queue_is_empty(queue));
+	i_assert(hash_table_count(queue->users) == 0);
 
+	for (i = 0; i < INDEXER_REQUEST_CLASS_COUNT; i++)
+		priorityq_deinit(&queue->pq[i]);
+	hash_table_destroy(&queue->users);
 	hash_table_destroy(&queue->requests);
+	event_unref(&queue->event);
 	i_free(queue);
 }
 
@@ -69,6 +148,106 @@ indexer_queue_lookup(struct indexer_queue *queue,
 	return hash_table_lookup(queue->requests, &lookup_request);
 }
 
+static struct indexer_user *
+indexer_user_get(struct indexer_queue *queue, const char *username)
+{
+	struct indexer_user *user;
+	unsigned int i;
+
+	user = hash_table_lookup(queue->users, username);
+	if (user != NULL)
+		return user;
+
+	user = i_new(struct indexer_user, 1);
+	user->queue = queue;
+	user->username = i_strdup(username);
+	user->vtime = queue->vtime;
+	for (i = 0; i < INDEXER_REQUEST_CLASS_COUNT; i++) {
+		user->sched[i].user = user;
+		user->sched[i].class = i;
+	}
+	hash_table_insert(queue->users, user->username, user);
+	return user;
+}
+
+static void indexer_user_update_sched(struct indexer_user *user)
+{
+	struct indexer_user_sched *sched;
+	unsigned int i;
+
+	/* the user's priority may have changed, so always remove and re-add
+	   the user to the queues */
+	for (i = 0; i < INDEXER_REQUEST_CLASS_COUNT; i++) {
+		sched = &user->sched[i];
+		if (sched->queued) {
+			priorityq_remove(user->queue->pq[i], &sched->item);
+			sched->queued = FALSE;
+		}
+		if (user->head[i] != NULL &&
+		    user->working_count < INDEXER_USER_MAX_WORKING_REQUESTS) {
+			priorityq_add(user->queue->pq[i], &sched->item);
+			sched->queued = TRUE;
+		}
+	}
+}
+
+static void indexer_user_unref_if_unused(struct indexer_user *user)
+{
+	unsigned int i;
+
+	if (user->queued_count > 0 || user->working_count > 0)
+		return;
+
+	for (i = 0; i < INDEXER_REQUEST_CLASS_COUNT; i++)
+		i_assert(!user->sched[i].queued);
+	hash_table_remove(user->queue->users, user->username);
+	i_free(user->username);
+	i_free(user);
+}
+
+static void
+indexer_queue_link_request(struct indexer_queue *queue,
+			   struct indexer_request *request,
+			   enum indexer_request_class class, bool append)
+{
+	struct indexer_user *user = request->user;
+
+	if (user->queued_count++ == 0 && user->working_count == 0) {
+		/* User became active. Don't let it catch up on the time it
+		   was idle. */
+		user->vtime = I_MAX(user->vtime, queue->vtime);
+	}
+	queue->queued_count++;
+
+	request->class = class;
+	request->queued_time = ioloop_timeval;
+	/* appended requests get increasing sequences, prepended requests
+	   decreasing negative ones, so the ordering between users matches the
+	   ordering within each user's list. */
+	request->queue_seq = append ? ++queue->last_seq : -(++queue->last_seq);
+	if (append)
+		DLLIST2_APPEND(&user->head[class], &user->tail[class], request);
+	else
+		DLLIST2_PREPEND(&user->head[class], &user->tail[class], request);
+	indexer_user_update_sched(user);
+}
+
+static void
+indexer_queue_unlink_request(struct indexer_queue *queue,
+			     struct indexer_request *request)
+{
+	struct indexer_user *user = request->user;
+	enum indexer_request_class class = request->class;
+
+	i_assert(user->queued_count > 0);
+	i_assert(queue->queued_count > 0);
+
+	DLLIST2_REMOVE(&user->head[class], &user->tail[class], request);
+	user->queued_count--;
+	queue->queued_count--;
+	indexer_user_update_sched(user);
+}
+
 static void request_add_context(struct indexer_request *request, void *context)
 {
 	if (context == NULL)
@@ -90,12 +269,20 @@ indexer_queue_append_request(struct indexer_queue *queue, bool append,
 	request = indexer_queue_lookup(queue, username, mailbox);
 	if (request == NULL) {
 		request = i_new(struct indexer_request, 1);
+		request->user = indexer_user_get(queue, username);
 		request->username = i_strdup(username);
 		request->mailbox = i_strdup(mailbox);
 		request->session_id = i_strdup(session_id);
 		request->max_recent_msgs = max_recent_msgs;
 		request_add_context(request, context);
 		hash_table_insert(queue->requests, request, request);
+
+		request->event = event_create(queue->event);
+		event_add_str(request->event, "user", username);
+		event_add_str(request->event, "mailbox", mailbox);
+		event_add_str(request->event, "session", session_id);
+		event_set_append_log_prefix(request->event,
+			t_strdup_printf("%s/%s: ", username, mailbox));
 	} else {
 		if (request->max_recent_msgs > max_recent_msgs)
 			request->max_recent_msgs = max_recent_msgs;
@@ -112,14 +299,13 @@ indexer_queue_append_request(struct indexer_queue *queue, bool append,
 			/* keep the request in its old position */
 			return request;
 		}
-		/* move request to beginning of the queue */
-		DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+		/* move request to beginning of the interactive queue */
+		indexer_queue_unlink_request(queue, request);
 	}
 
-	if (append)
-		DLLIST2_APPEND(&queue->head, &queue->tail, request);
-	else
-		DLLIST2_PREPEND(&queue->head, &queue->tail, request);
+	indexer_queue_link_request(queue, request, append ?
+				   INDEXER_REQUEST_CLASS_BACKGROUND :
+				   INDEXER_REQUEST_CLASS_INTERACTIVE, append);
 	return request;
 }
 
@@ -158,16 +344,26 @@ void indexer_queue_append_optimize(struct indexer_queue *queue,
 
 struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue)
 {
-	return queue->head;
+	struct indexer_user_sched *sched;
+	unsigned int i;
+
+	for (i = 0; i < INDEXER_REQUEST_CLASS_COUNT; i++) {
+		sched = (struct indexer_user_sched *)priorityq_peek(queue->pq[i]);
+		if (sched != NULL)
+			return sched->user->head[i];
+	}
+	return NULL;
 }
 
 void indexer_queue_request_remove(struct indexer_queue *queue)
 {
-	struct indexer_request *request = queue->head;
+	struct indexer_request *request = indexer_queue_request_peek(queue);
 
 	i_assert(request != NULL);
 
-	DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+	if (queue->vtime < request->user->vtime)
+		queue->vtime = request->user->vtime;
+	indexer_queue_unlink_request(queue, request);
 }
 
 static void indexer_queue_request_status_int(struct indexer_queue *queue,
@@ -192,20 +388,54 @@ void indexer_queue_request_status(struct indexer_queue *queue,
 	indexer_queue_request_status_int(queue, request, percentage);
 }
 
-void indexer_queue_move_head_to_tail(struct indexer_queue *queue)
-{
-	struct indexer_request *request = queue->head;
-
-	indexer_queue_request_remove(queue);
-	DLLIST2_APPEND(&queue->head, &queue->tail, request);
-}
-
 void indexer_queue_request_work(struct indexer_request *request)
 {
 	request->working = TRUE;
 	request->working_context_idx =
 		!array_is_created(&request->contexts) ? 0 :
 		array_count(&request->contexts);
+	request->work_start_time = ioloop_timeval;
+
+	request->user->working_count++;
+	indexer_user_update_sched(request->user);
+
+	e_debug(event_create_passthrough(request->event)->
+		set_name("indexer_request_started")->
+		add_str("class", indexer_request_class_names[request->class])->
+		add_int("queue_msecs",
+			timeval_diff_msecs(&request->work_start_time,
+					   &request->queued_time))->event(),
+		"Started %s request", indexer_request_class_names[request->class]);
+}
+
+static void
+indexer_queue_request_work_finished(struct indexer_request *request,
+				    bool success)
+{
+	struct indexer_user *user = request->user;
+	long long work_usecs;
+
+	work_usecs = timeval_diff_usecs(&ioloop_timeval,
+					&request->work_start_time);
+	if (work_usecs > 0) {
+		user->vtime += work_usecs /
+			indexer_request_class_weights[request->class];
+	}
+	i_assert(user->working_count > 0);
+	user->working_count--;
+	indexer_user_update_sched(user);
+
+	e_debug(event_create_passthrough(request->event)->
+		set_name("indexer_request_finished")->
+		add_str("class", indexer_request_class_names[request->class])->
+		add_int("queue_msecs",
+			timeval_diff_msecs(&request->work_start_time,
+					   &request->queued_time))->
+		add_int("work_msecs", work_usecs / 1000)->
+		add_str("success", success ? "yes" : "no")->event(),
+		"Finished %s request%s",
+		indexer_request_class_names[request->class],
+		success ? "" : " (failed)");
 }
 
 void indexer_queue_request_finish(struct indexer_queue *queue,
@@ -217,8 +447,12 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 	*_request = NULL;
 
 	indexer_queue_request_status_int(queue, request, success ? 100 : -1);
+	if (request->working)
+		indexer_queue_request_work_finished(request, success);
 
 	if (request->reindex_head || request->reindex_tail) {
+		bool reindex_head = request->reindex_head;
+
 		i_assert(request->working);
 		request->working = FALSE;
 		request->reindex_head = FALSE;
@@ -227,18 +461,24 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 			array_delete(&request->contexts, 0,
 				     request->working_context_idx);
 		}
-		if (request->reindex_head)
-			DLLIST2_PREPEND(&queue->head, &queue->tail, request);
-		else
-			DLLIST2_APPEND(&queue->head, &queue->tail, request);
+		if (reindex_head) {
+			indexer_queue_link_request(queue, request,
+				INDEXER_REQUEST_CLASS_INTERACTIVE, FALSE);
+		} else {
+			indexer_queue_link_request(queue, request,
+				INDEXER_REQUEST_CLASS_BACKGROUND, TRUE);
+		}
 		return;
 	}
 
 	hash_table_remove(queue->requests, request);
+	indexer_user_unref_if_unused(request->user);
 	if (array_is_created(&request->contexts))
 		array_free(&request->contexts);
+	event_unref(&request->event);
 	i_free(request->username);
 	i_free(request->mailbox);
+	i_free(request->session_id);
 	i_free(request);
 
 	indexer_refresh_proctitle();
@@ -248,24 +488,35 @@ void indexer_queue_cancel_all(struct indexer_queue *queue)
 {
 	struct indexer_request *request;
 	struct hash_iterate_context *iter;
+	ARRAY(struct indexer_request *) queued_requests;
 
 	/* remove all reindex-markers so when the current requests finish
 	   (or are cancelled) we don't try to retry them (especially during
 	   deinit where it crashes) */
+	i_array_init(&queued_requests, queue->queued_count + 1);
 	iter = hash_table_iterate_init(queue->requests);
-	while (hash_table_iterate(iter, queue->requests, &request, &request))
+	while (hash_table_iterate(iter, queue->requests, &request, &request)) {
 		request->reindex_head = request->reindex_tail = FALSE;
+		if (!request->working)
+			array_push_back(&queued_requests, &request);
+	}
 	hash_table_iterate_deinit(&iter);
 
-	while ((request = indexer_queue_request_peek(queue)) != NULL) {
-		indexer_queue_request_remove(queue);
-		indexer_queue_request_finish(queue, &request, FALSE);
+	/* requests of users that are already being worked on aren't returned
+	   by indexer_queue_request_peek(), so cancel everything directly */
+	array_foreach_elem(&queued_requests, request) {
+		struct indexer_request *cancel_request = request;
+
+		indexer_queue_unlink_request(queue, cancel_request);
+		indexer_queue_request_finish(queue, &cancel_request, FALSE);
 	}
+	array_free(&queued_requests);
+	i_assert(queue->queued_count == 0);
 }
 
 bool indexer_queue_is_empty(struct indexer_queue *queue)
 {
-	return queue->head == NULL;
+	return queue->queued_count == 0;
 }
 
 unsigned int indexer_queue_count(struct indexer_queue *queue)
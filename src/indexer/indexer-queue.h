@@ -3,14 +3,36 @@
 
 #include "indexer.h"
 
+/* Maximum number of requests for the same user that can be worked on at
+   the same time. */
+#define INDEXER_USER_MAX_WORKING_REQUESTS 1
+
+enum indexer_request_class {
+	/* Someone is waiting for the indexing to finish (e.g. SEARCH) */
+	INDEXER_REQUEST_CLASS_INTERACTIVE = 0,
+	/* Indexing new mails, doveadm index -q, optimizing */
+	INDEXER_REQUEST_CLASS_BACKGROUND,
+
+	INDEXER_REQUEST_CLASS_COUNT
+};
+
 struct indexer_request {
 	struct indexer_request *prev, *next;
+	struct indexer_user *user;
+	struct event *event;
 
 	char *username;
 	char *mailbox;
 	char *session_id;
 	unsigned int max_recent_msgs;
 
+	enum indexer_request_class class;
+	/* when the request was added to the queue / sent to a worker */
+	struct timeval queued_time, work_start_time;
+	/* Position in the queue. Used to keep the FIFO order between users
+	   that have the same virtual time. */
+	int64_t queue_seq;
+
 	/* index messages in this mailbox */
 	bool index:1;
 	/* optimize this mailbox */
@@ -30,6 +52,16 @@ struct indexer_request {
 	ARRAY(void *) contexts;
 };
 
+/* Requests are scheduled fairly between users: Each user has a virtual time,
+   which advances by the time spent indexing the user's mailboxes. The next
+   request is taken from the user with the lowest virtual time, so a user
+   with a large amount of indexing work can't starve the others. Interactive
+   requests are always sent before background requests, and each user can
+   have at most INDEXER_USER_MAX_WORKING_REQUESTS requests being worked on.
+
+   The "indexer_request_started" and "indexer_request_finished" events
+   contain the time the request spent in the queue, which can be used for
+   queue latency histograms in the statistics. */
 struct indexer_queue *indexer_queue_init(indexer_status_callback_t *callback);
 void indexer_queue_deinit(struct indexer_queue **queue);
 
@@ -49,7 +81,9 @@ void indexer_queue_cancel_all(struct indexer_queue *queue);
 bool indexer_queue_is_empty(struct indexer_queue *queue);
 unsigned int indexer_queue_count(struct indexer_queue *queue);
 
-/* Return the next request from the queue, without removing it. */
+/* Return the next request that can be worked on, without removing it.
+   Returns NULL if the queue is empty or all the queued requests' users
+   already have the maximum number of requests being worked on. */
 struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue);
 /* Remove the next request from the queue. You must call
    indexer_queue_request_finish() to free its memory. */
@@ -58,8 +92,6 @@ void indexer_queue_request_remove(struct indexer_queue *queue);
 void indexer_queue_request_status(struct indexer_queue *queue,
 				  struct indexer_request *request,
 				  int percentage);
-/* Move the next request to the end of the queue. */
-void indexer_queue_move_head_to_tail(struct indexer_queue *queue);
 /* Start working on a request */
 void indexer_queue_request_work(struct indexer_request *request);
 /* Finish the request and free its memory. */
@@ -8,6 +8,7 @@
 #include "master-service-settings.h"
 #include "indexer-client.h"
 #include "indexer-queue.h"
+#include "indexer-optimize.h"
 #include "worker-pool.h"
 #include "worker-connection.h"
 
@@ -19,6 +20,7 @@ struct worker_request {
 static const struct master_service_settings *set;
 static struct indexer_queue *queue;
 static struct worker_pool *worker_pool;
+static struct indexer_optimize *optimize;
 static struct timeout *to_send_more;
 
 void indexer_refresh_proctitle(void)
@@ -31,6 +33,13 @@ void indexer_refresh_proctitle(void)
 					  indexer_queue_count(queue)));
 }
 
+void indexer_set_fragmentation(const char *username, const char *mailbox,
+			       unsigned int fragmentation)
+{
+	indexer_optimize_set_fragmentation(optimize, username, mailbox,
+					   fragmentation);
+}
+
 static bool idle_die(void)
 {
 	return indexer_queue_is_empty(queue) &&
@@ -59,29 +68,13 @@ static void worker_send_request(struct worker_connection *conn,
 static void queue_try_send_more(struct indexer_queue *queue)
 {
 	struct worker_connection *conn;
-	struct indexer_request *request, *first_moved_request = NULL;
+	struct indexer_request *request;
 
 	timeout_remove(&to_send_more);
 
+	/* The queue returns only requests for users that aren't already
+	   being worked on by too many workers. */
 	while ((request = indexer_queue_request_peek(queue)) != NULL) {
-		conn = worker_pool_find_username_connection(worker_pool,
-							    request->username);
-		if (conn != NULL) {
-			/* There is already a connection handling a request
-			 * for this user. Move the request to the back of the
-			 * queue and handle requests from other users.
-			 * Terminate if we went through all requests. */
-			if (request == first_moved_request) {
-				/* all requests are waiting for existing users
-				   to finish. */
-				break;
-			}
-			if (first_moved_request == NULL)
-				first_moved_request = request;
-			indexer_queue_move_head_to_tail(queue);
-			continue;
-		}
-
 		/* create a new connection to a worker */
 		if (!worker_pool_get_connection(worker_pool, &conn))
 			break;
@@ -89,6 +82,7 @@ static void queue_try_send_more(struct indexer_queue *queue)
 		indexer_queue_request_remove(queue);
 		worker_send_request(conn, request);
 	}
+	indexer_optimize_set_idle(optimize, idle_die());
 }
 
 static void queue_listen_callback(struct indexer_queue *queue)
@@ -107,6 +101,7 @@ static void worker_status_callback(int percentage, void *context)
 		return;
 	}
 
+	indexer_optimize_request_finished(optimize, request);
 	indexer_queue_request_finish(queue, &request,
 				     percentage == 100);
 	if (worker_pool != NULL) /* not in deinit */
@@ -141,6 +136,7 @@ int main(int argc, char *argv[])
 	indexer_queue_set_listen_callback(queue, queue_listen_callback);
 	worker_pool = worker_pool_init("indexer-worker",
 				       worker_status_callback);
+	optimize = indexer_optimize_init(queue);
 	master_service_init_finish(master_service);
 
 	master_service_run(master_service, client_connected);
@@ -148,6 +144,7 @@ int main(int argc, char *argv[])
 	indexer_queue_cancel_all(queue);
 	indexer_clients_destroy_all();
 	worker_pool_deinit(&worker_pool);
+	indexer_optimize_deinit(&optimize);
 	indexer_queue_deinit(&queue);
 	timeout_remove(&to_send_more);
 
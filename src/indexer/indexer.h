@@ -5,5 +5,9 @@
 typedef void indexer_status_callback_t(int percentage, void *context);
 
 void indexer_refresh_proctitle(void);
+/* An indexer worker reported the user's FTS index fragmentation after
+   indexing the mailbox. */
+void indexer_set_fragmentation(const char *username, const char *mailbox,
+			       unsigned int fragmentation);
 
 #endif
@@ -0,0 +1,219 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+#include "time-util.h"
+#include "test-common.h"
+#include "indexer-queue.h"
+#include "indexer-optimize.h"
+
+/* Give up waiting for an optimize request after this long */
+#define TEST_WAIT_MAX_MSECS (INDEXER_OPTIMIZE_IDLE_MSECS * 20)
+
+static struct indexer_queue *test_queue;
+static struct indexer_optimize *test_opt;
+static struct indexer_request *test_request;
+static struct timeval test_request_time;
+
+void indexer_refresh_proctitle(void)
+{
+}
+
+static void test_indexer_status_callback(int percentage ATTR_UNUSED,
+					 void *context ATTR_UNUSED)
+{
+}
+
+static void test_queue_listen_callback(struct indexer_queue *queue)
+{
+	test_request = indexer_queue_request_peek(queue);
+	i_assert(test_request != NULL);
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_work(test_request);
+	i_gettimeofday(&test_request_time);
+	io_loop_stop(current_ioloop);
+}
+
+static void test_init(void)
+{
+	test_queue = indexer_queue_init(test_indexer_status_callback);
+	indexer_queue_set_listen_callback(test_queue,
+					  test_queue_listen_callback);
+	test_opt = indexer_optimize_init(test_queue);
+}
+
+static void test_deinit(void)
+{
+	indexer_optimize_deinit(&test_opt);
+	indexer_queue_deinit(&test_queue);
+}
+
+static struct indexer_request *test_request_take(void)
+{
+	struct indexer_request *request = test_request;
+
+	test_request = NULL;
+	return request;
+}
+
+static void test_request_finish(struct indexer_request *request)
+{
+	indexer_optimize_request_finished(test_opt, request);
+	indexer_queue_request_finish(test_queue, &request, TRUE);
+}
+
+/* Run the ioloop until an optimize request is queued or until wait_msecs
+   have passed. Returns the number of milliseconds waited for the request,
+   or -1 if no request was queued. */
+static int test_wait_request(unsigned int wait_msecs)
+{
+	struct timeout *to;
+	struct timeval start_time;
+
+	i_assert(test_request == NULL);
+	i_gettimeofday(&start_time);
+	to = timeout_add_short(wait_msecs, io_loop_stop, current_ioloop);
+	io_loop_run(current_ioloop);
+	timeout_remove(&to);
+	if (test_request == NULL)
+		return -1;
+	test_assert(test_request->optimize && !test_request->index);
+	return timeval_diff_msecs(&test_request_time, &start_time);
+}
+
+static void test_sleep(unsigned int msecs)
+{
+	test_assert(test_wait_request(msecs) == -1);
+}
+
+static void test_indexer_optimize_idle_wait(void)
+{
+	int msecs;
+
+	test_begin("indexer optimize idle wait");
+	test_init();
+
+	/* nothing is optimized while the indexer is busy */
+	indexer_optimize_set_fragmentation(test_opt, "user1", "box1", 50);
+	test_sleep(INDEXER_OPTIMIZE_IDLE_MSECS * 2);
+
+	/* becoming busy restarts the idle wait */
+	indexer_optimize_set_idle(test_opt, TRUE);
+	test_sleep(INDEXER_OPTIMIZE_IDLE_MSECS / 2);
+	indexer_optimize_set_idle(test_opt, FALSE);
+	indexer_optimize_set_idle(test_opt, TRUE);
+	msecs = test_wait_request(TEST_WAIT_MAX_MSECS);
+	test_assert(msecs >= INDEXER_OPTIMIZE_IDLE_MSECS - 1);
+	test_assert(test_request != NULL &&
+		    strcmp(test_request->username, "user1") == 0 &&
+		    strcmp(test_request->mailbox, "box1") == 0);
+	test_request_finish(test_request_take());
+
+	/* a too low fragmentation isn't optimized */
+	indexer_optimize_set_fragmentation(test_opt, "user1", "box1",
+		INDEXER_OPTIMIZE_MIN_FRAGMENTATION - 1);
+	test_sleep(INDEXER_OPTIMIZE_IDLE_MSECS * 2);
+	/* and it removes the earlier higher fragmentation */
+	indexer_optimize_set_fragmentation(test_opt, "user1", "box1", 50);
+	indexer_optimize_set_fragmentation(test_opt, "user1", "box2",
+		INDEXER_OPTIMIZE_MIN_FRAGMENTATION - 1);
+	test_sleep(INDEXER_OPTIMIZE_IDLE_MSECS * 2);
+
+	test_deinit();
+	test_end();
+}
+
+static void test_indexer_optimize_order(void)
+{
+	string_t *str = t_str_new(128);
+
+	test_begin("indexer optimize most fragmented first");
+	test_init();
+
+	/* the backends optimize the whole user's index, so each user is
+	   optimized only once. the user's latest fragmentation is used. */
+	indexer_optimize_set_fragmentation(test_opt, "user1", "box1", 90);
+	indexer_optimize_set_fragmentation(test_opt, "user1", "box2", 40);
+	indexer_optimize_set_fragmentation(test_opt, "user2", "box1", 60);
+	indexer_optimize_set_fragmentation(test_opt, "user3", "box1", 30);
+	indexer_optimize_set_fragmentation(test_opt, "user3", "box2", 80);
+	indexer_optimize_set_fragmentation(test_opt, "user4", "box1", 10);
+	indexer_optimize_set_idle(test_opt, TRUE);
+
+	while (test_wait_request(TEST_WAIT_MAX_MSECS) >= 0) {
+		str_printfa(str, "%s/%s ", test_request->username,
+			    test_request->mailbox);
+		test_request_finish(test_request_take());
+	}
+	test_assert_strcmp(str_c(str), "user3/box2 user2/box1 user1/box2 ");
+
+	test_deinit();
+	test_end();
+}
+
+static void test_indexer_optimize_time_budget(void)
+{
+	unsigned int work_msecs = INDEXER_OPTIMIZE_IDLE_MSECS / 2;
+	unsigned int delay_msecs = work_msecs *
+		(100 - INDEXER_OPTIMIZE_TIME_BUDGET_PERCENT) /
+		INDEXER_OPTIMIZE_TIME_BUDGET_PERCENT;
+	struct indexer_request *request;
+	int msecs;
+
+	test_begin("indexer optimize time budget");
+	test_init();
+
+	indexer_optimize_set_fragmentation(test_opt, "user1", "box1", 50);
+	indexer_optimize_set_fragmentation(test_opt, "user2", "box1", 40);
+	indexer_optimize_set_idle(test_opt, TRUE);
+	test_assert(test_wait_request(TEST_WAIT_MAX_MSECS) >= 0);
+	request = test_request_take();
+	test_assert_strcmp(request->username, "user1");
+
+	/* the next optimize is delayed by the time the previous one took
+	   multiplied by (100 - budget) / budget */
+	indexer_optimize_set_idle(test_opt, FALSE);
+	test_sleep(work_msecs);
+	test_request_finish(request);
+	indexer_optimize_set_idle(test_opt, TRUE);
+	msecs = test_wait_request(TEST_WAIT_MAX_MSECS);
+	test_assert(msecs >= (int)delay_msecs - 2);
+	request = test_request_take();
+	test_assert(request != NULL &&
+		    strcmp(request->username, "user2") == 0);
+	test_request_finish(request);
+
+	/* indexing requests don't delay optimizing */
+	indexer_queue_append(test_queue, TRUE, "user3", "box1", NULL, 0, NULL);
+	request = test_request_take();
+	test_assert(request != NULL && request->index);
+	indexer_optimize_set_idle(test_opt, FALSE);
+	test_sleep(INDEXER_OPTIMIZE_IDLE_MSECS * 2);
+	test_request_finish(request);
+	indexer_optimize_set_fragmentation(test_opt, "user3", "box1", 50);
+	indexer_optimize_set_idle(test_opt, TRUE);
+	msecs = test_wait_request(TEST_WAIT_MAX_MSECS);
+	test_assert(msecs >= 0 && msecs < (int)delay_msecs);
+	test_request_finish(test_request_take());
+
+	test_deinit();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_indexer_optimize_idle_wait,
+		test_indexer_optimize_order,
+		test_indexer_optimize_time_budget,
+		NULL
+	};
+	struct ioloop *ioloop;
+	int ret;
+
+	ioloop = io_loop_create();
+	ret = test_run(test_functions);
+	io_loop_destroy(&ioloop);
+	return ret;
+}
@@ -0,0 +1,223 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+#include "test-common.h"
+#include "indexer-queue.h"
+
+void indexer_refresh_proctitle(void)
+{
+}
+
+static void test_indexer_status_callback(int percentage ATTR_UNUSED,
+					 void *context ATTR_UNUSED)
+{
+}
+
+static void test_time_advance(unsigned int usecs)
+{
+	ioloop_timeval.tv_usec += usecs;
+	ioloop_timeval.tv_sec += ioloop_timeval.tv_usec / 1000000;
+	ioloop_timeval.tv_usec %= 1000000;
+}
+
+static struct indexer_request *test_queue_work(struct indexer_queue *queue)
+{
+	struct indexer_request *request;
+
+	request = indexer_queue_request_peek(queue);
+	if (request == NULL)
+		return NULL;
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_work(request);
+	return request;
+}
+
+static void test_queue_finish(struct indexer_queue *queue,
+			      struct indexer_request *request,
+			      unsigned int work_usecs)
+{
+	test_time_advance(work_usecs);
+	indexer_queue_request_finish(queue, &request, TRUE);
+}
+
+/* Work on the queued requests one at a time, each taking work_usecs.
+   Returns the "user/mailbox" names in the order they were worked on. */
+static const char *
+test_queue_work_all(struct indexer_queue *queue, unsigned int work_usecs)
+{
+	struct indexer_request *request;
+	string_t *str = t_str_new(128);
+
+	while ((request = test_queue_work(queue)) != NULL) {
+		str_printfa(str, "%s/%s ", request->username, request->mailbox);
+		test_queue_finish(queue, request, work_usecs);
+	}
+	return str_c(str);
+}
+
+static void test_indexer_queue_fairness(void)
+{
+	struct indexer_queue *queue;
+	unsigned int i;
+
+	test_begin("indexer queue fairness");
+	queue = indexer_queue_init(test_indexer_status_callback);
+
+	/* user1 bulk-appends a lot of mailboxes. user2 prepends a single
+	   mailbox (e.g. SEARCH) after them, which is handled first. */
+	for (i = 1; i <= 3; i++) {
+		indexer_queue_append(queue, TRUE, "user1",
+				     t_strdup_printf("box%u", i),
+				     NULL, 0, NULL);
+	}
+	indexer_queue_append(queue, FALSE, "user2", "INBOX", NULL, 0, NULL);
+	/* user2's background requests don't have to wait for all of
+	   user1's requests */
+	indexer_queue_append(queue, TRUE, "user2", "box1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "box2", NULL, 0, NULL);
+	test_assert(indexer_queue_count(queue) == 6);
+
+	test_assert_strcmp(test_queue_work_all(queue, 1000),
+		"user2/INBOX user1/box1 user2/box1 user1/box2 user2/box2 "
+		"user1/box3 ");
+
+	/* prepending an already queued background request moves it to the
+	   interactive queue */
+	indexer_queue_append(queue, TRUE, "user1", "box1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "box2", NULL, 0, NULL);
+	indexer_queue_append(queue, FALSE, "user1", "box2", NULL, 0, NULL);
+	test_assert(indexer_queue_count(queue) == 2);
+	test_assert_strcmp(test_queue_work_all(queue, 1000),
+			   "user1/box2 user1/box1 ");
+
+	test_assert(indexer_queue_is_empty(queue));
+	test_assert(indexer_queue_count(queue) == 0);
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_user_working_limit(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request1, *request2, *request3;
+
+	test_begin("indexer queue user working limit");
+	queue = indexer_queue_init(test_indexer_status_callback);
+
+	indexer_queue_append(queue, TRUE, "user1", "box1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "box2", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "box1", NULL, 0, NULL);
+
+	request1 = test_queue_work(queue);
+	test_assert_strcmp(request1->username, "user1");
+	test_assert_strcmp(request1->mailbox, "box1");
+	/* user1 already has the maximum number of requests being worked
+	   on, so only user2's request can be started */
+	request2 = test_queue_work(queue);
+	test_assert_strcmp(request2->username, "user2");
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+	test_assert(!indexer_queue_is_empty(queue));
+
+	/* not even an interactive request can be started for user1 */
+	indexer_queue_append(queue, FALSE, "user1", "INBOX", NULL, 0, NULL);
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+
+	/* a new request for the mailbox being worked on is queued only after
+	   the work finishes */
+	indexer_queue_append(queue, TRUE, "user2", "box1", NULL, 0, NULL);
+	test_assert(request2->reindex_tail);
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+	test_queue_finish(queue, request2, 1000);
+	request2 = indexer_queue_request_peek(queue);
+	test_assert(request2 != NULL &&
+		    strcmp(request2->username, "user2") == 0 &&
+		    strcmp(request2->mailbox, "box1") == 0);
+
+	test_queue_finish(queue, request1, 1000);
+	request3 = test_queue_work(queue);
+	test_assert_strcmp(request3->username, "user1");
+	test_assert_strcmp(request3->mailbox, "INBOX");
+	test_queue_finish(queue, request3, 1000);
+
+	indexer_queue_cancel_all(queue);
+	test_assert(indexer_queue_is_empty(queue));
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_vtime(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request1, *request2;
+
+	test_begin("indexer queue vtime");
+	queue = indexer_queue_init(test_indexer_status_callback);
+
+	indexer_queue_append(queue, TRUE, "user1", "box1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "box1", NULL, 0, NULL);
+	request1 = test_queue_work(queue);
+	request2 = test_queue_work(queue);
+	test_assert_strcmp(request1->username, "user1");
+	test_assert_strcmp(request2->username, "user2");
+
+	/* user1 was queued first, but its request took longer, so user2 gets
+	   to continue first */
+	indexer_queue_append(queue, TRUE, "user1", "box2", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "box2", NULL, 0, NULL);
+	test_queue_finish(queue, request2, 1000);
+	test_queue_finish(queue, request1, 9000);
+	/* user1 is 9ms ahead of user2, so user2's next three 3ms requests
+	   are handled before user1 continues */
+	indexer_queue_append(queue, TRUE, "user2", "box3", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "box4", NULL, 0, NULL);
+	test_assert_strcmp(test_queue_work_all(queue, 3000),
+		"user2/box2 user2/box3 user2/box4 user1/box2 ");
+
+	/* interactive requests advance the virtual time 4 times slower than
+	   background requests: user1's 4ms interactive request counts as
+	   1ms, so it continues before user2 after its 2ms request. */
+	indexer_queue_append(queue, FALSE, "user1", "box1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "box1", NULL, 0, NULL);
+	request1 = test_queue_work(queue);
+	request2 = test_queue_work(queue);
+	test_assert_strcmp(request1->username, "user1");
+	test_assert_strcmp(request2->username, "user2");
+	indexer_queue_append(queue, TRUE, "user1", "box2", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "box2", NULL, 0, NULL);
+	test_queue_finish(queue, request2, 2000);
+	test_queue_finish(queue, request1, 2000);
+	test_assert_strcmp(test_queue_work_all(queue, 1000),
+			   "user1/box2 user2/box2 ");
+
+	/* a user that becomes active doesn't get to catch up on the time it
+	   was idle */
+	indexer_queue_append(queue, TRUE, "user1", "box1", NULL, 0, NULL);
+	request1 = test_queue_work(queue);
+	indexer_queue_append(queue, TRUE, "user1", "box2", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "box3", NULL, 0, NULL);
+	test_queue_finish(queue, request1, 1000);
+	indexer_queue_append(queue, TRUE, "user3", "box1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user3", "box2", NULL, 0, NULL);
+	test_assert_strcmp(test_queue_work_all(queue, 1000),
+		"user3/box1 user1/box2 user3/box2 user1/box3 ");
+
+	test_assert(indexer_queue_is_empty(queue));
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_indexer_queue_fairness,
+		test_indexer_queue_user_working_limit,
+		test_indexer_queue_vtime,
+		NULL
+	};
+
+	ioloop_timeval.tv_sec = 1000000;
+	ioloop_timeval.tv_usec = 0;
+	return test_run(test_functions);
+}
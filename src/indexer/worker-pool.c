@@ -140,18 +140,3 @@ void worker_pool_release_connection(struct worker_pool *pool,
 
 	worker_connection_destroy(&conn);
 }
-
-struct worker_connection *
-worker_pool_find_username_connection(struct worker_pool *pool,
-				     const char *username)
-{
-	struct worker_connection_list *list;
-	const char *worker_user;
-
-	for (list = pool->busy_list; list != NULL; list = list->next) {
-		worker_user = worker_connection_get_username(list->conn);
-		if (worker_user != NULL && strcmp(worker_user, username) == 0)
-			return list->conn;
-	}
-	return NULL;
-}
@@ -16,8 +16,4 @@ bool worker_pool_get_connection(struct worker_pool *pool,
 void worker_pool_release_connection(struct worker_pool *pool,
 				    struct worker_connection *conn);
 
-struct worker_connection *
-worker_pool_find_username_connection(struct worker_pool *pool,
-				     const char *username);
-
 #endif
@@ -0,0 +1,163 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "randgen.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "fts-tokenizer.h"
+
+#include <stdio.h>
+
+/**
+ * Generates mail-like text, mostly ASCII words with some punctuation,
+ * addresses and non-ASCII words, and runs it through the tokenizers in
+ * small blocks the same way as the FTS indexing does. Reports how many MB/s
+ * each tokenizer configuration processes.
+ */
+
+#define BENCH_BLOCK_SIZE 4096
+
+struct bench_tokenizer {
+	const char *name;
+	bool email_address;
+	const char *const *settings;
+};
+
+static const char *const bench_settings_simple[] = {
+	"algorithm", "simple", NULL
+};
+static const char *const bench_settings_tr29[] = {
+	"algorithm", "tr29", NULL
+};
+static const char *const bench_settings_tr29_wb5a[] = {
+	"algorithm", "tr29", "wb5a", "yes", NULL
+};
+
+static const struct bench_tokenizer bench_tokenizers[] = {
+	{ "generic simple", FALSE, bench_settings_simple },
+	{ "generic tr29", FALSE, bench_settings_tr29 },
+	{ "generic tr29 wb5a", FALSE, bench_settings_tr29_wb5a },
+	{ "email-address + generic simple", TRUE, bench_settings_simple },
+};
+
+static const char *const bench_words[] = {
+	"the", "of", "and", "to", "in", "is", "that", "for", "it", "with",
+	"message", "mailbox", "Dovecot", "server", "configuration", "please",
+	"regards", "meeting", "tomorrow", "attached", "invoice", "2024",
+	"10:30", "v2.3.21", "don't", "it's", "e-mail", "re-indexing",
+	"user@example.com", "<foo.bar@example.org>", "https://example.com/x",
+	"na\xC3\xAFve", "caf\xC3\xA9", "\xC3\xBC" "ber", "gr\xC3\xB6\xC3\x9F" "e",
+	"\xD0\xBF\xD1\x80\xD0\xB8\xD0\xB2\xD0\xB5\xD1\x82",
+	"\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E",
+	"l\xE2\x80\x99homme",
+};
+
+static const char *const bench_separators[] = {
+	" ", " ", " ", " ", " ", " ", ", ", ". ", "\n", "\r\n", "\t",
+	" - ", ": ", "; ", "! ", "? ", " (", ") ", " \"", "\" ", "> ",
+};
+
+static void bench_build_input(buffer_t *input, size_t size)
+{
+	const char *word, *sep;
+
+	while (input->used < size) {
+		word = bench_words[i_rand_limit(N_ELEMENTS(bench_words))];
+		sep = bench_separators[i_rand_limit(N_ELEMENTS(bench_separators))];
+		buffer_append(input, word, strlen(word));
+		buffer_append(input, sep, strlen(sep));
+	}
+}
+
+static void
+bench_tokenizer(const struct bench_tokenizer *bench, const buffer_t *input,
+		unsigned int rounds)
+{
+	struct fts_tokenizer *gen_tok, *tok;
+	const unsigned char *data = input->data;
+	const char *token, *error;
+	unsigned long long token_count = 0;
+	uint64_t ts_0, ts_1;
+	unsigned int round;
+	size_t pos, size;
+	double secs, mbytes;
+
+	if (fts_tokenizer_create(fts_tokenizer_generic, NULL, bench->settings,
+				 &gen_tok, &error) < 0)
+		i_fatal("fts_tokenizer_create(%s) failed: %s", bench->name, error);
+	if (!bench->email_address)
+		tok = gen_tok;
+	else {
+		if (fts_tokenizer_create(fts_tokenizer_email_address, gen_tok,
+					 NULL, &tok, &error) < 0)
+			i_fatal("fts_tokenizer_create(%s) failed: %s",
+				bench->name, error);
+	}
+
+	ts_0 = i_nanoseconds();
+	for (round = 0; round < rounds; round++) {
+		for (pos = 0; pos < input->used; pos += size) {
+			/* tokenizers expect only full UTF-8 characters */
+			size = I_MIN(BENCH_BLOCK_SIZE, input->used - pos);
+			while (pos + size < input->used &&
+			       (data[pos + size] & 0xc0) == 0x80)
+				size--;
+			while (fts_tokenizer_next(tok, data + pos, size,
+						  &token, &error) > 0)
+				token_count++;
+		}
+		while (fts_tokenizer_final(tok, &token, &error) > 0)
+			token_count++;
+	}
+	ts_1 = i_nanoseconds();
+
+	if (tok != gen_tok)
+		fts_tokenizer_unref(&tok);
+	fts_tokenizer_unref(&gen_tok);
+
+	secs = (double)(ts_1 - ts_0) / 1000000000.0;
+	mbytes = (double)input->used * rounds / (1024.0 * 1024.0);
+	printf("%-32s %8.2lf MB/s %12llu tokens\n", bench->name,
+	       mbytes / secs, token_count);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [input_size rounds]\n", prog);
+	fprintf(stderr, "Runs 10 rounds over 4 MB of input if nothing given\n");
+	exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned long input_size = 4 * 1024 * 1024;
+	unsigned int i, rounds = 10;
+	buffer_t *input;
+
+	lib_init();
+
+	if (argc == 3) {
+		if (str_to_ulong(argv[1], &input_size) < 0 ||
+		    str_to_uint(argv[2], &rounds) < 0 || rounds == 0) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+	}
+
+	fts_tokenizers_init();
+	input = buffer_create_dynamic(default_pool, input_size + 128);
+	bench_build_input(input, input_size);
+	printf("Input data is %zu bytes, %u rounds\n\n", input->used, rounds);
+
+	for (i = 0; i < N_ELEMENTS(bench_tokenizers); i++) T_BEGIN {
+		bench_tokenizer(&bench_tokenizers[i], input, rounds);
+	} T_END;
+
+	buffer_free(&input);
+	fts_tokenizers_deinit();
+	lib_deinit();
+	return 0;
+}
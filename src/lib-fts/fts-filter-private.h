@@ -30,6 +30,8 @@ struct fts_filter {
 	string_t *token;
 	size_t max_length;
 	int refcount;
+	/* cache of the whole filter chain's results, or NULL */
+	struct fts_filter_cache *cache;
 };
 
 #endif
@@ -2,6 +2,8 @@
 
 #include "lib.h"
 #include "array.h"
+#include "hash.h"
+#include "llist.h"
 #include "str.h"
 #include "fts-language.h"
 #include "fts-filter-private.h"
@@ -10,8 +12,25 @@
 #  include "fts-icu.h"
 #endif
 
+struct fts_filter_cache_token {
+	struct fts_filter_cache_token *prev, *next;
+	/* filtered token, or NULL if the token was filtered out */
+	const char *token, *result;
+};
+
+struct fts_filter_cache {
+	HASH_TABLE(const char *, struct fts_filter_cache_token *) tokens;
+	/* head is the most recently used token */
+	struct fts_filter_cache_token *head, *tail;
+	unsigned int max_tokens;
+
+	uint64_t hits, misses;
+};
+
 static ARRAY(const struct fts_filter *) fts_filter_classes;
 
+static void fts_filter_cache_free(struct fts_filter_cache **_cache);
+
 void fts_filters_init(void)
 {
 	i_array_init(&fts_filter_classes, FTS_FILTER_CLASSES_NR);
@@ -106,6 +125,8 @@ void fts_filter_unref(struct fts_filter **_fpp)
 
 	if (fp->parent != NULL)
 		fts_filter_unref(&fp->parent);
+	if (fp->cache != NULL)
+		fts_filter_cache_free(&fp->cache);
 	if (fp->v.destroy != NULL)
 		fp->v.destroy(fp);
 	else {
@@ -115,8 +136,8 @@ void fts_filter_unref(struct fts_filter **_fpp)
 	}
 }
 
-int fts_filter_filter(struct fts_filter *filter, const char **token,
-		      const char **error_r)
+static int fts_filter_filter_chain(struct fts_filter *filter,
+				   const char **token, const char **error_r)
 {
 	int ret = 0;
 
@@ -124,7 +145,7 @@ int fts_filter_filter(struct fts_filter *filter, const char **token,
 
 	/* Recurse to parent. */
 	if (filter->parent != NULL)
-		ret = fts_filter_filter(filter->parent, token, error_r);
+		ret = fts_filter_filter_chain(filter->parent, token, error_r);
 
 	/* Parent returned token or no parent. */
 	if (ret > 0 || filter->parent == NULL)
@@ -138,3 +159,107 @@ int fts_filter_filter(struct fts_filter *filter, const char **token,
 	}
 	return ret;
 }
+
+static void
+fts_filter_cache_token_free(struct fts_filter_cache *cache,
+			    struct fts_filter_cache_token *ctoken)
+{
+	hash_table_remove(cache->tokens, ctoken->token);
+	DLLIST2_REMOVE(&cache->head, &cache->tail, ctoken);
+	i_free(ctoken);
+}
+
+static void fts_filter_cache_free(struct fts_filter_cache **_cache)
+{
+	struct fts_filter_cache *cache = *_cache;
+
+	*_cache = NULL;
+	while (cache->head != NULL)
+		fts_filter_cache_token_free(cache, cache->head);
+	hash_table_destroy(&cache->tokens);
+	i_free(cache);
+}
+
+static void
+fts_filter_cache_add(struct fts_filter_cache *cache, const char *token,
+		     const char *result)
+{
+	struct fts_filter_cache_token *ctoken;
+	size_t token_size = strlen(token) + 1;
+	size_t result_size = result == NULL ? 0 : strlen(result) + 1;
+	char *p;
+
+	if (hash_table_count(cache->tokens) >= cache->max_tokens)
+		fts_filter_cache_token_free(cache, cache->tail);
+
+	/* allocate the strings in the same memory block */
+	ctoken = i_malloc(MALLOC_ADD(sizeof(*ctoken),
+				     MALLOC_ADD(token_size, result_size)));
+	p = (char *)(ctoken + 1);
+	ctoken->token = memcpy(p, token, token_size);
+	if (result != NULL)
+		ctoken->result = memcpy(p + token_size, result, result_size);
+	hash_table_insert(cache->tokens, ctoken->token, ctoken);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, ctoken);
+}
+
+int fts_filter_filter(struct fts_filter *filter, const char **token,
+		      const char **error_r)
+{
+	struct fts_filter_cache *cache = filter->cache;
+	struct fts_filter_cache_token *ctoken;
+	const char *orig_token = *token;
+	int ret;
+
+	if (cache == NULL)
+		return fts_filter_filter_chain(filter, token, error_r);
+
+	i_assert((*token)[0] != '\0');
+	ctoken = hash_table_lookup(cache->tokens, *token);
+	if (ctoken != NULL) {
+		cache->hits++;
+		if (cache->head != ctoken) {
+			DLLIST2_REMOVE(&cache->head, &cache->tail, ctoken);
+			DLLIST2_PREPEND(&cache->head, &cache->tail, ctoken);
+		}
+		*token = ctoken->result;
+		return ctoken->result == NULL ? 0 : 1;
+	}
+
+	cache->misses++;
+	ret = fts_filter_filter_chain(filter, token, error_r);
+	if (ret >= 0)
+		fts_filter_cache_add(cache, orig_token, *token);
+	return ret;
+}
+
+void fts_filter_set_cache_size(struct fts_filter *filter,
+			       unsigned int max_tokens)
+{
+	struct fts_filter_cache *cache = filter->cache;
+
+	if (max_tokens == 0) {
+		if (cache != NULL)
+			fts_filter_cache_free(&filter->cache);
+		return;
+	}
+	if (cache == NULL) {
+		cache = filter->cache = i_new(struct fts_filter_cache, 1);
+		hash_table_create(&cache->tokens, default_pool, 0,
+				  str_hash, strcmp);
+	}
+	cache->max_tokens = max_tokens;
+	while (hash_table_count(cache->tokens) > max_tokens)
+		fts_filter_cache_token_free(cache, cache->tail);
+}
+
+void fts_filter_get_cache_stats(struct fts_filter *filter,
+				uint64_t *hits_r, uint64_t *misses_r)
+{
+	if (filter->cache == NULL) {
+		*hits_r = *misses_r = 0;
+		return;
+	}
+	*hits_r = filter->cache->hits;
+	*misses_r = filter->cache->misses;
+}
@@ -63,9 +63,19 @@ void fts_filter_unref(struct fts_filter **filter);
 
 /* Returns 1 if token is returned in *token, 0 if token was filtered
    out (*token is also set to NULL) and -1 on error.
-   Input is also given via *token.
+   Input is also given via *token. The returned token is valid only until
+   the next call.
 */
 int fts_filter_filter(struct fts_filter *filter, const char **token,
 		      const char **error_r);
 
+/* Cache the results of filtering tokens through the filter and all of its
+   parents. The least recently used tokens are dropped from the cache once
+   it has max_tokens tokens. 0 disables the cache. */
+void fts_filter_set_cache_size(struct fts_filter *filter,
+			       unsigned int max_tokens);
+/* Returns the number of tokens found/not found from the cache. */
+void fts_filter_get_cache_stats(struct fts_filter *filter,
+				uint64_t *hits_r, uint64_t *misses_r);
+
 #endif
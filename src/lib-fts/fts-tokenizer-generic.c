@@ -12,6 +12,10 @@
 #include "word-boundary-data.c"
 #include "word-break-data.c"
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 #define FTS_DEFAULT_TOKEN_MAX_LENGTH 30
 #define FTS_WB5A_PREFIX_MAX_LENGTH 3 /* Including apostrophe */
 
@@ -27,6 +31,100 @@ static unsigned char fts_ascii_word_breaks[128] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 0  /* 112-127: {|}~ */
 };
 
+/* letter_type() for ASCII characters, filled by the first create() */
+static enum letter_type fts_ascii_letter_types[128];
+
+static enum letter_type letter_type(unichar_t c);
+
+/* Runs of ASCII characters are scanned without decoding and classifying
+   each character separately. Both algorithms treat ASCII letters and digits
+   as word characters. The simple algorithm also treats '_' and DEL as word
+   characters and apostrophes specially. */
+static inline bool fts_ascii_is_word(unsigned char c, bool simple)
+{
+	if (c >= 0x80 || fts_ascii_word_breaks[c] != 0 || c == '\'')
+		return FALSE;
+	return simple || (c != '_' && c != 0x7f);
+}
+
+static inline bool fts_ascii_is_nonword(unsigned char c, bool simple)
+{
+	if (c >= 0x80 || fts_ascii_is_word(c, simple))
+		return FALSE;
+	return !simple || c != '\'';
+}
+
+#ifdef __SSE2__
+/* Returns a bitmask of the word characters in the 16 bytes */
+static inline unsigned int
+fts_ascii_word_mask16(__m128i v, bool simple)
+{
+	__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i word;
+
+	/* Bytes >= 0x80 are negative, so they never match these ranges. */
+	word = _mm_or_si128(
+		_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+			      _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1))),
+		_mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+			      _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1))));
+	if (simple) {
+		word = _mm_or_si128(word, _mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('_')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f))));
+	}
+	return _mm_movemask_epi8(word);
+}
+#endif
+
+/* Returns the number of word characters at the beginning of data. */
+static inline size_t
+fts_ascii_word_span(const unsigned char *data, size_t size, bool simple)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	unsigned int mask;
+
+	for (; i + 16 <= size; i += 16) {
+		mask = ~fts_ascii_word_mask16(
+			_mm_loadu_si128((const void *)(data + i)), simple);
+		mask &= 0xffff;
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	while (i < size && fts_ascii_is_word(data[i], simple))
+		i++;
+	return i;
+}
+
+/* Returns the number of ASCII non-word characters at the beginning of data.
+   With the simple algorithm apostrophes aren't included. */
+static inline size_t
+fts_ascii_nonword_span(const unsigned char *data, size_t size, bool simple)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	unsigned int mask;
+	__m128i v;
+
+	for (; i + 16 <= size; i += 16) {
+		v = _mm_loadu_si128((const void *)(data + i));
+		/* movemask(v) has the non-ASCII bytes */
+		mask = _mm_movemask_epi8(v) | fts_ascii_word_mask16(v, simple);
+		if (simple) {
+			mask |= _mm_movemask_epi8(
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+		}
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	while (i < size && fts_ascii_is_nonword(data[i], simple))
+		i++;
+	return i;
+}
+
 static int
 fts_tokenizer_generic_create(const char *const *settings,
 			     struct fts_tokenizer **tokenizer_r,
@@ -40,6 +138,11 @@ fts_tokenizer_generic_create(const char *const *settings,
 	bool explicitprefix = FALSE;
 	unsigned int i;
 
+	if (fts_ascii_letter_types[0] == LETTER_TYPE_NONE) {
+		for (i = 0; i < N_ELEMENTS(fts_ascii_letter_types); i++)
+			fts_ascii_letter_types[i] = letter_type(i);
+	}
+
 	for (i = 0; settings[i] != NULL; i += 2) {
 		const char *key = settings[i], *value = settings[i+1];
 
@@ -252,15 +355,43 @@ fts_tokenizer_generic_simple_next(struct fts_tokenizer *_tok,
 {
 	struct generic_fts_tokenizer *tok =
 		container_of(_tok, struct generic_fts_tokenizer, tokenizer);
-	size_t i, start = 0;
-	int char_size;
+	size_t i, n, start = 0, char_size;
 	unichar_t c;
 	bool apostrophe;
 	enum fts_break_type break_type;
+	int ret;
 
 	for (i = 0; i < size; i += char_size) {
-		char_size = uni_utf8_get_char_n(data + i, size - i, &c);
-		i_assert(char_size > 0);
+		if (data[i] < 0x80) {
+			/* Skip over runs of ASCII word characters inside a
+			   word and non-word characters between words. These
+			   don't change the state. */
+			if (tok->prev_type == LETTER_TYPE_ALETTER) {
+				n = fts_ascii_word_span(data + i, size - i, TRUE);
+				if (n > 0) {
+					tok->prev_prev_type = LETTER_TYPE_ALETTER;
+					char_size = n;
+					continue;
+				}
+			} else if (tok->prev_type == LETTER_TYPE_NONE &&
+				   tok->token->used == 0) {
+				n = fts_ascii_nonword_span(data + i, size - i,
+							   TRUE);
+				if (n > 0) {
+					i_assert(start == i);
+					tok->prev_prev_type = LETTER_TYPE_NONE;
+					start = i + n;
+					char_size = n;
+					continue;
+				}
+			}
+			c = data[i];
+			char_size = 1;
+		} else {
+			ret = uni_utf8_get_char_n(data + i, size - i, &c);
+			i_assert(ret > 0);
+			char_size = ret;
+		}
 
 		apostrophe = IS_APOSTROPHE(c);
 		if ((tok->prefixsplat && IS_PREFIX_SPLAT(c)) &&
@@ -709,16 +840,51 @@ fts_tokenizer_generic_tr29_next(struct fts_tokenizer *_tok,
 	struct generic_fts_tokenizer *tok =
 		container_of(_tok, struct generic_fts_tokenizer, tokenizer);
 	unichar_t c;
-	size_t i, char_start_i, start_pos = 0;
+	size_t i, n, char_start_i, start_pos = 0;
 	enum letter_type lt;
 	int char_size;
 
 	for (i = 0; i < size; ) {
+		if (data[i] < 0x80 && !tok->seen_wb5a) {
+			/* Skip over runs of ASCII letters and digits inside
+			   a word and non-token characters between words. */
+			if (tok->prev_type == LETTER_TYPE_NONE) {
+				n = fts_ascii_nonword_span(data + i, size - i,
+							   FALSE);
+				if (n > 0) {
+					i_assert(tok->token->used == 0);
+					i += n;
+					start_pos = i;
+					continue;
+				}
+			} else if (!tok->wb5a &&
+				   (tok->prev_type == LETTER_TYPE_ALETTER ||
+				    tok->prev_type == LETTER_TYPE_NUMERIC)) {
+				/* WB5, WB8, WB9, WB10 */
+				n = fts_ascii_word_span(data + i, size - i, FALSE);
+				if (n > 0) {
+					i += n;
+					tok->prev_prev_type = n == 1 ?
+						tok->prev_type :
+						fts_ascii_letter_types[data[i-2]];
+					tok->prev_type =
+						fts_ascii_letter_types[data[i-1]];
+					continue;
+				}
+			}
+		}
+
 		char_start_i = i;
-		char_size = uni_utf8_get_char_n(data + i, size - i, &c);
-		i_assert(char_size > 0);
+		if (data[i] < 0x80) {
+			c = data[i];
+			char_size = 1;
+			lt = fts_ascii_letter_types[c];
+		} else {
+			char_size = uni_utf8_get_char_n(data + i, size - i, &c);
+			i_assert(char_size > 0);
+			lt = letter_type(c);
+		}
 		i += char_size;
-		lt = letter_type(c);
 
 		/* The WB5a break is detected only when the "after
 		   break" char is inspected. That char needs to be
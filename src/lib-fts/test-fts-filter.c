@@ -973,6 +973,69 @@ static void test_fts_filter_english_possessive(void)
 	test_end();
 }
 
+static void test_fts_filter_cache(void)
+{
+	struct fts_filter *lowercase, *filter;
+	const char *error;
+	const char *input[] = {"An", "Elephant", "an", "Elephant", "and",
+			       "Bear", "An", "Elephant", NULL};
+	const char *output[] = {NULL, "elephant", NULL, "elephant", NULL,
+				"bear", NULL, "elephant"};
+	const char *token;
+	uint64_t hits, misses;
+	unsigned int i;
+	int ret;
+
+	test_begin("fts filter cache");
+	test_assert(fts_filter_create(fts_filter_lowercase, NULL, &english_language, NULL, &lowercase, &error) == 0);
+	test_assert(fts_filter_create(fts_filter_stopwords, lowercase, &english_language, stopword_settings, &filter, &error) == 0);
+	fts_filter_unref(&lowercase);
+
+	fts_filter_get_cache_stats(filter, &hits, &misses);
+	test_assert(hits == 0 && misses == 0);
+
+	/* cache has space for only 3 tokens */
+	fts_filter_set_cache_size(filter, 3);
+	for (i = 0; input[i] != NULL; i++) {
+		token = input[i];
+		ret = fts_filter_filter(filter, &token, &error);
+		if (output[i] == NULL) {
+			test_assert_idx(ret == 0, i);
+			test_assert_idx(token == NULL, i);
+		} else {
+			test_assert_idx(ret > 0, i);
+			test_assert_idx(null_strcmp(token, output[i]) == 0, i);
+		}
+	}
+	/* only the second "Elephant" was found from the cache. the first "An"
+	   and "Elephant" were already dropped when they were seen again. */
+	fts_filter_get_cache_stats(filter, &hits, &misses);
+	test_assert(hits == 1);
+	test_assert(misses == 7);
+
+	/* shrinking drops the least recently used tokens */
+	fts_filter_set_cache_size(filter, 1);
+	token = "Elephant";
+	test_assert(fts_filter_filter(filter, &token, &error) > 0);
+	token = "Bear";
+	test_assert(fts_filter_filter(filter, &token, &error) > 0);
+	test_assert(strcmp(token, "bear") == 0);
+	fts_filter_get_cache_stats(filter, &hits, &misses);
+	test_assert(hits == 2);
+	test_assert(misses == 8);
+
+	fts_filter_set_cache_size(filter, 0);
+	fts_filter_get_cache_stats(filter, &hits, &misses);
+	test_assert(hits == 0 && misses == 0);
+	token = "Elephant";
+	test_assert(fts_filter_filter(filter, &token, &error) > 0);
+	test_assert(strcmp(token, "elephant") == 0);
+
+	fts_filter_set_cache_size(filter, 10);
+	fts_filter_unref(&filter);
+	test_end();
+}
+
 /* TODO: Functions to test 1. ref-unref pairs 2. multiple registers +
   an unregister + find */
 
@@ -1014,6 +1077,7 @@ int main(void)
 #endif
 #endif
 		test_fts_filter_english_possessive,
+		test_fts_filter_cache,
 		NULL
 	};
 	int ret;
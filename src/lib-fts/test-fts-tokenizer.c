@@ -313,6 +313,35 @@ static void test_fts_tokenizer_generic_tr29_wb5a(void)
 	test_end();
 }
 
+static void test_fts_tokenizer_generic_ascii_runs(void)
+{
+	/* long ASCII word and separator runs are skipped in larger blocks */
+	static const char *const input =
+		"                                        "
+		"abcdefghijklmnopqrstuvwxyz0123 word_with_underscore"
+		"\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\tx "
+		"1234567890abcdefghij,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,end it's";
+	static const char *const expected_output[] = {
+		"abcdefghijklmnopqrstuvwxyz0123", "word_with_underscore", "x",
+		"1234567890abcdefghij", "end", "it's", NULL
+	};
+	static const char *const *const settings[] = {
+		NULL, tr29_settings, tr29_settings_wb5a
+	};
+	struct fts_tokenizer *tok;
+	const char *error;
+	unsigned int i;
+
+	test_begin("fts tokenizer generic ascii runs");
+	for (i = 0; i < N_ELEMENTS(settings); i++) {
+		test_assert(fts_tokenizer_create(fts_tokenizer_generic, NULL,
+						 settings[i], &tok, &error) == 0);
+		test_tokenizer_inputoutput(tok, input, expected_output, 0);
+		fts_tokenizer_unref(&tok);
+	}
+	test_end();
+}
+
 static void test_fts_tokenizer_address_only(void)
 {
 	static const char input[] = TEST_INPUT_ADDRESS;
@@ -570,6 +599,7 @@ int main(void)
 		test_fts_tokenizer_generic_only,
 		test_fts_tokenizer_generic_tr29_only,
 		test_fts_tokenizer_generic_tr29_wb5a,
+		test_fts_tokenizer_generic_ascii_runs,
 		test_fts_tokenizer_address_only,
 		test_fts_tokenizer_address_parent_simple,
 		test_fts_tokenizer_address_parent_tr29,
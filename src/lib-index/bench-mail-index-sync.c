@@ -0,0 +1,170 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "unlink-directory.h"
+#include "mail-index-private.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define BENCH_DIR_NAME ".dovecot.bench"
+
+/**
+ * Creates an index with the given number of messages and then writes a
+ * transaction log where each transaction changes some flags and expunges
+ * a message, mimicing a mailbox that was modified by other sessions
+ * while it wasn't open. Then measures how long it takes to open the index
+ * and replay the log.
+ */
+
+static struct mail_index *bench_index_open(void)
+{
+	struct mail_index_optimization_settings set = {
+		/* never rewrite the index or rotate the log, so all the
+		   changes need to be replayed from the log */
+		.index = {
+			.rewrite_min_log_bytes = UOFF_T_MAX,
+			.rewrite_max_log_bytes = UOFF_T_MAX,
+		},
+		.log = {
+			.min_size = UOFF_T_MAX,
+			.max_size = UOFF_T_MAX,
+		},
+	};
+	struct mail_index *index;
+
+	index = mail_index_alloc(NULL, BENCH_DIR_NAME, "bench.dovecot.index");
+	mail_index_set_optimization_settings(index, &set);
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("Failed to open index");
+	return index;
+}
+
+static void
+bench_index_sync(struct mail_index *index, uint32_t expunge_seq, bool write)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *sync_view;
+	struct mail_index_transaction *sync_trans;
+
+	if (mail_index_sync_begin(index, &sync_ctx, &sync_view,
+				  &sync_trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	if (expunge_seq != 0 &&
+	    expunge_seq <= mail_index_view_get_messages_count(sync_view))
+		mail_index_expunge(sync_trans, expunge_seq);
+	if (write)
+		mail_index_write(index, FALSE, "bench");
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+}
+
+static unsigned int
+bench_index_build(unsigned int message_count, unsigned int trans_count)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	unsigned int i, count, record_count = 0;
+	uint32_t uid, seq;
+
+	index = bench_index_open();
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	uid = 1234;
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid, sizeof(uid), TRUE);
+	for (uid = 1; uid <= message_count; uid++)
+		mail_index_append(trans, uid, &seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("Failed to append messages");
+	mail_index_view_close(&view);
+	/* write the index now, so only the following changes need to be
+	   replayed from the log */
+	bench_index_sync(index, 0, TRUE);
+
+	for (i = 0; i < trans_count; i++) {
+		view = mail_index_view_open(index);
+		count = mail_index_view_get_messages_count(view);
+		if (count == 0) {
+			mail_index_view_close(&view);
+			break;
+		}
+		seq = i_rand_limit(count) + 1;
+		trans = mail_index_transaction_begin(view, 0);
+		mail_index_update_flags(trans, seq, MODIFY_ADD, MAIL_SEEN);
+		mail_index_update_flags(trans, count + 1 - seq,
+					MODIFY_ADD, MAIL_FLAGGED);
+		if (mail_index_transaction_commit(&trans) < 0)
+			i_fatal("Failed to update flags");
+		mail_index_view_close(&view);
+
+		bench_index_sync(index, seq, FALSE);
+		record_count += 3;
+	}
+	mail_index_close(index);
+	mail_index_free(&index);
+	return record_count;
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s message_count transaction_count\n", prog);
+	fprintf(stderr, "Runs with 20000 messages and 2000 transactions "
+		"if nothing given\n");
+	exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	struct mail_index *index;
+	unsigned int message_count = 20000, trans_count = 2000;
+	unsigned int record_count;
+	uint64_t ts_0, ts_1;
+	const char *error;
+	double usecs;
+
+	lib_init();
+	ioloop_time = time(NULL);
+
+	if (argc == 3) {
+		if (str_to_uint(argv[1], &message_count) < 0 ||
+		    str_to_uint(argv[2], &trans_count) < 0) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+	}
+
+	(void)unlink_directory(BENCH_DIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR,
+			       &error);
+	if (mkdir(BENCH_DIR_NAME, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", BENCH_DIR_NAME);
+
+	printf("Building index with %u messages and %u transactions\n",
+	       message_count, trans_count);
+	record_count = bench_index_build(message_count, trans_count);
+
+	ts_0 = i_nanoseconds();
+	index = bench_index_open();
+	ts_1 = i_nanoseconds();
+	usecs = (double)(ts_1 - ts_0) / 1000.0;
+	printf("Opened index with %u messages in %0.02lf ms\n",
+	       index->map->hdr.messages_count, usecs / 1000.0);
+	printf("Replayed %u log records: %0.0lf records/s\n", record_count,
+	       (double)record_count / (usecs / 1000000.0));
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(BENCH_DIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR,
+			       &error);
+	lib_deinit();
+	return 0;
+}
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "buffer.h"
+#include "sort.h"
 #include "str.h"
 #include "mail-cache-private.h"
 
@@ -412,14 +413,136 @@ mail_cache_lookup_bitmask(struct mail_cache_lookup_iterate_ctx *iter,
 	return ret < 0 ? -1 : (found ? 1 : 0);
 }
 
+void mail_cache_prefetch_free(struct mail_cache_prefetch **_prefetch)
+{
+	struct mail_cache_prefetch *prefetch = *_prefetch;
+
+	if (prefetch == NULL)
+		return;
+	*_prefetch = NULL;
+	array_free(&prefetch->seqs);
+	array_free(&prefetch->field_columns);
+	array_free(&prefetch->values);
+	buffer_free(&prefetch->data);
+	i_free(prefetch);
+}
+
+int mail_cache_view_prefetch_fields(struct mail_cache_view *view,
+				    const ARRAY_TYPE(seq_range) *seqs,
+				    const unsigned int field_idxs[],
+				    unsigned int fields_count)
+{
+	struct mail_cache_prefetch *prefetch;
+	struct seq_range_iter iter;
+	unsigned int i, n, no_column = UINT_MAX;
+	uint32_t seq;
+	bool no_decision_updates = view->no_decision_updates;
+	int ret;
+
+	mail_cache_prefetch_free(&view->prefetch);
+
+	prefetch = i_new(struct mail_cache_prefetch, 1);
+	i_array_init(&prefetch->seqs, seq_range_count(seqs));
+	seq_range_array_iter_init(&iter, seqs); n = 0;
+	while (seq_range_array_iter_nth(&iter, n++, &seq))
+		array_push_back(&prefetch->seqs, &seq);
+
+	i_array_init(&prefetch->field_columns, view->cache->fields_count);
+	for (i = 0; i < view->cache->fields_count; i++)
+		array_push_back(&prefetch->field_columns, &no_column);
+	for (i = 0; i < fields_count; i++)
+		array_idx_set(&prefetch->field_columns, field_idxs[i], &i);
+
+	i_array_init(&prefetch->values,
+		     array_count(&prefetch->seqs) * fields_count + 1);
+	prefetch->data = buffer_create_dynamic(default_pool, 1024);
+	/* the caching decisions are updated when the fields are looked up,
+	   so they see the same access order as without prefetching */
+	view->no_decision_updates = TRUE;
+	ret = mail_cache_lookup_fields_batch(view, seqs, field_idxs,
+					     fields_count, &prefetch->values,
+					     prefetch->data);
+	view->no_decision_updates = no_decision_updates;
+	if (ret < 0) {
+		mail_cache_prefetch_free(&prefetch);
+		return -1;
+	}
+	prefetch->log_file_head_seq = view->view->log_file_head_seq;
+	prefetch->log_file_head_offset = view->view->log_file_head_offset;
+	view->prefetch = prefetch;
+	return 0;
+}
+
+/* Returns the prefetched value, which has size (uint32_t)-1 if the field
+   wasn't cached. Returns NULL if the field wasn't prefetched. */
+static struct mail_cache_lookup_batch_value *
+mail_cache_prefetch_get(struct mail_cache_view *view, uint32_t seq,
+			unsigned int field_idx)
+{
+	struct mail_cache_prefetch *prefetch = view->prefetch;
+	const unsigned int *column;
+	const uint32_t *seqp;
+	unsigned int idx;
+
+	if (prefetch == NULL)
+		return NULL;
+	if (prefetch->log_file_head_seq != view->view->log_file_head_seq ||
+	    prefetch->log_file_head_offset != view->view->log_file_head_offset) {
+		/* the view was synced, the sequences may have changed */
+		mail_cache_prefetch_free(&view->prefetch);
+		return NULL;
+	}
+	if (field_idx >= array_count(&prefetch->field_columns))
+		return NULL;
+	column = array_idx(&prefetch->field_columns, field_idx);
+	if (*column == UINT_MAX)
+		return NULL;
+	seqp = array_bsearch(&prefetch->seqs, &seq, uint32_cmp);
+	if (seqp == NULL)
+		return NULL;
+	idx = seqp - array_front(&prefetch->seqs);
+	return array_idx_modifiable(&prefetch->values,
+		*column * array_count(&prefetch->seqs) + idx);
+}
+
+void mail_cache_prefetch_forget(struct mail_cache_view *view, uint32_t seq,
+				unsigned int field_idx)
+{
+	struct mail_cache_lookup_batch_value *value;
+
+	value = mail_cache_prefetch_get(view, seq, field_idx);
+	if (value != NULL)
+		value->size = (uint32_t)-1;
+}
+
 int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 			    uint32_t seq, unsigned int field_idx)
 {
 	const struct mail_cache_field *field_def;
+	const struct mail_cache_lookup_batch_value *value;
 	struct mail_cache_lookup_iterate_ctx iter;
 	struct mail_cache_iterate_field field;
 	int ret;
 
+	field_def = &view->cache->fields[field_idx].field;
+	value = mail_cache_prefetch_get(view, seq, field_idx);
+	if (value != NULL && value->size != (uint32_t)-1) {
+		mail_cache_decision_state_update(view, seq, field_idx);
+		if (field_def->type == MAIL_CACHE_FIELD_BITMASK) {
+			buffer_write_zero(dest_buf, 0, field_def->field_size);
+			buffer_write(dest_buf, 0,
+				     CONST_PTR_OFFSET(view->prefetch->data->data,
+						      value->data_offset),
+				     value->size);
+		} else {
+			buffer_append(dest_buf,
+				      CONST_PTR_OFFSET(view->prefetch->data->data,
+						       value->data_offset),
+				      value->size);
+		}
+		return 1;
+	}
+
 	ret = mail_cache_field_exists(view, seq, field_idx);
 	mail_cache_decision_state_update(view, seq, field_idx);
 	if (ret <= 0)
@@ -427,7 +550,6 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 
 	/* the field should exist */
 	mail_cache_lookup_iter_init(view, seq, &iter);
-	field_def = &view->cache->fields[field_idx].field;
 	if (field_def->type == MAIL_CACHE_FIELD_BITMASK) {
 		return mail_cache_lookup_bitmask(&iter, field_idx,
 						 field_def->field_size,
@@ -445,6 +567,131 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 	return ret;
 }
 
+struct mail_cache_batch_seq {
+	uint32_t seq;
+	uint32_t offset;
+	/* index of the message in the looked up seqs */
+	unsigned int idx;
+};
+
+static int
+mail_cache_batch_seq_cmp(const struct mail_cache_batch_seq *s1,
+			 const struct mail_cache_batch_seq *s2)
+{
+	if (s1->offset < s2->offset)
+		return -1;
+	if (s1->offset > s2->offset)
+		return 1;
+	return s1->seq < s2->seq ? -1 : (s1->seq > s2->seq ? 1 : 0);
+}
+
+static void
+mail_cache_batch_value_add(struct mail_cache *cache,
+			   struct mail_cache_lookup_batch_value *value,
+			   const struct mail_cache_iterate_field *field,
+			   buffer_t *data_buf)
+{
+	const unsigned char *src;
+	unsigned char *dest;
+	unsigned int i;
+
+	if (value->size == (uint32_t)-1) {
+		value->data_offset = data_buf->used;
+		value->size = field->size;
+		buffer_append(data_buf, field->data, field->size);
+	} else if (cache->fields[field->field_idx].field.type ==
+		   MAIL_CACHE_FIELD_BITMASK) {
+		/* merge all bits */
+		src = field->data;
+		dest = buffer_get_space_unsafe(data_buf, value->data_offset,
+					       value->size);
+		for (i = 0; i < field->size && i < value->size; i++)
+			dest[i] |= src[i];
+	}
+	/* otherwise use the first one that's found. if there are multiple
+	   they're all identical. */
+}
+
+int mail_cache_lookup_fields_batch(struct mail_cache_view *view,
+				   const ARRAY_TYPE(seq_range) *seqs,
+				   const unsigned int field_idxs[],
+				   unsigned int fields_count,
+				   ARRAY_TYPE(mail_cache_lookup_batch_value) *values,
+				   buffer_t *data_buf)
+{
+	struct mail_cache *cache = view->cache;
+	ARRAY(struct mail_cache_batch_seq) batch_seqs;
+	const struct mail_cache_batch_seq *bseq;
+	struct mail_cache_lookup_batch_value *value_arr;
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	struct seq_range_iter range_iter;
+	unsigned int i, n, seq_count, value_count, cache_fields_count;
+	unsigned int *field_columns, column;
+	uint32_t seq, reset_id;
+	int ret = 0;
+
+	/* mapping from cache field index to the values column */
+	cache_fields_count = cache->fields_count;
+	field_columns = i_new(unsigned int, cache_fields_count);
+	for (i = 0; i < cache_fields_count; i++)
+		field_columns[i] = UINT_MAX;
+	for (i = 0; i < fields_count; i++) {
+		i_assert(field_idxs[i] < cache_fields_count);
+		field_columns[field_idxs[i]] = i;
+	}
+
+	seq_count = seq_range_count(seqs);
+	value_count = seq_count * fields_count;
+	array_clear(values);
+	if (value_count > 0) {
+		(void)array_idx_get_space(values, value_count - 1);
+		value_arr = array_front_modifiable(values);
+		for (i = 0; i < value_count; i++)
+			value_arr[i].size = (uint32_t)-1;
+	}
+
+	/* update the caching decisions in the order the messages are
+	   accessed, and get the latest record's offset for each message */
+	i_array_init(&batch_seqs, seq_count);
+	seq_range_array_iter_init(&range_iter, seqs); n = 0;
+	while (seq_range_array_iter_nth(&range_iter, n, &seq)) {
+		struct mail_cache_batch_seq *new_bseq;
+
+		for (i = 0; i < fields_count; i++)
+			mail_cache_decision_state_update(view, seq, field_idxs[i]);
+		new_bseq = array_append_space(&batch_seqs);
+		new_bseq->seq = seq;
+		new_bseq->idx = n++;
+		new_bseq->offset =
+			mail_cache_lookup_cur_offset(view->view, seq, &reset_id);
+	}
+	/* read the records in file offset order. Records of messages added
+	   at the same time are usually next to each others. */
+	array_sort(&batch_seqs, mail_cache_batch_seq_cmp);
+
+	array_foreach(&batch_seqs, bseq) {
+		mail_cache_lookup_iter_init(view, bseq->seq, &iter);
+		while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
+			if (field.field_idx >= cache_fields_count)
+				continue;
+			column = field_columns[field.field_idx];
+			if (column == UINT_MAX)
+				continue;
+
+			value_arr = array_idx_modifiable(values,
+				column * seq_count + bseq->idx);
+			mail_cache_batch_value_add(cache, value_arr, &field,
+						   data_buf);
+		}
+		if (ret < 0)
+			break;
+	}
+	array_free(&batch_seqs);
+	i_free(field_columns);
+	return ret < 0 ? -1 : 0;
+}
+
 struct header_lookup_data {
 	uint32_t data_size;
 	const unsigned char *data;
@@ -516,11 +763,13 @@ mail_cache_lookup_headers_real(struct mail_cache_view *view, string_t *dest,
 	struct mail_cache_iterate_field field;
 	struct header_lookup_context ctx;
 	struct header_lookup_line *lines;
+	const struct mail_cache_lookup_batch_value *value;
 	const unsigned char *p, *start, *end;
 	uint8_t *field_state;
 	unsigned int i, count, max_field = 0;
 	size_t hdr_size;
 	uint8_t want = HDR_FIELD_STATE_WANT;
+	bool prefetched = TRUE;
 	buffer_t *buf;
 	int ret;
 
@@ -531,8 +780,12 @@ mail_cache_lookup_headers_real(struct mail_cache_view *view, string_t *dest,
 
 	/* update the decision state regardless of whether the fields
 	   actually exist or not. */
-	for (i = 0; i < fields_count; i++)
+	for (i = 0; i < fields_count; i++) {
 		mail_cache_decision_state_update(view, seq, field_idxs[i]);
+		value = mail_cache_prefetch_get(view, seq, field_idxs[i]);
+		if (value == NULL || value->size == (uint32_t)-1)
+			prefetched = FALSE;
+	}
 
 	/* mark all the fields we want to find. */
 	buf = t_buffer_create(32);
@@ -550,19 +803,36 @@ mail_cache_lookup_headers_real(struct mail_cache_view *view, string_t *dest,
 	ctx.pool = *pool_r = pool_alloconly_create(MEMPOOL_GROWING"mail cache headers", 1024);
 	t_array_init(&ctx.lines, 32);
 
-	mail_cache_lookup_iter_init(view, seq, &iter);
-	while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
-		if (field.field_idx > max_field ||
-		    field_state[field.field_idx] != HDR_FIELD_STATE_WANT) {
-			/* a) don't want it, b) duplicate */
-		} else {
+	if (prefetched) {
+		/* all the fields were found by the prefetch */
+		for (i = 0; i < fields_count; i++) {
+			if (field_state[field_idxs[i]] != HDR_FIELD_STATE_WANT)
+				continue;
+			value = mail_cache_prefetch_get(view, seq,
+							field_idxs[i]);
+			i_zero(&field);
+			field.field_idx = field_idxs[i];
+			field.size = value->size;
+			field.data = CONST_PTR_OFFSET(view->prefetch->data->data,
+						      value->data_offset);
 			field_state[field.field_idx] = HDR_FIELD_STATE_SEEN;
 			header_lines_save(&ctx, &field);
 		}
-
+	} else {
+		mail_cache_lookup_iter_init(view, seq, &iter);
+		while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
+			if (field.field_idx > max_field ||
+			    field_state[field.field_idx] != HDR_FIELD_STATE_WANT) {
+				/* a) don't want it, b) duplicate */
+			} else {
+				field_state[field.field_idx] =
+					HDR_FIELD_STATE_SEEN;
+				header_lines_save(&ctx, &field);
+			}
+		}
+		if (ret < 0)
+			return -1;
 	}
-	if (ret < 0)
-		return -1;
 
 	/* check that all fields were found */
 	for (i = 0; i <= max_field; i++) {
@@ -13,6 +13,13 @@
 
 #define MAIL_CACHE_MAX_WRITE_BUFFER (1024*256)
 
+/* Cache files at least this large are purged by first copying the records
+   without locks (see mail_cache_purge_precopy()). */
+#define MAIL_CACHE_PURGE_PRECOPY_MIN_SIZE (1024*1024)
+/* Check between each this many precopied messages whether the cache file
+   was already purged by someone else. */
+#define MAIL_CACHE_PURGE_PRECOPY_CHUNK_COUNT 1000
+
 #define MAIL_CACHE_IS_UNUSABLE(cache) \
 	((cache)->hdr == NULL)
 
@@ -163,6 +170,21 @@ struct mail_cache_missing_reason_cache {
 	uoff_t log_file_head_offset;
 };
 
+/* Fields looked up with mail_cache_view_prefetch_fields() */
+struct mail_cache_prefetch {
+	/* sorted sequences of the prefetched messages */
+	ARRAY_TYPE(uint32_t) seqs;
+	/* cache field index -> values column, or UINT_MAX if the field
+	   wasn't prefetched */
+	ARRAY(unsigned int) field_columns;
+	ARRAY_TYPE(mail_cache_lookup_batch_value) values;
+	buffer_t *data;
+
+	/* the sequences are valid only until the view is synced */
+	uint32_t log_file_head_seq;
+	uoff_t log_file_head_offset;
+};
+
 struct mail_cache_view {
 	struct mail_cache *cache;
 	struct mail_cache_view *prev, *next;
@@ -181,6 +203,8 @@ struct mail_cache_view {
 	uint8_t cached_exists_value;
 	uint32_t cached_exists_seq;
 
+	struct mail_cache_prefetch *prefetch;
+
 	bool no_decision_updates:1;
 };
 
@@ -236,6 +260,12 @@ int mail_cache_get_record(struct mail_cache *cache, uint32_t offset,
 			  const struct mail_cache_record **rec_r);
 uint32_t mail_cache_get_first_new_seq(struct mail_index_view *view);
 
+void mail_cache_prefetch_free(struct mail_cache_prefetch **_prefetch);
+/* Forget the prefetched value of the field, because it was just added to the
+   cache transaction. */
+void mail_cache_prefetch_forget(struct mail_cache_view *view, uint32_t seq,
+				unsigned int field_idx);
+
 /* Returns TRUE if offset..size area has been tracked before.
    Returns FALSE if the area may or may not have been tracked before,
    but we don't know for sure yet. */
@@ -277,6 +307,8 @@ struct event_passthrough *
 mail_cache_decision_changed_event(struct mail_cache *cache, struct event *event,
 				  unsigned int field);
 
+struct mail_cache_purge_precopy;
+
 struct mail_cache_purge_drop_ctx {
 	struct mail_cache *cache;
 	time_t max_yes_downgrade_time;
@@ -294,6 +326,21 @@ enum mail_cache_purge_drop_decision
 mail_cache_purge_drop_test(struct mail_cache_purge_drop_ctx *ctx,
 			   unsigned int field);
 
+/* Copy the live cache records into a temporary file without holding any
+   locks. The following mail_cache_purge_with_precopy() then needs to copy
+   only the records that changed meanwhile while it's locked. Returns 1 if
+   precopy_r was set, 0 if precopying isn't possible (a normal purge should
+   be done), -1 on error. */
+int mail_cache_purge_precopy(struct mail_cache *cache, uint32_t purge_file_seq,
+			     struct mail_cache_purge_precopy **precopy_r);
+/* Same as mail_cache_purge_with_trans(), but reuse the records already
+   copied by mail_cache_purge_precopy(). The precopy is always freed. */
+int mail_cache_purge_with_precopy(struct mail_cache *cache,
+				  struct mail_index_transaction *trans,
+				  uint32_t purge_file_seq, const char *reason,
+				  struct mail_cache_purge_precopy **precopy);
+void mail_cache_purge_precopy_free(struct mail_cache_purge_precopy **precopy);
+
 int mail_cache_expunge_handler(struct mail_index_sync_map_ctx *sync_ctx,
 			       uint32_t seq, const void *data,
 			       void **sync_context, void *context);
@@ -8,6 +8,7 @@
 #include "file-dotlock.h"
 #include "file-cache.h"
 #include "file-set-size.h"
+#include "time-util.h"
 #include "mail-cache-private.h"
 
 #include <stdio.h>
@@ -17,13 +18,51 @@ struct mail_cache_copy_context {
 	struct mail_cache *cache;
 	struct event *event;
 	struct mail_cache_purge_drop_ctx drop_ctx;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct ostream *output;
 
 	buffer_t *buffer, *field_seen;
 	ARRAY(unsigned int) bitmask_pos;
 	uint32_t *field_file_map;
+	unsigned int fields_count, used_fields_count;
+
+	uint32_t first_new_seq;
+	unsigned int record_count;
+	uint32_t max_uid;
 
 	uint8_t field_seen_value;
 	bool new_msg;
+	bool fields_changed;
+};
+
+struct mail_cache_purge_precopy_rec {
+	uint32_t uid;
+	/* cache offset of the message in the original file */
+	uint32_t src_offset;
+	/* offset of the copied record in the temp file (0 = nothing cached) */
+	uint32_t dest_offset;
+	bool new_msg;
+};
+
+struct mail_cache_purge_precopy {
+	struct mail_cache *cache;
+	int fd;
+	char *temp_path;
+
+	/* file_seq of the cache file that the records were copied from */
+	uint32_t file_seq;
+	/* temp file size after the precopied records */
+	uoff_t size;
+
+	/* field mapping used by the precopied records */
+	uint32_t *field_file_map;
+	unsigned int fields_count, used_fields_count;
+
+	/* sorted by uid */
+	ARRAY(struct mail_cache_purge_precopy_rec) recs;
+	unsigned int rec_idx;
+	unsigned int record_count, reused_record_count;
 };
 
 static void
@@ -53,6 +92,11 @@ mail_cache_purge_field(struct mail_cache_copy_context *ctx,
 	uint32_t file_field_idx, size32;
 	uint8_t *field_seen;
 
+	if (field->field_idx >= ctx->fields_count) {
+		/* field was added after the mapping was created */
+		ctx->fields_changed = TRUE;
+		return;
+	}
 	file_field_idx = ctx->field_file_map[field->field_idx];
 	if (file_field_idx == (uint32_t)-1)
 		return;
@@ -198,23 +242,179 @@ mail_cache_purge_check_field(struct mail_cache_copy_context *ctx,
 	return priv->used;
 }
 
+static void
+mail_cache_copy_init(struct mail_cache_copy_context *ctx,
+		     struct mail_cache *cache, struct event *event,
+		     struct mail_index_view *view)
+{
+	i_zero(ctx);
+	ctx->cache = cache;
+	ctx->event = event;
+	ctx->view = view;
+	ctx->cache_view = mail_cache_view_open(cache, view);
+	ctx->buffer = buffer_create_dynamic(default_pool, 4096);
+	ctx->field_seen = buffer_create_dynamic(default_pool, 64);
+	ctx->field_seen_value = 0;
+	ctx->fields_count = cache->fields_count;
+	ctx->field_file_map = i_new(uint32_t, ctx->fields_count + 1);
+	i_array_init(&ctx->bitmask_pos, 32);
+
+	/* get sequence of first message which doesn't need its temp fields
+	   removed. */
+	ctx->first_new_seq = mail_cache_get_first_new_seq(view);
+	mail_cache_purge_drop_init(cache, mail_index_get_header(view),
+				   &ctx->drop_ctx);
+}
+
+static void mail_cache_copy_deinit(struct mail_cache_copy_context *ctx)
+{
+	mail_cache_view_close(&ctx->cache_view);
+	buffer_free(&ctx->buffer);
+	buffer_free(&ctx->field_seen);
+	array_free(&ctx->bitmask_pos);
+	i_free(ctx->field_file_map);
+}
+
+static void
+mail_cache_copy_map_fields(struct mail_cache_copy_context *ctx,
+			   const struct mail_cache_purge_precopy *precopy)
+{
+	struct mail_cache *cache = ctx->cache;
+	unsigned int i;
+
+	/* @UNSAFE: drop unused fields and create a field mapping for
+	   used fields */
+	if (cache->file_fields_count == 0) {
+		/* creating the initial cache file. add all fields. */
+		i_assert(precopy == NULL);
+		for (i = 0; i < ctx->fields_count; i++)
+			ctx->field_file_map[i] = i;
+		ctx->used_fields_count = i;
+		return;
+	}
+
+	/* The precopied records already refer to the fields they were
+	   written with, so those have to keep their indexes. Fields that
+	   became used afterwards are added after them. */
+	ctx->used_fields_count = precopy == NULL ? 0 :
+		precopy->used_fields_count;
+	for (i = 0; i < ctx->fields_count; i++) {
+		if (precopy != NULL && i < precopy->fields_count &&
+		    precopy->field_file_map[i] != (uint32_t)-1) {
+			(void)mail_cache_purge_check_field(ctx, i);
+			ctx->field_file_map[i] = precopy->field_file_map[i];
+		} else if (!mail_cache_purge_check_field(ctx, i))
+			ctx->field_file_map[i] = (uint32_t)-1;
+		else
+			ctx->field_file_map[i] = ctx->used_fields_count++;
+	}
+}
+
+static uint32_t
+mail_cache_copy_record(struct mail_cache_copy_context *ctx, uint32_t seq)
+{
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	struct mail_cache_record cache_rec;
+	uint32_t ext_offset;
+
+	ctx->new_msg = seq >= ctx->first_new_seq;
+	buffer_set_used_size(ctx->buffer, 0);
+
+	ctx->field_seen_value = (ctx->field_seen_value + 1) % UINT8_MAX;
+	if (ctx->field_seen_value == 0) {
+		memset(buffer_get_modifiable_data(ctx->field_seen, NULL),
+		       0, buffer_get_size(ctx->field_seen));
+		ctx->field_seen_value++;
+	}
+	array_clear(&ctx->bitmask_pos);
+
+	i_zero(&cache_rec);
+	buffer_append(ctx->buffer, &cache_rec, sizeof(cache_rec));
+
+	mail_cache_lookup_iter_init(ctx->cache_view, seq, &iter);
+	while (mail_cache_lookup_iter_next(&iter, &field) > 0)
+		mail_cache_purge_field(ctx, &field);
+
+	if (ctx->buffer->used == sizeof(cache_rec) ||
+	    ctx->buffer->used > ctx->cache->index->optimization_set.cache.record_max_size) {
+		/* nothing cached */
+		return 0;
+	}
+
+	mail_index_lookup_uid(ctx->view, seq, &ctx->max_uid);
+	cache_rec.size = ctx->buffer->used;
+	ext_offset = ctx->output->offset;
+	buffer_write(ctx->buffer, 0, &cache_rec, sizeof(cache_rec));
+	o_stream_nsend(ctx->output, ctx->buffer->data, cache_rec.size);
+	ctx->record_count++;
+	return ext_offset;
+}
+
+static bool
+mail_cache_purge_precopy_is_usable(struct mail_cache_purge_precopy *precopy,
+				   struct mail_index_transaction *trans)
+{
+	struct mail_cache *cache = precopy->cache;
+	const struct mail_index_ext *ext;
+
+	if (trans->reset || MAIL_CACHE_IS_UNUSABLE(cache) ||
+	    cache->file_fields_count == 0 ||
+	    cache->hdr->file_seq != precopy->file_seq)
+		return FALSE;
+	/* the cache offsets in the index must still point to the same
+	   cache file that we copied */
+	ext = mail_index_view_get_ext(trans->view, cache->ext_id);
+	return ext != NULL && ext->reset_id == precopy->file_seq;
+}
+
+static bool
+mail_cache_purge_precopy_find(struct mail_cache_purge_precopy *precopy,
+			      struct mail_cache_copy_context *ctx,
+			      uint32_t seq, uint32_t *ext_offset_r)
+{
+	const struct mail_cache_purge_precopy_rec *recs;
+	uint32_t uid, offset, reset_id;
+	unsigned int count;
+
+	/* messages are looked up in ascending uid order */
+	mail_index_lookup_uid(ctx->view, seq, &uid);
+	recs = array_get(&precopy->recs, &count);
+	while (precopy->rec_idx < count && recs[precopy->rec_idx].uid < uid)
+		precopy->rec_idx++;
+	if (precopy->rec_idx == count || recs[precopy->rec_idx].uid != uid)
+		return FALSE;
+
+	/* if more data was cached for the message meanwhile, its offset
+	   has changed and the record needs to be copied again. */
+	offset = mail_cache_lookup_cur_offset(ctx->view, seq, &reset_id);
+	if (offset != recs[precopy->rec_idx].src_offset ||
+	    recs[precopy->rec_idx].new_msg != (seq >= ctx->first_new_seq))
+		return FALSE;
+
+	*ext_offset_r = recs[precopy->rec_idx].dest_offset;
+	if (*ext_offset_r != 0) {
+		if (uid > ctx->max_uid)
+			ctx->max_uid = uid;
+		ctx->record_count++;
+		precopy->reused_record_count++;
+	}
+	return TRUE;
+}
+
 static int
 mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 		struct event *event, int fd, const char *reason,
+		struct mail_cache_purge_precopy *precopy,
 		uint32_t *file_seq_r, uoff_t *file_size_r, uint32_t *max_uid_r,
 		uint32_t *ext_first_seq_r, ARRAY_TYPE(uint32_t) *ext_offsets)
 {
-        struct mail_cache_copy_context ctx;
-	struct mail_cache_lookup_iterate_ctx iter;
-	struct mail_cache_iterate_field field;
+	struct mail_cache_copy_context ctx;
 	struct mail_index_view *view;
-	struct mail_cache_view *cache_view;
-	const struct mail_index_header *idx_hdr;
 	struct mail_cache_header hdr;
-	struct mail_cache_record cache_rec;
 	struct ostream *output;
-	uint32_t message_count, seq, first_new_seq, ext_offset;
-	unsigned int i, used_fields_count, orig_fields_count, record_count;
+	uint32_t message_count, seq, ext_offset;
+	uoff_t start_offset;
 
 	i_assert(reason != NULL);
 
@@ -226,8 +426,7 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 		return -1;
 
 	view = mail_index_transaction_open_updated_view(trans);
-	cache_view = mail_cache_view_open(cache, view);
-	output = o_stream_create_fd_file(fd, 0, FALSE);
+	mail_cache_copy_init(&ctx, cache, event, view);
 
 	i_zero(&hdr);
 	hdr.major_version = MAIL_CACHE_MAJOR_VERSION;
@@ -235,45 +434,24 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 	hdr.compat_sizeof_uoff_t = sizeof(uoff_t);
 	hdr.indexid = cache->index->indexid;
 	hdr.file_seq = get_next_file_seq(cache);
-	o_stream_nsend(output, &hdr, sizeof(hdr));
+	if (precopy == NULL) {
+		output = o_stream_create_fd_file(fd, 0, FALSE);
+		o_stream_nsend(output, &hdr, sizeof(hdr));
+	} else {
+		/* continue after the precopied records. the header is
+		   written last anyway. */
+		output = o_stream_create_fd_file(fd, precopy->size, FALSE);
+	}
+	ctx.output = output;
+	start_offset = output->offset;
 
 	event_add_str(event, "reason", reason);
 	event_add_int(event, "file_seq", hdr.file_seq);
 	event_set_name(event, "mail_cache_purge_started");
 	e_debug(event, "Purging (new file_seq=%u): %s", hdr.file_seq, reason);
 
-	i_zero(&ctx);
-	ctx.cache = cache;
-	ctx.event = event;
-	ctx.buffer = buffer_create_dynamic(default_pool, 4096);
-	ctx.field_seen = buffer_create_dynamic(default_pool, 64);
-	ctx.field_seen_value = 0;
-	ctx.field_file_map = t_new(uint32_t, cache->fields_count + 1);
-	t_array_init(&ctx.bitmask_pos, 32);
-
-	/* @UNSAFE: drop unused fields and create a field mapping for
-	   used fields */
-	idx_hdr = mail_index_get_header(view);
-	mail_cache_purge_drop_init(cache, idx_hdr, &ctx.drop_ctx);
-
-	orig_fields_count = cache->fields_count;
-	if (cache->file_fields_count == 0) {
-		/* creating the initial cache file. add all fields. */
-		for (i = 0; i < orig_fields_count; i++)
-			ctx.field_file_map[i] = i;
-		used_fields_count = i;
-	} else {
-		for (i = used_fields_count = 0; i < orig_fields_count; i++) {
-			if (!mail_cache_purge_check_field(&ctx, i))
-				ctx.field_file_map[i] = (uint32_t)-1;
-			else
-				ctx.field_file_map[i] = used_fields_count++;
-		}
-	}
+	mail_cache_copy_map_fields(&ctx, precopy);
 
-	/* get sequence of first message which doesn't need its temp fields
-	   removed. */
-	first_new_seq = mail_cache_get_first_new_seq(view);
 	message_count = mail_index_view_get_messages_count(view);
 	if (!trans->reset)
 		seq = 1;
@@ -283,63 +461,44 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 	}
 
 	*ext_first_seq_r = seq;
-	i_array_init(ext_offsets, message_count); record_count = 0;
+	i_array_init(ext_offsets, message_count);
 	for (; seq <= message_count; seq++) {
 		if (mail_index_transaction_is_expunged(trans, seq)) {
 			array_append_zero(ext_offsets);
 			continue;
 		}
-
-		ctx.new_msg = seq >= first_new_seq;
-		buffer_set_used_size(ctx.buffer, 0);
-
-		ctx.field_seen_value = (ctx.field_seen_value + 1) % UINT8_MAX;
-		if (ctx.field_seen_value == 0) {
-			memset(buffer_get_modifiable_data(ctx.field_seen, NULL),
-			       0, buffer_get_size(ctx.field_seen));
-			ctx.field_seen_value++;
-		}
-		array_clear(&ctx.bitmask_pos);
-
-		i_zero(&cache_rec);
-		buffer_append(ctx.buffer, &cache_rec, sizeof(cache_rec));
-
-		mail_cache_lookup_iter_init(cache_view, seq, &iter);
-		while (mail_cache_lookup_iter_next(&iter, &field) > 0)
-			mail_cache_purge_field(&ctx, &field);
-
-		if (ctx.buffer->used == sizeof(cache_rec) ||
-		    ctx.buffer->used > cache->index->optimization_set.cache.record_max_size) {
-			/* nothing cached */
-			ext_offset = 0;
-		} else {
-			mail_index_lookup_uid(view, seq, max_uid_r);
-			cache_rec.size = ctx.buffer->used;
-			ext_offset = output->offset;
-			buffer_write(ctx.buffer, 0, &cache_rec,
-				     sizeof(cache_rec));
-			o_stream_nsend(output, ctx.buffer->data, cache_rec.size);
-			record_count++;
-		}
-
+		if (precopy == NULL ||
+		    !mail_cache_purge_precopy_find(precopy, &ctx, seq,
+						   &ext_offset))
+			ext_offset = mail_cache_copy_record(&ctx, seq);
 		array_push_back(ext_offsets, &ext_offset);
 	}
-	i_assert(orig_fields_count == cache->fields_count);
-
-	hdr.record_count = record_count;
+	i_assert(ctx.fields_count == cache->fields_count);
+	i_assert(!ctx.fields_changed);
+
+	event_add_int(event, "precopy_size",
+		      precopy == NULL ? 0 : precopy->size);
+	event_add_int(event, "locked_copy_size",
+		      output->offset - start_offset);
+
+	hdr.record_count = ctx.record_count;
+	if (precopy != NULL) {
+		/* precopied records that had to be copied again */
+		hdr.deleted_record_count = precopy->record_count -
+			precopy->reused_record_count;
+	}
 	hdr.field_header_offset = mail_index_uint32_to_offset(output->offset);
-	mail_cache_purge_get_fields(&ctx, used_fields_count);
+	mail_cache_purge_get_fields(&ctx, ctx.used_fields_count);
 	o_stream_nsend(output, ctx.buffer->data, ctx.buffer->used);
 
 	hdr.backwards_compat_used_file_size = output->offset;
-	buffer_free(&ctx.buffer);
-	buffer_free(&ctx.field_seen);
+	*max_uid_r = ctx.max_uid;
+	mail_cache_copy_deinit(&ctx);
 
 	*file_size_r = output->offset;
 	(void)o_stream_seek(output, 0);
 	o_stream_nsend(output, &hdr, sizeof(hdr));
 
-	mail_cache_view_close(&cache_view);
 	mail_index_view_close(&view);
 
 	if (o_stream_finish(output) < 0) {
@@ -366,10 +525,12 @@ static int
 mail_cache_purge_write(struct mail_cache *cache,
 		       struct mail_index_transaction *trans,
 		       int fd, const char *temp_path, const char *
-		       reason, bool *unlock)
+		       reason, struct mail_cache_purge_precopy *precopy,
+		       const struct timeval *lock_start, bool *unlock)
 {
 	struct event *event;
 	struct stat st;
+	struct timeval now;
 	uint32_t prev_file_seq, file_seq, old_offset, max_uid, ext_first_seq;
 	ARRAY_TYPE(uint32_t) ext_offsets;
 	const uint32_t *offsets;
@@ -390,24 +551,31 @@ mail_cache_purge_write(struct mail_cache *cache,
 	event_add_int(event, "prev_file_size", prev_file_size);
 	event_add_int(event, "prev_deleted_records", prev_deleted_records);
 
-	if (mail_cache_copy(cache, trans, event, fd, reason,
+	if (mail_cache_copy(cache, trans, event, fd, reason, precopy,
 			    &file_seq, &file_size, &max_uid,
-			    &ext_first_seq, &ext_offsets) < 0)
+			    &ext_first_seq, &ext_offsets) < 0) {
+		event_unref(&event);
 		return -1;
+	}
 
 	if (fstat(fd, &st) < 0) {
 		mail_cache_set_syscall_error(cache, "fstat()");
 		array_free(&ext_offsets);
+		event_unref(&event);
 		return -1;
 	}
 	if (rename(temp_path, cache->filepath) < 0) {
 		mail_cache_set_syscall_error(cache, "rename()");
 		array_free(&ext_offsets);
+		event_unref(&event);
 		return -1;
 	}
 
+	i_gettimeofday(&now);
 	event_add_int(event, "file_size", file_size);
 	event_add_int(event, "max_uid", max_uid);
+	event_add_int(event, "lock_usecs",
+		      timeval_diff_usecs(&now, lock_start));
 	event_set_name(event, "mail_cache_purge_finished");
 	e_debug(event, "Purging finished, file_seq changed %u -> %u, "
 		"size=%"PRIuUOFF_T" -> %"PRIuUOFF_T", max_uid=%u",
@@ -478,10 +646,171 @@ mail_cache_purge_has_file_changed(struct mail_cache *cache,
 	}
 }
 
+static int
+mail_cache_precopy_records(struct mail_cache_purge_precopy *precopy,
+			   struct mail_index_view *view, struct event *event)
+{
+	struct mail_cache *cache = precopy->cache;
+	struct mail_cache_copy_context ctx;
+	struct mail_cache_purge_precopy_rec *rec;
+	struct mail_cache_header hdr;
+	uint32_t seq, message_count, offset, reset_id;
+	int ret = 1;
+
+	mail_cache_copy_init(&ctx, cache, event, view);
+	ctx.output = o_stream_create_fd_file(precopy->fd, 0, FALSE);
+	/* the real header is written after the final copy */
+	i_zero(&hdr);
+	o_stream_nsend(ctx.output, &hdr, sizeof(hdr));
+	mail_cache_copy_map_fields(&ctx, NULL);
+
+	message_count = mail_index_view_get_messages_count(view);
+	i_array_init(&precopy->recs, message_count);
+	for (seq = 1; seq <= message_count; seq++) {
+		if (seq % MAIL_CACHE_PURGE_PRECOPY_CHUNK_COUNT == 0) {
+			ret = mail_cache_purge_has_file_changed(cache,
+							precopy->file_seq);
+			if (ret != 0) {
+				/* already purged by someone else */
+				ret = ret < 0 ? -1 : 0;
+				break;
+			}
+			ret = 1;
+		}
+		offset = mail_cache_lookup_cur_offset(view, seq, &reset_id);
+		if (offset == 0)
+			continue;
+
+		rec = array_append_space(&precopy->recs);
+		mail_index_lookup_uid(view, seq, &rec->uid);
+		rec->src_offset = offset;
+		rec->new_msg = seq >= ctx.first_new_seq;
+		rec->dest_offset = mail_cache_copy_record(&ctx, seq);
+	}
+	if (ctx.fields_changed || ctx.fields_count != cache->fields_count) {
+		/* new fields were added meanwhile */
+		ret = 0;
+	}
+
+	precopy->size = ctx.output->offset;
+	precopy->record_count = ctx.record_count;
+	precopy->fields_count = ctx.fields_count;
+	precopy->used_fields_count = ctx.used_fields_count;
+	precopy->field_file_map = ctx.field_file_map;
+	ctx.field_file_map = NULL;
+	mail_cache_copy_deinit(&ctx);
+
+	if (o_stream_finish(ctx.output) < 0) {
+		mail_cache_set_syscall_error(cache, "write()");
+		ret = -1;
+	}
+	o_stream_destroy(&ctx.output);
+	return ret;
+}
+
+int mail_cache_purge_precopy(struct mail_cache *cache, uint32_t purge_file_seq,
+			     struct mail_cache_purge_precopy **precopy_r)
+{
+	struct mail_cache_purge_precopy *precopy;
+	struct mail_index_view *view;
+	const struct mail_index_ext *ext;
+	struct event *event;
+	const char *temp_path;
+	int fd, ret;
+
+	*precopy_r = NULL;
+
+	i_assert(!cache->index->log_sync_locked);
+	if (MAIL_INDEX_IS_IN_MEMORY(cache->index) || cache->index->readonly ||
+	    cache->map_with_read)
+		return 0;
+
+	if (mail_index_refresh(cache->index) < 0)
+		return -1;
+	if (!cache->opened) {
+		if (mail_cache_open_and_verify(cache) < 0)
+			return -1;
+	}
+	if (MAIL_CACHE_IS_UNUSABLE(cache) || cache->file_fields_count == 0)
+		return 0;
+	if (purge_file_seq != (uint32_t)-1 &&
+	    cache->hdr->file_seq != purge_file_seq) {
+		/* already purged */
+		return 0;
+	}
+	if (mail_cache_header_fields_read(cache) < 0)
+		return -1;
+	if ((ret = mail_cache_map_all(cache)) <= 0)
+		return ret;
+
+	view = mail_index_view_open(cache->index);
+	ext = mail_index_view_get_ext(view, cache->ext_id);
+	if (ext == NULL || ext->reset_id != cache->hdr->file_seq) {
+		/* index and cache aren't in sync */
+		mail_index_view_close(&view);
+		return 0;
+	}
+
+	fd = mail_index_create_tmp_file(cache->index, cache->filepath,
+					&temp_path);
+	if (fd == -1) {
+		mail_index_view_close(&view);
+		return -1;
+	}
+	precopy = i_new(struct mail_cache_purge_precopy, 1);
+	precopy->cache = cache;
+	precopy->fd = fd;
+	precopy->temp_path = i_strdup(temp_path);
+	precopy->file_seq = cache->hdr->file_seq;
+
+	event = event_create(cache->event);
+	ret = mail_cache_precopy_records(precopy, view, event);
+	if (ret > 0) {
+		e_debug(event, "Purge precopied %u records "
+			"(%"PRIuUOFF_T" bytes) from file_seq=%u",
+			precopy->record_count, precopy->size,
+			precopy->file_seq);
+	}
+	event_unref(&event);
+	mail_index_view_close(&view);
+
+	/* the locked purging decides the fields again */
+	if (mail_cache_header_fields_read(cache) < 0)
+		ret = -1;
+	if (ret <= 0) {
+		mail_cache_purge_precopy_free(&precopy);
+		return ret;
+	}
+	*precopy_r = precopy;
+	return 1;
+}
+
+void mail_cache_purge_precopy_free(struct mail_cache_purge_precopy **_precopy)
+{
+	struct mail_cache_purge_precopy *precopy = *_precopy;
+
+	if (precopy == NULL)
+		return;
+	*_precopy = NULL;
+
+	if (precopy->fd != -1) {
+		i_close_fd(&precopy->fd);
+		i_unlink(precopy->temp_path);
+	}
+	if (array_is_created(&precopy->recs))
+		array_free(&precopy->recs);
+	i_free(precopy->field_file_map);
+	i_free(precopy->temp_path);
+	i_free(precopy);
+}
+
 static int mail_cache_purge_locked(struct mail_cache *cache,
 				   uint32_t purge_file_seq,
 				   struct mail_index_transaction *trans,
-				   const char *reason, bool *unlock)
+				   const char *reason,
+				   struct mail_cache_purge_precopy **precopy,
+				   const struct timeval *lock_start,
+				   bool *unlock)
 {
 	const char *temp_path;
 	int fd, ret;
@@ -509,11 +838,23 @@ static int mail_cache_purge_locked(struct mail_cache *cache,
 			return -1;
 	}
 
+	if (*precopy != NULL &&
+	    !mail_cache_purge_precopy_is_usable(*precopy, trans))
+		mail_cache_purge_precopy_free(precopy);
+
 	/* we want to recreate the cache. write it first to a temporary file */
-	fd = mail_index_create_tmp_file(cache->index, cache->filepath, &temp_path);
-	if (fd == -1)
-		return -1;
-	if (mail_cache_purge_write(cache, trans, fd, temp_path, reason, unlock) < 0) {
+	if (*precopy != NULL) {
+		fd = (*precopy)->fd;
+		temp_path = t_strdup((*precopy)->temp_path);
+		(*precopy)->fd = -1;
+	} else {
+		fd = mail_index_create_tmp_file(cache->index, cache->filepath,
+						&temp_path);
+		if (fd == -1)
+			return -1;
+	}
+	if (mail_cache_purge_write(cache, trans, fd, temp_path, reason,
+				   *precopy, lock_start, unlock) < 0) {
 		i_close_fd(&fd);
 		i_unlink(temp_path);
 		return -1;
@@ -533,8 +874,10 @@ static int mail_cache_purge_locked(struct mail_cache *cache,
 static int
 mail_cache_purge_full(struct mail_cache *cache,
 		      struct mail_index_transaction *trans,
-		      uint32_t purge_file_seq, const char *reason)
+		      uint32_t purge_file_seq, const char *reason,
+		      struct mail_cache_purge_precopy **precopy)
 {
+	struct timeval lock_start;
 	bool unlock = FALSE;
 	int ret;
 
@@ -569,8 +912,10 @@ mail_cache_purge_full(struct mail_cache *cache,
 		/* locking succeeded. */
 		unlock = TRUE;
 	}
+	i_gettimeofday(&lock_start);
 	cache->purging = TRUE;
-	ret = mail_cache_purge_locked(cache, purge_file_seq, trans, reason, &unlock);
+	ret = mail_cache_purge_locked(cache, purge_file_seq, trans, reason,
+				      precopy, &lock_start, &unlock);
 	cache->purging = FALSE;
 	if (unlock)
 		mail_cache_unlock(cache);
@@ -587,12 +932,29 @@ int mail_cache_purge_with_trans(struct mail_cache *cache,
 				struct mail_index_transaction *trans,
 				uint32_t purge_file_seq, const char *reason)
 {
-	return mail_cache_purge_full(cache, trans, purge_file_seq, reason);
+	struct mail_cache_purge_precopy *precopy = NULL;
+
+	return mail_cache_purge_full(cache, trans, purge_file_seq, reason,
+				     &precopy);
+}
+
+int mail_cache_purge_with_precopy(struct mail_cache *cache,
+				  struct mail_index_transaction *trans,
+				  uint32_t purge_file_seq, const char *reason,
+				  struct mail_cache_purge_precopy **precopy)
+{
+	int ret;
+
+	ret = mail_cache_purge_full(cache, trans, purge_file_seq, reason,
+				    precopy);
+	mail_cache_purge_precopy_free(precopy);
+	return ret;
 }
 
 int mail_cache_purge(struct mail_cache *cache, uint32_t purge_file_seq,
 		     const char *reason)
 {
+	struct mail_cache_purge_precopy *precopy = NULL;
 	struct mail_index_view *view;
 	struct mail_index_transaction *trans;
 	bool lock_log;
@@ -603,10 +965,20 @@ int mail_cache_purge(struct mail_cache *cache, uint32_t purge_file_seq,
 		uint32_t file_seq;
 		uoff_t file_offset;
 
+		/* With large cache files copy most of the records before
+		   locking, so the log stays locked only for copying the
+		   records that changed meanwhile. */
+		if (cache->last_stat_size >= MAIL_CACHE_PURGE_PRECOPY_MIN_SIZE &&
+		    mail_cache_purge_precopy(cache, purge_file_seq,
+					     &precopy) < 0)
+			return -1;
+
 		if (mail_transaction_log_sync_lock(cache->index->log,
 						   "mail cache purge",
-						   &file_seq, &file_offset) < 0)
+						   &file_seq, &file_offset) < 0) {
+			mail_cache_purge_precopy_free(&precopy);
 			return -1;
+		}
 	}
 	/* make sure we see the latest changes in index */
 	ret = mail_index_refresh(cache->index);
@@ -616,13 +988,15 @@ int mail_cache_purge(struct mail_cache *cache, uint32_t purge_file_seq,
 		MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
 	if (ret < 0)
 		;
-	else if ((ret = mail_cache_purge_full(cache, trans, purge_file_seq,
-					      reason)) < 0)
+	else if ((ret = mail_cache_purge_with_precopy(cache, trans,
+						purge_file_seq, reason,
+						&precopy)) < 0)
 		mail_index_transaction_rollback(&trans);
 	else {
 		if (mail_index_transaction_commit(&trans) < 0)
 			ret = -1;
 	}
+	mail_cache_purge_precopy_free(&precopy);
 	mail_index_view_close(&view);
 	if (lock_log) {
 		mail_transaction_log_sync_unlock(cache->index->log,
@@ -797,6 +797,7 @@ void mail_cache_add(struct mail_cache_transaction_ctx *ctx, uint32_t seq,
 	mail_cache_transaction_refresh_decisions(ctx);
 
 	mail_cache_decision_add(ctx->view, seq, field_idx);
+	mail_cache_prefetch_forget(ctx->view, seq, field_idx);
 
 	fixed_size = ctx->cache->fields[field_idx].field.field_size;
 	i_assert(fixed_size == UINT_MAX || fixed_size == data_size);
@@ -62,6 +62,9 @@ void mail_cache_set_seq_corrupted_reason(struct mail_cache_view *cache_view,
 	struct mail_cache *cache = cache_view->cache;
 	struct mail_index_view *view = cache_view->view;
 
+	/* the prefetched data may be from the corrupted record */
+	mail_cache_prefetch_free(&cache_view->prefetch);
+
 	/* drop cache pointer */
 	struct mail_index_transaction *t =
 		mail_index_transaction_begin(view, MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
@@ -976,6 +979,7 @@ void mail_cache_view_close(struct mail_cache_view **_view)
                 (void)mail_cache_header_fields_update(view->cache);
 
 	DLLIST_REMOVE(&view->cache->views, view);
+	mail_cache_prefetch_free(&view->prefetch);
 	buffer_free(&view->cached_exists_buf);
 	i_free(view);
 }
@@ -31,6 +31,15 @@ enum mail_cache_field_type {
 	MAIL_CACHE_FIELD_COUNT
 };
 
+struct mail_cache_lookup_batch_value {
+	/* offset of the value in the data buffer */
+	uint32_t data_offset;
+	/* size of the value, or (uint32_t)-1 if it's not cached */
+	uint32_t size;
+};
+ARRAY_DEFINE_TYPE(mail_cache_lookup_batch_value,
+		  struct mail_cache_lookup_batch_value);
+
 struct mail_cache_field {
 	const char *name;
 	unsigned int idx;
@@ -149,6 +158,31 @@ void mail_cache_decision_add(struct mail_cache_view *view, uint32_t seq,
 int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 			    uint32_t seq, unsigned int field_idx);
 
+/* Look up multiple fields for all the messages in seqs. Each message's
+   record list is walked only once, and the messages are processed in cache
+   file offset order. The values array is filled one field at a time: the
+   value of field_idxs[i] for the n-th message in seqs is at
+   values[i * seq_range_count(seqs) + n]. The field data is appended to
+   data_buf. Returns 0 if ok, -1 if error. */
+int mail_cache_lookup_fields_batch(struct mail_cache_view *view,
+				   const ARRAY_TYPE(seq_range) *seqs,
+				   const unsigned int field_idxs[],
+				   unsigned int fields_count,
+				   ARRAY_TYPE(mail_cache_lookup_batch_value) *values,
+				   buffer_t *data_buf);
+
+/* Look up the fields for all the messages in seqs with
+   mail_cache_lookup_fields_batch() and keep the values in the view.
+   mail_cache_lookup_field() and mail_cache_lookup_headers() return them
+   without walking the messages' records again, until the next prefetch or
+   until the view is synced. Fields that weren't cached are looked up
+   normally. The caching decisions are updated by the lookups, not by the
+   prefetch. Returns 0 if ok, -1 if error. */
+int mail_cache_view_prefetch_fields(struct mail_cache_view *view,
+				    const ARRAY_TYPE(seq_range) *seqs,
+				    const unsigned int field_idxs[],
+				    unsigned int fields_count);
+
 /* Return specified cached headers. Returns 1 if all fields were found,
    0 if not, -1 if error. dest is updated only if all fields were found. */
 int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
@@ -10,6 +10,10 @@
 #include "mail-transaction-log-private.h"
 #include "ioloop.h"
 
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
 static void mail_index_map_copy_hdr(struct mail_index_map *map,
 				    const struct mail_index_header *hdr)
 {
@@ -27,6 +31,33 @@ static void mail_index_map_copy_hdr(struct mail_index_map *map,
 	map->hdr.unused_old_recent_messages_count = 0;
 }
 
+static void *
+mail_index_mmap_file(struct mail_index *index, size_t file_size,
+		     size_t *append_size_r)
+{
+	void *base;
+
+	*append_size_r = 0;
+#ifdef MAP_ANONYMOUS
+	/* Reserve anonymous space after the file for appends and map the
+	   file privately over its beginning. Until they're modified, the
+	   file's pages stay shared with all the other processes. */
+	base = mmap(NULL, file_size + MAIL_INDEX_MMAP_APPEND_SPACE,
+		    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base != MAP_FAILED) {
+		if (mmap(base, file_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_FIXED, index->fd, 0) != MAP_FAILED) {
+			*append_size_r = MAIL_INDEX_MMAP_APPEND_SPACE;
+			return base;
+		}
+		if (munmap(base, file_size + MAIL_INDEX_MMAP_APPEND_SPACE) < 0)
+			mail_index_set_syscall_error(index, "munmap()");
+	}
+#endif
+	return mmap(NULL, file_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE, index->fd, 0);
+}
+
 static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 {
 	struct mail_index *index = map->index;
@@ -44,8 +75,8 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 		return -1;
 	}
 
-	rec_map->mmap_base = mmap(NULL, file_size, PROT_READ | PROT_WRITE,
-				  MAP_PRIVATE, index->fd, 0);
+	rec_map->mmap_base = mail_index_mmap_file(index, file_size,
+						  &rec_map->mmap_append_size);
 	if (rec_map->mmap_base == MAP_FAILED) {
 		rec_map->mmap_base = NULL;
 		if (ioloop_time != index->last_mmap_error_time) {
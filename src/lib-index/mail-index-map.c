@@ -271,7 +271,8 @@ static void mail_index_record_map_free(struct mail_index_map *map,
 		buffer_free(&rec_map->buffer);
 	} else if (rec_map->mmap_base != NULL) {
 		i_assert(rec_map->buffer == NULL);
-		if (munmap(rec_map->mmap_base, rec_map->mmap_size) < 0)
+		if (munmap(rec_map->mmap_base, rec_map->mmap_size +
+			   rec_map->mmap_append_size) < 0)
 			mail_index_set_syscall_error(map->index, "munmap()");
 		rec_map->mmap_base = NULL;
 	}
@@ -476,12 +477,28 @@ void mail_index_map_move_to_memory(struct mail_index_map *map)
 		mail_index_record_map_unlink(map);
 		map->rec_map = new_map;
 	} else {
-		if (munmap(new_map->mmap_base, new_map->mmap_size) < 0)
+		if (munmap(new_map->mmap_base, new_map->mmap_size +
+			   new_map->mmap_append_size) < 0)
 			mail_index_set_syscall_error(map->index, "munmap()");
 		new_map->mmap_base = NULL;
+		new_map->mmap_append_size = 0;
 	}
 }
 
+bool mail_index_map_mmap_can_append(struct mail_index_map *map)
+{
+	struct mail_index_record_map *rec_map = map->rec_map;
+	size_t records_offset;
+
+	i_assert(rec_map->mmap_base != NULL);
+
+	records_offset = (const char *)rec_map->records -
+		(const char *)rec_map->mmap_base;
+	return records_offset + (size_t)(rec_map->records_count + 1) *
+		map->hdr.record_size <=
+		rec_map->mmap_size + rec_map->mmap_append_size;
+}
+
 bool mail_index_map_get_ext_idx(struct mail_index_map *map,
 				uint32_t ext_id, uint32_t *idx_r)
 {
@@ -15,6 +15,10 @@ struct mail_index_sync_map_ctx;
 
 /* How large index files to mmap() instead of reading to memory. */
 #define MAIL_INDEX_MMAP_MIN_SIZE (1024*64)
+/* Reserve this much address space after the mmap()ed index file. Syncing
+   appends into it instead of copying the whole map to memory, so the rest
+   of the map keeps sharing the file's pages with other processes. */
+#define MAIL_INDEX_MMAP_APPEND_SPACE (1024*256)
 /* How many times to retry opening index files if read/fstat returns ESTALE.
    This happens with NFS when the file has been deleted (ie. index file was
    rewritten by another computer than us). */
@@ -108,6 +112,8 @@ struct mail_index_record_map {
 
 	void *mmap_base;
 	size_t mmap_size, mmap_used_size;
+	/* anonymous memory reserved after mmap_size for appends */
+	size_t mmap_append_size;
 
 	buffer_t *buffer;
 
@@ -285,6 +291,9 @@ struct mail_index_map *mail_index_map_clone(const struct mail_index_map *map);
 void mail_index_record_map_move_to_private(struct mail_index_map *map);
 /* Move a mmaped map to memory. */
 void mail_index_map_move_to_memory(struct mail_index_map *map);
+/* Returns TRUE if a record can be appended to the mmaped map without moving
+   it to memory. */
+bool mail_index_map_mmap_can_append(struct mail_index_map *map);
 void mail_index_fchown(struct mail_index *index, int fd, const char *path);
 
 bool mail_index_map_lookup_ext(struct mail_index_map *map, const char *name,
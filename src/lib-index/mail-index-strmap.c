@@ -1031,9 +1031,22 @@ static int mail_index_strmap_recreate(struct mail_index_strmap_view *view)
 				     temp_path, strmap->path);
 		ret = -1;
 	}
-	if (ret < 0)
+	if (ret < 0) {
 		i_unlink(temp_path);
-	return ret;
+		return -1;
+	}
+
+	/* The view already matches the new file. Keep it open, so the next
+	   sync doesn't need to read it again from the beginning and reset
+	   the view. */
+	mail_index_strmap_close(strmap);
+	strmap->fd = open(strmap->path, O_RDWR);
+	if (strmap->fd == -1) {
+		mail_index_strmap_set_syscall_error(strmap, "open()");
+		return -1;
+	}
+	strmap->input = i_stream_create_fd(strmap->fd, SIZE_MAX);
+	return 0;
 }
 
 static int mail_index_strmap_lock(struct mail_index_strmap *strmap)
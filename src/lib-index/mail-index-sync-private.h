@@ -35,6 +35,9 @@ struct mail_index_sync_map_ctx {
 	ARRAY(struct mail_index_expunge_handler) expunge_handlers;
 	ARRAY(void *) extra_contexts;
 	buffer_t *unknown_extensions;
+	/* Expunges that haven't been applied to the map yet. Used only when
+	   defer_expunges is set. */
+	ARRAY_TYPE(seq_range) pending_expunges;
 
         enum mail_index_sync_handler_type type;
 
@@ -44,6 +47,9 @@ struct mail_index_sync_map_ctx {
 	bool cur_ext_ignore:1;
 	bool internal_update:1; /* used by keywords for ext_intro */
 	bool errors:1;
+	/* Collect expunges from consecutive log records into
+	   pending_expunges and remove them from the map in one pass. */
+	bool defer_expunges:1;
 };
 
 extern struct mail_transaction_map_functions mail_index_map_sync_funcs;
@@ -61,6 +67,8 @@ int mail_index_sync_map(struct mail_index_map **_map,
 int mail_index_sync_record(struct mail_index_sync_map_ctx *ctx,
 			   const struct mail_transaction_header *hdr,
 			   const void *data);
+/* Apply all the expunges collected with defer_expunges. */
+void mail_index_sync_expunges_flush(struct mail_index_sync_map_ctx *ctx);
 
 struct mail_index_map *
 mail_index_sync_get_atomic_map(struct mail_index_sync_map_ctx *ctx);
@@ -71,7 +71,8 @@ static void mail_index_sync_replace_map(struct mail_index_sync_map_ctx *ctx,
 }
 
 static struct mail_index_map *
-mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
+mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx,
+				       bool append)
 {
 	struct mail_index_map *map = ctx->view->map;
 
@@ -80,7 +81,10 @@ mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
 		mail_index_sync_replace_map(ctx, map);
 	}
 
-	if (!MAIL_INDEX_MAP_IS_IN_MEMORY(ctx->view->map))
+	/* Appends can be written to the private mmap, which copies only
+	   the modified pages. Otherwise copy the whole map to memory. */
+	if (!MAIL_INDEX_MAP_IS_IN_MEMORY(ctx->view->map) &&
+	    (!append || !mail_index_map_mmap_can_append(ctx->view->map)))
 		mail_index_map_move_to_memory(ctx->view->map);
 	mail_index_modseq_sync_map_replaced(ctx->modseq_ctx);
 	return map;
@@ -89,7 +93,7 @@ mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
 struct mail_index_map *
 mail_index_sync_get_atomic_map(struct mail_index_sync_map_ctx *ctx)
 {
-	(void)mail_index_sync_move_to_private_memory(ctx);
+	(void)mail_index_sync_move_to_private_memory(ctx, FALSE);
 	mail_index_record_map_move_to_private(ctx->view->map);
 	mail_index_modseq_sync_map_replaced(ctx->modseq_ctx);
 	return ctx->view->map;
@@ -303,6 +307,12 @@ static void *sync_append_record(struct mail_index_map *map)
 	size_t append_pos;
 	void *ret;
 
+	if (map->rec_map->buffer == NULL) {
+		/* appending to the space reserved after the mmaped file */
+		i_assert(mail_index_map_mmap_can_append(map));
+		return MAIL_INDEX_MAP_IDX(map, map->rec_map->records_count);
+	}
+
 	append_pos = map->rec_map->records_count * map->hdr.record_size;
 	ret = buffer_get_space_unsafe(map->rec_map->buffer, append_pos,
 				      map->hdr.record_size);
@@ -387,10 +397,11 @@ static int sync_append(const struct mail_index_record *rec,
 		return -1;
 	}
 
-	/* move to memory. the mapping is written when unlocking so we don't
+	/* move to private memory, unless there's still space reserved after
+	   the mmaped file. the mapping is written when unlocking so we don't
 	   waste time re-mmap()ing multiple times or waste space growing index
 	   file too large */
-	map = mail_index_sync_move_to_private_memory(ctx);
+	map = mail_index_sync_move_to_private_memory(ctx, TRUE);
 
 	if (rec->uid <= map->rec_map->last_appended_uid) {
 		i_assert(map->hdr.messages_count < map->rec_map->records_count);
@@ -519,6 +530,42 @@ static int sync_header_update(const struct mail_transaction_header_update *u,
 	return 1;
 }
 
+static bool
+sync_record_type_can_defer_expunges(const struct mail_transaction_header *hdr)
+{
+	switch (hdr->type & MAIL_TRANSACTION_TYPE_MASK) {
+	case MAIL_TRANSACTION_EXPUNGE:
+	case MAIL_TRANSACTION_EXPUNGE|MAIL_TRANSACTION_EXPUNGE_PROT:
+	case MAIL_TRANSACTION_EXPUNGE_GUID:
+	case MAIL_TRANSACTION_EXPUNGE_GUID|MAIL_TRANSACTION_EXPUNGE_PROT:
+	case MAIL_TRANSACTION_APPEND:
+	case MAIL_TRANSACTION_FLAG_UPDATE:
+	case MAIL_TRANSACTION_KEYWORD_UPDATE:
+	case MAIL_TRANSACTION_MODSEQ_UPDATE:
+	case MAIL_TRANSACTION_BOUNDARY:
+		/* These only look up or modify the messages by their UIDs,
+		   and appends go to the end of the map. Sequences of the
+		   pending expunges stay valid. Changing the to-be-expunged
+		   messages' flags is harmless, since the header counters
+		   are updated again when the expunge is applied. */
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+void mail_index_sync_expunges_flush(struct mail_index_sync_map_ctx *ctx)
+{
+	if (!array_is_created(&ctx->pending_expunges) ||
+	    array_count(&ctx->pending_expunges) == 0)
+		return;
+
+	T_BEGIN {
+		sync_expunge_range(ctx, &ctx->pending_expunges);
+	} T_END;
+	array_clear(&ctx->pending_expunges);
+}
+
 static int
 mail_index_sync_record_real(struct mail_index_sync_map_ctx *ctx,
 			    const struct mail_transaction_header *hdr,
@@ -526,6 +573,13 @@ mail_index_sync_record_real(struct mail_index_sync_map_ctx *ctx,
 {
 	int ret = 0;
 
+	if (ctx->defer_expunges) {
+		if (!sync_record_type_can_defer_expunges(hdr))
+			mail_index_sync_expunges_flush(ctx);
+		else if (!array_is_created(&ctx->pending_expunges))
+			i_array_init(&ctx->pending_expunges, 64);
+	}
+
 	switch (hdr->type & MAIL_TRANSACTION_TYPE_MASK) {
 	case MAIL_TRANSACTION_APPEND: {
 		const struct mail_index_record *rec, *end;
@@ -541,43 +595,55 @@ mail_index_sync_record_real(struct mail_index_sync_map_ctx *ctx,
 	case MAIL_TRANSACTION_EXPUNGE:
 	case MAIL_TRANSACTION_EXPUNGE|MAIL_TRANSACTION_EXPUNGE_PROT: {
 		const struct mail_transaction_expunge *rec = data, *end;
-		ARRAY_TYPE(seq_range) seqs;
+		ARRAY_TYPE(seq_range) tmp_seqs, *seqs;
 		uint32_t seq1, seq2;
 
 		if ((hdr->type & MAIL_TRANSACTION_EXTERNAL) == 0) {
 			/* this is simply a request for expunge */
 			break;
 		}
-		t_array_init(&seqs, 64);
+		if (ctx->defer_expunges)
+			seqs = &ctx->pending_expunges;
+		else {
+			seqs = &tmp_seqs;
+			t_array_init(seqs, 64);
+		}
 		end = CONST_PTR_OFFSET(data, hdr->size);
 		for (; rec != end; rec++) {
 			if (mail_index_lookup_seq_range(ctx->view,
 					rec->uid1, rec->uid2, &seq1, &seq2))
-				seq_range_array_add_range(&seqs, seq1, seq2);
+				seq_range_array_add_range(seqs, seq1, seq2);
 		}
-		sync_expunge_range(ctx, &seqs);
+		if (!ctx->defer_expunges)
+			sync_expunge_range(ctx, seqs);
 		break;
 	}
 	case MAIL_TRANSACTION_EXPUNGE_GUID:
 	case MAIL_TRANSACTION_EXPUNGE_GUID|MAIL_TRANSACTION_EXPUNGE_PROT: {
 		const struct mail_transaction_expunge_guid *rec = data, *end;
-		ARRAY_TYPE(seq_range) seqs;
+		ARRAY_TYPE(seq_range) tmp_seqs, *seqs;
 		uint32_t seq;
 
 		if ((hdr->type & MAIL_TRANSACTION_EXTERNAL) == 0) {
 			/* this is simply a request for expunge */
 			break;
 		}
-		t_array_init(&seqs, 64);
+		if (ctx->defer_expunges)
+			seqs = &ctx->pending_expunges;
+		else {
+			seqs = &tmp_seqs;
+			t_array_init(seqs, 64);
+		}
 		end = CONST_PTR_OFFSET(data, hdr->size);
 		for (; rec != end; rec++) {
 			i_assert(rec->uid != 0);
 
 			if (mail_index_lookup_seq(ctx->view, rec->uid, &seq))
-				seq_range_array_add(&seqs, seq);
+				seq_range_array_add(seqs, seq);
 		}
 
-		sync_expunge_range(ctx, &seqs);
+		if (!ctx->defer_expunges)
+			sync_expunge_range(ctx, seqs);
 		break;
 	}
 	case MAIL_TRANSACTION_FLAG_UPDATE: {
@@ -839,7 +905,12 @@ void mail_index_sync_map_deinit(struct mail_index_sync_map_ctx *sync_map_ctx)
 {
 	i_assert(sync_map_ctx->modseq_ctx == NULL);
 
+	i_assert(!array_is_created(&sync_map_ctx->pending_expunges) ||
+		 array_count(&sync_map_ctx->pending_expunges) == 0);
+
 	buffer_free(&sync_map_ctx->unknown_extensions);
+	if (array_is_created(&sync_map_ctx->pending_expunges))
+		array_free(&sync_map_ctx->pending_expunges);
 	if (sync_map_ctx->expunge_handlers_used)
 		mail_index_sync_deinit_expunge_handlers(sync_map_ctx);
 	mail_index_sync_deinit_handlers(sync_map_ctx);
@@ -1003,6 +1074,10 @@ int mail_index_sync_map(struct mail_index_map **_map,
 					       &prev_seq, &prev_offset);
 
 	mail_index_sync_map_init(&sync_map_ctx, view, type);
+	/* Replaying a long log is much faster when the expunges are applied
+	   in larger batches, since each expunge moves the following records
+	   in the map. */
+	sync_map_ctx.defer_expunges = TRUE;
 	if (reset) {
 		/* Reset the entire index. Leave only indexid and
 		   log_file_seq. */
@@ -1038,6 +1113,7 @@ int mail_index_sync_map(struct mail_index_map **_map,
 		/* we'll just skip over broken entries */
 		(void)mail_index_sync_record(&sync_map_ctx, thdr, tdata);
 	}
+	mail_index_sync_expunges_flush(&sync_map_ctx);
 	map = view->map;
 
 	if (had_dirty)
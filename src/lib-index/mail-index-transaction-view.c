@@ -320,6 +320,81 @@ static void tview_lookup_keywords(struct mail_index_view *view, uint32_t seq,
 	}
 }
 
+static bool
+tview_flag_seq_matches(struct mail_index_view *view, uint32_t seq,
+		       enum mail_flags flags, uint8_t flags_mask,
+		       const struct mail_keywords *keywords,
+		       ARRAY_TYPE(keyword_indexes) *keyword_idx)
+{
+	const struct mail_index_record *rec;
+	struct mail_index_map *map;
+	const unsigned int *indexes;
+	unsigned int i, j, count;
+
+	rec = tview_lookup_full(view, seq, &map, NULL);
+	if ((rec->flags & flags_mask) != (uint8_t)flags)
+		return FALSE;
+	if (keywords == NULL || keywords->count == 0)
+		return TRUE;
+
+	tview_lookup_keywords(view, seq, keyword_idx);
+	indexes = array_get(keyword_idx, &count);
+	for (i = 0; i < keywords->count; i++) {
+		for (j = 0; j < count; j++) {
+			if (indexes[j] == keywords->idx[i])
+				break;
+		}
+		if (j == count)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+tview_lookup_flag_seqs(struct mail_index_view *view,
+		       uint32_t seq1, uint32_t seq2,
+		       enum mail_flags flags, uint8_t flags_mask,
+		       const struct mail_keywords *keywords,
+		       ARRAY_TYPE(seq_range) *seqs_r)
+{
+	struct mail_index_view_transaction *tview =
+		(struct mail_index_view_transaction *)view;
+	struct mail_index_transaction *t = tview->t;
+	ARRAY_TYPE(keyword_indexes) keyword_idx;
+	uint32_t seq, last_old_seq, recheck_seq1, recheck_seq2;
+
+	last_old_seq = I_MIN(seq2, t->first_new_seq - 1);
+	if (t->reset) {
+		/* recheck everything */
+		recheck_seq1 = seq1;
+		recheck_seq2 = last_old_seq;
+	} else {
+		if (seq1 <= last_old_seq) {
+			tview->super->lookup_flag_seqs(view, seq1, last_old_seq,
+						       flags, flags_mask,
+						       keywords, seqs_r);
+		}
+		/* recheck only the messages updated by this transaction */
+		recheck_seq1 = I_MAX(seq1, t->min_flagupdate_seq);
+		recheck_seq2 = I_MIN(last_old_seq, t->max_flagupdate_seq);
+	}
+
+	t_array_init(&keyword_idx, 32);
+	for (seq = recheck_seq1; seq <= recheck_seq2; seq++) {
+		if (tview_flag_seq_matches(view, seq, flags, flags_mask,
+					   keywords, &keyword_idx))
+			seq_range_array_add(seqs_r, seq);
+		else
+			seq_range_array_remove(seqs_r, seq);
+	}
+	/* new messages appended by this transaction */
+	for (seq = I_MAX(seq1, t->first_new_seq); seq <= seq2; seq++) {
+		if (tview_flag_seq_matches(view, seq, flags, flags_mask,
+					   keywords, &keyword_idx))
+			seq_range_array_add(seqs_r, seq);
+	}
+}
+
 static const void *
 tview_return_updated_ext(struct mail_index_view_transaction *tview,
 			 uint32_t seq, const void *data, uint32_t ext_id)
@@ -505,6 +580,7 @@ static struct mail_index_view_vfuncs trans_view_vfuncs = {
 	tview_lookup_seq_range,
 	tview_lookup_first,
 	tview_lookup_keywords,
+	tview_lookup_flag_seqs,
 	tview_lookup_ext_full,
 	tview_get_header_ext,
 	tview_ext_get_reset_id
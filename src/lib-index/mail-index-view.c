@@ -355,6 +355,93 @@ static void view_lookup_keywords(struct mail_index_view *view, uint32_t seq,
 	mail_index_data_lookup_keywords(map, data, keyword_idx);
 }
 
+static bool
+view_keywords_get_bits(struct mail_index_map *map,
+		       const struct mail_keywords *keywords,
+		       uint16_t record_size, unsigned int *bits)
+{
+	const unsigned int *keyword_idx_map;
+	unsigned int i, j, keyword_count;
+
+	if (!array_is_created(&map->keyword_idx_map))
+		return FALSE;
+
+	/* convert the index keyword indexes to the bit positions in the
+	   keyword records */
+	keyword_idx_map = array_get(&map->keyword_idx_map, &keyword_count);
+	for (i = 0; i < keywords->count; i++) {
+		for (j = 0; j < keyword_count; j++) {
+			if (keyword_idx_map[j] == keywords->idx[i])
+				break;
+		}
+		if (j == keyword_count || j / CHAR_BIT >= record_size) {
+			/* keyword doesn't exist in this map */
+			return FALSE;
+		}
+		bits[i] = j;
+	}
+	return TRUE;
+}
+
+static void
+view_lookup_flag_seqs(struct mail_index_view *view,
+		      uint32_t seq1, uint32_t seq2,
+		      enum mail_flags flags, uint8_t flags_mask,
+		      const struct mail_keywords *keywords,
+		      ARRAY_TYPE(seq_range) *seqs_r)
+{
+	struct mail_index_map *map = view->map;
+	const struct mail_index_record *rec;
+	const struct mail_index_ext *ext;
+	const unsigned char *data;
+	unsigned int *bits = NULL;
+	unsigned int i, keywords_count, ext_offset = 0;
+	uint32_t ext_idx, seq, range_start = 0;
+
+	i_assert(seq2 <= map->hdr.messages_count);
+
+	keywords_count = keywords == NULL ? 0 : keywords->count;
+	if (keywords_count > 0) {
+		if (!mail_index_map_get_ext_idx(map, view->index->keywords_ext_id,
+						&ext_idx))
+			return;
+		ext = array_idx(&map->extensions, ext_idx);
+		if (ext->record_offset == 0)
+			return;
+		ext_offset = ext->record_offset;
+		bits = t_new(unsigned int, keywords_count);
+		if (!view_keywords_get_bits(map, keywords, ext->record_size,
+					    bits))
+			return;
+	}
+
+	for (seq = seq1; seq <= seq2; seq++) {
+		rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
+		if ((rec->flags & flags_mask) != (uint8_t)flags)
+			i = 0;
+		else {
+			data = CONST_PTR_OFFSET(rec, ext_offset);
+			for (i = 0; i < keywords_count; i++) {
+				if ((data[bits[i] / CHAR_BIT] &
+				     (1 << (bits[i] % CHAR_BIT))) == 0)
+					break;
+			}
+			if (i == keywords_count) {
+				/* matched - grow the current range */
+				if (range_start == 0)
+					range_start = seq;
+				continue;
+			}
+		}
+		if (range_start != 0) {
+			seq_range_array_add_range(seqs_r, range_start, seq - 1);
+			range_start = 0;
+		}
+	}
+	if (range_start != 0)
+		seq_range_array_add_range(seqs_r, range_start, seq2);
+}
+
 static const void *
 view_map_lookup_ext_full(struct mail_index_map *map,
 			 const struct mail_index_record *rec, uint32_t ext_id)
@@ -493,6 +580,22 @@ void mail_index_lookup_keywords(struct mail_index_view *view, uint32_t seq,
 	view->v.lookup_keywords(view, seq, keyword_idx);
 }
 
+void mail_index_lookup_flag_seqs(struct mail_index_view *view,
+				 uint32_t seq1, uint32_t seq2,
+				 enum mail_flags flags, uint8_t flags_mask,
+				 const struct mail_keywords *keywords,
+				 ARRAY_TYPE(seq_range) *seqs_r)
+{
+	i_assert(seq1 > 0);
+
+	if (seq1 > seq2)
+		return;
+	T_BEGIN {
+		view->v.lookup_flag_seqs(view, seq1, seq2, flags, flags_mask,
+					 keywords, seqs_r);
+	} T_END;
+}
+
 void mail_index_lookup_view_flags(struct mail_index_view *view, uint32_t seq,
 				  enum mail_flags *flags_r,
 				  ARRAY_TYPE(keyword_indexes) *keyword_idx)
@@ -607,6 +710,7 @@ static struct mail_index_view_vfuncs view_vfuncs = {
 	view_lookup_seq_range,
 	view_lookup_first,
 	view_lookup_keywords,
+	view_lookup_flag_seqs,
 	view_lookup_ext_full,
 	view_get_header_ext,
 	view_ext_get_reset_id
@@ -565,6 +565,15 @@ bool mail_index_lookup_seq(struct mail_index_view *view,
 void mail_index_lookup_first(struct mail_index_view *view,
 			     enum mail_flags flags, uint8_t flags_mask,
 			     uint32_t *seq_r);
+/* Add all mails in seq1..seq2 with (mail->flags & flags_mask) == flags and
+   all the given keywords set to seqs_r. keywords may be NULL. This scans the
+   records' flag and keyword columns in a single pass, so it's much faster
+   than looking up each message separately. */
+void mail_index_lookup_flag_seqs(struct mail_index_view *view,
+				 uint32_t seq1, uint32_t seq2,
+				 enum mail_flags flags, uint8_t flags_mask,
+				 const struct mail_keywords *keywords,
+				 ARRAY_TYPE(seq_range) *seqs_r);
 
 /* Append a new record to index. */
 void mail_index_append(struct mail_index_transaction *t, uint32_t uid,
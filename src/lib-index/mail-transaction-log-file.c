@@ -12,7 +12,11 @@
 #include "mail-index-modseq.h"
 #include "mail-transaction-log-private.h"
 
+#include <fcntl.h>
+
 #define LOG_PREFETCH IO_BLOCK_SIZE
+/* Maximum size of a single read() when reading a large log file */
+#define LOG_PREFETCH_MAX (1024*1024)
 #define MEMORY_LOG_NAME "(in-memory transaction log file)"
 #define LOG_NEW_DOTLOCK_SUFFIX ".newlock"
 
@@ -1587,17 +1591,34 @@ mail_transaction_log_file_read_more(struct mail_transaction_log_file *file,
 				    const char **reason_r)
 {
 	void *data;
-	size_t size;
+	size_t size, read_size = LOG_PREFETCH;
 	uint32_t read_offset;
 	ssize_t ret;
 
 	read_offset = file->buffer_offset + file->buffer->used;
 
+/* HAVE_POSIX_FADVISE alone isn't enough for CentOS 4.9 */
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	if (file->last_size > read_offset &&
+	    file->last_size - read_offset > LOG_PREFETCH) {
+		/* we already know there's a lot to read. tell the OS to start
+		   reading the rest of the file. */
+		if (posix_fadvise(file->fd, read_offset, 0,
+				  POSIX_FADV_WILLNEED) < 0)
+			log_file_set_syscall_error(file, "posix_fadvise()");
+	}
+#endif
 	do {
-		data = buffer_append_space_unsafe(file->buffer, LOG_PREFETCH);
-		ret = pread(file->fd, data, LOG_PREFETCH, read_offset);
-		if (ret > 0)
+		data = buffer_append_space_unsafe(file->buffer, read_size);
+		ret = pread(file->fd, data, read_size, read_offset);
+		if (ret > 0) {
 			read_offset += ret;
+			/* reading a large file - grow the read size to avoid
+			   lots of small reads */
+			if ((size_t)ret == read_size &&
+			    read_size < LOG_PREFETCH_MAX)
+				read_size *= 2;
+		}
 
 		size = read_offset - file->buffer_offset;
 		buffer_set_used_size(file->buffer, size);
@@ -1042,6 +1042,66 @@ static void test_mail_cache_update_need_purge_deleted_records2(void)
 	test_end();
 }
 
+static void test_mail_cache_purge_precopy(void)
+{
+	struct test_mail_cache_ctx ctx;
+	struct mail_cache_purge_precopy *precopy;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	char value[30];
+	uint32_t seq, log_seq;
+	uoff_t log_offset;
+
+	test_begin("mail cache purge precopy");
+	test_mail_cache_init(test_mail_index_init(), &ctx);
+	for (seq = 1; seq <= 4; seq++) {
+		i_snprintf(value, sizeof(value), "foo%u", seq);
+		test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, value);
+	}
+
+	/* copy the records without locking */
+	test_assert(mail_cache_purge_precopy(ctx.cache, (uint32_t)-1,
+					     &precopy) == 1);
+
+	/* change the mailbox before the locked purging: add a field to the
+	   2nd mail, expunge the 3rd mail and add a new mail */
+	test_mail_cache_add_field(&ctx, 2, ctx.cache_field2.idx, "bar2");
+	trans = mail_index_transaction_begin(ctx.view, 0);
+	mail_index_expunge(trans, 3);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	test_mail_cache_index_sync(&ctx);
+	test_mail_cache_view_sync(&ctx);
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, "foo5");
+
+	test_assert(mail_transaction_log_sync_lock(ctx.index->log, "purge",
+						   &log_seq, &log_offset) == 0);
+	trans = mail_index_transaction_begin(ctx.view, 0);
+	test_assert(mail_cache_purge_with_precopy(ctx.cache, trans,
+						  (uint32_t)-1, "test",
+						  &precopy) == 0);
+	test_assert(precopy == NULL);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_transaction_log_sync_unlock(ctx.index->log, "purge");
+	test_mail_cache_view_sync(&ctx);
+
+	test_assert(test_mail_cache_get_purge_count(&ctx) == 1);
+	test_assert(ctx.cache->hdr->record_count == 4);
+	/* the precopied records of the 2nd and 3rd mail weren't used */
+	test_assert(ctx.cache->hdr->deleted_record_count == 2);
+
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+	test_assert(cache_equals(cache_view, 1, ctx.cache_field.idx, "foo1"));
+	test_assert(cache_equals(cache_view, 2, ctx.cache_field.idx, "foo2"));
+	test_assert(cache_equals(cache_view, 2, ctx.cache_field2.idx, "bar2"));
+	test_assert(cache_equals(cache_view, 3, ctx.cache_field.idx, "foo4"));
+	test_assert(cache_equals(cache_view, 4, ctx.cache_field.idx, "foo5"));
+	mail_cache_view_close(&cache_view);
+
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
@@ -1070,6 +1130,7 @@ int main(void)
 		test_mail_cache_update_need_purge_continued_records2,
 		test_mail_cache_update_need_purge_deleted_records,
 		test_mail_cache_update_need_purge_deleted_records2,
+		test_mail_cache_purge_precopy,
 		NULL
 	};
 	return test_run(test_functions);
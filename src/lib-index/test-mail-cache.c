@@ -1,6 +1,7 @@
 /* Copyright (c) 2020 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "str.h"
 #include "write-full.h"
 #include "test-common.h"
@@ -745,6 +746,200 @@ static void test_mail_cache_size_corruption(void)
 	test_end();
 }
 
+static void test_mail_cache_lookup_fields_batch(void)
+{
+	struct test_mail_cache_ctx ctx;
+	struct mail_cache_view *cache_view;
+	ARRAY_TYPE(seq_range) seqs;
+	ARRAY_TYPE(mail_cache_lookup_batch_value) values;
+	const struct mail_cache_lookup_batch_value *value;
+	unsigned int field_idxs[2];
+	buffer_t *data_buf;
+
+	test_begin("mail cache lookup fields batch");
+	test_mail_cache_init(test_mail_index_init(), &ctx);
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, "foo1");
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, "foo2");
+	test_mail_cache_add_mail(&ctx, UINT_MAX, NULL);
+	/* the 1st mail's fields are spread into two records, with the
+	   later one in a higher file offset than the 2nd mail's */
+	test_mail_cache_add_field(&ctx, 1, ctx.cache_field2.idx, "bar1");
+	test_mail_cache_view_sync(&ctx);
+
+	t_array_init(&seqs, 2);
+	seq_range_array_add_range(&seqs, 1, 3);
+	t_array_init(&values, 6);
+	data_buf = t_buffer_create(64);
+	field_idxs[0] = ctx.cache_field.idx;
+	field_idxs[1] = ctx.cache_field2.idx;
+
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+	test_assert(mail_cache_lookup_fields_batch(cache_view, &seqs,
+						   field_idxs, 2, &values,
+						   data_buf) == 0);
+	test_assert(array_count(&values) == 6);
+
+	/* foo column */
+	value = array_idx(&values, 0);
+	test_assert(value->size == 4 &&
+		    memcmp(CONST_PTR_OFFSET(data_buf->data, value->data_offset),
+			   "foo1", 4) == 0);
+	value = array_idx(&values, 1);
+	test_assert(value->size == 4 &&
+		    memcmp(CONST_PTR_OFFSET(data_buf->data, value->data_offset),
+			   "foo2", 4) == 0);
+	value = array_idx(&values, 2);
+	test_assert(value->size == (uint32_t)-1);
+	/* bar column */
+	value = array_idx(&values, 3);
+	test_assert(value->size == 4 &&
+		    memcmp(CONST_PTR_OFFSET(data_buf->data, value->data_offset),
+			   "bar1", 4) == 0);
+	value = array_idx(&values, 4);
+	test_assert(value->size == (uint32_t)-1);
+	value = array_idx(&values, 5);
+	test_assert(value->size == (uint32_t)-1);
+
+	mail_cache_view_close(&cache_view);
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
+static void test_mail_cache_view_prefetch_fields(void)
+{
+	struct mail_cache_field cache_fields[] = {
+		{
+			.name = "bitmask",
+			.type = MAIL_CACHE_FIELD_BITMASK,
+			.field_size = 4,
+			.decision = MAIL_CACHE_DECISION_YES,
+		},
+		{
+			.name = "header1",
+			.type = MAIL_CACHE_FIELD_HEADER,
+			.decision = MAIL_CACHE_DECISION_YES,
+		},
+		{
+			.name = "header2",
+			.type = MAIL_CACHE_FIELD_HEADER,
+			.decision = MAIL_CACHE_DECISION_YES,
+		},
+	};
+	struct test_header_data header_data1 = {
+		.line1 = 15,
+		.line2 = 30,
+		.headers = "foo\nbar\n",
+	};
+	struct test_header_data header_data2 = {
+		.line1 = 10,
+		.line2 = 20,
+		.headers = "123\n456\n",
+	};
+	const uint8_t bitmask_data[] = { 0x00, 0x01, 0x10, 0x11 };
+	const uint8_t bitmask_add[] = { 0x20, 0x20, 0x20, 0x20 };
+	const uint8_t bitmask_merged[] = { 0x20, 0x21, 0x30, 0x31 };
+	struct test_mail_cache_ctx ctx;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_transaction_ctx *cache_trans;
+	struct mail_cache_lookup_batch_value *value;
+	ARRAY_TYPE(seq_range) seqs;
+	unsigned int field_idxs[4], header_idxs[2];
+	string_t *str = t_str_new(16);
+
+	test_begin("mail cache view prefetch fields");
+	test_mail_cache_init(test_mail_index_init(), &ctx);
+	mail_cache_register_fields(ctx.cache, cache_fields,
+				   N_ELEMENTS(cache_fields));
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, "foo1");
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, "foo2");
+	test_mail_cache_add_mail(&ctx, UINT_MAX, NULL);
+
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+	trans = mail_index_transaction_begin(ctx.view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	mail_cache_add(cache_trans, 1, cache_fields[0].idx,
+		       bitmask_data, sizeof(bitmask_data));
+	mail_cache_add(cache_trans, 1, cache_fields[1].idx,
+		       &header_data1, sizeof(header_data1));
+	mail_cache_add(cache_trans, 1, cache_fields[2].idx,
+		       &header_data2, sizeof(header_data2));
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_cache_view_close(&cache_view);
+	test_mail_cache_view_sync(&ctx);
+
+	field_idxs[0] = ctx.cache_field.idx;
+	field_idxs[1] = cache_fields[0].idx;
+	field_idxs[2] = header_idxs[1] = cache_fields[1].idx;
+	field_idxs[3] = header_idxs[0] = cache_fields[2].idx;
+	t_array_init(&seqs, 2);
+	seq_range_array_add_range(&seqs, 1, 3);
+
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+	test_assert(mail_cache_view_prefetch_fields(cache_view, &seqs,
+			field_idxs, N_ELEMENTS(field_idxs)) == 0);
+	test_assert(cache_view->prefetch != NULL);
+
+	/* the lookups return the prefetched data */
+	value = array_idx_modifiable(&cache_view->prefetch->values, 0);
+	test_assert(value->size == 4);
+	buffer_write(cache_view->prefetch->data, value->data_offset,
+		     "FOO1", 4);
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+					    ctx.cache_field.idx) == 1);
+	test_assert_strcmp(str_c(str), "FOO1");
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 2,
+					    ctx.cache_field.idx) == 1);
+	test_assert_strcmp(str_c(str), "foo2");
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 3,
+					    ctx.cache_field.idx) == 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+					    ctx.cache_field2.idx) == 0);
+	test_assert(mail_cache_lookup_headers(cache_view, str, 1, header_idxs,
+					      N_ELEMENTS(header_idxs)) == 1);
+	test_assert_strcmp(str_c(str), "123\nfoo\n456\nbar\n");
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_headers(cache_view, str, 2, header_idxs,
+					      N_ELEMENTS(header_idxs)) == 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+					    cache_fields[0].idx) == 1);
+	test_assert(str_len(str) == sizeof(bitmask_data) &&
+		    memcmp(str_data(str), bitmask_data, str_len(str)) == 0);
+
+	/* fields added after the prefetch aren't returned from it */
+	trans = mail_index_transaction_begin(ctx.view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	mail_cache_add(cache_trans, 1, cache_fields[0].idx,
+		       bitmask_add, sizeof(bitmask_add));
+	mail_cache_add(cache_trans, 3, ctx.cache_field.idx, "foo3", 4);
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+					    cache_fields[0].idx) == 1);
+	test_assert(str_len(str) == sizeof(bitmask_merged) &&
+		    memcmp(str_data(str), bitmask_merged, str_len(str)) == 0);
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 3,
+					    ctx.cache_field.idx) == 1);
+	test_assert_strcmp(str_c(str), "foo3");
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+
+	/* the prefetch is dropped once the view is synced */
+	test_mail_cache_add_mail(&ctx, UINT_MAX, NULL);
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+					    ctx.cache_field.idx) == 1);
+	test_assert_strcmp(str_c(str), "foo1");
+	test_assert(cache_view->prefetch == NULL);
+
+	mail_cache_view_close(&cache_view);
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
@@ -758,6 +953,8 @@ int main(void)
 		test_mail_cache_lookup_decisions2,
 		test_mail_cache_in_memory,
 		test_mail_cache_size_corruption,
+		test_mail_cache_lookup_fields_batch,
+		test_mail_cache_view_prefetch_fields,
 		NULL
 	};
 	return test_run(test_functions);
@@ -40,10 +40,217 @@ static void test_mail_index_rotate(void)
 	test_end();
 }
 
+static void test_mail_index_lookup_flag_seqs(void)
+{
+	const char *const keyword_names[] = { "foo", NULL };
+	struct mail_index *index;
+	struct mail_index_view *view, *updated_view;
+	struct mail_index_transaction *trans;
+	struct mail_keywords *keywords;
+	ARRAY_TYPE(seq_range) seqs;
+	const struct seq_range *range;
+	unsigned int count;
+	uint32_t uid, seq;
+
+	test_begin("mail index lookup flag seqs");
+	index = test_mail_index_init();
+	view = mail_index_view_open(index);
+	keywords = mail_index_keywords_create(index, keyword_names);
+
+	/* seqs 1..10, even ones are \Seen, 3..5 have keyword foo */
+	trans = mail_index_transaction_begin(view, 0);
+	uid = 1234;
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid, sizeof(uid), TRUE);
+	for (uid = 1; uid <= 10; uid++) {
+		mail_index_append(trans, uid, &seq);
+		if (seq % 2 == 0)
+			mail_index_update_flags(trans, seq, MODIFY_ADD, MAIL_SEEN);
+		if (seq >= 3 && seq <= 5) {
+			mail_index_update_keywords(trans, seq, MODIFY_ADD,
+						   keywords);
+		}
+	}
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	view = mail_index_view_open(index);
+
+	t_array_init(&seqs, 8);
+	mail_index_lookup_flag_seqs(view, 1, 10, MAIL_SEEN, MAIL_SEEN,
+				    NULL, &seqs);
+	test_assert(seq_range_count(&seqs) == 5);
+	test_assert(seq_range_exists(&seqs, 2) && !seq_range_exists(&seqs, 3));
+
+	array_clear(&seqs);
+	mail_index_lookup_flag_seqs(view, 2, 10, 0, 0, keywords, &seqs);
+	range = array_get(&seqs, &count);
+	test_assert(count == 1 && range[0].seq1 == 3 && range[0].seq2 == 5);
+
+	array_clear(&seqs);
+	mail_index_lookup_flag_seqs(view, 1, 10, MAIL_SEEN, MAIL_SEEN,
+				    keywords, &seqs);
+	range = array_get(&seqs, &count);
+	test_assert(count == 1 && range[0].seq1 == 4 && range[0].seq2 == 4);
+
+	/* uncommitted updates are visible in the transaction's view */
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_flags(trans, 4, MODIFY_REMOVE, MAIL_SEEN);
+	mail_index_update_keywords(trans, 8, MODIFY_ADD, keywords);
+	mail_index_append(trans, 11, &seq);
+	mail_index_update_flags(trans, seq, MODIFY_ADD, MAIL_SEEN);
+	mail_index_update_keywords(trans, seq, MODIFY_ADD, keywords);
+	updated_view = mail_index_transaction_open_updated_view(trans);
+
+	array_clear(&seqs);
+	mail_index_lookup_flag_seqs(updated_view, 1, 11, MAIL_SEEN, MAIL_SEEN,
+				    keywords, &seqs);
+	range = array_get(&seqs, &count);
+	test_assert(count == 2 && range[0].seq1 == 8 && range[0].seq2 == 8 &&
+		    range[1].seq1 == 11 && range[1].seq2 == 11);
+	mail_index_view_close(&updated_view);
+	mail_index_transaction_rollback(&trans);
+
+	mail_index_keywords_unref(&keywords);
+	mail_index_view_close(&view);
+	test_mail_index_deinit(&index);
+	test_end();
+}
+
+static void test_mail_index_mmap_append(void)
+{
+	struct mail_index *index, *index2;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *sync_view;
+	struct mail_index_transaction *sync_trans;
+	uint32_t uid, seq;
+
+	test_begin("mail index mmap append");
+	index = test_mail_index_init();
+	view = mail_index_view_open(index);
+
+	/* create an index file large enough to be mmaped */
+	trans = mail_index_transaction_begin(view, 0);
+	uid = 1234;
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid, sizeof(uid), TRUE);
+	for (uid = 1; uid <= 10000; uid++)
+		mail_index_append(trans, uid, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &sync_view,
+					  &sync_trans, 0) == 1);
+	mail_index_write(index, TRUE, "test");
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+
+	index2 = test_mail_index_open();
+	test_assert(!MAIL_INDEX_MAP_IS_IN_MEMORY(index2->map));
+	test_assert(index2->map->rec_map->mmap_append_size > 0);
+
+	/* appends are synced into the space reserved after the mmaped file
+	   without moving the map to memory */
+	mail_index_view_close(&view);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	for (uid = 10001; uid <= 10005; uid++)
+		mail_index_append(trans, uid, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+
+	test_assert(mail_index_refresh(index2) == 0);
+	test_assert(!MAIL_INDEX_MAP_IS_IN_MEMORY(index2->map));
+	test_assert(index2->map->hdr.messages_count == 10005);
+	test_assert(MAIL_INDEX_REC_AT_SEQ(index2->map, 10000)->uid == 10000);
+	test_assert(MAIL_INDEX_REC_AT_SEQ(index2->map, 10005)->uid == 10005);
+
+	mail_index_view_close(&view);
+	test_mail_index_close(&index2);
+	test_mail_index_deinit(&index);
+	test_end();
+}
+
+static void test_mail_index_sync_deferred_expunges(void)
+{
+	struct mail_index *index, *index2;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *sync_view;
+	struct mail_index_transaction *sync_trans;
+	const struct mail_index_record *rec;
+	uint32_t uid, seq, seq1, seq2;
+	unsigned int i;
+
+	test_begin("mail index sync deferred expunges");
+	index = test_mail_index_init();
+	view = mail_index_view_open(index);
+
+	trans = mail_index_transaction_begin(view, 0);
+	uid = 1234;
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid, sizeof(uid), TRUE);
+	for (uid = 1; uid <= 100; uid++)
+		mail_index_append(trans, uid, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+
+	index2 = test_mail_index_open();
+
+	/* interleave flag updates and expunges: for each 10 UIDs mark
+	   the first 5 as \Seen and expunge the 2nd and 3rd. */
+	for (i = 0; i < 10; i++) {
+		view = mail_index_view_open(index);
+		trans = mail_index_transaction_begin(view, 0);
+		test_assert(mail_index_lookup_seq_range(view, i*10 + 1,
+							i*10 + 5,
+							&seq1, &seq2));
+		mail_index_update_flags_range(trans, seq1, seq2,
+					      MODIFY_ADD, MAIL_SEEN);
+		test_assert(mail_index_transaction_commit(&trans) == 0);
+		mail_index_view_close(&view);
+
+		test_assert(mail_index_sync_begin(index, &sync_ctx, &sync_view,
+						  &sync_trans, 0) == 1);
+		test_assert(mail_index_lookup_seq_range(sync_view, i*10 + 2,
+							i*10 + 3,
+							&seq1, &seq2));
+		for (seq = seq1; seq <= seq2; seq++)
+			mail_index_expunge(sync_trans, seq);
+		test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+	}
+
+	/* replay all of the above from the log */
+	test_assert(mail_index_refresh(index2) == 0);
+	test_assert(index2->map->hdr.messages_count == 80);
+	test_assert(index2->map->hdr.seen_messages_count == 30);
+	test_assert(index2->map->hdr.messages_count ==
+		    index->map->hdr.messages_count);
+	test_assert(index2->map->hdr.seen_messages_count ==
+		    index->map->hdr.seen_messages_count);
+	for (seq = 1; seq <= index2->map->hdr.messages_count; seq++) {
+		rec = MAIL_INDEX_REC_AT_SEQ(index2->map, seq);
+		test_assert_idx(rec->uid ==
+				MAIL_INDEX_REC_AT_SEQ(index->map, seq)->uid, seq);
+		test_assert_idx((rec->uid - 1) % 10 != 1 &&
+				(rec->uid - 1) % 10 != 2, seq);
+		test_assert_idx(((rec->flags & MAIL_SEEN) != 0) ==
+				((rec->uid - 1) % 10 < 5), seq);
+	}
+
+	test_mail_index_close(&index2);
+	test_mail_index_deinit(&index);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_mail_index_rotate,
+		test_mail_index_lookup_flag_seqs,
+		test_mail_index_mmap_append,
+		test_mail_index_sync_deferred_expunges,
 		NULL
 	};
 	return test_run(test_functions);
@@ -0,0 +1,281 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "base64.h"
+#include "str.h"
+#include "strnum.h"
+#include "istream.h"
+#include "time-util.h"
+#include "message-size.h"
+#include "message-header-parser.h"
+#include "message-parser.h"
+
+#include <stdio.h>
+
+/**
+ * Generates a corpus of MIME messages shaped like typical mails: plain text
+ * mails, text+html alternatives, mails with base64 attachments and
+ * forwarded mails. Each message is then parsed with the full message parser
+ * and separately with only the header parser, and the throughput is reported
+ * in MB/s.
+ */
+
+ARRAY_DEFINE_TYPE(bench_message, string_t *);
+
+static const char *bench_words[] = {
+	"the", "meeting", "tomorrow", "report", "please", "attached", "thanks",
+	"regards", "quarterly", "project", "update", "schedule", "review",
+	"-", "--", "a", "document", "version", "final", "draft",
+};
+
+static void bench_headers(string_t *str, unsigned int idx,
+			  const char *content_type)
+{
+	unsigned int i;
+
+	str_printfa(str,
+		"Return-Path: <sender%u@example.com>\r\n"
+		"Received: from mx%u.example.com (mx%u.example.com [192.0.2.%u])\r\n"
+		"\tby mail.example.org with ESMTPS id abc%u\r\n"
+		"\tfor <user@example.org>; Tue, 1 Oct 2024 10:%02u:00 +0000\r\n",
+		idx, idx % 7, idx % 7, idx % 250, idx, idx % 60);
+	for (i = 0; i < 3; i++) {
+		str_printfa(str, "X-Spam-Check-%u: score=%u.%u tests=BAYES_00,"
+			    "DKIM_SIGNED,DKIM_VALID,SPF_PASS\r\n",
+			    i, idx % 10, i);
+	}
+	str_printfa(str,
+		"DKIM-Signature: v=1; a=rsa-sha256; c=relaxed/relaxed;\r\n"
+		"\td=example.com; s=selector1; h=from:to:subject:date;\r\n"
+		"\tbh=47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=;\r\n"
+		"\tb=dGhpcyBpcyBub3QgYSByZWFsIHNpZ25hdHVyZSBhdCBhbGwgYnV0IGl0\r\n"
+		"\t IGxvb2tzIGxpa2Ugb25lIGZvciB0aGUgcHVycG9zZXMgb2YgdGhpcyB0ZXN0\r\n"
+		"From: Sender %u <sender%u@example.com>\r\n"
+		"To: User <user@example.org>\r\n"
+		"Subject: Re: project update %u\r\n"
+		"Date: Tue, 1 Oct 2024 10:%02u:00 +0000\r\n"
+		"Message-ID: <%u.bench@example.com>\r\n"
+		"MIME-Version: 1.0\r\n"
+		"Content-Type: %s\r\n"
+		"\r\n", idx, idx, idx, idx % 60, idx, content_type);
+}
+
+static void bench_text(string_t *str, unsigned int size)
+{
+	size_t start = str_len(str), line_start = start;
+
+	while (str_len(str) - start < size) {
+		if (str_len(str) - line_start > 70) {
+			str_append(str, "\r\n");
+			line_start = str_len(str);
+		} else if (str_len(str) != line_start) {
+			str_append_c(str, ' ');
+		}
+		str_append(str, bench_words[i_rand_limit(N_ELEMENTS(bench_words))]);
+	}
+	str_append(str, "\r\n");
+}
+
+static void bench_html(string_t *str, unsigned int size)
+{
+	size_t start = str_len(str);
+
+	str_append(str, "<html><body>\r\n");
+	while (str_len(str) - start < size) {
+		str_append(str, "<p style=\"margin: 0\">");
+		bench_text(str, 200);
+		str_append(str, "</p>\r\n");
+	}
+	str_append(str, "</body></html>\r\n");
+}
+
+static void bench_base64(string_t *str, unsigned int size)
+{
+	buffer_t *data = t_buffer_create(size);
+	string_t *b64 = t_str_new(MAX_BASE64_ENCODED_SIZE(size));
+	const char *p;
+	size_t left;
+	unsigned int i;
+
+	for (i = 0; i < size; i++)
+		buffer_append_c(data, i_rand_limit(256));
+	base64_encode(data->data, data->used, b64);
+	for (p = str_c(b64), left = str_len(b64); left > 76; ) {
+		str_append_data(str, p, 76);
+		str_append(str, "\r\n");
+		p += 76; left -= 76;
+	}
+	str_append_data(str, p, left);
+	str_append(str, "\r\n");
+}
+
+static void bench_alternative(string_t *str, const char *boundary,
+			      unsigned int size)
+{
+	str_printfa(str, "--%s\r\n"
+		    "Content-Type: text/plain; charset=utf-8\r\n"
+		    "Content-Transfer-Encoding: quoted-printable\r\n"
+		    "\r\n", boundary);
+	bench_text(str, size);
+	str_printfa(str, "--%s\r\n"
+		    "Content-Type: text/html; charset=utf-8\r\n"
+		    "Content-Transfer-Encoding: quoted-printable\r\n"
+		    "\r\n", boundary);
+	bench_html(str, size * 2);
+	str_printfa(str, "--%s--\r\n", boundary);
+}
+
+static void bench_message(string_t *str, unsigned int idx)
+{
+	switch (idx % 4) {
+	case 0:
+		bench_headers(str, idx, "text/plain; charset=utf-8");
+		bench_text(str, 2000 + i_rand_limit(4000));
+		break;
+	case 1:
+		bench_headers(str, idx, "multipart/alternative;\r\n"
+			      "\tboundary=\"----=_Part_alt_1234567890\"");
+		str_append(str, "This is a multi-part message in MIME format.\r\n");
+		bench_alternative(str, "----=_Part_alt_1234567890",
+				  3000 + i_rand_limit(5000));
+		break;
+	case 2:
+		bench_headers(str, idx, "multipart/mixed;\r\n"
+			      "\tboundary=\"----=_Part_mixed_0987654321\"");
+		str_append(str, "------=_Part_mixed_0987654321\r\n"
+			   "Content-Type: multipart/alternative;\r\n"
+			   "\tboundary=\"----=_Part_alt_1234567890\"\r\n\r\n");
+		bench_alternative(str, "----=_Part_alt_1234567890",
+				  1000 + i_rand_limit(2000));
+		str_append(str, "------=_Part_mixed_0987654321\r\n"
+			   "Content-Type: application/pdf; name=\"report.pdf\"\r\n"
+			   "Content-Transfer-Encoding: base64\r\n"
+			   "Content-Disposition: attachment; filename=\"report.pdf\"\r\n"
+			   "\r\n");
+		bench_base64(str, 20000 + i_rand_limit(200000));
+		str_append(str, "------=_Part_mixed_0987654321--\r\n");
+		break;
+	case 3:
+		bench_headers(str, idx, "multipart/mixed;\r\n"
+			      "\tboundary=\"fwd_boundary\"");
+		str_append(str, "--fwd_boundary\r\n"
+			   "Content-Type: text/plain\r\n\r\n");
+		bench_text(str, 500);
+		str_append(str, "--fwd_boundary\r\n"
+			   "Content-Type: message/rfc822\r\n\r\n");
+		bench_headers(str, idx + 1, "multipart/alternative;\r\n"
+			      "\tboundary=\"inner_boundary\"");
+		bench_alternative(str, "inner_boundary",
+				  2000 + i_rand_limit(3000));
+		str_append(str, "--fwd_boundary--\r\n");
+		break;
+	}
+}
+
+static void bench_message_parse(const ARRAY_TYPE(bench_message) *messages)
+{
+	const struct message_parser_settings set = { .flags = 0 };
+	struct message_parser_ctx *parser;
+	struct message_block block;
+	struct message_part *parts;
+	struct istream *input;
+	string_t *msg;
+	pool_t pool;
+
+	pool = pool_alloconly_create("message parser", 10240);
+	array_foreach_elem(messages, msg) {
+		input = i_stream_create_from_data(str_data(msg), str_len(msg));
+		parser = message_parser_init(pool, input, &set);
+		while (message_parser_parse_next_block(parser, &block) > 0) ;
+		message_parser_deinit(&parser, &parts);
+		i_assert(input->eof);
+		i_stream_unref(&input);
+		p_clear(pool);
+	}
+	pool_unref(&pool);
+}
+
+static void bench_header_callback(struct message_header_line *hdr ATTR_UNUSED,
+				  void *context ATTR_UNUSED)
+{
+}
+
+static void bench_header_parse(const ARRAY_TYPE(bench_message) *messages)
+{
+	struct message_size hdr_size;
+	struct istream *input;
+	string_t *msg;
+
+	array_foreach_elem(messages, msg) {
+		input = i_stream_create_from_data(str_data(msg), str_len(msg));
+		message_parse_header(input, &hdr_size, 0,
+				     bench_header_callback, NULL);
+		i_stream_unref(&input);
+	}
+}
+
+static void bench_print(const char *name, uint64_t ts_0, uint64_t ts_1,
+			uint64_t bytes)
+{
+	printf("%-15s %8.1lf MB/s\n", name,
+	       (double)bytes / 1048576.0 / ((double)(ts_1 - ts_0) / 1e9));
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [message_count [rounds]]\n", prog);
+	fprintf(stderr, "Runs 10 rounds of 1000 messages if nothing given\n");
+	exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	ARRAY_TYPE(bench_message) messages;
+	unsigned int i, message_count = 1000, rounds = 10;
+	uint64_t ts_0, ts_1, total_size = 0, hdr_total_size = 0;
+	string_t *str;
+
+	lib_init();
+
+	if (argc >= 2) {
+		if (str_to_uint(argv[1], &message_count) < 0 ||
+		    (argc >= 3 && str_to_uint(argv[2], &rounds) < 0) ||
+		    argc > 3) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+		}
+	}
+
+	i_array_init(&messages, message_count);
+	for (i = 0; i < message_count; i++) {
+		str = str_new(default_pool, 4096);
+		T_BEGIN {
+			bench_message(str, i);
+		} T_END;
+		array_push_back(&messages, &str);
+		total_size += str_len(str);
+		hdr_total_size += strstr(str_c(str), "\r\n\r\n") -
+			str_c(str) + 4;
+	}
+	printf("%u messages, %"PRIu64" kB, %u rounds\n\n",
+	       message_count, total_size / 1024, rounds);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < rounds; i++)
+		bench_message_parse(&messages);
+	ts_1 = i_nanoseconds();
+	bench_print("message parser", ts_0, ts_1, total_size * rounds);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < rounds; i++)
+		bench_header_parse(&messages);
+	ts_1 = i_nanoseconds();
+	bench_print("header parser", ts_0, ts_1, hdr_total_size * rounds);
+
+	array_foreach_elem(&messages, str)
+		str_free(&str);
+	array_free(&messages);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,127 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "qp-encoder.h"
+#include "qp-decoder.h"
+
+#include <stdio.h>
+
+/**
+ * Measures the quoted-printable encoding and decoding throughput. The input
+ * is mostly ASCII text with some 8-bit characters, like a typical
+ * quoted-printable encoded mail body.
+ */
+
+#define BENCH_BLOCK_SIZE 8192
+
+static const char *bench_words[] = {
+	"the", "meeting", "tomorrow", "report", "please", "attached",
+	"thanks", "regards", "quarterly", "project", "update", "schedule",
+	"review", "a", "document", "version", "final", "draft",
+	"r\xc3\xa9sum\xc3\xa9", "na\xc3\xafve", "caf\xc3\xa9", "1+1=2",
+};
+
+static void bench_text(string_t *str, size_t size)
+{
+	size_t line_start = 0;
+
+	while (str_len(str) < size) {
+		if (str_len(str) - line_start > 60) {
+			str_append_c(str, '\n');
+			line_start = str_len(str);
+		} else if (str_len(str) != line_start) {
+			str_append_c(str, ' ');
+		}
+		str_append(str, bench_words[i_rand_limit(N_ELEMENTS(bench_words))]);
+	}
+}
+
+static void bench_print(const char *name, uint64_t ts_0, uint64_t ts_1,
+			uint64_t bytes)
+{
+	printf("%-8s %8.1lf MB/s\n", name,
+	       (double)bytes / 1048576.0 / ((double)(ts_1 - ts_0) / 1e9));
+}
+
+static void bench_qp(size_t size, unsigned int rounds)
+{
+	struct qp_encoder *enc;
+	struct qp_decoder *dec;
+	string_t *text, *encoded, *decoded;
+	uint64_t ts_0, ts_1;
+	const char *error;
+	size_t pos, n, error_pos;
+	unsigned int i;
+
+	text = str_new(default_pool, size + 64);
+	bench_text(text, size);
+	encoded = str_new(default_pool, size * 2);
+	decoded = str_new(default_pool, size * 2);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < rounds; i++) {
+		str_truncate(encoded, 0);
+		enc = qp_encoder_init(encoded, 76, 0);
+		for (pos = 0; pos < str_len(text); pos += n) {
+			n = I_MIN(str_len(text) - pos, BENCH_BLOCK_SIZE);
+			qp_encoder_more(enc, str_data(text) + pos, n);
+		}
+		qp_encoder_finish(enc);
+		qp_encoder_deinit(&enc);
+	}
+	ts_1 = i_nanoseconds();
+	bench_print("encode", ts_0, ts_1, (uint64_t)str_len(text) * rounds);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < rounds; i++) {
+		str_truncate(decoded, 0);
+		dec = qp_decoder_init(decoded);
+		for (pos = 0; pos < str_len(encoded); pos += n) {
+			n = I_MIN(str_len(encoded) - pos, BENCH_BLOCK_SIZE);
+			if (qp_decoder_more(dec, str_data(encoded) + pos, n,
+					    &error_pos, &error) < 0)
+				i_fatal("qp_decoder_more() failed: %s", error);
+		}
+		if (qp_decoder_finish(dec, &error) < 0)
+			i_fatal("qp_decoder_finish() failed: %s", error);
+		qp_decoder_deinit(&dec);
+	}
+	ts_1 = i_nanoseconds();
+	bench_print("decode", ts_0, ts_1, (uint64_t)str_len(encoded) * rounds);
+
+	str_free(&text);
+	str_free(&encoded);
+	str_free(&decoded);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [size [rounds]]\n", prog);
+	fprintf(stderr, "Runs 100 rounds of 1 MB if nothing given\n");
+	exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int size = 1024*1024, rounds = 100;
+
+	lib_init();
+
+	if (argc >= 2) {
+		if (str_to_uint(argv[1], &size) < 0 ||
+		    (argc >= 3 && str_to_uint(argv[2], &rounds) < 0) ||
+		    argc > 3) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+		}
+	}
+
+	printf("%u bytes, %u rounds\n\n", size, rounds);
+	bench_qp(size, rounds);
+
+	lib_deinit();
+	return 0;
+}
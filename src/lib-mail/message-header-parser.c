@@ -7,6 +7,7 @@
 #include "unichar.h"
 #include "message-size.h"
 #include "message-header-parser.h"
+#include "message-scan.h"
 
 struct message_header_parser_ctx {
 	struct message_header_line line;
@@ -166,10 +167,13 @@ int message_parse_header_next(struct message_header_parser_ctx *ctx,
 		/* find ':' */
 		if (colon_pos == UINT_MAX) {
 			for (i = startpos; i < parse_size; i++) {
-				if (msg[i] > ':')
-					continue;
+				i += message_scan_header_delim(msg + i,
+					parse_size - i,
+					ctx->skip_line ? '\n' : ':');
+				if (i == parse_size)
+					break;
 
-				if (msg[i] == ':' && !ctx->skip_line) {
+				if (msg[i] == ':') {
 					colon_pos = i;
 					line->full_value_offset =
 						ctx->input->v_offset + i + 1;
@@ -189,12 +193,12 @@ int message_parse_header_next(struct message_header_parser_ctx *ctx,
 
 		/* find '\n' */
 		for (; i < parse_size; i++) {
-			if (msg[i] <= '\n') {
-				if (msg[i] == '\n')
-					break;
-				if (msg[i] == '\0')
-					ctx->has_nuls = TRUE;
-			}
+			i += message_scan_header_delim(msg + i, parse_size - i,
+						       '\n');
+			if (i == parse_size || msg[i] == '\n')
+				break;
+			/* NUL */
+			ctx->has_nuls = TRUE;
 		}
 
 		if (i < parse_size && i+1 == size && ret == -2) {
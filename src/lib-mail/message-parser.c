@@ -6,6 +6,7 @@
 #include "istream.h"
 #include "rfc822-parser.h"
 #include "rfc2231-parser.h"
+#include "message-scan.h"
 #include "message-parser-private.h"
 
 message_part_header_callback_t *null_message_part_header_callback = NULL;
@@ -395,7 +396,7 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 {
 	struct message_boundary *boundary = NULL;
 	const unsigned char *data, *cur, *next, *end;
-	size_t boundary_start;
+	size_t pos, boundary_start;
 	int ret;
 	bool full;
 
@@ -418,9 +419,17 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 	boundary_start = 0;
 
 	/* skip to beginning of the next line. the first line was
-	   handled already. */
+	   handled already. Only lines beginning with "--" can be
+	   boundaries, so the other lines are skipped without looking
+	   at them. */
 	cur = data; end = data + block_r->size;
-	while ((next = memchr(cur, '\n', end - cur)) != NULL) {
+	for (;;) {
+		pos = message_scan_boundary_lf(cur, end - cur);
+		if (pos == (size_t)(end - cur)) {
+			next = NULL;
+			break;
+		}
+		next = cur + pos;
 		cur = next + 1;
 
 		boundary_start = next - data;
@@ -442,6 +451,22 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 		}
 	}
 
+	if (next == NULL) {
+		/* the rest of the block has no boundary lines. find the
+		   beginning of its last line. */
+		for (next = end; next > cur; next--) {
+			if (next[-1] == '\n')
+				break;
+		}
+		if (next > cur) {
+			next--;
+			boundary_start = next - data;
+			if (next > data && next[-1] == '\r')
+				boundary_start--;
+		}
+		next = NULL;
+	}
+
 	if (next != NULL) {
 		/* found / need more data */
 		i_assert(ret >= 0);
@@ -2,7 +2,10 @@
 
 #include "lib.h"
 #include "buffer.h"
+#include "numpack.h"
+#include "message-address.h"
 #include "message-parser.h"
+#include "message-part-data.h"
 #include "message-part-serialize.h"
 
 /*
@@ -26,11 +29,53 @@
      (flags & (MESSAGE_PART_FLAG_MULTIPART | MESSAGE_PART_FLAG_MESSAGE_RFC822))
        unsigned int children_count
 
+   The message part data is serialized separately, visiting the parts in
+   the same order:
+
+   part data
+     unsigned char flags (enum part_data_serialize_flags)
+     (always, since every part has data)
+       string content_type, content_subtype
+       number content_type_params_count
+         string name, value (for each param)
+       string content_transfer_encoding, content_id, content_description
+       string content_disposition
+       number content_disposition_params_count
+         string name, value (for each param)
+       string content_md5
+       number content_language count + 1, or 0 if there's none
+         string language (for each language)
+       string content_location
+     (flags & PART_DATA_SERIALIZE_FLAG_ENVELOPE, never for the root part)
+       envelope of the message/rfc822 part's message
+
+   The part data is followed by the top-level message's envelope:
+
+   unsigned char have_envelope
+   (have_envelope)
+     envelope
+
+   envelope
+     string date, subject
+     addresses from, sender, reply_to, to, cc, bcc
+     string in_reply_to, message_id
+
+   Numbers are written with numpack_encode(). Strings are written as the
+   string's length + 1 followed by the string, or as 0 for NULL strings.
+   Addresses are written as the number of addresses followed by each
+   address:
+     unsigned char invalid_syntax
+     string name, route, mailbox, domain
 */
 
 #define MINIMUM_SERIALIZED_SIZE \
 	(sizeof(unsigned int) + sizeof(uoff_t) * 4)
 
+enum part_data_serialize_flags {
+	PART_DATA_SERIALIZE_FLAG_CONTENT	= 0x01,
+	PART_DATA_SERIALIZE_FLAG_ENVELOPE	= 0x02,
+};
+
 struct deserialize_context {
 	pool_t pool;
 	const unsigned char *data, *end;
@@ -267,3 +312,381 @@ message_part_deserialize(pool_t pool, const void *data, size_t size,
 
 	return part;
 }
+
+static void part_data_serialize_str(buffer_t *dest, const char *str)
+{
+	size_t len;
+
+	if (str == NULL) {
+		numpack_encode(dest, 0);
+		return;
+	}
+	len = strlen(str);
+	numpack_encode(dest, len + 1);
+	buffer_append(dest, str, len);
+}
+
+static void
+part_data_serialize_params(buffer_t *dest,
+			   const struct message_part_param *params,
+			   unsigned int count)
+{
+	unsigned int i;
+
+	numpack_encode(dest, count);
+	for (i = 0; i < count; i++) {
+		part_data_serialize_str(dest, params[i].name);
+		part_data_serialize_str(dest, params[i].value);
+	}
+}
+
+static void
+part_data_serialize_addresses(buffer_t *dest,
+			      const struct message_address *addr)
+{
+	const struct message_address *a;
+	unsigned int count = 0;
+
+	for (a = addr; a != NULL; a = a->next)
+		count++;
+	numpack_encode(dest, count);
+	for (a = addr; a != NULL; a = a->next) {
+		buffer_append_c(dest, a->invalid_syntax ? 1 : 0);
+		part_data_serialize_str(dest, a->name);
+		part_data_serialize_str(dest, a->route);
+		part_data_serialize_str(dest, a->mailbox);
+		part_data_serialize_str(dest, a->domain);
+	}
+}
+
+static void
+part_data_serialize_content(buffer_t *dest,
+			    const struct message_part_data *data)
+{
+	unsigned int count;
+
+	part_data_serialize_str(dest, data->content_type);
+	part_data_serialize_str(dest, data->content_subtype);
+	part_data_serialize_params(dest, data->content_type_params,
+				   data->content_type_params_count);
+	part_data_serialize_str(dest, data->content_transfer_encoding);
+	part_data_serialize_str(dest, data->content_id);
+	part_data_serialize_str(dest, data->content_description);
+	part_data_serialize_str(dest, data->content_disposition);
+	part_data_serialize_params(dest, data->content_disposition_params,
+				   data->content_disposition_params_count);
+	part_data_serialize_str(dest, data->content_md5);
+	if (data->content_language == NULL)
+		numpack_encode(dest, 0);
+	else {
+		count = str_array_length(data->content_language);
+		numpack_encode(dest, count + 1);
+		for (unsigned int i = 0; i < count; i++) {
+			part_data_serialize_str(dest,
+						data->content_language[i]);
+		}
+	}
+	part_data_serialize_str(dest, data->content_location);
+}
+
+static void
+part_data_serialize_envelope(buffer_t *dest,
+			     const struct message_part_envelope *envelope)
+{
+	part_data_serialize_str(dest, envelope->date);
+	part_data_serialize_str(dest, envelope->subject);
+	part_data_serialize_addresses(dest, envelope->from);
+	part_data_serialize_addresses(dest, envelope->sender);
+	part_data_serialize_addresses(dest, envelope->reply_to);
+	part_data_serialize_addresses(dest, envelope->to);
+	part_data_serialize_addresses(dest, envelope->cc);
+	part_data_serialize_addresses(dest, envelope->bcc);
+	part_data_serialize_str(dest, envelope->in_reply_to);
+	part_data_serialize_str(dest, envelope->message_id);
+}
+
+static void
+part_data_serialize(const struct message_part *part, buffer_t *dest)
+{
+	enum part_data_serialize_flags flags;
+
+	for (; part != NULL; part = part->next) {
+		i_assert(part->data != NULL);
+		/* the top-level envelope is serialized separately */
+		i_assert(part->parent != NULL || part->data->envelope == NULL);
+
+		flags = PART_DATA_SERIALIZE_FLAG_CONTENT;
+		if (part->data->envelope != NULL)
+			flags |= PART_DATA_SERIALIZE_FLAG_ENVELOPE;
+		buffer_append_c(dest, flags);
+		part_data_serialize_content(dest, part->data);
+		if ((flags & PART_DATA_SERIALIZE_FLAG_ENVELOPE) != 0)
+			part_data_serialize_envelope(dest, part->data->envelope);
+		part_data_serialize(part->children, dest);
+	}
+}
+
+void message_part_data_serialize(const struct message_part *part,
+				 const struct message_part_envelope *envelope,
+				 buffer_t *dest)
+{
+	part_data_serialize(part, dest);
+	buffer_append_c(dest, envelope != NULL ? 1 : 0);
+	if (envelope != NULL)
+		part_data_serialize_envelope(dest, envelope);
+}
+
+static bool
+part_data_deserialize_number(struct deserialize_context *ctx,
+			     unsigned int *num_r)
+{
+	uint32_t num;
+
+	if (numpack_decode32(&ctx->data, ctx->end, &num) < 0) {
+		ctx->error = "Invalid number";
+		return FALSE;
+	}
+	/* each counted item takes at least one byte */
+	if (num > (size_t)(ctx->end - ctx->data) + 1) {
+		ctx->error = "Too large count";
+		return FALSE;
+	}
+	*num_r = num;
+	return TRUE;
+}
+
+static bool
+part_data_deserialize_str(struct deserialize_context *ctx, const char **str_r)
+{
+	uint64_t len;
+
+	if (numpack_decode(&ctx->data, ctx->end, &len) < 0) {
+		ctx->error = "Invalid string length";
+		return FALSE;
+	}
+	if (len == 0) {
+		*str_r = NULL;
+		return TRUE;
+	}
+	len--;
+	if (len > (size_t)(ctx->end - ctx->data)) {
+		ctx->error = "Not enough data";
+		return FALSE;
+	}
+	*str_r = p_strndup(ctx->pool, ctx->data, len);
+	ctx->data += len;
+	return TRUE;
+}
+
+static bool
+part_data_deserialize_params(struct deserialize_context *ctx,
+			     const struct message_part_param **params_r,
+			     unsigned int *count_r)
+{
+	struct message_part_param *params;
+	unsigned int i, count;
+
+	if (!part_data_deserialize_number(ctx, &count))
+		return FALSE;
+	if (count == 0) {
+		*params_r = NULL;
+		*count_r = 0;
+		return TRUE;
+	}
+	params = p_new(ctx->pool, struct message_part_param, count);
+	for (i = 0; i < count; i++) {
+		if (!part_data_deserialize_str(ctx, &params[i].name) ||
+		    !part_data_deserialize_str(ctx, &params[i].value))
+			return FALSE;
+		if (params[i].name == NULL || params[i].value == NULL) {
+			ctx->error = "Parameter has NULL name or value";
+			return FALSE;
+		}
+	}
+	*params_r = params;
+	*count_r = count;
+	return TRUE;
+}
+
+static bool
+part_data_deserialize_addresses(struct deserialize_context *ctx,
+				struct message_address **addr_r)
+{
+	struct message_address *addr, **next_addr = addr_r;
+	unsigned int count;
+
+	*addr_r = NULL;
+	if (!part_data_deserialize_number(ctx, &count))
+		return FALSE;
+	for (; count > 0; count--) {
+		addr = p_new(ctx->pool, struct message_address, 1);
+		if (ctx->data == ctx->end) {
+			ctx->error = "Not enough data";
+			return FALSE;
+		}
+		addr->invalid_syntax = *ctx->data++ != 0;
+		if (!part_data_deserialize_str(ctx, &addr->name) ||
+		    !part_data_deserialize_str(ctx, &addr->route) ||
+		    !part_data_deserialize_str(ctx, &addr->mailbox) ||
+		    !part_data_deserialize_str(ctx, &addr->domain))
+			return FALSE;
+		*next_addr = addr;
+		next_addr = &addr->next;
+	}
+	return TRUE;
+}
+
+static bool
+part_data_deserialize_content(struct deserialize_context *ctx,
+			      struct message_part_data *data)
+{
+	const char **languages;
+	unsigned int i, count;
+
+	if (!part_data_deserialize_str(ctx, &data->content_type) ||
+	    !part_data_deserialize_str(ctx, &data->content_subtype) ||
+	    !part_data_deserialize_params(ctx, &data->content_type_params,
+					  &data->content_type_params_count) ||
+	    !part_data_deserialize_str(ctx, &data->content_transfer_encoding) ||
+	    !part_data_deserialize_str(ctx, &data->content_id) ||
+	    !part_data_deserialize_str(ctx, &data->content_description) ||
+	    !part_data_deserialize_str(ctx, &data->content_disposition) ||
+	    !part_data_deserialize_params(ctx,
+			&data->content_disposition_params,
+			&data->content_disposition_params_count) ||
+	    !part_data_deserialize_str(ctx, &data->content_md5) ||
+	    !part_data_deserialize_number(ctx, &count))
+		return FALSE;
+
+	if (count > 0) {
+		count--;
+		languages = p_new(ctx->pool, const char *, count + 1);
+		for (i = 0; i < count; i++) {
+			if (!part_data_deserialize_str(ctx, &languages[i]))
+				return FALSE;
+			if (languages[i] == NULL) {
+				ctx->error = "NULL content language";
+				return FALSE;
+			}
+		}
+		data->content_language = languages;
+	}
+	return part_data_deserialize_str(ctx, &data->content_location);
+}
+
+static bool
+part_data_deserialize_envelope(struct deserialize_context *ctx,
+			       struct message_part_envelope *envelope)
+{
+	return part_data_deserialize_str(ctx, &envelope->date) &&
+		part_data_deserialize_str(ctx, &envelope->subject) &&
+		part_data_deserialize_addresses(ctx, &envelope->from) &&
+		part_data_deserialize_addresses(ctx, &envelope->sender) &&
+		part_data_deserialize_addresses(ctx, &envelope->reply_to) &&
+		part_data_deserialize_addresses(ctx, &envelope->to) &&
+		part_data_deserialize_addresses(ctx, &envelope->cc) &&
+		part_data_deserialize_addresses(ctx, &envelope->bcc) &&
+		part_data_deserialize_str(ctx, &envelope->in_reply_to) &&
+		part_data_deserialize_str(ctx, &envelope->message_id);
+}
+
+static bool
+message_part_data_deserialize_part(struct deserialize_context *ctx,
+				   struct message_part *part)
+{
+	struct message_part_data *data;
+	unsigned char flags;
+
+	for (; part != NULL; part = part->next) {
+		if (ctx->data == ctx->end) {
+			ctx->error = "Not enough data";
+			return FALSE;
+		}
+		flags = *ctx->data++;
+		if ((flags & ENUM_NEGATE(PART_DATA_SERIALIZE_FLAG_CONTENT |
+					 PART_DATA_SERIALIZE_FLAG_ENVELOPE)) != 0 ||
+		    (flags & PART_DATA_SERIALIZE_FLAG_CONTENT) == 0) {
+			/* every part must have data, since the callers
+			   expect it to exist after a successful
+			   deserialization */
+			ctx->error = "Invalid part data flags";
+			return FALSE;
+		}
+		if (part->parent == NULL &&
+		    (flags & PART_DATA_SERIALIZE_FLAG_ENVELOPE) != 0) {
+			ctx->error = "Root part has an envelope";
+			return FALSE;
+		}
+		data = p_new(ctx->pool, struct message_part_data, 1);
+		if (!part_data_deserialize_content(ctx, data))
+			return FALSE;
+		if ((flags & PART_DATA_SERIALIZE_FLAG_ENVELOPE) != 0) {
+			data->envelope = p_new(ctx->pool,
+					       struct message_part_envelope, 1);
+			if (!part_data_deserialize_envelope(ctx, data->envelope))
+				return FALSE;
+		}
+		part->data = data;
+
+		if (!message_part_data_deserialize_part(ctx, part->children))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void message_part_data_clear(struct message_part *part)
+{
+	for (; part != NULL; part = part->next) {
+		part->data = NULL;
+		message_part_data_clear(part->children);
+	}
+}
+
+static bool
+message_part_data_deserialize_envelope(struct deserialize_context *ctx,
+				       struct message_part_envelope **envelope_r)
+{
+	unsigned char have_envelope;
+
+	*envelope_r = NULL;
+	if (!read_next(ctx, &have_envelope, sizeof(have_envelope)))
+		return FALSE;
+	if (have_envelope > 1) {
+		ctx->error = "Invalid envelope flag";
+		return FALSE;
+	}
+	if (have_envelope == 0)
+		return TRUE;
+
+	*envelope_r = p_new(ctx->pool, struct message_part_envelope, 1);
+	return part_data_deserialize_envelope(ctx, *envelope_r);
+}
+
+int message_part_data_deserialize(pool_t pool, struct message_part *part,
+				  const void *data, size_t size,
+				  struct message_part_envelope **envelope_r,
+				  const char **error_r)
+{
+	struct deserialize_context ctx;
+
+	i_zero(&ctx);
+	ctx.pool = pool;
+	ctx.data = data;
+	ctx.end = ctx.data + size;
+
+	*envelope_r = NULL;
+	if (!message_part_data_deserialize_part(&ctx, part) ||
+	    !message_part_data_deserialize_envelope(&ctx, envelope_r)) {
+		message_part_data_clear(part);
+		*envelope_r = NULL;
+		*error_r = ctx.error;
+		return -1;
+	}
+	if (ctx.data != ctx.end) {
+		message_part_data_clear(part);
+		*envelope_r = NULL;
+		*error_r = "Too much data";
+		return -1;
+	}
+	return 0;
+}
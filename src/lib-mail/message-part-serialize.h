@@ -2,6 +2,7 @@
 #define MESSAGE_PART_SERIALIZE_H
 
 struct message_part;
+struct message_part_envelope;
 struct message_size;
 
 /* Serialize message part. */
@@ -13,4 +14,24 @@ struct message_part *
 message_part_deserialize(pool_t pool, const void *data, size_t size,
 			 const char **error_r);
 
+/* Serialize the message_part_data of the part and all of its children,
+   followed by the top-level message's envelope (which may be NULL). This is
+   stored separately from message_part_serialize(), since the data is
+   usually much larger than the part offsets and it's needed less often.
+   All the parts must have data. The top-level envelope is kept out of the
+   root part's data, since it would then look like a message/rfc822 part's
+   envelope. */
+void message_part_data_serialize(const struct message_part *part,
+				 const struct message_part_envelope *envelope,
+				 buffer_t *dest);
+/* Set the message_part_data of the part and all of its children from the
+   serialized data, and return the top-level envelope (or NULL if there was
+   none). The parts must have the same structure as when the data was
+   serialized. Returns 0 if ok, -1 and sets error if any problems are
+   detected, in which case the parts' data is left NULL. */
+int message_part_data_deserialize(pool_t pool, struct message_part *part,
+				  const void *data, size_t size,
+				  struct message_part_envelope **envelope_r,
+				  const char **error_r);
+
 #endif
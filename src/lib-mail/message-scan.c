@@ -0,0 +1,70 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "message-scan.h"
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+size_t message_scan_boundary_lf(const unsigned char *data, size_t size)
+{
+	const unsigned char *p;
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i lf = _mm_set1_epi8('\n'), dash = _mm_set1_epi8('-');
+	unsigned int mask;
+
+	/* compare LF at each position and "--" at the following two
+	   positions using overlapping loads */
+	for (; i + 16 + 2 <= size; i += 16) {
+		__m128i v0 = _mm_loadu_si128((const void *)(data + i));
+		__m128i v1 = _mm_loadu_si128((const void *)(data + i + 1));
+		__m128i v2 = _mm_loadu_si128((const void *)(data + i + 2));
+
+		mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(v0, lf),
+			_mm_and_si128(_mm_cmpeq_epi8(v1, dash),
+				      _mm_cmpeq_epi8(v2, dash))));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	while (i < size) {
+		p = memchr(data + i, '\n', size - i);
+		if (p == NULL)
+			return size;
+		i = p - data;
+		if (i + 2 >= size || (p[1] == '-' && p[2] == '-'))
+			return i;
+		i++;
+	}
+	return size;
+}
+
+size_t message_scan_header_delim(const unsigned char *data, size_t size,
+				 unsigned char chr)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i v_chr = _mm_set1_epi8(chr), lf = _mm_set1_epi8('\n');
+	const __m128i nul = _mm_setzero_si128();
+	unsigned int mask;
+
+	for (; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const void *)(data + i));
+
+		mask = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, v_chr),
+			_mm_or_si128(_mm_cmpeq_epi8(v, lf),
+				     _mm_cmpeq_epi8(v, nul))));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < size; i++) {
+		if (data[i] == chr || data[i] == '\n' || data[i] == '\0')
+			break;
+	}
+	return i;
+}
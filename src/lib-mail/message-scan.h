@@ -0,0 +1,18 @@
+#ifndef MESSAGE_SCAN_H
+#define MESSAGE_SCAN_H
+
+/* Helpers for quickly skipping over uninteresting message data. These are
+   used by the message parsers in hot loops, so they scan 16 bytes at a time
+   when SSE2 is available. */
+
+/* Returns the offset of the first LF in data that is followed by "--", i.e.
+   a potential MIME boundary line. An LF in the last two bytes is also
+   returned, since it can't yet be known what follows it. Returns size if no
+   such LF was found. */
+size_t message_scan_boundary_lf(const unsigned char *data, size_t size);
+/* Returns the offset of the first chr, LF or NUL in data, or size if none
+   of them were found. */
+size_t message_scan_header_delim(const unsigned char *data, size_t size,
+				 unsigned char chr);
+
+#endif
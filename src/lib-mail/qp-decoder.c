@@ -5,6 +5,10 @@
 #include "hex-binary.h"
 #include "qp-decoder.h"
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 /* quoted-printable lines can be max 76 characters. if we've seen more than
    that much whitespace, it means there really shouldn't be anything else left
    in the line except trailing whitespace. */
@@ -48,6 +52,42 @@ void qp_decoder_deinit(struct qp_decoder **_qp)
 	i_free(qp);
 }
 
+/* Returns the number of bytes at the beginning of src that are certainly
+   copied to output as-is. This stops at '=', CR and LF, and at whitespace
+   followed by more whitespace or a newline, since that may be trailing
+   whitespace. The last 16 bytes are left for the caller to check. */
+static inline size_t
+qp_decoder_literal_span(const unsigned char *src ATTR_UNUSED,
+			size_t src_size ATTR_UNUSED)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i v, next, ws, next_special, special;
+	unsigned int mask;
+
+	for (; i + 16 + 1 <= src_size; i += 16) {
+		v = _mm_loadu_si128((const void *)(src + i));
+		next = _mm_loadu_si128((const void *)(src + i + 1));
+		ws = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+				  _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+		next_special = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(next, _mm_set1_epi8(' ')),
+				     _mm_cmpeq_epi8(next, _mm_set1_epi8('\t'))),
+			_mm_or_si128(_mm_cmpeq_epi8(next, _mm_set1_epi8('\r')),
+				     _mm_cmpeq_epi8(next, _mm_set1_epi8('\n'))));
+		special = _mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('=')),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+				     _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+		mask = _mm_movemask_epi8(_mm_or_si128(
+			special, _mm_and_si128(ws, next_special)));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	return i;
+}
+
 static size_t
 qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 		     size_t src_size)
@@ -55,6 +95,9 @@ qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 	size_t i, start = 0, ret = src_size;
 
 	for (i = 0; i < src_size; i++) {
+		i += qp_decoder_literal_span(src + i, src_size - i);
+		if (i == src_size)
+			break;
 		if (src[i] > '=') {
 			/* fast path */
 			continue;
@@ -74,6 +117,12 @@ qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 			continue;
 		case ' ':
 		case '\t':
+			if (i + 1 < src_size &&
+			    !QP_IS_TRAILING_WHITESPACE(src[i+1]) &&
+			    src[i+1] != '\r' && src[i+1] != '\n') {
+				/* not trailing whitespace */
+				continue;
+			}
 			i_assert(qp->whitespace->used == 0);
 			qp->state = STATE_WHITESPACE;
 			buffer_append_c(qp->whitespace, src[i]);
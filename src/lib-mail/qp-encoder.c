@@ -7,6 +7,10 @@
 #include "qp-encoder.h"
 #include <ctype.h>
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 enum qp_encoder_last_char {
 	QP_ENCODER_LAST_ANY = 0,
 	QP_ENCODER_LAST_CR,
@@ -93,6 +97,42 @@ qp_encode_or_break(struct qp_encoder *qp, unsigned char c)
 	}
 }
 
+static inline bool qp_is_literal(unsigned char c)
+{
+	return (c >= ' ' && c <= '~' && c != '=') || c == '\t';
+}
+
+/* Returns the number of bytes at the beginning of src that don't need to be
+   encoded in body format. */
+static inline size_t
+qp_encoder_literal_span(const unsigned char *src, size_t src_size)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i v, literal;
+	unsigned int mask;
+
+	for (; i + 16 <= src_size; i += 16) {
+		v = _mm_loadu_si128((const void *)(src + i));
+		/* ' '..'~': bytes >= 0x80 are negative, so they fail the
+		   first comparison */
+		literal = _mm_and_si128(
+			_mm_cmpgt_epi8(v, _mm_set1_epi8(' ' - 1)),
+			_mm_cmpgt_epi8(_mm_set1_epi8('~' + 1), v));
+		literal = _mm_andnot_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('=')), literal);
+		literal = _mm_or_si128(
+			literal, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+		mask = ~_mm_movemask_epi8(literal) & 0xffff;
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	while (i < src_size && qp_is_literal(src[i]))
+		i++;
+	return i;
+}
+
 void qp_encoder_more(struct qp_encoder *qp, const void *_src, size_t src_size)
 {
 	const unsigned char *src = _src;
@@ -105,7 +145,28 @@ void qp_encoder_more(struct qp_encoder *qp, const void *_src, size_t src_size)
 		str_append(qp->dest, "=?utf-8?Q?");
 		qp->line_len = qp->dest->used - used;
 	}
-	for(unsigned int i = 0; i < src_size; i++) {
+	for (size_t i = 0; i < src_size; i++) {
+		if (qp->last_char != QP_ENCODER_LAST_CR &&
+		    (qp->flags & QP_ENCODER_FLAG_HEADER_FORMAT) == 0 &&
+		    qp->line_len + 4 < qp->max_len) {
+			/* Copy the characters that don't need encoding as-is,
+			   as long as the line can't become too long. */
+			size_t n = qp_encoder_literal_span(src + i,
+				I_MIN(src_size - i,
+				      qp->max_len - 4 - qp->line_len));
+			if (n > 0) {
+				str_append_data(qp->dest, src + i, n);
+				qp->line_len += n;
+				i += n;
+				qp->last_char = src[i-1] == ' ' ||
+					src[i-1] == '\t' ?
+					QP_ENCODER_LAST_WHITE_SPACE :
+					QP_ENCODER_LAST_ANY;
+				if (i == src_size)
+					break;
+			}
+		}
+
 		unsigned char c = src[i];
 		/* if input is not binary data and we encounter newline
 		   convert it as crlf, or if the last byte was CR, preserve
@@ -3,8 +3,10 @@
 #include "lib.h"
 #include "str.h"
 #include "istream.h"
+#include "message-address.h"
 #include "message-parser.h"
 #include "message-part.h"
+#include "message-part-data.h"
 #include "message-part-serialize.h"
 #include "test-common.h"
 
@@ -251,11 +253,240 @@ static enum fatal_test_state test_message_deserialize_fatals(unsigned int stage)
 	return FATAL_TEST_FINISHED;
 }
 
+static bool
+test_params_equal(const struct message_part_param *params1,
+		  unsigned int count1,
+		  const struct message_part_param *params2,
+		  unsigned int count2)
+{
+	if (count1 != count2)
+		return FALSE;
+	for (unsigned int i = 0; i < count1; i++) {
+		if (strcmp(params1[i].name, params2[i].name) != 0 ||
+		    strcmp(params1[i].value, params2[i].value) != 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static bool test_addresses_equal(const struct message_address *addr1,
+				 const struct message_address *addr2)
+{
+	for (; addr1 != NULL && addr2 != NULL;
+	     addr1 = addr1->next, addr2 = addr2->next) {
+		if (null_strcmp(addr1->name, addr2->name) != 0 ||
+		    null_strcmp(addr1->route, addr2->route) != 0 ||
+		    null_strcmp(addr1->mailbox, addr2->mailbox) != 0 ||
+		    null_strcmp(addr1->domain, addr2->domain) != 0 ||
+		    addr1->invalid_syntax != addr2->invalid_syntax)
+			return FALSE;
+	}
+	return addr1 == NULL && addr2 == NULL;
+}
+
+static bool
+test_envelopes_equal(const struct message_part_envelope *envelope1,
+		     const struct message_part_envelope *envelope2)
+{
+	if (envelope1 == NULL || envelope2 == NULL)
+		return envelope1 == envelope2;
+	return null_strcmp(envelope1->date, envelope2->date) == 0 &&
+		null_strcmp(envelope1->subject, envelope2->subject) == 0 &&
+		test_addresses_equal(envelope1->from, envelope2->from) &&
+		test_addresses_equal(envelope1->sender, envelope2->sender) &&
+		test_addresses_equal(envelope1->reply_to, envelope2->reply_to) &&
+		test_addresses_equal(envelope1->to, envelope2->to) &&
+		test_addresses_equal(envelope1->cc, envelope2->cc) &&
+		test_addresses_equal(envelope1->bcc, envelope2->bcc) &&
+		null_strcmp(envelope1->in_reply_to,
+			    envelope2->in_reply_to) == 0 &&
+		null_strcmp(envelope1->message_id,
+			    envelope2->message_id) == 0;
+}
+
+static bool test_part_data_equal(const struct message_part *part1,
+				 const struct message_part *part2)
+{
+	const struct message_part_data *data1, *data2;
+
+	for (; part1 != NULL && part2 != NULL;
+	     part1 = part1->next, part2 = part2->next) {
+		data1 = part1->data;
+		data2 = part2->data;
+		if (data1 == NULL || data2 == NULL) {
+			if (data1 != data2)
+				return FALSE;
+		} else if (null_strcmp(data1->content_type,
+				       data2->content_type) != 0 ||
+			   null_strcmp(data1->content_subtype,
+				       data2->content_subtype) != 0 ||
+			   !test_params_equal(data1->content_type_params,
+					      data1->content_type_params_count,
+					      data2->content_type_params,
+					      data2->content_type_params_count) ||
+			   null_strcmp(data1->content_transfer_encoding,
+				       data2->content_transfer_encoding) != 0 ||
+			   null_strcmp(data1->content_id,
+				       data2->content_id) != 0 ||
+			   null_strcmp(data1->content_description,
+				       data2->content_description) != 0 ||
+			   null_strcmp(data1->content_disposition,
+				       data2->content_disposition) != 0 ||
+			   !test_params_equal(data1->content_disposition_params,
+					      data1->content_disposition_params_count,
+					      data2->content_disposition_params,
+					      data2->content_disposition_params_count) ||
+			   null_strcmp(data1->content_md5,
+				       data2->content_md5) != 0 ||
+			   (data1->content_language == NULL) !=
+			   (data2->content_language == NULL) ||
+			   (data1->content_language != NULL &&
+			    strcmp(t_strarray_join(data1->content_language, " "),
+				   t_strarray_join(data2->content_language, " ")) != 0) ||
+			   null_strcmp(data1->content_location,
+				       data2->content_location) != 0 ||
+			   !test_envelopes_equal(data1->envelope,
+						 data2->envelope))
+			return FALSE;
+		if (!test_part_data_equal(part1->children, part2->children))
+			return FALSE;
+	}
+	return part1 == NULL && part2 == NULL;
+}
+
+static const char test_part_data_msg[] =
+"From: Sender <sender@example.com>, \"Group\": a@example.com, b@example.com;\n"
+"To: <@route:user@example.org>, invalid@\n"
+"Subject: part data\n"
+"Message-ID: <1@example.com>\n"
+"MIME-Version: 1.0\n"
+"Content-Type: multipart/mixed; boundary=\"b1\"; foo=bar\n"
+"Content-Language: en, fi\n"
+"\n"
+"--b1\n"
+"Content-Type: text/plain; charset=utf-8; format=flowed\n"
+"Content-Transfer-Encoding: quoted-printable\n"
+"Content-ID: <id@example.com>\n"
+"Content-Description: description\n"
+"Content-MD5: md5\n"
+"Content-Location: http://example.com/\n"
+"\n"
+"body\n"
+"--b1\n"
+"Content-Type: message/rfc822\n"
+"Content-Disposition: attachment; filename=\"fwd.eml\"\n"
+"\n"
+"From: inner@example.com\n"
+"Date: Tue, 1 Oct 2024 10:00:00 +0000\n"
+"In-Reply-To: <0@example.com>\n"
+"\n"
+"inner body\n"
+"--b1\n"
+"\n"
+"no headers\n"
+"--b1--\n";
+
+static void test_message_part_data_serialize(void)
+{
+	struct message_parser_ctx *parser;
+	struct message_part_envelope *root_envelope = NULL, *envelope2;
+	struct message_part *parts, *parts2;
+	struct message_block block;
+	struct istream *input;
+	buffer_t *parts_buf, *data_buf;
+	const char *error;
+	pool_t pool;
+
+	test_begin("message part data serialize");
+	pool = pool_alloconly_create("message part data", 10240);
+	input = test_istream_create_data(test_part_data_msg,
+					 sizeof(test_part_data_msg)-1);
+	parser = message_parser_init(pool, input, &set_empty);
+	while (message_parser_parse_next_block(parser, &block) > 0) {
+		if (block.size != 0)
+			continue;
+		if (block.part->parent == NULL) {
+			message_part_envelope_parse_from_header(pool,
+				&root_envelope, block.hdr);
+		}
+		message_part_data_parse_from_header(pool, block.part,
+						    block.hdr);
+	}
+	message_parser_deinit(&parser, &parts);
+
+	parts_buf = buffer_create_dynamic(pool, 128);
+	data_buf = buffer_create_dynamic(pool, 256);
+	message_part_serialize(parts, parts_buf);
+	message_part_data_serialize(parts, root_envelope, data_buf);
+
+	parts2 = message_part_deserialize(pool, parts_buf->data,
+					  parts_buf->used, &error);
+	test_assert(parts2 != NULL);
+	test_assert(message_part_data_deserialize(pool, parts2, data_buf->data,
+						  data_buf->used, &envelope2,
+						  &error) == 0);
+	test_assert(test_part_data_equal(parts, parts2));
+	test_assert_strcmp(t_strarray_join(parts2->data->content_language, " "),
+			   "en fi");
+	/* the top-level envelope isn't in the root part's data, so that
+	   it's not mixed up with a message/rfc822 part's envelope */
+	test_assert(parts2->data->envelope == NULL);
+	test_assert(test_envelopes_equal(root_envelope, envelope2));
+	test_assert_strcmp(envelope2->to->route, "@route");
+	test_assert(envelope2->to->next->invalid_syntax);
+	test_assert_strcmp(parts2->children->data->content_md5, "md5");
+	test_assert_strcmp(parts2->children->next->children->data->
+			   envelope->in_reply_to, "<0@example.com>");
+	/* the last part had no headers, but it still has data */
+	test_assert(parts2->children->next->next->data != NULL);
+
+	/* truncated data */
+	for (size_t i = 0; i < data_buf->used; i++) {
+		test_assert_idx(message_part_data_deserialize(pool, parts2,
+				data_buf->data, i, &envelope2, &error) < 0, i);
+		test_assert_idx(parts2->data == NULL, i);
+		test_assert_idx(envelope2 == NULL, i);
+	}
+	/* too much data */
+	buffer_append_c(data_buf, '\0');
+	test_assert(message_part_data_deserialize(pool, parts2, data_buf->data,
+						  data_buf->used, &envelope2,
+						  &error) < 0);
+	test_assert_strcmp(error, "Too much data");
+	/* invalid flags - the part data must always exist */
+	test_assert(message_part_data_deserialize(pool, parts2, "\x04", 1,
+						  &envelope2, &error) < 0);
+	test_assert_strcmp(error, "Invalid part data flags");
+	test_assert(message_part_data_deserialize(pool, parts2, "\x00", 1,
+						  &envelope2, &error) < 0);
+	test_assert_strcmp(error, "Invalid part data flags");
+	test_assert(message_part_data_deserialize(pool, parts2, "\x02", 1,
+						  &envelope2, &error) < 0);
+	test_assert_strcmp(error, "Invalid part data flags");
+	test_assert(message_part_data_deserialize(pool, parts2, "\x03", 1,
+						  &envelope2, &error) < 0);
+	test_assert_strcmp(error, "Root part has an envelope");
+
+	/* without the top-level envelope */
+	buffer_set_used_size(data_buf, 0);
+	message_part_data_serialize(parts, NULL, data_buf);
+	test_assert(message_part_data_deserialize(pool, parts2, data_buf->data,
+						  data_buf->used, &envelope2,
+						  &error) == 0);
+	test_assert(envelope2 == NULL);
+	test_assert(test_part_data_equal(parts, parts2));
+
+	i_stream_unref(&input);
+	pool_unref(&pool);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_message_serialize_deserialize,
 		test_message_deserialize_errors,
+		test_message_part_data_serialize,
 		NULL
 	};
 	static enum fatal_test_state (*const fatal_functions[])(unsigned int) = {
@@ -0,0 +1,114 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "message-scan.h"
+#include "test-common.h"
+
+static size_t
+test_boundary_lf_slow(const unsigned char *data, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] != '\n')
+			continue;
+		if (i + 2 >= size || (data[i+1] == '-' && data[i+2] == '-'))
+			break;
+	}
+	return i;
+}
+
+static size_t
+test_header_delim_slow(const unsigned char *data, size_t size,
+		       unsigned char chr)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] == chr || data[i] == '\n' || data[i] == '\0')
+			break;
+	}
+	return i;
+}
+
+static void test_message_scan_boundary_lf(void)
+{
+	static const struct {
+		const char *input;
+		size_t result;
+	} tests[] = {
+		{ "", 0 },
+		{ "\n", 0 },
+		{ "abc\n", 3 },
+		{ "abc\nx", 3 },
+		{ "abc\nxy", 6 },
+		{ "abc\n--", 3 },
+		{ "abc\n-x\n--b", 6 },
+		{ "0123456789abcdef0123456789abcdef\n--", 32 },
+		{ "0123456789abcdef\nfoo\n-\n-0123456789abcdef\n--b", 40 },
+		{ "0123456789abcdef0123456789abcdef0123456789", 42 },
+	};
+	unsigned int i;
+
+	test_begin("message scan boundary lf");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		test_assert_idx(message_scan_boundary_lf(
+			(const unsigned char *)tests[i].input,
+			strlen(tests[i].input)) == tests[i].result, i);
+	}
+	test_end();
+}
+
+static void test_message_scan_header_delim(void)
+{
+	static const unsigned char input[] =
+		"Subject: hello\0world\nFrom: user@example.com";
+	size_t size = sizeof(input) - 1;
+
+	test_begin("message scan header delim");
+	test_assert(message_scan_header_delim(input, size, ':') == 7);
+	test_assert(message_scan_header_delim(input, size, '\n') == 14);
+	test_assert(message_scan_header_delim(input + 15, size - 15, ':') == 5);
+	test_assert(message_scan_header_delim(input + 21, size - 21, '\n') ==
+		    size - 21);
+	test_assert(message_scan_header_delim(input, 0, ':') == 0);
+	test_end();
+}
+
+static void test_message_scan_random(void)
+{
+	static const unsigned char chars[] = { 'a', '-', '\n', ':', '\0' };
+	unsigned char data[128];
+	unsigned int i, j, size, offset;
+
+	test_begin("message scan random");
+	for (i = 0; i < 10000; i++) {
+		size = i_rand_limit(sizeof(data));
+		for (j = 0; j < size; j++) {
+			/* mostly plain text with some interesting chars */
+			data[j] = i_rand_limit(4) != 0 ? 'a' :
+				chars[i_rand_limit(N_ELEMENTS(chars))];
+		}
+		offset = size == 0 ? 0 : i_rand_limit(size);
+		test_assert_idx(message_scan_boundary_lf(data + offset,
+							 size - offset) ==
+				test_boundary_lf_slow(data + offset,
+						      size - offset), i);
+		test_assert_idx(message_scan_header_delim(data + offset,
+							  size - offset, ':') ==
+				test_header_delim_slow(data + offset,
+						       size - offset, ':'), i);
+	}
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_message_scan_boundary_lf,
+		test_message_scan_header_delim,
+		test_message_scan_random,
+		NULL
+	};
+	return test_run(test_functions);
+}
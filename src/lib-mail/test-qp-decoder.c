@@ -178,10 +178,59 @@ static void test_qp_decoder(void)
 	test_end();
 }
 
+static void test_qp_decoder_random(void)
+{
+	static const char chars[] = "abc  \t=\r\n0F";
+	unsigned char input[256];
+	string_t *str1, *str2;
+	struct qp_decoder *qp;
+	size_t error_pos;
+	const char *error;
+	unsigned int i, j, size;
+	int ret1, ret2;
+
+	test_begin("qp-decoder random");
+	str1 = t_str_new(256);
+	str2 = t_str_new(256);
+	for (i = 0; i < 10000; i++) {
+		size = i_rand_limit(sizeof(input));
+		for (j = 0; j < size; j++) {
+			/* mostly text with some special characters */
+			input[j] = i_rand_limit(3) != 0 ? 'x' :
+				chars[i_rand_limit(sizeof(chars) - 1)];
+		}
+		str_truncate(str1, 0);
+		str_truncate(str2, 0);
+
+		/* all at once vs. one byte at a time */
+		qp = qp_decoder_init(str1);
+		ret1 = qp_decoder_more(qp, input, size, &error_pos, &error);
+		if (qp_decoder_finish(qp, &error) < 0)
+			ret1 = -1;
+		qp_decoder_deinit(&qp);
+
+		qp = qp_decoder_init(str2);
+		ret2 = 0;
+		for (j = 0; j < size; j++) {
+			if (qp_decoder_more(qp, input + j, 1,
+					    &error_pos, &error) < 0)
+				ret2 = -1;
+		}
+		if (qp_decoder_finish(qp, &error) < 0)
+			ret2 = -1;
+		qp_decoder_deinit(&qp);
+
+		test_assert_idx(ret1 == ret2, i);
+		test_assert_idx(str_equals(str1, str2), i);
+	}
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_qp_decoder,
+		test_qp_decoder_random,
 		NULL
 	};
 	return test_run(test_functions);
@@ -193,6 +193,47 @@ static void test_qp_encoder_header(void)
         test_end();
 }
 
+static void test_qp_encoder_random(void)
+{
+	static const char chars[] = "  \t=\r\n\x80\xff";
+	static const enum qp_encoder_flag flags[] = {
+		0, QP_ENCODER_FLAG_BINARY_DATA
+	};
+	unsigned char input[512];
+	string_t *str1, *str2;
+	struct qp_encoder *qp;
+	unsigned int i, j, size, max_len;
+
+	test_begin("qp-encoder random");
+	str1 = t_str_new(1024);
+	str2 = t_str_new(1024);
+	for (i = 0; i < 10000; i++) {
+		size = i_rand_limit(sizeof(input));
+		for (j = 0; j < size; j++) {
+			/* mostly text with some special characters */
+			input[j] = i_rand_limit(4) != 0 ? 'x' :
+				chars[i_rand_limit(sizeof(chars) - 1)];
+		}
+		max_len = 5 + i_rand_limit(80);
+		str_truncate(str1, 0);
+		str_truncate(str2, 0);
+
+		/* all at once vs. one byte at a time */
+		qp = qp_encoder_init(str1, max_len, flags[i % 2]);
+		qp_encoder_more(qp, input, size);
+		qp_encoder_finish(qp);
+		qp_encoder_deinit(&qp);
+
+		qp = qp_encoder_init(str2, max_len, flags[i % 2]);
+		for (j = 0; j < size; j++)
+			qp_encoder_more(qp, input + j, 1);
+		qp_encoder_finish(qp);
+		qp_encoder_deinit(&qp);
+
+		test_assert_idx(str_equals(str1, str2), i);
+	}
+	test_end();
+}
 
 int main(void)
 {
@@ -200,6 +241,7 @@ int main(void)
 		test_qp_encoder,
 		test_qp_encoder_binary,
 		test_qp_encoder_header,
+		test_qp_encoder_random,
 		NULL
 	};
 	return test_run(test_functions);
@@ -125,6 +125,7 @@ master_service_ssl_settings_check(void *_set, pool_t pool ATTR_UNUSED,
 	/* First set them all to defaults */
 	set->parsed_opts.compression = FALSE;
 	set->parsed_opts.tickets = TRUE;
+	set->parsed_opts.ktls = FALSE;
 
 	/* Then modify anything specified in the string */
 	const char **opts = t_strsplit_spaces(set->ssl_options, ", ");
@@ -139,6 +140,8 @@ master_service_ssl_settings_check(void *_set, pool_t pool ATTR_UNUSED,
 #endif
 		} else if (strcasecmp(opt, "no_ticket") == 0) {
 			set->parsed_opts.tickets = FALSE;
+		} else if (strcasecmp(opt, "ktls") == 0) {
+			set->parsed_opts.ktls = TRUE;
 		} else {
 			*error_r = t_strdup_printf("ssl_options: unknown flag: '%s'",
 						   opt);
@@ -214,5 +217,6 @@ void master_service_ssl_settings_to_iostream_set(
 	set_r->prefer_server_ciphers = ssl_set->ssl_prefer_server_ciphers;
 	set_r->compression = ssl_set->parsed_opts.compression;
 	set_r->tickets = ssl_set->parsed_opts.tickets;
+	set_r->ktls = ssl_set->parsed_opts.ktls;
 	set_r->curve_list = p_strdup(pool, ssl_set->ssl_curve_list);
 }
@@ -34,6 +34,7 @@ struct master_service_ssl_settings {
 	struct {
 		bool compression;
 		bool tickets;
+		bool ktls;
 	} parsed_opts;
 };
 
@@ -84,6 +84,7 @@ void master_service_ssl_ctx_init(struct master_service *service)
 	ssl_set.verify_remote_cert = set->ssl_verify_client_cert;
 	ssl_set.prefer_server_ciphers = set->ssl_prefer_server_ciphers;
 	ssl_set.compression = set->parsed_opts.compression;
+	ssl_set.ktls = set->parsed_opts.ktls;
 
 	if (ssl_iostream_context_init_server(&ssl_set, &service->ssl_ctx,
 					     &error) < 0) {
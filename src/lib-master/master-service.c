@@ -840,6 +840,17 @@ const char *master_service_get_config_path(struct master_service *service)
 	return service->config_path;
 }
 
+const char *const *
+master_service_get_config_overrides(struct master_service *service,
+				    unsigned int *count_r)
+{
+	if (!array_is_created(&service->config_overrides)) {
+		*count_r = 0;
+		return NULL;
+	}
+	return array_get(&service->config_overrides, count_r);
+}
+
 const char *master_service_get_version_string(struct master_service *service)
 {
 	return service->version_string;
@@ -198,6 +198,11 @@ const char *master_service_get_socket_name(struct master_service *service,
 
 /* Returns configuration file path. */
 const char *master_service_get_config_path(struct master_service *service);
+/* Returns the "key=value" settings overridden with -o parameters, or NULL
+   if there are none. */
+const char *const *
+master_service_get_config_overrides(struct master_service *service,
+				    unsigned int *count_r);
 /* Returns PACKAGE_VERSION or NULL if version_ignore=yes. This function is
    useful mostly as parameter to module_dir_load(). */
 const char *master_service_get_version_string(struct master_service *service);
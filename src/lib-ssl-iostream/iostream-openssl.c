@@ -1,6 +1,7 @@
 /* Copyright (c) 2009-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "net.h"
 #include "istream-private.h"
 #include "ostream-private.h"
 #include "iostream-openssl.h"
@@ -258,6 +259,49 @@ openssl_iostream_set(struct ssl_iostream *ssl_io,
 	return 0;
 }
 
+static BIO *openssl_iostream_socket_wbio(struct ssl_iostream *ssl_io)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	struct ip_addr ip;
+	int fd;
+
+	if (!ssl_io->ctx->set.ktls)
+		return NULL;
+
+	/* OpenSSL can enable kernel TLS only when it writes directly to the
+	   socket. This is possible only if nothing is buffered in
+	   plain_output and it isn't a wrapper stream. */
+	fd = o_stream_get_fd(ssl_io->plain_output);
+	if (fd == -1 || ssl_io->plain_output->real_stream->parent != NULL ||
+	    o_stream_get_buffer_used_size(ssl_io->plain_output) > 0)
+		return NULL;
+	if (net_getsockname(fd, &ip, NULL) < 0)
+		return NULL;
+	return BIO_new_socket(fd, BIO_NOCLOSE);
+#else
+	return NULL;
+#endif
+}
+
+#ifdef SSL_OP_ENABLE_KTLS
+static void openssl_iostream_ktls_init(struct ssl_iostream *ssl_io)
+{
+	BIO *bio_int = SSL_get_rbio(ssl_io->ssl);
+
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl_io->ssl))) {
+		ssl_io->ktls_send = TRUE;
+		return;
+	}
+	/* Kernel TLS couldn't be enabled for this connection (unsupported
+	   kernel, socket type or cipher). Go back to writing via the BIO
+	   pair, which is more efficient than OpenSSL writing each record
+	   separately to the socket. */
+	BIO_up_ref(bio_int);
+	SSL_set0_wbio(ssl_io->ssl, bio_int);
+	ssl_io->socket_wbio = FALSE;
+}
+#endif
+
 static int
 openssl_iostream_create(struct ssl_iostream_context *ctx, const char *host,
 			const struct ssl_iostream_settings *set,
@@ -267,7 +311,7 @@ openssl_iostream_create(struct ssl_iostream_context *ctx, const char *host,
 {
 	struct ssl_iostream *ssl_io;
 	SSL *ssl;
-	BIO *bio_int, *bio_ext;
+	BIO *bio_int, *bio_ext, *bio_socket;
 
 	/* Don't allow an existing io_add_istream() to be use on the input.
 	   It would seem to work, but it would also cause hangs. */
@@ -303,8 +347,14 @@ openssl_iostream_create(struct ssl_iostream_context *ctx, const char *host,
 	ssl_io->connected_host = i_strdup(host);
 	ssl_io->log_prefix = host == NULL ? i_strdup("") :
 		i_strdup_printf("%s: ", host);
-	/* bio_int will be freed by SSL_free() */
-	SSL_set_bio(ssl_io->ssl, bio_int, bio_int);
+	/* bio_int (and bio_socket) will be freed by SSL_free() */
+	bio_socket = openssl_iostream_socket_wbio(ssl_io);
+	if (bio_socket == NULL)
+		SSL_set_bio(ssl_io->ssl, bio_int, bio_int);
+	else {
+		SSL_set_bio(ssl_io->ssl, bio_int, bio_socket);
+		ssl_io->socket_wbio = TRUE;
+	}
         SSL_set_ex_data(ssl_io->ssl, dovecot_ssl_extdata_index, ssl_io);
 #ifdef HAVE_SSL_GET_SERVERNAME
 	SSL_set_tlsext_host_name(ssl_io->ssl, host);
@@ -367,6 +417,12 @@ void openssl_iostream_shutdown(struct ssl_iostream *ssl_io)
 	i_assert(ssl_io->ssl_output != NULL);
 
 	ssl_io->destroyed = TRUE;
+	if (ssl_io->ktls_send) {
+		/* plain_output may still have data that must be sent before
+		   the close_notify alert, which OpenSSL writes directly to
+		   the socket. */
+		(void)o_stream_flush(ssl_io->plain_output);
+	}
 	if (ssl_io->handshaked && SSL_shutdown(ssl_io->ssl) != 1) {
 		/* if bidirectional shutdown fails we need to clear
 		   the error queue */
@@ -576,6 +632,12 @@ int openssl_iostream_handle_error(struct ssl_iostream *ssl_io, int ret,
 	err = SSL_get_error(ssl_io->ssl, ret);
 	switch (err) {
 	case SSL_ERROR_WANT_WRITE:
+		if (ssl_io->socket_wbio) {
+			/* OpenSSL is writing directly to the socket. Continue
+			   once it's writable again. */
+			o_stream_set_flush_pending(ssl_io->plain_output, TRUE);
+			return 0;
+		}
 		if (openssl_iostream_bio_sync(ssl_io, type) == 0) {
 			if (type != OPENSSL_IOSTREAM_SYNC_TYPE_WRITE)
 				i_panic("SSL ostream buffer size not unlimited");
@@ -679,6 +741,10 @@ static int openssl_iostream_handshake(struct ssl_iostream *ssl_io)
 		}
 	}
 	/* handshake finished */
+#ifdef SSL_OP_ENABLE_KTLS
+	if (ssl_io->socket_wbio)
+		openssl_iostream_ktls_init(ssl_io);
+#endif
 	(void)openssl_iostream_bio_sync(ssl_io, OPENSSL_IOSTREAM_SYNC_TYPE_HANDSHAKE);
 
 	if (ssl_io->handshake_callback != NULL) {
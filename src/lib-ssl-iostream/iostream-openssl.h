@@ -63,6 +63,12 @@ struct ssl_iostream {
 	bool cert_received:1;
 	bool cert_broken:1;
 	bool want_read:1;
+	/* OpenSSL writes directly to plain_output's socket instead of the
+	   BIO pair. This is needed for enabling kernel TLS. */
+	bool socket_wbio:1;
+	/* Kernel TLS is used for sending. Plaintext written to the socket is
+	   encrypted by the kernel. */
+	bool ktls_send:1;
 	bool ostream_flush_waiting_input:1;
 	bool closed:1;
 	bool destroyed:1;
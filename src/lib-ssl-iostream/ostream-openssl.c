@@ -95,12 +95,40 @@ o_stream_ssl_buffer(struct ssl_ostream *sstream, const struct const_iovec *iov,
 	return bytes_sent;
 }
 
+static void o_stream_ssl_set_plain_error(struct ssl_ostream *sstream)
+{
+	struct ostream *plain_output = sstream->ssl_io->plain_output;
+
+	io_stream_set_error(&sstream->ostream.iostream, "%s",
+			    o_stream_get_error(plain_output));
+	sstream->ostream.ostream.stream_errno = plain_output->stream_errno;
+}
+
+static int o_stream_ssl_flush_buffer_ktls(struct ssl_ostream *sstream)
+{
+	ssize_t ret;
+
+	/* the kernel encrypts the data, so send the plaintext directly to
+	   the socket */
+	ret = o_stream_send(sstream->ssl_io->plain_output,
+			    sstream->buffer->data, sstream->buffer->used);
+	if (ret < 0) {
+		o_stream_ssl_set_plain_error(sstream);
+		return -1;
+	}
+	buffer_delete(sstream->buffer, 0, ret);
+	return sstream->buffer->used == 0 ? 1 : 0;
+}
+
 static int o_stream_ssl_flush_buffer(struct ssl_ostream *sstream)
 {
 	struct ssl_iostream *ssl_io = sstream->ssl_io;
 	size_t pos = 0;
 	int ret = 1;
 
+	if (ssl_io->ktls_send)
+		return o_stream_ssl_flush_buffer_ktls(sstream);
+
 	while (pos < sstream->buffer->used) {
 		/* we're writing plaintext data to OpenSSL, which it encrypts
 		   and writes to bio_int's buffer. ssl_iostream_bio_sync()
@@ -174,6 +202,28 @@ static int o_stream_ssl_flush(struct ostream_private *stream)
 	return o_stream_get_buffer_used_size(plain_output) == 0 ? 1 : 0;
 }
 
+static ssize_t
+o_stream_ssl_sendv_ktls(struct ssl_ostream *sstream,
+			const struct const_iovec *iov, unsigned int iov_count)
+{
+	ssize_t ret;
+
+	if (sstream->buffer != NULL && sstream->buffer->used > 0) {
+		/* data buffered during the handshake must be sent first */
+		if (o_stream_ssl_flush_buffer_ktls(sstream) < 0)
+			return -1;
+		if (sstream->buffer->used > 0)
+			return o_stream_ssl_buffer(sstream, iov, iov_count, 0);
+	}
+	ret = o_stream_sendv(sstream->ssl_io->plain_output, iov, iov_count);
+	if (ret < 0) {
+		o_stream_ssl_set_plain_error(sstream);
+		return -1;
+	}
+	sstream->ostream.ostream.offset += ret;
+	return ret;
+}
+
 static ssize_t
 o_stream_ssl_sendv(struct ostream_private *stream,
 		   const struct const_iovec *iov, unsigned int iov_count)
@@ -181,6 +231,9 @@ o_stream_ssl_sendv(struct ostream_private *stream,
 	struct ssl_ostream *sstream = (struct ssl_ostream *)stream;
 	size_t bytes_sent = 0;
 
+	if (sstream->ssl_io->ktls_send)
+		return o_stream_ssl_sendv_ktls(sstream, iov, iov_count);
+
 	bytes_sent = o_stream_ssl_buffer(sstream, iov, iov_count, bytes_sent);
 	if (sstream->ssl_io->handshaked &&
 	    sstream->buffer->used == bytes_sent) {
@@ -192,6 +245,28 @@ o_stream_ssl_sendv(struct ostream_private *stream,
 	return bytes_sent;
 }
 
+static enum ostream_send_istream_result
+o_stream_ssl_send_istream(struct ostream_private *outstream,
+			  struct istream *instream)
+{
+	struct ssl_ostream *sstream = (struct ssl_ostream *)outstream;
+	enum ostream_send_istream_result res;
+	uoff_t orig_offset;
+
+	if (!sstream->ssl_io->ktls_send ||
+	    (sstream->buffer != NULL && sstream->buffer->used > 0))
+		return io_stream_copy(&outstream->ostream, instream);
+
+	/* The kernel encrypts the data, so plain_output can send the input
+	   directly to the socket, using sendfile() when possible. */
+	orig_offset = instream->v_offset;
+	res = o_stream_send_istream(sstream->ssl_io->plain_output, instream);
+	outstream->ostream.offset += instream->v_offset - orig_offset;
+	if (res == OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT)
+		o_stream_ssl_set_plain_error(sstream);
+	return res;
+}
+
 static void o_stream_ssl_switch_ioloop_to(struct ostream_private *stream,
 					  struct ioloop *ioloop)
 {
@@ -283,6 +358,7 @@ struct ostream *openssl_o_stream_create_ssl(struct ssl_iostream *ssl_io)
 	sstream->ostream.iostream.destroy = o_stream_ssl_destroy;
 	sstream->ostream.sendv = o_stream_ssl_sendv;
 	sstream->ostream.flush = o_stream_ssl_flush;
+	sstream->ostream.send_istream = o_stream_ssl_send_istream;
 	sstream->ostream.switch_ioloop_to = o_stream_ssl_switch_ioloop_to;
 
 	sstream->ostream.get_buffer_used_size =
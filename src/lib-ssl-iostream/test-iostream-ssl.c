@@ -3,6 +3,7 @@
 #include "test-lib.h"
 #include "buffer.h"
 #include "randgen.h"
+#include "net.h"
 #include "istream.h"
 #include "ostream.h"
 #include "iostream-openssl.h"
@@ -10,6 +11,8 @@
 #include "iostream-ssl-test.h"
 
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #define MAX_SENT_BYTES 10000
 
@@ -433,7 +436,62 @@ static void test_iostream_ssl_get_buffer_avail_size(void)
 	test_end();
 }
 
-static void test_iostream_ssl_small_packets(void)
+static void test_tcp_socketpair(int fd[2])
+{
+	struct ip_addr ip;
+	in_port_t port = 0;
+	int listen_fd;
+
+	if (net_addr2ip("127.0.0.1", &ip) < 0)
+		i_unreached();
+	listen_fd = net_listen(&ip, &port, 1);
+	if (listen_fd == -1)
+		i_fatal("net_listen() failed: %m");
+	fd[1] = net_connect_ip_blocking(&ip, port, NULL);
+	if (fd[1] == -1)
+		i_fatal("net_connect_ip_blocking() failed: %m");
+	fd_set_nonblock(listen_fd, FALSE);
+	fd[0] = net_accept(listen_fd, NULL, NULL);
+	if (fd[0] < 0)
+		i_fatal("net_accept() failed: %m");
+	i_close_fd(&listen_fd);
+}
+
+static bool test_ktls_supported(void)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS) && \
+	defined(TCP_ULP)
+	int fd[2];
+	bool ret;
+
+	/* the kernel may not have the TLS ULP */
+	test_tcp_socketpair(fd);
+	ret = setsockopt(fd[0], IPPROTO_TCP, TCP_ULP, "tls",
+			 sizeof("tls")) == 0;
+	i_close_fd(&fd[0]);
+	i_close_fd(&fd[1]);
+	return ret;
+#else
+	return FALSE;
+#endif
+}
+
+static bool test_fd_has_ktls(int fd ATTR_UNUSED)
+{
+#ifdef TCP_ULP
+	char name[16];
+	socklen_t len = sizeof(name) - 1;
+
+	if (getsockopt(fd, IPPROTO_TCP, TCP_ULP, name, &len) < 0)
+		return FALSE;
+	name[len] = '\0';
+	return strcmp(name, "tls") == 0;
+#else
+	return FALSE;
+#endif
+}
+
+static void test_iostream_ssl_small_packets_real(bool ktls)
 {
 	struct ssl_iostream_settings set;
 	struct test_endpoint *server, *client;
@@ -441,19 +499,28 @@ static void test_iostream_ssl_small_packets(void)
 	int fd[2];
 	const char *error;
 
-	test_begin("ssl: small packets");
+	test_begin(ktls ? "ssl: small packets with ktls" : "ssl: small packets");
 
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
-		i_fatal("socketpair() failed: %m");
+	if (!ktls) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+			i_fatal("socketpair() failed: %m");
+	} else {
+		/* kernel TLS requires a TCP socket. If the kernel doesn't
+		   support it, this tests falling back to the BIO pair after
+		   the handshake. */
+		test_tcp_socketpair(fd);
+	}
 	fd_set_nonblock(fd[0], TRUE);
 	fd_set_nonblock(fd[1], TRUE);
 
 	ioloop = io_loop_create();
 
 	ssl_iostream_test_settings_server(&set);
+	set.ktls = ktls;
 	server = create_test_endpoint(fd[0], &set);
 	ssl_iostream_test_settings_client(&set);
 	set.allow_invalid_cert = TRUE;
+	set.ktls = ktls;
 	client = create_test_endpoint(fd[1], &set);
 
 	test_assert(ssl_iostream_context_init_server(server->set, &server->ctx,
@@ -492,6 +559,13 @@ static void test_iostream_ssl_small_packets(void)
 
 	test_assert(server->sent > MAX_SENT_BYTES ||
 		    client->sent > MAX_SENT_BYTES);
+	if (ktls && test_ktls_supported()) {
+		test_assert(test_fd_has_ktls(server->fd));
+		test_assert(test_fd_has_ktls(client->fd));
+	} else {
+		test_assert(!test_fd_has_ktls(server->fd));
+		test_assert(!test_fd_has_ktls(client->fd));
+	}
 	test_assert(o_stream_finish(server->output) >= 0);
 	test_assert(o_stream_finish(client->output) >= 0);
 
@@ -508,6 +582,12 @@ static void test_iostream_ssl_small_packets(void)
 	test_end();
 }
 
+static void test_iostream_ssl_small_packets(void)
+{
+	test_iostream_ssl_small_packets_real(FALSE);
+	test_iostream_ssl_small_packets_real(TRUE);
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
@@ -43,7 +43,10 @@ void dbox_save_begin(struct dbox_save_context *ctx, struct istream *input)
 
 	mail_set_seq_saving(_ctx->dest_mail, ctx->seq);
 
-	crlf_input = i_stream_create_lf(input);
+	if (_storage->set->mail_save_crlf)
+		crlf_input = i_stream_create_crlf(input);
+	else
+		crlf_input = i_stream_create_lf(input);
 	ctx->input = index_mail_cache_parse_init(_ctx->dest_mail, crlf_input);
 	i_stream_unref(&crlf_input);
 
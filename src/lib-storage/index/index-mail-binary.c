@@ -12,6 +12,7 @@
 #include "ostream.h"
 #include "message-binary-part.h"
 #include "message-parser.h"
+#include "message-part-data.h"
 #include "message-decoder.h"
 #include "mail-user.h"
 #include "index-storage.h"
@@ -477,6 +478,38 @@ msg_part_find(struct message_part *parts, uoff_t physical_pos)
 	return NULL;
 }
 
+static bool message_part_is_binary_unconverted(const struct message_part *part)
+{
+	const char *cte;
+
+	/* Content-* headers of non-MIME parts aren't in the part data */
+	if (part->data == NULL ||
+	    (part->flags & MESSAGE_PART_FLAG_IS_MIME) == 0)
+		return FALSE;
+	cte = part->data->content_transfer_encoding;
+	if (cte != NULL && strcasecmp(cte, "7bit") != 0 &&
+	    strcasecmp(cte, "8bit") != 0 && strcasecmp(cte, "binary") != 0)
+		return FALSE;
+	for (part = part->children; part != NULL; part = part->next) {
+		if (!message_part_is_binary_unconverted(part))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static bool
+index_mail_binary_size_is_virtual_size(struct index_mail *mail,
+				       const struct message_part *part)
+{
+	/* If the cached part data shows that nothing in the part is
+	   converted, the binary size is the same as the virtual size and the
+	   message doesn't need to be read. This relies on the first
+	   Content-Transfer-Encoding header, while the conversion uses the
+	   last one. Messages with multiple ones are invalid anyway. */
+	return index_mail_get_cached_parts_data(mail) &&
+		message_part_is_binary_unconverted(part);
+}
+
 static int
 index_mail_get_binary_size(struct mail *_mail,
 			   const struct message_part *part, bool include_hdr,
@@ -493,7 +526,8 @@ index_mail_get_binary_size(struct mail *_mail,
 		return -1;
 
 	/* first lookup from cache */
-	if (!get_cached_binary_parts(mail)) {
+	if (!get_cached_binary_parts(mail) &&
+	    !index_mail_binary_size_is_virtual_size(mail, part)) {
 		/* not found. parse the whole message */
 		if (index_mail_read_binary_to_cache(_mail, all_parts, TRUE,
 						    "binary.size", &binary, &converted) < 0)
@@ -198,6 +198,15 @@ void index_mail_parse_header_init(struct index_mail *mail,
 	i_assert(!mail->data.header_parser_initialized);
 
 	mail->header_seq = data->seq;
+	if (data->save_bodystructure_header &&
+	    !data->parsed_bodystructure_header) {
+		/* collect the root part's envelope for mime.parts.data while
+		   the bodystructure is being parsed */
+		data->parts_envelope_data = NULL;
+		if (!data->save_message_parts_data &&
+		    index_mail_want_cache_message_parts_data(mail))
+			data->save_message_parts_data = TRUE;
+	}
 	if (mail->header_data == NULL) {
 		mail->header_data = buffer_create_dynamic(default_pool, 4096);
 		i_array_init(&mail->header_lines, 32);
@@ -297,6 +306,14 @@ void index_mail_parse_header(struct message_part *part,
 	    !data->parsed_bodystructure_header) {
 		i_assert(part != NULL);
 		message_part_data_parse_from_header(mail->mail.data_pool, part, hdr);
+		if (data->save_message_parts_data && part->parent == NULL) {
+			/* kept out of the root part's data, since SEARCH
+			   MIMEPART would see it as a message/rfc822 part's
+			   envelope */
+			message_part_envelope_parse_from_header(
+				mail->mail.data_pool,
+				&data->parts_envelope_data, hdr);
+		}
 	}
 
 	if (data->save_envelope) {
@@ -387,6 +404,7 @@ index_mail_cache_parse_init(struct mail *_mail, struct istream *input)
 	mail->data.save_sent_date = TRUE;
 	mail->data.save_bodystructure_header = TRUE;
 	mail->data.save_bodystructure_body = TRUE;
+	mail->data.save_message_parts_data = TRUE;
 	/* Don't unnecessarily waste time generating a snippet, since it's
 	   not as cheap as the others to generate. */
 	if (index_mail_want_cache(mail, MAIL_CACHE_BODY_SNIPPET))
@@ -514,6 +532,12 @@ int index_mail_headers_get_envelope(struct index_mail *mail)
 		mail->data.envelope = str_c(str);
 		return 0;
 	}
+	if (index_mail_get_cached_parts_data(mail) &&
+	    mail->data.parts_envelope_data != NULL) {
+		imap_envelope_write(mail->data.parts_envelope_data, str);
+		mail->data.envelope = str_c(str);
+		return 0;
+	}
 	str_free(&str);
 
 	old_offset = mail->data.stream == NULL ? 0 :
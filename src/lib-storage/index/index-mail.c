@@ -63,6 +63,8 @@ struct mail_cache_field global_cache_fields[MAIL_INDEX_CACHE_FIELD_COUNT] = {
 	{ .name = "binary.parts",
 	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE },
 	{ .name = "body.snippet",
+	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE },
+	{ .name = "mime.parts.data",
 	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE }
 	/* FIXME: for now need to update get_metadata_precache_fields() in
 	   index-status.c when adding more fields. those fields should probably
@@ -184,6 +186,69 @@ static bool get_cached_parts(struct index_mail *mail)
 	return TRUE;
 }
 
+static bool index_mail_have_cached_parts_data(struct index_mail *mail)
+{
+	struct mail *_mail = &mail->mail.mail;
+	const struct mail_cache_field *cache_fields = mail->ibox->cache_fields;
+
+	return mail_cache_field_exists(_mail->transaction->cache_view,
+			_mail->seq,
+			cache_fields[MAIL_CACHE_MESSAGE_PARTS].idx) > 0 &&
+		mail_cache_field_exists(_mail->transaction->cache_view,
+			_mail->seq,
+			cache_fields[MAIL_CACHE_MESSAGE_PARTS_DATA].idx) > 0;
+}
+
+static int get_unserialized_parts_data(struct index_mail *mail)
+{
+	const unsigned int field_idx =
+		mail->ibox->cache_fields[MAIL_CACHE_MESSAGE_PARTS_DATA].idx;
+	buffer_t *buf;
+	const char *error;
+
+	buf = t_buffer_create(256);
+	if (index_mail_cache_lookup_field(mail, buf, field_idx) <= 0)
+		return 0;
+
+	if (message_part_data_deserialize(mail->mail.data_pool,
+					  mail->data.parts, buf->data,
+					  buf->used,
+					  &mail->data.parts_envelope_data,
+					  &error) < 0) {
+		mail_set_mail_cache_corrupted(&mail->mail.mail,
+			"Corrupted cached mime.parts.data data: %s", error);
+		return -1;
+	}
+	return 1;
+}
+
+bool index_mail_get_cached_parts_data(struct index_mail *mail)
+{
+	struct index_mail_data *data = &mail->data;
+	int ret;
+
+	if (data->parsed_bodystructure)
+		return TRUE;
+	/* the parts may still be replaced while the message is being
+	   parsed */
+	if (data->parser_ctx != NULL ||
+	    !index_mail_have_cached_parts_data(mail) ||
+	    !get_cached_parts(mail))
+		return FALSE;
+
+	T_BEGIN {
+		ret = get_unserialized_parts_data(mail);
+	} T_END;
+	if (ret <= 0)
+		return FALSE;
+
+	/* the parts now have everything that parsing the BODYSTRUCTURE
+	   would have given. The save_bodystructure_* flags are left alone,
+	   since a caller may be in the middle of forcing a header parse. */
+	data->parsed_bodystructure = TRUE;
+	return TRUE;
+}
+
 void index_mail_set_message_parts_corrupted(struct mail *mail, const char *error)
 {
 	buffer_t *part_buf;
@@ -768,6 +833,18 @@ static void index_mail_body_parsed_cache_flags(struct index_mail *mail)
 	data->cache_flags = cache_flags;
 }
 
+static bool index_mail_can_cache_message_parts_data(struct index_mail *mail)
+{
+	struct index_mail_data *data = &mail->data;
+
+	/* mime.parts.data is only cached with the root part's envelope, so
+	   that its existence also means that ENVELOPE can be returned. */
+	if (!data->save_message_parts_data || !data->parsed_bodystructure ||
+	    data->parts_envelope_data == NULL)
+		return FALSE;
+	return index_mail_want_cache_message_parts_data(mail);
+}
+
 static void index_mail_body_parsed_cache_message_parts(struct index_mail *mail)
 {
 	struct mail *_mail = &mail->mail.mail;
@@ -792,7 +869,8 @@ static void index_mail_body_parsed_cache_message_parts(struct index_mail *mail)
 	}
 	if (decision == MAIL_CACHE_DECISION_NO &&
 	    !data->save_message_parts &&
-	    (data->wanted_fields & MAIL_FETCH_MESSAGE_PARTS) == 0) {
+	    (data->wanted_fields & MAIL_FETCH_MESSAGE_PARTS) == 0 &&
+	    !index_mail_can_cache_message_parts_data(mail)) {
 		/* we didn't really care about the message parts themselves,
 		   just wanted to use something that depended on it */
 		return;
@@ -808,6 +886,38 @@ static void index_mail_body_parsed_cache_message_parts(struct index_mail *mail)
 	data->messageparts_saved_to_cache = TRUE;
 }
 
+static void
+index_mail_body_parsed_cache_message_parts_data(struct index_mail *mail)
+{
+	struct mail *_mail = &mail->mail.mail;
+	struct index_mail_data *data = &mail->data;
+	const unsigned int cache_field_parts =
+		mail->ibox->cache_fields[MAIL_CACHE_MESSAGE_PARTS].idx;
+	const unsigned int cache_field =
+		mail->ibox->cache_fields[MAIL_CACHE_MESSAGE_PARTS_DATA].idx;
+	buffer_t *buffer;
+
+	if (!index_mail_can_cache_message_parts_data(mail))
+		return;
+	/* the data is useless without the parts */
+	if (!data->messageparts_saved_to_cache &&
+	    mail_cache_field_exists(_mail->transaction->cache_view,
+				    _mail->seq, cache_field_parts) <= 0)
+		return;
+	if (mail_cache_field_exists(_mail->transaction->cache_view,
+				    _mail->seq, cache_field) != 0)
+		return;
+
+	T_BEGIN {
+		buffer = t_buffer_create(1024);
+		message_part_data_serialize(data->parts,
+					    data->parts_envelope_data, buffer);
+		index_mail_cache_add_idx(mail, cache_field,
+					 buffer->data, buffer->used);
+	} T_END;
+	data->save_message_parts_data = FALSE;
+}
+
 static void
 index_mail_body_parsed_cache_bodystructure(struct index_mail *mail,
 					   enum index_cache_field field)
@@ -942,6 +1052,24 @@ bool index_mail_want_cache(struct index_mail *mail, enum index_cache_field field
 	}
 }
 
+bool index_mail_want_cache_message_parts_data(struct index_mail *mail)
+{
+	struct mail *_mail = &mail->mail.mail;
+	const unsigned int cache_field =
+		mail->ibox->cache_fields[MAIL_CACHE_MESSAGE_PARTS_DATA].idx;
+
+	/* New mails get it cached unless it's explicitly disabled. This way
+	   BODYSTRUCTURE and ENVELOPE never need to open the mail, even when
+	   they're first fetched long after the mail was saved (e.g. when
+	   mails are imported with dsync). */
+	if (_mail->saving) {
+		return mail_cache_field_can_add(_mail->transaction->cache_trans,
+						_mail->seq, cache_field);
+	}
+	return mail_cache_field_want_add(_mail->transaction->cache_trans,
+					 _mail->seq, cache_field);
+}
+
 static void index_mail_save_finish_make_snippet(struct index_mail *mail)
 {
 	if (mail->data.save_body_snippet) {
@@ -1200,6 +1328,7 @@ index_mail_parse_body_finish(struct index_mail *mail,
 
 	index_mail_body_parsed_cache_flags(mail);
 	index_mail_body_parsed_cache_message_parts(mail);
+	index_mail_body_parsed_cache_message_parts_data(mail);
 	index_mail_body_parsed_cache_bodystructure(mail, field);
 	index_mail_cache_sizes(mail);
 	index_mail_cache_dates(mail);
@@ -1577,6 +1706,13 @@ bool index_mail_get_cached_body(struct index_mail *mail, const char **value_r)
 			*value_r = data->body = str_c(str);
 			return TRUE;
 		}
+		str_truncate(str, 0);
+	}
+	/* 4) generate it from the cached message parts */
+	if (index_mail_get_cached_parts_data(mail)) {
+		imap_bodystructure_write(data->parts, str, FALSE);
+		*value_r = data->body = str_c(str);
+		return TRUE;
 	}
 
 	str_free(&str);
@@ -1602,7 +1738,11 @@ bool index_mail_get_cached_bodystructure(struct index_mail *mail,
 	    get_cached_parts(mail))
 		index_mail_get_plain_bodystructure(mail, str, TRUE);
 	else if (index_mail_cache_lookup_field(mail, str,
-			bodystructure_cache_field) <= 0) {
+			bodystructure_cache_field) > 0)
+		;
+	else if (index_mail_get_cached_parts_data(mail))
+		imap_bodystructure_write(data->parts, str, TRUE);
+	else {
 		str_free(&str);
 		return FALSE;
 	}
@@ -1859,6 +1999,9 @@ static void check_envelope(struct index_mail *mail)
 	if (mail_cache_field_exists(_mail->transaction->cache_view,
 				    _mail->seq, cache_field_envelope) > 0)
 		return;
+	/* the envelope can be generated from the cached message parts */
+	if (index_mail_have_cached_parts_data(mail))
+		return;
 
 	/* don't waste time doing full checks for all required
 	   headers. assume that if we have "hdr.message-id" cached,
@@ -1938,7 +2081,8 @@ void index_mail_update_access_parts_pre(struct mail *_mail)
 		if (mail_cache_field_exists(cache_view, _mail->seq,
 					    cache_field1) <= 0 &&
 		    mail_cache_field_exists(cache_view, _mail->seq,
-					    cache_field2) <= 0) {
+					    cache_field2) <= 0 &&
+		    !index_mail_have_cached_parts_data(mail)) {
 			data->access_part |= PARSE_HDR | PARSE_BODY;
 			data->save_bodystructure_header = TRUE;
 			data->save_bodystructure_body = TRUE;
@@ -1953,7 +2097,8 @@ void index_mail_update_access_parts_pre(struct mail *_mail)
 			cache_fields[MAIL_CACHE_IMAP_BODYSTRUCTURE].idx;
 
                 if (mail_cache_field_exists(cache_view, _mail->seq,
-                                            cache_field) <= 0) {
+                                            cache_field) <= 0 &&
+		    !index_mail_have_cached_parts_data(mail)) {
 			data->access_part |= PARSE_HDR | PARSE_BODY;
 			data->save_bodystructure_header = TRUE;
 			data->save_bodystructure_body = TRUE;
@@ -2463,6 +2608,10 @@ void index_mail_set_cache_corrupted(struct mail *mail,
 	case MAIL_FETCH_MESSAGE_PARTS:
 		field_name = "MIME parts";
 		imail->data.parts = NULL;
+		/* the cached mime.parts.data was deserialized into the
+		   parts, so it's dropped as well */
+		imail->data.parsed_bodystructure = FALSE;
+		imail->data.parts_envelope_data = NULL;
 		break;
 	case MAIL_FETCH_IMAP_BODY:
 		field_name = "IMAP BODY";
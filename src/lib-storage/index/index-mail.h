@@ -24,6 +24,7 @@ enum index_cache_field {
 	MAIL_CACHE_MESSAGE_PARTS,
 	MAIL_CACHE_BINARY_PARTS,
 	MAIL_CACHE_BODY_SNIPPET,
+	MAIL_CACHE_MESSAGE_PARTS_DATA,
 
 	MAIL_INDEX_CACHE_FIELD_COUNT
 };
@@ -86,6 +87,10 @@ struct index_mail_data {
 	const char *envelope, *body, *bodystructure, *guid, *filename;
 	const char *from_envelope, *body_snippet;
 	struct message_part_envelope *envelope_data;
+	/* Root part's envelope, which is saved to mime.parts.data. It's kept
+	   out of parts->data, which has only message/rfc822 parts'
+	   envelopes. */
+	struct message_part_envelope *parts_envelope_data;
 
 	uint32_t seq;
 	uint32_t cache_flags;
@@ -115,6 +120,7 @@ struct index_mail_data {
 	bool save_bodystructure_header:1;
 	bool save_bodystructure_body:1;
 	bool save_message_parts:1;
+	bool save_message_parts_data:1;
 	bool save_body_snippet:1;
 	bool stream_has_only_header:1;
 	bool parsed_bodystructure:1;
@@ -258,12 +264,14 @@ bool index_mail_get_cached_uoff_t(struct index_mail *mail,
 				  enum index_cache_field field, uoff_t *size_r);
 bool index_mail_get_cached_virtual_size(struct index_mail *mail,
 					uoff_t *size_r);
+bool index_mail_get_cached_parts_data(struct index_mail *mail);
 bool index_mail_get_cached_body(struct index_mail *mail, const char **value_r);
 bool index_mail_get_cached_bodystructure(struct index_mail *mail,
 					 const char **value_r);
 const uint32_t *index_mail_get_vsize_extension(struct mail *_mail);
 
 bool index_mail_want_cache(struct index_mail *mail, enum index_cache_field field);
+bool index_mail_want_cache_message_parts_data(struct index_mail *mail);
 void index_mail_cache_add(struct index_mail *mail, enum index_cache_field field,
 			  const void *data, size_t data_size);
 void index_mail_cache_add_idx(struct index_mail *mail, unsigned int field_idx,
@@ -19,6 +19,15 @@ struct index_search_context {
 	struct mailbox_header_lookup_ctx *extra_wanted_headers;
 
 	uint32_t seq1, seq2;
+	/* Sequences matching the root-level flag and keyword args. Looked up
+	   from the index in a single pass when the search starts. */
+	ARRAY_TYPE(seq_range) index_flag_seqs;
+	unsigned int index_flag_seqs_idx;
+	/* Cache fields wanted by FETCH, which are prefetched for the matching
+	   sequences a window at a time. */
+	ARRAY(unsigned int) cache_prefetch_fields;
+	ARRAY_TYPE(seq_range) cache_prefetch_seqs;
+	uint32_t cache_prefetch_seq2;
 	struct mail *cur_mail;
 	struct index_mail *cur_imail;
 	struct mail_thread_context *thread_ctx;
@@ -37,6 +37,8 @@
 #define SEARCH_INITIAL_MAX_COST 30000
 #define SEARCH_RECALC_MIN_USECS 50000
 
+#define SEARCH_CACHE_PREFETCH_COUNT 256
+
 struct search_header_context {
         struct index_search_context *index_ctx;
         struct index_mail *imail;
@@ -1126,6 +1128,176 @@ static void search_get_seqset(struct index_search_context *ctx,
 	}
 }
 
+static void search_lookup_index_flag_seqs(struct index_search_context *ctx)
+{
+	ARRAY_TYPE(seq_range) arg_seqs;
+	struct mail_search_arg *arg;
+	const struct mail_keywords *keywords;
+	enum mail_flags flags, pvt_flags_mask;
+	bool limited = FALSE;
+
+	if (ctx->seq1 > ctx->seq2)
+		return;
+
+	/* we can't trust that private view's header is fully up to date,
+	   so do this optimization only for non-private flags */
+	pvt_flags_mask = ctx->box->view_pvt == NULL ? 0 :
+		mailbox_get_private_flags_mask(ctx->box);
+
+	i_array_init(&ctx->index_flag_seqs, 32);
+	seq_range_array_add_range(&ctx->index_flag_seqs, ctx->seq1, ctx->seq2);
+	i_array_init(&arg_seqs, 32);
+	/* root level args are ANDed, so each one can only narrow down the
+	   matching sequences */
+	for (arg = ctx->mail_ctx.args->args; arg != NULL; arg = arg->next) {
+		flags = 0;
+		keywords = NULL;
+		switch (arg->type) {
+		case SEARCH_FLAGS:
+			/* recent flags aren't in the index */
+			if ((arg->value.flags &
+			     (MAIL_RECENT | pvt_flags_mask)) != 0)
+				continue;
+			flags = arg->value.flags;
+			break;
+		case SEARCH_KEYWORDS:
+			keywords = arg->initialized.keywords;
+			if (keywords == NULL)
+				continue;
+			break;
+		default:
+			continue;
+		}
+
+		array_clear(&arg_seqs);
+		if (keywords == NULL || keywords->count > 0) {
+			/* (invalid keyword never matches) */
+			mail_index_lookup_flag_seqs(ctx->view,
+						    ctx->seq1, ctx->seq2,
+						    flags, flags, keywords,
+						    &arg_seqs);
+		}
+		if (arg->match_not)
+			seq_range_array_invert(&arg_seqs, ctx->seq1, ctx->seq2);
+		(void)seq_range_array_intersect(&ctx->index_flag_seqs,
+						&arg_seqs);
+		limited = TRUE;
+	}
+	array_free(&arg_seqs);
+
+	if (!limited)
+		array_free(&ctx->index_flag_seqs);
+}
+
+static void search_init_cache_prefetch(struct index_search_context *ctx)
+{
+	struct index_mailbox_context *ibox = INDEX_STORAGE_CONTEXT(ctx->box);
+	struct mailbox_header_lookup_ctx *headers =
+		ctx->mail_ctx.wanted_headers;
+	const struct mail_search_arg *arg;
+	const struct seq_range *range;
+	ARRAY_TYPE(seq_range) arg_seqs;
+	unsigned int field_idx;
+	uint32_t seq1, seq2;
+
+	/* Prefetch only when all the messages in the message set are
+	   returned in the sequence order, as with FETCH. */
+	if (ctx->mail_ctx.sort_program != NULL || ctx->seq1 > ctx->seq2)
+		return;
+	for (arg = ctx->mail_ctx.args->args; arg != NULL; arg = arg->next) {
+		if (arg->match_not)
+			return;
+		if (arg->type != SEARCH_SEQSET && arg->type != SEARCH_UIDSET &&
+		    arg->type != SEARCH_ALL)
+			return;
+	}
+
+	i_array_init(&ctx->cache_prefetch_fields, 8);
+	if ((ctx->mail_ctx.wanted_fields & MAIL_FETCH_IMAP_ENVELOPE) != 0) {
+		field_idx = ibox->cache_fields[MAIL_CACHE_IMAP_ENVELOPE].idx;
+		array_push_back(&ctx->cache_prefetch_fields, &field_idx);
+	}
+	if (headers != NULL) {
+		array_append(&ctx->cache_prefetch_fields,
+			     headers->idx, headers->count);
+	}
+	if (array_count(&ctx->cache_prefetch_fields) == 0) {
+		array_free(&ctx->cache_prefetch_fields);
+		return;
+	}
+
+	i_array_init(&ctx->cache_prefetch_seqs, 8);
+	seq_range_array_add_range(&ctx->cache_prefetch_seqs,
+				  ctx->seq1, ctx->seq2);
+	t_array_init(&arg_seqs, 8);
+	for (arg = ctx->mail_ctx.args->args; arg != NULL; arg = arg->next) {
+		switch (arg->type) {
+		case SEARCH_SEQSET:
+			(void)seq_range_array_intersect(
+				&ctx->cache_prefetch_seqs, &arg->value.seqset);
+			break;
+		case SEARCH_UIDSET:
+			array_clear(&arg_seqs);
+			array_foreach(&arg->value.seqset, range) {
+				mail_index_lookup_seq_range(ctx->view,
+					range->seq1, range->seq2,
+					&seq1, &seq2);
+				if (seq1 != 0) {
+					seq_range_array_add_range(&arg_seqs,
+								  seq1, seq2);
+				}
+			}
+			(void)seq_range_array_intersect(
+				&ctx->cache_prefetch_seqs, &arg_seqs);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static void
+search_cache_prefetch_next(struct index_search_context *ctx, uint32_t seq)
+{
+	ARRAY_TYPE(seq_range) seqs;
+
+	if (!array_is_created(&ctx->cache_prefetch_fields) ||
+	    seq <= ctx->cache_prefetch_seq2)
+		return;
+
+	/* look up the cached fields of the next messages in cache file
+	   order */
+	ctx->cache_prefetch_seq2 =
+		I_MIN(seq + SEARCH_CACHE_PREFETCH_COUNT - 1, ctx->seq2);
+	t_array_init(&seqs, 8);
+	seq_range_array_add_range(&seqs, seq, ctx->cache_prefetch_seq2);
+	(void)seq_range_array_intersect(&seqs, &ctx->cache_prefetch_seqs);
+	if (array_count(&seqs) == 0)
+		return;
+	/* on failure the fields are just looked up one mail at a time */
+	(void)mail_cache_view_prefetch_fields(
+		ctx->mail_ctx.transaction->cache_view, &seqs,
+		array_front(&ctx->cache_prefetch_fields),
+		array_count(&ctx->cache_prefetch_fields));
+}
+
+static bool
+search_index_flag_seqs_next(struct index_search_context *ctx, uint32_t *seq)
+{
+	const struct seq_range *range;
+	unsigned int count;
+
+	range = array_get(&ctx->index_flag_seqs, &count);
+	for (; ctx->index_flag_seqs_idx < count; ctx->index_flag_seqs_idx++) {
+		if (*seq <= range[ctx->index_flag_seqs_idx].seq2) {
+			if (*seq < range[ctx->index_flag_seqs_idx].seq1)
+				*seq = range[ctx->index_flag_seqs_idx].seq1;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
 static int search_build_subthread(struct mail_thread_iterate_context *iter,
 				  ARRAY_TYPE(seq_range) *uids)
 {
@@ -1328,6 +1500,9 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 
 	search_get_seqset(ctx, status.messages, args->args);
 	(void)mail_search_args_foreach(args->args, search_init_arg, ctx);
+	T_BEGIN {
+		search_init_cache_prefetch(ctx);
+	} T_END;
 
 	/* Need to reset results for match_always cases */
 	mail_search_args_reset(ctx->mail_ctx.args->args, FALSE);
@@ -1370,6 +1545,12 @@ int index_storage_search_deinit(struct mail_search_context *_ctx)
 	}
 	if (ctx->thread_ctx != NULL)
 		mail_thread_deinit(&ctx->thread_ctx);
+	if (array_is_created(&ctx->index_flag_seqs))
+		array_free(&ctx->index_flag_seqs);
+	if (array_is_created(&ctx->cache_prefetch_fields)) {
+		array_free(&ctx->cache_prefetch_fields);
+		array_free(&ctx->cache_prefetch_seqs);
+	}
 	array_free(&ctx->mail_ctx.results);
 	array_free(&ctx->mail_ctx.module_contexts);
 
@@ -1860,6 +2041,8 @@ bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 	if (_ctx->seq == 0) {
 		/* first time */
 		_ctx->seq = ctx->seq1;
+		if (ctx->have_index_args)
+			search_lookup_index_flag_seqs(ctx);
 	} else {
 		_ctx->seq++;
 	}
@@ -1867,11 +2050,22 @@ bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 	if (!ctx->have_seqsets && !ctx->have_index_args &&
 	    _ctx->update_result == NULL) {
 		_ctx->progress_cur = _ctx->seq;
-		return _ctx->seq <= ctx->seq2;
+		if (_ctx->seq > ctx->seq2)
+			return FALSE;
+		T_BEGIN {
+			search_cache_prefetch_next(ctx, _ctx->seq);
+		} T_END;
+		return TRUE;
 	}
 
 	ret = 0;
 	while (_ctx->seq <= ctx->seq2) {
+		if (array_is_created(&ctx->index_flag_seqs) &&
+		    !search_index_flag_seqs_next(ctx, &_ctx->seq)) {
+			/* no more messages with matching flags */
+			_ctx->seq = ctx->seq2 + 1;
+			break;
+		}
 		/* check if the sequence matches */
 		ret = mail_search_args_foreach(ctx->mail_ctx.args->args,
 					       search_seqset_arg, ctx);
@@ -1904,6 +2098,9 @@ bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 			search_set_static_matches(_ctx->args->args);
 		}
 	}
+	if (ret != 0) T_BEGIN {
+		search_cache_prefetch_next(ctx, _ctx->seq);
+	} T_END;
 	ctx->mail_ctx.progress_cur = _ctx->seq;
 	return ret != 0;
 }
@@ -17,6 +17,9 @@ struct mail_search_sort_program {
 	ARRAY_TYPE(uint32_t) seqs;
 	unsigned int iter_idx;
 
+	/* "sort-d" extension containing messages' DATE sort keys */
+	uint32_t date_ext_id;
+
 	bool failed;
 };
 
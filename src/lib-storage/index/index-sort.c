@@ -7,7 +7,9 @@
 #include "message-address.h"
 #include "message-header-decode.h"
 #include "imap-base-subject.h"
+#include "mail-cache.h"
 #include "index-storage.h"
+#include "index-mail.h"
 #include "index-sort-private.h"
 
 
@@ -78,10 +80,10 @@ index_sort_list_add_arrival(struct mail_search_sort_program *program,
 	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
 	struct mail_sort_node_date *node;
 
+	/* the received dates are looked up with a single batched cache
+	   lookup in index_sort_list_finish_arrival() */
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_received_date(mail, &node->date) < 0)
-		node->date = index_sort_program_set_date_failed(program, mail);
 }
 
 static void
@@ -90,15 +92,38 @@ index_sort_list_add_date(struct mail_search_sort_program *program,
 {
 	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
 	struct mail_sort_node_date *node;
+	const void *data;
+	uint32_t sort_date;
+	bool expunged;
 	int tz;
 
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_date(mail, &node->date, &tz) < 0)
+
+	/* the messages' sort dates never change, so once they're looked up
+	   they're stored in the index to avoid header lookups in the
+	   following sorts. 0 means it's not set yet. */
+	mail_index_lookup_ext(program->t->view, mail->seq, program->date_ext_id,
+			      &data, &expunged);
+	if (data != NULL && (sort_date = *(const uint32_t *)data) != 0) {
+		node->date = sort_date;
+		return;
+	}
+
+	if (mail_get_date(mail, &node->date, &tz) < 0) {
 		node->date = index_sort_program_set_date_failed(program, mail);
-	else if (node->date == 0) {
-		if (mail_get_received_date(mail, &node->date) < 0)
+		return;
+	}
+	if (node->date == 0) {
+		if (mail_get_received_date(mail, &node->date) < 0) {
 			node->date = index_sort_program_set_date_failed(program, mail);
+			return;
+		}
+	}
+	if (!expunged && node->date > 0 && node->date <= (time_t)UINT32_MAX) {
+		sort_date = node->date;
+		mail_index_update_ext(program->t->itrans, mail->seq,
+				      program->date_ext_id, &sort_date, NULL);
 	}
 }
 
@@ -222,6 +247,88 @@ index_sort_list_finish_date(struct mail_search_sort_program *program)
 	program->context = NULL;
 }
 
+static void
+index_sort_set_seq(struct mail_search_sort_program *program,
+		   struct mail *mail, uint32_t seq)
+{
+	if ((mail->mail_stream_opened || mail->mail_metadata_accessed) &&
+	    program->slow_mails_left > 0)
+		program->slow_mails_left--;
+	mail_set_seq(mail, seq);
+	if (program->slow_mails_left == 0) {
+		/* too many slow lookups - just return the rest of the results
+		   in whatever order. */
+		mail->lookup_abort = MAIL_LOOKUP_ABORT_NOT_IN_CACHE;
+	}
+}
+
+static int sort_node_seq_cmp(const struct mail_sort_node_date *n1,
+			     const struct mail_sort_node_date *n2)
+{
+	if (n1->seq < n2->seq)
+		return -1;
+	if (n1->seq > n2->seq)
+		return 1;
+	return 0;
+}
+
+static void
+index_sort_list_finish_arrival(struct mail_search_sort_program *program)
+{
+	struct index_mailbox_context *ibox =
+		INDEX_STORAGE_CONTEXT(program->t->box);
+	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
+	ARRAY_TYPE(mail_cache_lookup_batch_value) values;
+	const struct mail_cache_lookup_batch_value *value;
+	ARRAY_TYPE(seq_range) seqs;
+	struct mail_sort_node_date *node;
+	struct mail *mail = program->temp_mail;
+	unsigned int field_idx, i, count;
+	buffer_t *data_buf;
+	uint32_t t;
+
+	node = array_get_modifiable(nodes, &count);
+	if (count == 0) {
+		index_sort_list_finish_date(program);
+		return;
+	}
+	/* the nodes are normally already sorted */
+	array_sort(nodes, sort_node_seq_cmp);
+
+	T_BEGIN {
+		t_array_init(&seqs, 8);
+		for (i = 0; i < count; i++)
+			seq_range_array_add(&seqs, node[i].seq);
+		t_array_init(&values, count);
+		data_buf = t_buffer_create(count * sizeof(t));
+
+		field_idx = ibox->cache_fields[MAIL_CACHE_RECEIVED_DATE].idx;
+		if (mail_cache_lookup_fields_batch(program->t->cache_view,
+						   &seqs, &field_idx, 1,
+						   &values, data_buf) < 0)
+			array_clear(&values);
+
+		for (i = 0; i < count; i++) {
+			value = i < array_count(&values) ?
+				array_idx(&values, i) : NULL;
+			if (value != NULL && value->size == sizeof(t)) {
+				memcpy(&t, CONST_PTR_OFFSET(data_buf->data,
+							    value->data_offset),
+				       sizeof(t));
+				node[i].date = t;
+				continue;
+			}
+			/* not in cache */
+			index_sort_set_seq(program, mail, node[i].seq);
+			if (mail_get_received_date(mail, &node[i].date) < 0) {
+				node[i].date = index_sort_program_set_date_failed(
+					program, mail);
+			}
+		}
+	} T_END;
+	index_sort_list_finish_date(program);
+}
+
 static int sort_node_size_cmp(const struct mail_sort_node_size *n1,
 			      const struct mail_sort_node_size *n2)
 {
@@ -410,11 +517,18 @@ index_sort_program_init(struct mailbox_transaction_context *t,
 		i_array_init(nodes, 128);
 
 		if ((program->sort_program[0] &
-		     MAIL_SORT_MASK) == MAIL_SORT_ARRIVAL)
+		     MAIL_SORT_MASK) == MAIL_SORT_ARRIVAL) {
 			program->sort_list_add = index_sort_list_add_arrival;
-		else
+			program->sort_list_finish =
+				index_sort_list_finish_arrival;
+		} else {
+			program->date_ext_id =
+				mail_index_ext_register(t->box->index, "sort-d",
+							0, sizeof(uint32_t),
+							sizeof(uint32_t));
 			program->sort_list_add = index_sort_list_add_date;
-		program->sort_list_finish = index_sort_list_finish_date;
+			program->sort_list_finish = index_sort_list_finish_date;
+		}
 		program->context = nodes;
 		break;
 	}
@@ -543,21 +657,6 @@ get_display_name(struct mail *mail, const char *header, const char **name_r)
 	return 0;
 }
 
-static void
-index_sort_set_seq(struct mail_search_sort_program *program,
-		   struct mail *mail, uint32_t seq)
-{
-	if ((mail->mail_stream_opened || mail->mail_metadata_accessed) &&
-	    program->slow_mails_left > 0)
-		program->slow_mails_left--;
-	mail_set_seq(mail, seq);
-	if (program->slow_mails_left == 0) {
-		/* too many slow lookups - just return the rest of the results
-		   in whatever order. */
-		mail->lookup_abort = MAIL_LOOKUP_ABORT_NOT_IN_CACHE;
-	}
-}
-
 int index_sort_header_get(struct mail_search_sort_program *program, uint32_t seq,
 			  enum mail_sort_type sort_type, string_t *dest)
 {
@@ -182,16 +182,25 @@ static void mail_thread_strmap_remap(const uint32_t *idx_map,
 		cache->first_invalid_msgid_str_idx;
 
 	old_nodes = array_get(&cache->thread_nodes, &nodes_count);
+	max = I_MIN(I_MIN(old_count, nodes_count),
+		    cache->first_invalid_msgid_str_idx);
+	for (i = 0; i < max; i++) {
+		if (idx_map[i] == 0 && old_nodes[i].uid != 0) {
+			/* The expunged messages weren't removed from the
+			   cache before the strmap was updated. Rebuild the
+			   thread. */
+			mailbox_search_result_free(&cache->search_result);
+			return;
+		}
+	}
 	i_array_init(&new_nodes, new_count + invalid_count + 32);
 
 	/* optimization: allocate all nodes initially */
-	(void)array_idx_modifiable(&new_nodes, new_count-1);
+	(void)array_idx_get_space(&new_nodes, new_count-1);
 
 	/* renumber existing valid nodes. all existing records in old_nodes
 	   should also exist in idx_map since we've removed expunged messages
 	   from the cache before committing the sync. */
-	max = I_MIN(I_MIN(old_count, nodes_count),
-		    cache->first_invalid_msgid_str_idx);
 	for (i = 0; i < max; i++) {
 		if (idx_map[i] == 0) {
 			/* expunged record. */
@@ -212,7 +221,7 @@ static void mail_thread_strmap_remap(const uint32_t *idx_map,
 	new_first_invalid = new_count + 1 +
 		THREAD_INVALID_MSGID_STR_IDX_SKIP_COUNT;
 	for (i = 0; i < invalid_count; i++) {
-		node = array_idx_modifiable(&new_nodes, new_first_invalid + i);
+		node = array_idx_get_space(&new_nodes, new_first_invalid + i);
 		*node = old_nodes[cache->first_invalid_msgid_str_idx + i];
 		if (node->parent_idx != 0) {
 			node->parent_idx = idx_map[node->parent_idx];
@@ -615,6 +624,66 @@ mail_thread_iterate_init(struct mail_thread_context *ctx,
 					     thread_type, write_seqs);
 }
 
+static void mail_thread_strmap_update(struct mailbox *box)
+{
+	struct mail_thread_mailbox *tbox = MAIL_THREAD_CONTEXT_REQUIRE(box);
+	struct mail_thread_context *ctx;
+
+	ctx = i_new(struct mail_thread_context, 1);
+	ctx->box = box;
+	ctx->t = mailbox_transaction_begin(box, 0, __func__);
+	tbox->ctx = ctx;
+
+	if (mail_thread_index_map_build(ctx) < 0 || ctx->failed) {
+		/* the next THREAD command will try again */
+		if (ctx->corrupted)
+			mail_index_strmap_view_set_corrupted(tbox->strmap_view);
+	}
+	mail_thread_clear(ctx);
+	tbox->ctx = NULL;
+	i_free(ctx);
+}
+
+static void mail_thread_cache_sync_expunges(struct mail_thread_mailbox *tbox)
+{
+	struct mail_thread_cache *cache = tbox->cache;
+	ARRAY_TYPE(seq_range) added_uids;
+
+	if (cache->search_result == NULL)
+		return;
+
+	/* Remove the expunged messages from the cache before the strmap
+	   update renumbers the thread index. Otherwise the cache would have
+	   to be rebuilt. */
+	t_array_init(&added_uids, 64);
+	if (!mail_thread_cache_update_removes(tbox, &added_uids)) {
+		mailbox_search_result_free(&cache->search_result);
+		return;
+	}
+	/* the next THREAD command adds the new messages to the cache */
+	array_append_array(&cache->search_result->added_uids, &added_uids);
+}
+
+static int mail_thread_mailbox_sync_deinit(struct mailbox_sync_context *ctx,
+					   struct mailbox_sync_status *status_r)
+{
+	struct mailbox *box = ctx->box;
+	struct mail_thread_mailbox *tbox = MAIL_THREAD_CONTEXT_REQUIRE(box);
+
+	if (tbox->module_ctx.super.sync_deinit(ctx, status_r) < 0)
+		return -1;
+	ctx = NULL;
+
+	/* If THREAD has already been used for this mailbox, add the newly
+	   synced messages' Message-IDs to the thread index now. This way the
+	   following THREAD commands don't need to look up the headers. */
+	if (tbox->strmap_view != NULL && tbox->ctx == NULL) T_BEGIN {
+		mail_thread_cache_sync_expunges(tbox);
+		mail_thread_strmap_update(box);
+	} T_END;
+	return 0;
+}
+
 static void mail_thread_mailbox_close(struct mailbox *box)
 {
 	struct mail_thread_mailbox *tbox = MAIL_THREAD_CONTEXT_REQUIRE(box);
@@ -653,6 +722,7 @@ void index_thread_mailbox_opened(struct mailbox *box)
 	tbox->module_ctx.super = box->v;
 	box->v.close = mail_thread_mailbox_close;
 	box->v.free = mail_thread_mailbox_free;
+	box->v.sync_deinit = mail_thread_mailbox_sync_deinit;
 
 	tbox->strmap = mail_index_strmap_init(box->index,
 					      MAIL_THREAD_INDEX_SUFFIX);
@@ -3,20 +3,28 @@
 #include "lib.h"
 #include "test-common.h"
 #include "istream.h"
+#include "str.h"
 #include "master-service.h"
 #include "message-size.h"
+#include "message-part.h"
+#include "message-part-data.h"
+#include "mail-cache-private.h"
+#include "mail-search-build.h"
+#include "mail-thread.h"
 #include "test-mail-storage-common.h"
 
 static struct event *test_event;
 
 static int
 test_mail_save_trans(struct mailbox_transaction_context *trans,
-		     struct istream *input)
+		     struct istream *input, time_t received_date)
 {
 	struct mail_save_context *save_ctx;
 	int ret;
 
 	save_ctx = mailbox_save_alloc(trans);
+	if (received_date != (time_t)-1)
+		mailbox_save_set_received_date(save_ctx, received_date, 0);
 	if (mailbox_save_begin(&save_ctx, input) < 0)
 		return -1;
 	do {
@@ -31,7 +39,9 @@ test_mail_save_trans(struct mailbox_transaction_context *trans,
 	return mailbox_save_finish(&save_ctx);
 }
 
-static void test_mail_save(struct mailbox *box, const char *mail_input)
+static void
+test_mail_save_received(struct mailbox *box, const char *mail_input,
+			time_t received_date)
 {
 	struct mailbox_transaction_context *trans;
 	struct istream *input;
@@ -40,7 +50,7 @@ static void test_mail_save(struct mailbox *box, const char *mail_input)
 	input = i_stream_create_from_data(mail_input, strlen(mail_input));
 	trans = mailbox_transaction_begin(box,
 			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
-	ret = test_mail_save_trans(trans, input);
+	ret = test_mail_save_trans(trans, input, received_date);
 	i_stream_unref(&input);
 	if (ret < 0)
 		mailbox_transaction_rollback(&trans);
@@ -55,6 +65,11 @@ static void test_mail_save(struct mailbox *box, const char *mail_input)
 			mailbox_get_last_internal_error(box, NULL));
 }
 
+static void test_mail_save(struct mailbox *box, const char *mail_input)
+{
+	test_mail_save_received(box, mail_input, (time_t)-1);
+}
+
 static void test_mail_remove_keywords(struct mailbox *box)
 {
 	struct mailbox_transaction_context *trans;
@@ -286,6 +301,7 @@ static void test_mail_random_access(void)
 		"",
 		"flags",
 		"mime.parts",
+		"mime.parts.data",
 		"imap.body",
 		"imap.bodystructure",
 	};
@@ -437,12 +453,419 @@ static void test_bodystructure_reparsing(void)
 	test_end();
 }
 
+static void test_cached_message_parts_data(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+		.extra_input = (const char *const[]) {
+			"mail_never_cache_fields=imap.envelope",
+			NULL
+		},
+	};
+	struct message_part *parts, *part;
+	const char *value;
+	uoff_t size;
+	unsigned int lines;
+
+	test_begin("mail cached message parts data");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+
+	struct mailbox *box =
+		mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+
+	test_mail_save(box,
+		       "From: Sender <sender@example.com>\r\n"
+		       "To: user@example.org\r\n"
+		       "Subject: parts\r\n"
+		       "Message-ID: <1@example.com>\r\n"
+		       "MIME-Version: 1.0\r\n"
+		       "Content-Type: multipart/mixed; boundary=\"b\"\r\n"
+		       "\r\n"
+		       "--b\r\n"
+		       "Content-Type: text/plain; charset=utf-8\r\n"
+		       "\r\n"
+		       "text\r\n"
+		       "--b\r\n"
+		       "Content-Type: message/rfc822\r\n"
+		       "\r\n"
+		       "From: inner@example.com\r\n"
+		       "Subject: inner\r\n"
+		       "\r\n"
+		       "inner body\r\n"
+		       "--b--\r\n");
+
+	/* everything is derived from the parts cached when the mail was
+	   saved, without opening the mail */
+	struct mailbox_transaction_context *trans =
+		mailbox_transaction_begin(box, 0, __func__);
+	struct mail *mail = mail_alloc(trans, MAIL_FETCH_IMAP_BODYSTRUCTURE |
+				       MAIL_FETCH_IMAP_ENVELOPE, NULL);
+	mail_set_seq(mail, 1);
+	test_assert(mail_get_special(mail, MAIL_FETCH_IMAP_ENVELOPE,
+				     &value) == 0);
+	test_assert_strcmp(value, "NIL \"parts\" "
+		"((\"Sender\" NIL \"sender\" \"example.com\")) "
+		"((\"Sender\" NIL \"sender\" \"example.com\")) "
+		"((\"Sender\" NIL \"sender\" \"example.com\")) "
+		"((NIL NIL \"user\" \"example.org\")) "
+		"NIL NIL NIL \"<1@example.com>\"");
+	test_assert(mail_get_special(mail, MAIL_FETCH_IMAP_BODYSTRUCTURE,
+				     &value) == 0);
+	test_assert_strcmp(value, "(\"text\" \"plain\" "
+		"(\"charset\" \"utf-8\") NIL NIL \"7bit\" 4 0 NIL NIL NIL NIL)"
+		"(\"message\" \"rfc822\" NIL NIL NIL \"7bit\" 53 "
+		"(NIL \"inner\" ((NIL NIL \"inner\" \"example.com\")) "
+		"((NIL NIL \"inner\" \"example.com\")) "
+		"((NIL NIL \"inner\" \"example.com\")) NIL NIL NIL NIL NIL) "
+		"(\"text\" \"plain\" (\"charset\" \"us-ascii\") NIL NIL "
+		"\"7bit\" 10 0 NIL NIL NIL NIL) 3 NIL NIL NIL NIL) "
+		"\"mixed\" (\"boundary\" \"b\") NIL NIL NIL");
+	test_assert(mail_get_special(mail, MAIL_FETCH_IMAP_BODY, &value) == 0);
+	test_assert(mail_get_parts(mail, &parts) == 0);
+	/* the root part's envelope isn't in its part data, or it would be
+	   seen as the envelope of a message/rfc822 part */
+	test_assert(parts->data->envelope == NULL);
+	part = parts->children->next->children;
+	test_assert_strcmp(part->data->envelope->subject, "inner");
+	test_assert(mail_get_binary_size(mail, parts->children, FALSE,
+					 &size, &lines) == 0);
+	test_assert(size == 4 && lines == 0);
+	test_assert(!mail->mail_stream_opened);
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
+static void test_mail_fetch_cache_prefetch(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+		.extra_input = (const char *const[]) {
+			"mail_always_cache_fields=imap.envelope hdr.subject",
+			/* the envelope would be derived from it instead of
+			   imap.envelope */
+			"mail_never_cache_fields=mime.parts.data",
+			NULL
+		},
+	};
+	const char *const wanted_headers[] = { "Subject", NULL };
+	struct mailbox_header_lookup_ctx *headers;
+	struct mail_search_args *search_args;
+	struct mail_search_context *search_ctx;
+	const struct mail_cache_prefetch *prefetch;
+	const struct mail_cache_lookup_batch_value *batch_value;
+	struct mail *mail;
+	const char *value;
+	unsigned int i;
+
+	test_begin("mail fetch cache prefetch");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+
+	struct mailbox *box =
+		mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	for (i = 1; i <= 5; i++) {
+		test_mail_save(box, t_strdup_printf(
+			"From: user@example.com\nSubject: s%u\n\nbody\n", i));
+	}
+
+	/* FETCH 2:4 (ENVELOPE BODY.PEEK[HEADER.FIELDS (Subject)]). The first
+	   FETCH adds imap.envelope to the cache, and the second one gets
+	   all the fields from the prefetch. */
+	for (unsigned int n = 0; n < 2; n++) {
+		struct mailbox_transaction_context *trans =
+			mailbox_transaction_begin(box, 0, __func__);
+		search_args = mail_search_build_init();
+		mail_search_build_add_seqset(search_args, 2, 4);
+		mail_search_args_init(search_args, box, FALSE, NULL);
+		headers = mailbox_header_lookup_init(box, wanted_headers);
+		search_ctx = mailbox_search_init(trans, search_args, NULL,
+						 MAIL_FETCH_IMAP_ENVELOPE,
+						 headers);
+		mail_search_args_unref(&search_args);
+		mailbox_header_lookup_unref(&headers);
+
+		i = 2;
+		while (mailbox_search_next(search_ctx, &mail)) {
+			prefetch = trans->cache_view->prefetch;
+			test_assert_idx(prefetch != NULL &&
+					array_count(&prefetch->seqs) == 3, i);
+			if (n == 1 && prefetch != NULL) {
+				array_foreach(&prefetch->values, batch_value) {
+					test_assert_idx(batch_value->size !=
+							(uint32_t)-1, i);
+				}
+			}
+			test_assert_idx(mail->seq == i, i);
+			test_assert_idx(mail_get_special(mail,
+					MAIL_FETCH_IMAP_ENVELOPE, &value) == 0, i);
+			test_assert_strcmp_idx(value, t_strdup_printf(
+				"NIL \"s%u\" "
+				"((NIL NIL \"user\" \"example.com\")) "
+				"((NIL NIL \"user\" \"example.com\")) "
+				"((NIL NIL \"user\" \"example.com\")) "
+				"NIL NIL NIL NIL NIL", i), i);
+			test_assert_idx(mail_get_first_header(mail, "Subject",
+							      &value) == 1, i);
+			test_assert_strcmp_idx(value,
+					       t_strdup_printf("s%u", i), i);
+			test_assert_idx(n == 0 || !mail->mail_stream_opened, i);
+			i++;
+		}
+		test_assert(i == 5);
+		test_assert(mailbox_search_deinit(&search_ctx) == 0);
+		test_assert(mailbox_transaction_commit(&trans) == 0);
+	}
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
+static const char *test_mail_sort_date(struct mailbox *box)
+{
+	static const enum mail_sort_type sort_program[] = {
+		MAIL_SORT_DATE, MAIL_SORT_END
+	};
+	struct mailbox_transaction_context *trans;
+	struct mail_search_args *search_args;
+	struct mail_search_context *search_ctx;
+	struct mail *mail;
+	string_t *str = t_str_new(32);
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	search_args = mail_search_build_init();
+	mail_search_build_add_all(search_args);
+	mail_search_args_init(search_args, box, FALSE, NULL);
+	search_ctx = mailbox_search_init(trans, search_args, sort_program,
+					 0, NULL);
+	mail_search_args_unref(&search_args);
+	while (mailbox_search_next(search_ctx, &mail))
+		str_printfa(str, "%u ", mail->uid);
+	test_assert(mailbox_search_deinit(&search_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("Failed to sync mailbox: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	return str_c(str);
+}
+
+static uint32_t
+test_mail_sort_date_ext(struct mailbox *box, uint32_t ext_id, uint32_t seq)
+{
+	const void *data;
+	bool expunged;
+
+	mail_index_lookup_ext(box->view, seq, ext_id, &data, &expunged);
+	return data == NULL ? 0 : *(const uint32_t *)data;
+}
+
+static void test_mail_sort_date_index(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+		.extra_input = (const char *const[]) {
+			/* the cached received dates are only 32bit */
+			"mail_never_cache_fields=date.received",
+			NULL
+		},
+	};
+	struct mailbox_transaction_context *trans;
+	uint32_t ext_id, sort_date;
+
+	test_begin("mail sort date index");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+
+	struct mailbox *box =
+		mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_mail_save_received(box, "Date: Wed, 3 Jan 2024 00:00:00 +0000\n"
+				"\nbody\n", 1);
+	test_mail_save_received(box, "Date: Mon, 1 Jan 2024 00:00:00 +0000\n"
+				"\nbody\n", 1);
+	/* without a Date header the received date is used */
+	test_mail_save_received(box, "Subject: 2 Jan 2024\n\nbody\n",
+				1704153600);
+	/* dates that can't be stored in the index */
+	test_mail_save_received(box, "Subject: 0\n\nbody\n", 0);
+	test_mail_save_received(box, "Subject: 2106+\n\nbody\n",
+				(time_t)UINT32_MAX + 1);
+
+	/* the first sort stores the dates in the index */
+	test_assert_strcmp(test_mail_sort_date(box), "4 2 3 1 5 ");
+	test_assert(mail_index_ext_lookup(box->index, "sort-d", &ext_id));
+	test_assert(test_mail_sort_date_ext(box, ext_id, 1) == 1704240000);
+	test_assert(test_mail_sort_date_ext(box, ext_id, 2) == 1704067200);
+	test_assert(test_mail_sort_date_ext(box, ext_id, 3) == 1704153600);
+	test_assert(test_mail_sort_date_ext(box, ext_id, 4) == 0);
+	test_assert(test_mail_sort_date_ext(box, ext_id, 5) == 0);
+
+	/* the following sorts use the stored dates instead of looking up
+	   the headers. change one of them to see that it's used. */
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	sort_date = 1;
+	mail_index_update_ext(trans->itrans, 1, ext_id, &sort_date, NULL);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_assert_strcmp(test_mail_sort_date(box), "4 1 2 3 5 ");
+	test_assert(test_mail_sort_date_ext(box, ext_id, 1) == 1);
+	test_assert(test_mail_sort_date_ext(box, ext_id, 4) == 0);
+	test_assert(test_mail_sort_date_ext(box, ext_id, 5) == 0);
+	mailbox_free(&box);
+
+	/* unchanged after reopening */
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_assert_strcmp(test_mail_sort_date(box), "4 1 2 3 5 ");
+	mailbox_free(&box);
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
+static void
+test_mail_thread_append(struct mail_thread_iterate_context *iter,
+			string_t *str)
+{
+	struct mail_thread_iterate_context *child_iter;
+	const struct mail_thread_child_node *node;
+
+	while ((node = mail_thread_iterate_next(iter, &child_iter)) != NULL) {
+		str_printfa(str, "(%u", node->uid);
+		if (child_iter != NULL) {
+			test_mail_thread_append(child_iter, str);
+			test_assert(mail_thread_iterate_deinit(&child_iter) == 0);
+		}
+		str_append_c(str, ')');
+	}
+}
+
+static const char *test_mail_thread(struct mailbox *box)
+{
+	struct mail_thread_context *ctx;
+	struct mail_thread_iterate_context *iter;
+	string_t *str = t_str_new(64);
+
+	if (mail_thread_init(box, NULL, &ctx) < 0)
+		i_fatal("Failed to thread mailbox: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	iter = mail_thread_iterate_init(ctx, MAIL_THREAD_REFERENCES, FALSE);
+	test_mail_thread_append(iter, str);
+	test_assert(mail_thread_iterate_deinit(&iter) == 0);
+	mail_thread_deinit(&ctx);
+	return str_c(str);
+}
+
+static void test_mail_thread_expunge(struct mailbox *box, uint32_t seq)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, seq);
+	mail_expunge(mail);
+	mail_free(&mail);
+	if (mailbox_transaction_commit(&trans) < 0)
+		i_fatal("Failed to expunge mail: %s",
+			mailbox_get_last_internal_error(box, NULL));
+}
+
+static void test_mail_thread_incremental(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+	};
+	string_t *no_msgid_threads = t_str_new(128);
+	struct mailbox *box;
+
+	test_begin("mail thread incremental update");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_mail_save(box, "Date: Mon, 1 Jan 2024 00:00:01 +0000\n"
+		       "Message-ID: <a@example.com>\n\nbody\n");
+	test_mail_save(box, "Date: Mon, 1 Jan 2024 00:00:02 +0000\n"
+		       "Message-ID: <b@example.com>\n"
+		       "References: <a@example.com>\n\nbody\n");
+	test_mail_save(box, "Date: Mon, 1 Jan 2024 00:00:03 +0000\n"
+		       "Message-ID: <c@example.com>\n"
+		       "References: <a@example.com> <b@example.com>\n"
+		       "\nbody\n");
+	test_mail_save(box, "Date: Mon, 1 Jan 2024 00:00:04 +0000\n"
+		       "Message-ID: <d@example.com>\n\nbody\n");
+	test_assert_strcmp(test_mail_thread(box), "(1(2(3)))(4)");
+	test_assert(array_count(&box->search_results) == 1);
+
+	/* expunge messages that no other message refers to and append new
+	   ones. the messages without Message-ID make the sync renumber the
+	   thread index and drop the expunged messages from it. the cached
+	   thread is still kept. */
+	test_mail_thread_expunge(box, 4);
+	test_mail_thread_expunge(box, 3);
+	test_mail_save(box, "Date: Mon, 1 Jan 2024 00:00:05 +0000\n"
+		       "Message-ID: <e@example.com>\n"
+		       "References: <a@example.com> <b@example.com>\n"
+		       "\nbody\n");
+	for (unsigned int i = 6; i <= 21; i++) {
+		test_mail_save(box, t_strdup_printf(
+			"Date: Mon, 1 Jan 2024 00:00:%02u +0000\n\nbody\n", i));
+		str_printfa(no_msgid_threads, "(%u)", i);
+	}
+	test_assert(array_count(&box->search_results) == 1);
+	test_assert_strcmp(test_mail_thread(box),
+		t_strconcat("(1(2(5)))", str_c(no_msgid_threads), NULL));
+	test_assert(array_count(&box->search_results) == 1);
+
+	test_mail_thread_expunge(box, 3);
+	test_mail_save(box, "Date: Mon, 1 Jan 2024 00:00:30 +0000\n"
+		       "Message-ID: <f@example.com>\n"
+		       "References: <a@example.com>\n\nbody\n");
+	test_assert(array_count(&box->search_results) == 1);
+	test_assert_strcmp(test_mail_thread(box),
+		t_strconcat("(1(2)(22))", str_c(no_msgid_threads), NULL));
+	test_assert(array_count(&box->search_results) == 1);
+	const char *thread = t_strdup(test_mail_thread(box));
+	mailbox_free(&box);
+
+	/* the result is the same as when threading from scratch */
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_assert_strcmp(test_mail_thread(box), thread);
+	mailbox_free(&box);
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
 int main(int argc, char **argv)
 {
 	void (*const tests[])(void) = {
 		test_mail_random_access,
 		test_attachment_flags_during_header_fetch,
 		test_bodystructure_reparsing,
+		test_cached_message_parts_data,
+		test_mail_fetch_cache_prefetch,
+		test_mail_sort_date_index,
+		test_mail_thread_incremental,
 		NULL
 	};
 	int ret;
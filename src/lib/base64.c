@@ -4,6 +4,331 @@
 #include "base64.h"
 #include "buffer.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  include <immintrin.h>
+#  define BASE64_HAVE_X86_SIMD
+#endif
+
+/*
+ * SIMD kernels
+ */
+
+/* The SIMD kernels convert the bulk of the data for the "base64" and
+   "base64url" schemes. They're built for SSSE3 and AVX2 regardless of the
+   compiler flags, and the best one the CPU supports is picked at runtime.
+   Whatever they leave unconverted is handled by the generic code. */
+
+#ifdef BASE64_HAVE_X86_SIMD
+#define BASE64_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define BASE64_TARGET_AVX2 __attribute__((target("avx2")))
+
+enum base64_simd_level {
+	BASE64_SIMD_UNKNOWN = 0,
+	BASE64_SIMD_NONE,
+	BASE64_SIMD_SSSE3,
+	BASE64_SIMD_AVX2,
+};
+
+static enum base64_simd_level base64_simd_level_get(void)
+{
+	static enum base64_simd_level level = BASE64_SIMD_UNKNOWN;
+
+	if (likely(level != BASE64_SIMD_UNKNOWN))
+		return level;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		level = BASE64_SIMD_AVX2;
+	else if (__builtin_cpu_supports("ssse3"))
+		level = BASE64_SIMD_SSSE3;
+	else
+		level = BASE64_SIMD_NONE;
+	return level;
+}
+
+/* Encoding: Every 3 input bytes are spread to 4 bytes containing the 6-bit
+   values using a shuffle and multiplications. The values are then mapped to
+   the alphabet by adding an offset looked up for each value range. */
+#define BASE64_ENCODE_SHUFFLE \
+	10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1
+#define BASE64_ENCODE_OFFSETS(encmap) \
+	'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+	(encmap)[62] - 62, (encmap)[63] - 63, 'A', 0, 0
+
+static size_t BASE64_TARGET_SSSE3
+base64_encode_ssse3(const struct base64_scheme *b64,
+		    const unsigned char *src, size_t src_size,
+		    unsigned char *dest, size_t dest_size)
+{
+	const __m128i shuffle = _mm_set_epi8(BASE64_ENCODE_SHUFFLE);
+	const __m128i offsets =
+		_mm_setr_epi8(BASE64_ENCODE_OFFSETS(b64->encmap));
+	size_t src_pos = 0, dest_pos = 0;
+	__m128i in, t0, t1, idx, res;
+
+	/* each round reads 16 bytes, but converts only 12 of them */
+	for (; src_size - src_pos >= 16 && dest_size - dest_pos >= 16;
+	     src_pos += 12, dest_pos += 16) {
+		in = _mm_loadu_si128((const void *)(src + src_pos));
+		in = _mm_shuffle_epi8(in, shuffle);
+		t0 = _mm_mulhi_epu16(
+			_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+			_mm_set1_epi32(0x04000040));
+		t1 = _mm_mullo_epi16(
+			_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+			_mm_set1_epi32(0x01000010));
+		idx = _mm_or_si128(t0, t1);
+
+		/* 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10,
+		   62 -> 11, 63 -> 12 */
+		res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+		res = _mm_or_si128(res, _mm_and_si128(
+			_mm_cmpgt_epi8(_mm_set1_epi8(26), idx),
+			_mm_set1_epi8(13)));
+		res = _mm_add_epi8(_mm_shuffle_epi8(offsets, res), idx);
+		_mm_storeu_si128((void *)(dest + dest_pos), res);
+	}
+	return src_pos;
+}
+
+static size_t BASE64_TARGET_AVX2
+base64_encode_avx2(const struct base64_scheme *b64,
+		   const unsigned char *src, size_t src_size,
+		   unsigned char *dest, size_t dest_size)
+{
+	const __m256i shuffle = _mm256_set_epi8(BASE64_ENCODE_SHUFFLE,
+						BASE64_ENCODE_SHUFFLE);
+	const __m256i offsets = _mm256_setr_epi8(
+		BASE64_ENCODE_OFFSETS(b64->encmap),
+		BASE64_ENCODE_OFFSETS(b64->encmap));
+	size_t src_pos = 0, dest_pos = 0;
+	__m256i in, t0, t1, idx, res;
+
+	/* each 128-bit lane converts 12 bytes, the second lane starting
+	   from offset 12 */
+	for (; src_size - src_pos >= 28 && dest_size - dest_pos >= 32;
+	     src_pos += 24, dest_pos += 32) {
+		in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_loadu_si128((const void *)(src + src_pos))),
+			_mm_loadu_si128((const void *)(src + src_pos + 12)), 1);
+		in = _mm256_shuffle_epi8(in, shuffle);
+		t0 = _mm256_mulhi_epu16(
+			_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+			_mm256_set1_epi32(0x04000040));
+		t1 = _mm256_mullo_epi16(
+			_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+			_mm256_set1_epi32(0x01000010));
+		idx = _mm256_or_si256(t0, t1);
+
+		res = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		res = _mm256_or_si256(res, _mm256_and_si256(
+			_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx),
+			_mm256_set1_epi8(13)));
+		res = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, res), idx);
+		_mm256_storeu_si256((void *)(dest + dest_pos), res);
+	}
+	return src_pos;
+}
+
+/* Decoding: The characters are validated and mapped to their 6-bit values
+   by checking which range each one belongs to. Bytes >= 0x80 are negative,
+   so they never match any of the ranges. The 6-bit values are then packed
+   to 3 bytes using multiply-adds and a shuffle. */
+#define BASE64_DECODE_SHUFFLE \
+	2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+static size_t BASE64_TARGET_SSSE3
+base64_decode_ssse3(const struct base64_scheme *b64,
+		    const unsigned char *src, size_t src_size,
+		    unsigned char *dest, size_t dest_size)
+{
+	const __m128i c62 = _mm_set1_epi8(b64->encmap[62]);
+	const __m128i c63 = _mm_set1_epi8(b64->encmap[63]);
+	const __m128i shuffle = _mm_setr_epi8(BASE64_DECODE_SHUFFLE);
+	size_t src_pos = 0, dest_pos = 0;
+	__m128i in, upper, lower, digit, is62, is63, shift;
+
+	/* each round writes 16 bytes, but only 12 of them are valid */
+	for (; src_size - src_pos >= 16 && dest_size - dest_pos >= 16;
+	     src_pos += 16, dest_pos += 12) {
+		in = _mm_loadu_si128((const void *)(src + src_pos));
+		upper = _mm_and_si128(
+			_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+			_mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), in));
+		lower = _mm_and_si128(
+			_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+			_mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), in));
+		digit = _mm_and_si128(
+			_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+			_mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), in));
+		is62 = _mm_cmpeq_epi8(in, c62);
+		is63 = _mm_cmpeq_epi8(in, c63);
+		if (_mm_movemask_epi8(_mm_or_si128(
+			_mm_or_si128(upper, lower),
+			_mm_or_si128(digit, _mm_or_si128(is62, is63)))) != 0xffff)
+			break;
+
+		shift = _mm_or_si128(
+			_mm_or_si128(
+				_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+				_mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+			_mm_or_si128(
+				_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+				_mm_or_si128(
+					_mm_and_si128(is62, _mm_sub_epi8(
+						_mm_set1_epi8(62), c62)),
+					_mm_and_si128(is63, _mm_sub_epi8(
+						_mm_set1_epi8(63), c63)))));
+		in = _mm_add_epi8(in, shift);
+
+		in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+		in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+		in = _mm_shuffle_epi8(in, shuffle);
+		_mm_storeu_si128((void *)(dest + dest_pos), in);
+	}
+	return src_pos;
+}
+
+static size_t BASE64_TARGET_AVX2
+base64_decode_avx2(const struct base64_scheme *b64,
+		   const unsigned char *src, size_t src_size,
+		   unsigned char *dest, size_t dest_size)
+{
+	const __m256i c62 = _mm256_set1_epi8(b64->encmap[62]);
+	const __m256i c63 = _mm256_set1_epi8(b64->encmap[63]);
+	const __m256i shuffle = _mm256_setr_epi8(BASE64_DECODE_SHUFFLE,
+						 BASE64_DECODE_SHUFFLE);
+	size_t src_pos = 0, dest_pos = 0;
+	__m256i in, upper, lower, digit, is62, is63, shift;
+
+	/* each 128-bit lane produces 12 bytes. the lanes are written
+	   separately, so each round writes 28 bytes of which 24 are valid. */
+	for (; src_size - src_pos >= 32 && dest_size - dest_pos >= 28;
+	     src_pos += 32, dest_pos += 24) {
+		in = _mm256_loadu_si256((const void *)(src + src_pos));
+		upper = _mm256_and_si256(
+			_mm256_cmpgt_epi8(in, _mm256_set1_epi8('A' - 1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), in));
+		lower = _mm256_and_si256(
+			_mm256_cmpgt_epi8(in, _mm256_set1_epi8('a' - 1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), in));
+		digit = _mm256_and_si256(
+			_mm256_cmpgt_epi8(in, _mm256_set1_epi8('0' - 1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), in));
+		is62 = _mm256_cmpeq_epi8(in, c62);
+		is63 = _mm256_cmpeq_epi8(in, c63);
+		if ((unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_or_si256(upper, lower),
+			_mm256_or_si256(digit, _mm256_or_si256(is62, is63)))) !=
+		    0xffffffffU)
+			break;
+
+		shift = _mm256_or_si256(
+			_mm256_or_si256(
+				_mm256_and_si256(upper,
+						 _mm256_set1_epi8(-'A')),
+				_mm256_and_si256(lower,
+						 _mm256_set1_epi8(26 - 'a'))),
+			_mm256_or_si256(
+				_mm256_and_si256(digit,
+						 _mm256_set1_epi8(52 - '0')),
+				_mm256_or_si256(
+					_mm256_and_si256(is62, _mm256_sub_epi8(
+						_mm256_set1_epi8(62), c62)),
+					_mm256_and_si256(is63, _mm256_sub_epi8(
+						_mm256_set1_epi8(63), c63)))));
+		in = _mm256_add_epi8(in, shift);
+
+		in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+		in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+		in = _mm256_shuffle_epi8(in, shuffle);
+		_mm_storeu_si128((void *)(dest + dest_pos),
+				 _mm256_castsi256_si128(in));
+		_mm_storeu_si128((void *)(dest + dest_pos + 12),
+				 _mm256_extracti128_si256(in, 1));
+	}
+	return src_pos;
+}
+#endif
+
+/* Encode as much of src as the SIMD kernels can. Returns the number of
+   bytes encoded from src. The number of characters written to dest is 4/3
+   of that. */
+static size_t
+base64_encode_simd(const struct base64_scheme *b64 ATTR_UNUSED,
+		   const unsigned char *src ATTR_UNUSED,
+		   size_t src_size ATTR_UNUSED,
+		   unsigned char *dest ATTR_UNUSED,
+		   size_t dest_size ATTR_UNUSED)
+{
+	size_t src_pos = 0;
+#ifdef BASE64_HAVE_X86_SIMD
+	size_t dest_pos;
+
+	if (b64 != &base64_scheme && b64 != &base64url_scheme)
+		return 0;
+
+	switch (base64_simd_level_get()) {
+	case BASE64_SIMD_UNKNOWN:
+		i_unreached();
+	case BASE64_SIMD_NONE:
+		break;
+	case BASE64_SIMD_AVX2:
+		src_pos = base64_encode_avx2(b64, src, src_size,
+					     dest, dest_size);
+		/* fall through */
+	case BASE64_SIMD_SSSE3:
+		dest_pos = src_pos / 3 * 4;
+		src_pos += base64_encode_ssse3(b64, src + src_pos,
+					       src_size - src_pos,
+					       dest + dest_pos,
+					       dest_size - dest_pos);
+		break;
+	}
+#endif
+	return src_pos;
+}
+
+/* Decode as much of src as the SIMD kernels can. They stop at the first
+   block containing a character outside the alphabet. Returns the number of
+   characters decoded from src. The number of bytes written to dest is 3/4
+   of that. */
+static size_t
+base64_decode_simd(const struct base64_scheme *b64 ATTR_UNUSED,
+		   const unsigned char *src ATTR_UNUSED,
+		   size_t src_size ATTR_UNUSED,
+		   unsigned char *dest ATTR_UNUSED,
+		   size_t dest_size ATTR_UNUSED)
+{
+	size_t src_pos = 0;
+#ifdef BASE64_HAVE_X86_SIMD
+	size_t dest_pos;
+
+	if (b64 != &base64_scheme && b64 != &base64url_scheme)
+		return 0;
+
+	switch (base64_simd_level_get()) {
+	case BASE64_SIMD_UNKNOWN:
+		i_unreached();
+	case BASE64_SIMD_NONE:
+		break;
+	case BASE64_SIMD_AVX2:
+		src_pos = base64_decode_avx2(b64, src, src_size,
+					     dest, dest_size);
+		/* fall through */
+	case BASE64_SIMD_SSSE3:
+		dest_pos = src_pos / 4 * 3;
+		src_pos += base64_decode_ssse3(b64, src + src_pos,
+					       src_size - src_pos,
+					       dest + dest_pos,
+					       dest_size - dest_pos);
+		break;
+	}
+#endif
+	return src_pos;
+}
+
 /*
  * Low-level Base64 encoder
  */
@@ -218,7 +543,7 @@ base64_encode_more_data(struct base64_encoder *enc,
 {
 	const struct base64_scheme *b64 = enc->b64;
 	const char *b64enc = b64->encmap;
-	size_t res_size;
+	size_t res_size, n;
 	unsigned char *start, *ptr, *end;
 	size_t src_pos;
 
@@ -304,6 +629,10 @@ base64_encode_more_data(struct base64_encoder *enc,
 	}
 
 	/* Convert the bulk */
+	n = base64_encode_simd(b64, src_c + src_pos, src_size - src_pos,
+			       ptr, end - ptr);
+	src_pos += n;
+	ptr += n / 3 * 4;
 	for (; src_size - src_pos > 2 && &ptr[3] < end;
 	     src_pos += 3, ptr += 4) {
 		ptr[0] = b64enc[src_c[src_pos] >> 2];
@@ -584,6 +913,42 @@ bool base64_encode_finish(struct base64_encoder *enc, buffer_t *dest)
 #define IS_EMPTY(c) \
 	((c) == '\n' || (c) == '\r' || (c) == ' ' || (c) == '\t')
 
+/* Decode as many complete 4 character groups from the beginning of src as
+   possible, stopping at the first group that contains a character outside
+   the alphabet (e.g. whitespace or padding). Returns the number of
+   characters decoded. */
+static size_t
+base64_decode_bulk(const struct base64_scheme *b64,
+		   const unsigned char *src_c, size_t src_size,
+		   size_t *dst_avail, buffer_t *dest)
+{
+	const unsigned char *decmap = b64->decmap;
+	unsigned char *dst, a, b, c, d;
+	size_t src_pos, dst_pos, dst_size;
+
+	dst_size = I_MIN(src_size / 4, *dst_avail / 3) * 3;
+	if (dst_size == 0)
+		return 0;
+	dst = buffer_append_space_unsafe(dest, dst_size);
+
+	src_pos = base64_decode_simd(b64, src_c, src_size, dst, dst_size);
+	dst_pos = src_pos / 4 * 3;
+	for (; dst_size - dst_pos >= 3; src_pos += 4, dst_pos += 3) {
+		a = decmap[src_c[src_pos]];
+		b = decmap[src_c[src_pos+1]];
+		c = decmap[src_c[src_pos+2]];
+		d = decmap[src_c[src_pos+3]];
+		if (((a | b | c | d) & 0xc0) != 0)
+			break;
+		dst[dst_pos] = (a << 2) | (b >> 4);
+		dst[dst_pos+1] = (b << 4) | (c >> 2);
+		dst[dst_pos+2] = (c << 6) | d;
+	}
+	buffer_set_used_size(dest, dest->used - (dst_size - dst_pos));
+	*dst_avail -= dst_pos;
+	return src_pos;
+}
+
 static inline void
 base64_skip_whitespace(struct base64_decoder *dec, const unsigned char *src_c,
 		       size_t src_size, size_t *src_pos)
@@ -658,8 +1023,18 @@ int base64_decode_more(struct base64_decoder *dec,
 	}
 
 	for (; !dec->seen_padding && src_pos < src_size; src_pos++) {
-		unsigned char in = src_c[src_pos];
-		unsigned char dm = b64->decmap[in];
+		unsigned char in, dm;
+
+		if (dec->sub_pos == 0 && src_size - src_pos >= 4) {
+			/* fast path for the complete groups */
+			src_pos += base64_decode_bulk(b64, src_c + src_pos,
+						      src_size - src_pos,
+						      &dst_avail, dest);
+			if (src_pos == src_size)
+				break;
+		}
+		in = src_c[src_pos];
+		dm = b64->decmap[in];
 
 		if (dm == 0xff) {
 			if (no_whitespace) {
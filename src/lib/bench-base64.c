@@ -0,0 +1,110 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "base64.h"
+#include "strnum.h"
+#include "time-util.h"
+
+#include <stdio.h>
+
+/**
+ * Measures the base64 encoding and decoding throughput with MIME style
+ * output: 76 character lines separated by CRLF. The input is random data,
+ * so it's encoded and decoded in blocks the same way as attachments are
+ * processed by the istreams.
+ */
+
+#define BENCH_BLOCK_SIZE 8192
+
+static void bench_print(const char *name, uint64_t ts_0, uint64_t ts_1,
+			uint64_t bytes)
+{
+	printf("%-8s %8.1lf MB/s\n", name,
+	       (double)bytes / 1048576.0 / ((double)(ts_1 - ts_0) / 1e9));
+}
+
+static void bench_base64(size_t size, unsigned int rounds)
+{
+	struct base64_encoder enc;
+	struct base64_decoder dec;
+	buffer_t *data, *encoded, *decoded;
+	uint64_t ts_0, ts_1;
+	unsigned int i;
+	size_t pos, n;
+
+	data = buffer_create_dynamic(default_pool, size);
+	for (i = 0; i < size; i++)
+		buffer_append_c(data, i_rand_uchar());
+	encoded = buffer_create_dynamic(default_pool,
+					MAX_BASE64_ENCODED_SIZE(size) * 2);
+	decoded = buffer_create_dynamic(default_pool, size);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < rounds; i++) {
+		buffer_set_used_size(encoded, 0);
+		base64_encode_init(&enc, &base64_scheme,
+				   BASE64_ENCODE_FLAG_CRLF, 76);
+		for (pos = 0; pos < size; pos += n) {
+			n = I_MIN(size - pos, BENCH_BLOCK_SIZE);
+			if (!base64_encode_more(&enc, CONST_PTR_OFFSET(
+					data->data, pos), n, NULL, encoded))
+				i_unreached();
+		}
+		if (!base64_encode_finish(&enc, encoded))
+			i_unreached();
+	}
+	ts_1 = i_nanoseconds();
+	bench_print("encode", ts_0, ts_1, (uint64_t)size * rounds);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < rounds; i++) {
+		buffer_set_used_size(decoded, 0);
+		base64_decode_init(&dec, &base64_scheme, 0);
+		for (pos = 0; pos < encoded->used; pos += n) {
+			n = I_MIN(encoded->used - pos, BENCH_BLOCK_SIZE);
+			if (base64_decode_more(&dec, CONST_PTR_OFFSET(
+					encoded->data, pos), n,
+					NULL, decoded) < 0)
+				i_unreached();
+		}
+		if (base64_decode_finish(&dec) < 0)
+			i_unreached();
+	}
+	ts_1 = i_nanoseconds();
+	bench_print("decode", ts_0, ts_1, (uint64_t)encoded->used * rounds);
+	i_assert(buffer_cmp(data, decoded));
+
+	buffer_free(&data);
+	buffer_free(&encoded);
+	buffer_free(&decoded);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [size [rounds]]\n", prog);
+	fprintf(stderr, "Runs 100 rounds of 1 MB if nothing given\n");
+	exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int size = 1024*1024, rounds = 100;
+
+	lib_init();
+
+	if (argc >= 2) {
+		if (str_to_uint(argv[1], &size) < 0 ||
+		    (argc >= 3 && str_to_uint(argv[2], &rounds) < 0) ||
+		    argc > 3) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+		}
+	}
+
+	printf("%u bytes, %u rounds\n\n", size, rounds);
+	bench_base64(size, rounds);
+
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,186 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "hash.h"
+#include "strnum.h"
+#include "time-util.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/**
+ * Compares the chained hash tables created with hash_table_create() against
+ * the open addressing tables created with hash_table_create_flat(). Measures
+ * inserts, successful and failed lookups, iteration and removals with both
+ * direct (pointer) keys and string keys. Memory usage is the growth of the
+ * process's maximum RSS while the keys are inserted, so each test is run in
+ * its own child process.
+ */
+
+enum bench_key_type {
+	BENCH_KEY_DIRECT,
+	BENCH_KEY_STRING,
+};
+
+static long bench_maxrss_kb(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		i_fatal("getrusage() failed: %m");
+	return usage.ru_maxrss;
+}
+
+static double bench_ns_per_op(uint64_t ts_0, uint64_t ts_1, unsigned int count)
+{
+	return (double)(ts_1 - ts_0) / (double)count;
+}
+
+static void bench_hash(bool flat, enum bench_key_type key_type,
+		       unsigned int count)
+{
+	HASH_TABLE(char *, void *) hash;
+	struct hash_iterate_context *iter;
+	char **keys, **missing_keys, *key;
+	unsigned int i, j, iter_count = 0;
+	void *value;
+	uint64_t ts_0, ts_1;
+	long rss_0, rss_1;
+
+	keys = i_new(char *, count);
+	missing_keys = i_new(char *, count);
+	for (i = 0; i < count; i++) {
+		if (key_type == BENCH_KEY_DIRECT) {
+			keys[i] = POINTER_CAST(i * 2 + 2);
+			missing_keys[i] = POINTER_CAST(i * 2 + 1);
+		} else {
+			keys[i] = i_strdup_printf("user%u@example.com", i);
+			missing_keys[i] = i_strdup_printf("user%u@example.org", i);
+		}
+	}
+	/* lookup in random order */
+	for (i = count; i > 1; i--) {
+		j = i_rand_limit(i);
+		key = keys[i - 1]; keys[i - 1] = keys[j]; keys[j] = key;
+	}
+
+	rss_0 = bench_maxrss_kb();
+	ts_0 = i_nanoseconds();
+	if (key_type == BENCH_KEY_DIRECT) {
+		if (flat)
+			hash_table_create_direct_flat(&hash, default_pool, 0);
+		else
+			hash_table_create_direct(&hash, default_pool, 0);
+	} else {
+		if (flat)
+			hash_table_create_flat(&hash, default_pool, 0, str_hash, strcmp);
+		else
+			hash_table_create(&hash, default_pool, 0, str_hash, strcmp);
+	}
+	for (i = 0; i < count; i++)
+		hash_table_insert(hash, keys[i], POINTER_CAST(1));
+	ts_1 = i_nanoseconds();
+	rss_1 = bench_maxrss_kb();
+
+	printf("%-7s %-6s insert: %6.1lf ns/op, memory: %ld kB\n",
+	       flat ? "flat" : "chained",
+	       key_type == BENCH_KEY_DIRECT ? "direct" : "string",
+	       bench_ns_per_op(ts_0, ts_1, count), rss_1 - rss_0);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++) {
+		if (hash_table_lookup(hash, keys[i]) == NULL)
+			i_unreached();
+	}
+	ts_1 = i_nanoseconds();
+	printf("\tlookup: %6.1lf ns/op\n", bench_ns_per_op(ts_0, ts_1, count));
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++) {
+		if (hash_table_lookup(hash, missing_keys[i]) != NULL)
+			i_unreached();
+	}
+	ts_1 = i_nanoseconds();
+	printf("\tmissing lookup: %6.1lf ns/op\n",
+	       bench_ns_per_op(ts_0, ts_1, count));
+
+	ts_0 = i_nanoseconds();
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value))
+		iter_count++;
+	hash_table_iterate_deinit(&iter);
+	ts_1 = i_nanoseconds();
+	i_assert(iter_count == count);
+	printf("\titerate: %6.1lf ns/op\n", bench_ns_per_op(ts_0, ts_1, count));
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++)
+		hash_table_remove(hash, keys[i]);
+	ts_1 = i_nanoseconds();
+	printf("\tremove: %6.1lf ns/op\n", bench_ns_per_op(ts_0, ts_1, count));
+	hash_table_destroy(&hash);
+
+	if (key_type == BENCH_KEY_STRING) {
+		for (i = 0; i < count; i++) {
+			i_free(keys[i]);
+			i_free(missing_keys[i]);
+		}
+	}
+	i_free(keys);
+	i_free(missing_keys);
+}
+
+static void bench_hash_fork(bool flat, enum bench_key_type key_type,
+			    unsigned int count)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		bench_hash(flat, key_type, count);
+		fflush(stdout);
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		i_fatal("Benchmark process failed");
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [key_count]\n", prog);
+	fprintf(stderr, "Runs with 1000000 keys if nothing given\n");
+	exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int count = 1000000;
+
+	lib_init();
+
+	if (argc == 2) {
+		if (str_to_uint(argv[1], &count) < 0 || count == 0) {
+			fprintf(stderr, "Invalid parameters\n");
+			print_usage(argv[0]);
+		}
+	} else if (argc != 1) {
+		print_usage(argv[0]);
+	}
+
+	printf("%u keys\n\n", count);
+	bench_hash_fork(FALSE, BENCH_KEY_DIRECT, count);
+	bench_hash_fork(TRUE, BENCH_KEY_DIRECT, count);
+	bench_hash_fork(FALSE, BENCH_KEY_STRING, count);
+	bench_hash_fork(TRUE, BENCH_KEY_STRING, count);
+
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,508 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+
+#include "lib.h"
+#include "array.h"
+#include "byteorder.h"
+#include "hash-flat.h"
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+/* The keys and values are stored in a single array of slots. Each slot has
+   a control byte, which is either EMPTY, DELETED or 7 bits of the key's
+   hash. The control bytes are probed in groups, so a lookup usually
+   needs to compare only the keys whose hash bits match and stops at the first
+   group containing an EMPTY slot. With SSE2 a group of 16 control bytes is
+   matched with a couple of instructions, otherwise groups of 8 bytes are
+   matched using 64bit integer arithmetic. */
+
+#define HASH_FLAT_CTRL_EMPTY 0x80
+#define HASH_FLAT_CTRL_DELETED 0xfe
+#define HASH_FLAT_CTRL_IS_FULL(c) (((c) & 0x80) == 0)
+
+#define HASH_FLAT_MIN_CAPACITY 32
+/* Maximum load factor is 7/8 */
+#define HASH_FLAT_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+#ifdef __SSE2__
+#  define HASH_FLAT_GROUP_WIDTH 16
+typedef unsigned int hash_flat_mask_t;
+#else
+#  define HASH_FLAT_GROUP_WIDTH 8
+#  define HASH_FLAT_LSBS 0x0101010101010101ULL
+#  define HASH_FLAT_MSBS 0x8080808080808080ULL
+typedef uint64_t hash_flat_mask_t;
+#endif
+
+struct hash_flat_slot {
+	void *key;
+	void *value;
+};
+
+struct hash_flat_old_slots {
+	struct hash_flat_slot *slots;
+	uint8_t *ctrl;
+	unsigned int capacity;
+};
+
+struct hash_flat {
+	/* capacity is a power of 2. ctrl points right after the slots in the
+	   same allocation. */
+	unsigned int initial_capacity, capacity;
+	unsigned int count, deleted_count;
+	struct hash_flat_slot *slots;
+	uint8_t *ctrl;
+
+	int frozen;
+	/* Increased whenever the table is resized while it's frozen. The old
+	   slots are kept in old_slots until the table is thawed, so that the
+	   existing iterators can continue using them. Removed keys are marked
+	   deleted also in the old slots. */
+	unsigned int resize_count;
+	ARRAY(struct hash_flat_old_slots) old_slots;
+
+	hash_callback_t *hash_cb;
+	hash_cmp_callback_t *key_compare_cb;
+};
+
+#ifdef __SSE2__
+static inline __m128i hash_flat_group_load(const uint8_t *ctrl)
+{
+	return _mm_loadu_si128((const void *)ctrl);
+}
+
+static inline hash_flat_mask_t
+hash_flat_group_match(const uint8_t *ctrl, uint8_t h2)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(hash_flat_group_load(ctrl),
+						_mm_set1_epi8((char)h2)));
+}
+
+static inline hash_flat_mask_t hash_flat_group_match_empty(const uint8_t *ctrl)
+{
+	return hash_flat_group_match(ctrl, HASH_FLAT_CTRL_EMPTY);
+}
+
+static inline hash_flat_mask_t hash_flat_group_match_free(const uint8_t *ctrl)
+{
+	/* EMPTY or DELETED */
+	return _mm_movemask_epi8(hash_flat_group_load(ctrl));
+}
+
+static inline unsigned int hash_flat_mask_first(hash_flat_mask_t mask)
+{
+	return __builtin_ctz(mask);
+}
+#else
+static inline hash_flat_mask_t
+hash_flat_group_match(const uint8_t *ctrl, uint8_t h2)
+{
+	/* This may give false positives, which are filtered out by the
+	   caller by checking the control byte. */
+	uint64_t x = le64_to_cpu_unaligned(ctrl) ^ (HASH_FLAT_LSBS * h2);
+
+	return (x - HASH_FLAT_LSBS) & ~x & HASH_FLAT_MSBS;
+}
+
+static inline hash_flat_mask_t hash_flat_group_match_empty(const uint8_t *ctrl)
+{
+	/* EMPTY is the only control byte with the highest bit set and the
+	   second lowest bit unset */
+	uint64_t x = le64_to_cpu_unaligned(ctrl);
+
+	return x & ~(x << 6) & HASH_FLAT_MSBS;
+}
+
+static inline hash_flat_mask_t hash_flat_group_match_free(const uint8_t *ctrl)
+{
+	return le64_to_cpu_unaligned(ctrl) & HASH_FLAT_MSBS;
+}
+
+static inline unsigned int hash_flat_mask_first(hash_flat_mask_t mask)
+{
+	return __builtin_ctzll(mask) / 8;
+}
+#endif
+
+static inline uint64_t hash_flat_mix(unsigned int hash)
+{
+	/* The hash functions aren't always well distributed, e.g. direct
+	   pointer hashes have the lowest bits zero. Multiplying spreads the
+	   bits so that both the group index and the 7 control bits are
+	   usable. */
+	return (uint64_t)hash * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline uint8_t hash_flat_h2(uint64_t mixed)
+{
+	return mixed >> 57;
+}
+
+static inline unsigned int
+hash_flat_first_group(unsigned int capacity, uint64_t mixed)
+{
+	return (unsigned int)(mixed >> 32) &
+		(capacity / HASH_FLAT_GROUP_WIDTH - 1);
+}
+
+static unsigned int hash_flat_capacity_for(unsigned int count)
+{
+	unsigned int capacity = HASH_FLAT_MIN_CAPACITY;
+
+	while (HASH_FLAT_MAX_LOAD(capacity) < count) {
+		i_assert(capacity < UINT_MAX / 2);
+		capacity *= 2;
+	}
+	return capacity;
+}
+
+static void hash_flat_alloc(struct hash_flat *flat, unsigned int capacity)
+{
+	size_t slots_size = sizeof(struct hash_flat_slot) * capacity;
+
+	flat->capacity = capacity;
+	flat->slots = i_malloc(MALLOC_ADD(slots_size, capacity));
+	flat->ctrl = PTR_OFFSET(flat->slots, slots_size);
+	memset(flat->ctrl, HASH_FLAT_CTRL_EMPTY, capacity);
+	flat->count = 0;
+	flat->deleted_count = 0;
+}
+
+struct hash_flat *
+hash_flat_create(unsigned int initial_size, hash_callback_t *hash_cb,
+		 hash_cmp_callback_t *key_compare_cb)
+{
+	struct hash_flat *flat;
+
+	flat = i_new(struct hash_flat, 1);
+	flat->hash_cb = hash_cb;
+	flat->key_compare_cb = key_compare_cb;
+	flat->initial_capacity = hash_flat_capacity_for(initial_size);
+	hash_flat_alloc(flat, flat->initial_capacity);
+	return flat;
+}
+
+static void hash_flat_free_old_slots(struct hash_flat *flat)
+{
+	struct hash_flat_old_slots *old;
+
+	if (!array_is_created(&flat->old_slots))
+		return;
+	array_foreach_modifiable(&flat->old_slots, old)
+		i_free(old->slots);
+	array_clear(&flat->old_slots);
+}
+
+void hash_flat_destroy(struct hash_flat **_flat)
+{
+	struct hash_flat *flat = *_flat;
+
+	*_flat = NULL;
+	i_assert(flat->frozen == 0);
+
+	hash_flat_free_old_slots(flat);
+	if (array_is_created(&flat->old_slots))
+		array_free(&flat->old_slots);
+	i_free(flat->slots);
+	i_free(flat);
+}
+
+void hash_flat_clear(struct hash_flat *flat)
+{
+	i_assert(flat->frozen == 0);
+
+	memset(flat->slots, 0, sizeof(struct hash_flat_slot) * flat->capacity);
+	memset(flat->ctrl, HASH_FLAT_CTRL_EMPTY, flat->capacity);
+	flat->count = 0;
+	flat->deleted_count = 0;
+}
+
+static bool
+hash_flat_find_in(const struct hash_flat *flat,
+		  const struct hash_flat_slot *slots, const uint8_t *ctrl,
+		  unsigned int capacity, const void *key, uint64_t mixed,
+		  unsigned int *idx_r)
+{
+	unsigned int group_mask = capacity / HASH_FLAT_GROUP_WIDTH - 1;
+	unsigned int group = hash_flat_first_group(capacity, mixed);
+	uint8_t h2 = hash_flat_h2(mixed);
+	const uint8_t *group_ctrl;
+	hash_flat_mask_t mask;
+	unsigned int i, idx;
+
+	/* triangular probing visits each group exactly once */
+	for (i = 0; i <= group_mask; i++) {
+		group_ctrl = ctrl + group * HASH_FLAT_GROUP_WIDTH;
+		mask = hash_flat_group_match(group_ctrl, h2);
+		for (; mask != 0; mask &= mask - 1) {
+			idx = group * HASH_FLAT_GROUP_WIDTH +
+				hash_flat_mask_first(mask);
+			if (ctrl[idx] == h2 &&
+			    flat->key_compare_cb(slots[idx].key, key) == 0) {
+				*idx_r = idx;
+				return TRUE;
+			}
+		}
+		if (hash_flat_group_match_empty(group_ctrl) != 0)
+			break;
+		group = (group + i + 1) & group_mask;
+	}
+	return FALSE;
+}
+
+static inline bool
+hash_flat_find(const struct hash_flat *flat, const void *key,
+	       uint64_t mixed, unsigned int *idx_r)
+{
+	return hash_flat_find_in(flat, flat->slots, flat->ctrl,
+				 flat->capacity, key, mixed, idx_r);
+}
+
+static unsigned int
+hash_flat_find_free(const struct hash_flat *flat, uint64_t mixed)
+{
+	unsigned int group_mask = flat->capacity / HASH_FLAT_GROUP_WIDTH - 1;
+	unsigned int group = hash_flat_first_group(flat->capacity, mixed);
+	hash_flat_mask_t mask;
+	unsigned int i;
+
+	for (i = 0; i <= group_mask; i++) {
+		mask = hash_flat_group_match_free(flat->ctrl +
+						  group * HASH_FLAT_GROUP_WIDTH);
+		if (mask != 0) {
+			return group * HASH_FLAT_GROUP_WIDTH +
+				hash_flat_mask_first(mask);
+		}
+		group = (group + i + 1) & group_mask;
+	}
+	i_unreached();
+}
+
+static void
+hash_flat_insert_slot(struct hash_flat *flat, uint64_t mixed,
+		      void *key, void *value)
+{
+	unsigned int idx;
+
+	idx = hash_flat_find_free(flat, mixed);
+	if (flat->ctrl[idx] == HASH_FLAT_CTRL_DELETED)
+		flat->deleted_count--;
+	flat->ctrl[idx] = hash_flat_h2(mixed);
+	flat->slots[idx].key = key;
+	flat->slots[idx].value = value;
+	flat->count++;
+}
+
+static void hash_flat_resize(struct hash_flat *flat, unsigned int capacity)
+{
+	struct hash_flat_old_slots old = {
+		.slots = flat->slots,
+		.ctrl = flat->ctrl,
+		.capacity = flat->capacity,
+	};
+	unsigned int i;
+
+	hash_flat_alloc(flat, capacity);
+	for (i = 0; i < old.capacity; i++) {
+		if (HASH_FLAT_CTRL_IS_FULL(old.ctrl[i])) {
+			hash_flat_insert_slot(flat,
+				hash_flat_mix(flat->hash_cb(old.slots[i].key)),
+				old.slots[i].key, old.slots[i].value);
+		}
+	}
+
+	if (flat->frozen == 0)
+		i_free(old.slots);
+	else {
+		/* iterators may still be using the old slots */
+		if (!array_is_created(&flat->old_slots))
+			i_array_init(&flat->old_slots, 4);
+		array_push_back(&flat->old_slots, &old);
+		flat->resize_count++;
+	}
+}
+
+static void hash_flat_grow(struct hash_flat *flat)
+{
+	unsigned int used = flat->count + flat->deleted_count;
+
+	/* The same load limit is used while frozen. Letting the table fill
+	   up completely would make the probe sequences very long, e.g. with
+	   hash_table_copy(), which freezes the destination table. The old
+	   slots are kept for the iterators if the table is resized. */
+	if (used < HASH_FLAT_MAX_LOAD(flat->capacity))
+		return;
+
+	/* If at most half of the slots are actually used, the table is
+	   mostly filled with deleted slots - rehash with the same size. */
+	if (flat->count < flat->capacity / 2)
+		hash_flat_resize(flat, flat->capacity);
+	else {
+		i_assert(flat->capacity < UINT_MAX / 2);
+		hash_flat_resize(flat, flat->capacity * 2);
+	}
+}
+
+static void hash_flat_try_shrink(struct hash_flat *flat)
+{
+	unsigned int capacity;
+
+	i_assert(flat->frozen == 0);
+
+	if (flat->count < flat->capacity / 8 &&
+	    flat->capacity > flat->initial_capacity) {
+		capacity = I_MAX(hash_flat_capacity_for(flat->count * 2),
+				 flat->initial_capacity);
+		hash_flat_resize(flat, capacity);
+	} else if (flat->deleted_count > flat->capacity / 4) {
+		hash_flat_resize(flat, flat->capacity);
+	}
+}
+
+bool hash_flat_lookup(const struct hash_flat *flat, const void *key,
+		      void **orig_key_r, void **value_r)
+{
+	unsigned int idx;
+
+	if (!hash_flat_find(flat, key, hash_flat_mix(flat->hash_cb(key)),
+			    &idx))
+		return FALSE;
+	*orig_key_r = flat->slots[idx].key;
+	*value_r = flat->slots[idx].value;
+	return TRUE;
+}
+
+void hash_flat_insert(struct hash_flat *flat, void *key, void *value,
+		      bool update)
+{
+	uint64_t mixed;
+	unsigned int idx;
+
+	i_assert(flat->count < UINT_MAX);
+	i_assert(key != NULL);
+
+	mixed = hash_flat_mix(flat->hash_cb(key));
+	if (hash_flat_find(flat, key, mixed, &idx)) {
+		i_assert(update);
+		flat->slots[idx].value = value;
+		return;
+	}
+	hash_flat_grow(flat);
+	hash_flat_insert_slot(flat, mixed, key, value);
+}
+
+static void
+hash_flat_remove_old(struct hash_flat *flat, const void *key, uint64_t mixed)
+{
+	struct hash_flat_old_slots *old;
+	unsigned int idx;
+
+	/* Mark the key deleted also in the old slots, so the iterators won't
+	   access the key anymore. The old slots are never probed for inserts,
+	   so there's no need to care about EMPTY vs DELETED. */
+	array_foreach_modifiable(&flat->old_slots, old) {
+		if (hash_flat_find_in(flat, old->slots, old->ctrl,
+				      old->capacity, key, mixed, &idx))
+			old->ctrl[idx] = HASH_FLAT_CTRL_DELETED;
+	}
+}
+
+bool hash_flat_try_remove(struct hash_flat *flat, const void *key)
+{
+	uint64_t mixed = hash_flat_mix(flat->hash_cb(key));
+	unsigned int idx, group;
+
+	if (!hash_flat_find(flat, key, mixed, &idx))
+		return FALSE;
+	if (flat->frozen > 0 && array_is_created(&flat->old_slots) &&
+	    array_count(&flat->old_slots) > 0)
+		hash_flat_remove_old(flat, key, mixed);
+
+	/* If the group still has an EMPTY slot, no lookup could have probed
+	   past it. Otherwise the slot must be marked DELETED so the lookups
+	   continue to the following groups. */
+	group = idx / HASH_FLAT_GROUP_WIDTH;
+	if (hash_flat_group_match_empty(flat->ctrl +
+					group * HASH_FLAT_GROUP_WIDTH) != 0)
+		flat->ctrl[idx] = HASH_FLAT_CTRL_EMPTY;
+	else {
+		flat->ctrl[idx] = HASH_FLAT_CTRL_DELETED;
+		flat->deleted_count++;
+	}
+	flat->slots[idx].key = NULL;
+	flat->slots[idx].value = NULL;
+	flat->count--;
+
+	if (flat->frozen == 0)
+		hash_flat_try_shrink(flat);
+	return TRUE;
+}
+
+unsigned int hash_flat_count(const struct hash_flat *flat)
+{
+	return flat->count;
+}
+
+void hash_flat_freeze(struct hash_flat *flat)
+{
+	flat->frozen++;
+}
+
+void hash_flat_thaw(struct hash_flat *flat)
+{
+	i_assert(flat->frozen > 0);
+
+	if (--flat->frozen > 0)
+		return;
+
+	hash_flat_free_old_slots(flat);
+	hash_flat_try_shrink(flat);
+}
+
+void hash_flat_iterate_init(struct hash_flat *flat,
+			    struct hash_flat_iterate_context *ctx_r)
+{
+	hash_flat_freeze(flat);
+
+	i_zero(ctx_r);
+	ctx_r->flat = flat;
+	ctx_r->slots = flat->slots;
+	ctx_r->ctrl = flat->ctrl;
+	ctx_r->capacity = flat->capacity;
+	ctx_r->resize_count = flat->resize_count;
+}
+
+bool hash_flat_iterate(struct hash_flat_iterate_context *ctx,
+		       void **key_r, void **value_r)
+{
+	const struct hash_flat_slot *slot;
+
+	while (ctx->pos < ctx->capacity) {
+		if (!HASH_FLAT_CTRL_IS_FULL(ctx->ctrl[ctx->pos])) {
+			ctx->pos++;
+			continue;
+		}
+		slot = &ctx->slots[ctx->pos++];
+		if (ctx->resize_count == ctx->flat->resize_count) {
+			*key_r = slot->key;
+			*value_r = slot->value;
+			return TRUE;
+		}
+		/* The table was resized after the iteration started, so
+		   we're iterating the old slots. Removed keys were marked
+		   deleted in them also, but the value may have been
+		   updated. */
+		if (hash_flat_lookup(ctx->flat, slot->key, key_r, value_r))
+			return TRUE;
+	}
+	*key_r = *value_r = NULL;
+	return FALSE;
+}
+
+void hash_flat_iterate_deinit(struct hash_flat_iterate_context *ctx)
+{
+	hash_flat_thaw(ctx->flat);
+}
@@ -0,0 +1,44 @@
+#ifndef HASH_FLAT_H
+#define HASH_FLAT_H
+
+/* Open addressing hash table used by hash_table_create_flat(). This isn't
+   meant to be used directly - use the hash.h API instead. */
+
+#include "hash.h"
+
+struct hash_flat;
+struct hash_flat_slot;
+
+struct hash_flat_iterate_context {
+	struct hash_flat *flat;
+	const struct hash_flat_slot *slots;
+	const uint8_t *ctrl;
+	unsigned int capacity, pos;
+	unsigned int resize_count;
+};
+
+struct hash_flat *
+hash_flat_create(unsigned int initial_size, hash_callback_t *hash_cb,
+		 hash_cmp_callback_t *key_compare_cb);
+void hash_flat_destroy(struct hash_flat **flat);
+void hash_flat_clear(struct hash_flat *flat);
+
+bool hash_flat_lookup(const struct hash_flat *flat, const void *key,
+		      void **orig_key_r, void **value_r);
+/* Insert a new key. If update is TRUE and the key already exists, update
+   only the value. Otherwise the key must not exist yet. */
+void hash_flat_insert(struct hash_flat *flat, void *key, void *value,
+		      bool update);
+bool hash_flat_try_remove(struct hash_flat *flat, const void *key);
+unsigned int hash_flat_count(const struct hash_flat *flat) ATTR_PURE;
+
+void hash_flat_freeze(struct hash_flat *flat);
+void hash_flat_thaw(struct hash_flat *flat);
+
+void hash_flat_iterate_init(struct hash_flat *flat,
+			    struct hash_flat_iterate_context *ctx_r);
+bool hash_flat_iterate(struct hash_flat_iterate_context *ctx,
+		       void **key_r, void **value_r);
+void hash_flat_iterate_deinit(struct hash_flat_iterate_context *ctx);
+
+#endif
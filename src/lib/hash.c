@@ -4,6 +4,7 @@
 
 #include "lib.h"
 #include "hash.h"
+#include "hash-flat.h"
 #include "primes.h"
 
 #include <ctype.h>
@@ -12,6 +13,8 @@
 
 #undef hash_table_create
 #undef hash_table_create_direct
+#undef hash_table_create_flat
+#undef hash_table_create_direct_flat
 #undef hash_table_destroy
 #undef hash_table_clear
 #undef hash_table_lookup
@@ -34,6 +37,9 @@ struct hash_node {
 
 struct hash_table {
 	pool_t node_pool;
+	/* Non-NULL if the table was created with hash_table_create_flat().
+	   All the operations are then done by hash-flat.c. */
+	struct hash_flat *flat;
 
 	int frozen;
 	unsigned int initial_size, nodes_count, removed_count;
@@ -50,6 +56,8 @@ struct hash_iterate_context {
 	struct hash_table *table;
 	struct hash_node *next;
 	unsigned int pos;
+
+	struct hash_flat_iterate_context flat_iter;
 };
 
 enum hash_table_operation{
@@ -98,6 +106,26 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 			  direct_hash, direct_cmp);
 }
 
+void hash_table_create_flat(struct hash_table **table_r, pool_t node_pool,
+			    unsigned int initial_size, hash_callback_t *hash_cb,
+			    hash_cmp_callback_t *key_compare_cb)
+{
+	struct hash_table *table;
+
+	pool_ref(node_pool);
+	table = i_new(struct hash_table, 1);
+	table->node_pool = node_pool;
+	table->flat = hash_flat_create(initial_size, hash_cb, key_compare_cb);
+	*table_r = table;
+}
+
+void hash_table_create_direct_flat(struct hash_table **table_r,
+				   pool_t node_pool, unsigned int initial_size)
+{
+	hash_table_create_flat(table_r, node_pool, initial_size,
+			       direct_hash, direct_cmp);
+}
+
 static void free_node(struct hash_table *table, struct hash_node *node)
 {
 	if (!table->node_pool->alloconly_pool)
@@ -139,6 +167,13 @@ void hash_table_destroy(struct hash_table **_table)
 
 	i_assert(table->frozen == 0);
 
+	if (table->flat != NULL) {
+		hash_flat_destroy(&table->flat);
+		pool_unref(&table->node_pool);
+		i_free(table);
+		return;
+	}
+
 	if (!table->node_pool->alloconly_pool) {
 		hash_table_destroy_nodes(table);
 		destroy_node_list(table, table->free_nodes);
@@ -153,6 +188,11 @@ void hash_table_clear(struct hash_table *table, bool free_nodes)
 {
 	i_assert(table->frozen == 0);
 
+	if (table->flat != NULL) {
+		hash_flat_clear(table->flat);
+		return;
+	}
+
 	if (!table->node_pool->alloconly_pool)
 		hash_table_destroy_nodes(table);
 
@@ -190,6 +230,13 @@ hash_table_lookup_node(const struct hash_table *table,
 void *hash_table_lookup(const struct hash_table *table, const void *key)
 {
 	struct hash_node *node;
+	void *orig_key, *value;
+
+	if (table->flat != NULL) {
+		if (!hash_flat_lookup(table->flat, key, &orig_key, &value))
+			return NULL;
+		return value;
+	}
 
 	node = hash_table_lookup_node(table, key, table->hash_cb(key));
 	return node != NULL ? node->value : NULL;
@@ -201,6 +248,9 @@ bool hash_table_lookup_full(const struct hash_table *table,
 {
 	struct hash_node *node;
 
+	if (table->flat != NULL)
+		return hash_flat_lookup(table->flat, lookup_key, orig_key, value);
+
 	node = hash_table_lookup_node(table, lookup_key,
 				      table->hash_cb(lookup_key));
 	if (node == NULL)
@@ -297,12 +347,18 @@ hash_table_insert_node(struct hash_table *table, void *key, void *value,
 
 void hash_table_insert(struct hash_table *table, void *key, void *value)
 {
-	hash_table_insert_node(table, key, value, HASH_TABLE_OP_INSERT);
+	if (table->flat != NULL)
+		hash_flat_insert(table->flat, key, value, FALSE);
+	else
+		hash_table_insert_node(table, key, value, HASH_TABLE_OP_INSERT);
 }
 
 void hash_table_update(struct hash_table *table, void *key, void *value)
 {
-	hash_table_insert_node(table, key, value, HASH_TABLE_OP_UPDATE);
+	if (table->flat != NULL)
+		hash_flat_insert(table->flat, key, value, TRUE);
+	else
+		hash_table_insert_node(table, key, value, HASH_TABLE_OP_UPDATE);
 }
 
 static void
@@ -347,6 +403,9 @@ bool hash_table_try_remove(struct hash_table *table, const void *key)
 	struct hash_node *node;
 	unsigned int hash;
 
+	if (table->flat != NULL)
+		return hash_flat_try_remove(table->flat, key);
+
 	hash = table->hash_cb(key);
 
 	node = hash_table_lookup_node(table, key, hash);
@@ -365,6 +424,8 @@ bool hash_table_try_remove(struct hash_table *table, const void *key)
 
 unsigned int hash_table_count(const struct hash_table *table)
 {
+	if (table->flat != NULL)
+		return hash_flat_count(table->flat);
 	return table->nodes_count;
 }
 
@@ -372,10 +433,14 @@ struct hash_iterate_context *hash_table_iterate_init(struct hash_table *table)
 {
 	struct hash_iterate_context *ctx;
 
-	hash_table_freeze(table);
-
 	ctx = i_new(struct hash_iterate_context, 1);
 	ctx->table = table;
+	if (table->flat != NULL) {
+		hash_flat_iterate_init(table->flat, &ctx->flat_iter);
+		return ctx;
+	}
+
+	hash_table_freeze(table);
 	ctx->next = &table->nodes[0];
 	return ctx;
 }
@@ -403,6 +468,9 @@ bool hash_table_iterate(struct hash_iterate_context *ctx,
 {
 	struct hash_node *node;
 
+	if (ctx->table->flat != NULL)
+		return hash_flat_iterate(&ctx->flat_iter, key_r, value_r);
+
 	node = ctx->next;
 	if (node != NULL && node->key == NULL)
 		node = hash_table_iterate_next(ctx, node);
@@ -425,17 +493,28 @@ void hash_table_iterate_deinit(struct hash_iterate_context **_ctx)
 		return;
 
 	*_ctx = NULL;
-	hash_table_thaw(ctx->table);
+	if (ctx->table->flat != NULL)
+		hash_flat_iterate_deinit(&ctx->flat_iter);
+	else
+		hash_table_thaw(ctx->table);
 	i_free(ctx);
 }
 
 void hash_table_freeze(struct hash_table *table)
 {
-	table->frozen++;
+	if (table->flat != NULL)
+		hash_flat_freeze(table->flat);
+	else
+		table->frozen++;
 }
 
 void hash_table_thaw(struct hash_table *table)
 {
+	if (table->flat != NULL) {
+		hash_flat_thaw(table->flat);
+		return;
+	}
+
 	i_assert(table->frozen > 0);
 
 	if (--table->frozen > 0)
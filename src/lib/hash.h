@@ -51,6 +51,43 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 		sizeof((*table)._value) != sizeof(void *)), \
 	hash_table_create_direct(&(*table)._table, pool, size))
 
+/* Same as hash_table_create(), but the table uses open addressing instead
+   of chaining. The keys and values are stored directly in a single array,
+   which uses less memory and makes lookups faster especially with large
+   tables. node_pool isn't used for anything. Otherwise the table works the
+   same as the ones created with hash_table_create(). */
+void hash_table_create_flat(struct hash_table **table_r, pool_t node_pool,
+			    unsigned int initial_size,
+			    hash_callback_t *hash_cb,
+			    hash_cmp_callback_t *key_compare_cb);
+#define hash_table_create_flat(table, pool, size, hash_cb, key_cmp_cb) \
+	TYPE_CHECKS(void, \
+	COMPILE_ERROR_IF_TRUE( \
+		sizeof((*table)._key) != sizeof(void *) || \
+		sizeof((*table)._value) != sizeof(void *)) || \
+	COMPILE_ERROR_IF_TRUE( \
+               !__builtin_types_compatible_p(typeof(&key_cmp_cb), \
+                       int (*)(typeof((*table)._key), typeof((*table)._key))) && \
+               !__builtin_types_compatible_p(typeof(&key_cmp_cb), \
+                       int (*)(typeof((*table)._const_key), typeof((*table)._const_key)))) || \
+	COMPILE_ERROR_IF_TRUE( \
+		!__builtin_types_compatible_p(typeof(&hash_cb), \
+			unsigned int (*)(typeof((*table)._key))) && \
+		!__builtin_types_compatible_p(typeof(&hash_cb), \
+		unsigned int (*)(typeof((*table)._const_key)))), \
+	hash_table_create_flat(&(*table)._table, pool, size, \
+		(hash_callback_t *)hash_cb, \
+		(hash_cmp_callback_t *)key_cmp_cb))
+void hash_table_create_direct_flat(struct hash_table **table_r,
+				   pool_t node_pool,
+				   unsigned int initial_size);
+#define hash_table_create_direct_flat(table, pool, size) \
+	TYPE_CHECKS(void, \
+	COMPILE_ERROR_IF_TRUE( \
+		sizeof((*table)._key) != sizeof(void *) || \
+		sizeof((*table)._value) != sizeof(void *)), \
+	hash_table_create_direct_flat(&(*table)._table, pool, size))
+
 #define hash_table_is_created(table) \
 	((table)._table != NULL)
 
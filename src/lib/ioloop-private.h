@@ -119,6 +119,16 @@ void io_loop_handle_remove(struct io_file *io, bool closed);
 void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count);
 void io_loop_handler_deinit(struct ioloop *ioloop);
 
+#ifdef IOLOOP_URING
+/* epoll handler, used by the io_uring handler as a fallback */
+void io_loop_epoll_handler_run_internal(struct ioloop *ioloop);
+void io_loop_epoll_handle_add(struct io_file *io);
+void io_loop_epoll_handle_remove(struct io_file *io, bool closed);
+void io_loop_epoll_handler_init(struct ioloop *ioloop,
+				unsigned int initial_fd_count);
+void io_loop_epoll_handler_deinit(struct ioloop *ioloop);
+#endif
+
 void io_loop_notify_remove(struct io *io);
 void io_loop_notify_handler_deinit(struct ioloop *ioloop);
 
@@ -0,0 +1,531 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "sleep.h"
+#include "ioloop-private.h"
+#include "ioloop-iolist.h"
+
+#ifdef IOLOOP_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <unistd.h>
+
+/* The I/Os are watched with one-shot IORING_OP_POLL_ADD requests. A request
+   is re-armed only after its completion has been handled, which keeps the
+   level-triggered semantics that the rest of the code expects. The poll
+   additions and modifications done during a single ioloop iteration are
+   submitted with the same io_uring_enter() call that waits for the next
+   events. If io_uring can't be used, or the IOLOOP_URING_DISABLE environment
+   variable is set, the epoll handler is used instead. */
+
+#define URING_SQ_ENTRIES 512
+#define URING_CQ_ENTRIES 4096
+/* user_data for requests whose completions are ignored */
+#define URING_USER_DATA_IGNORE ((uint64_t)-1)
+
+#define URING_REQUIRED_FEATURES \
+	(IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)
+
+#define IO_URING_ERROR (POLLERR | POLLHUP)
+#define IO_URING_INPUT (POLLIN | POLLPRI | IO_URING_ERROR)
+#define IO_URING_OUTPUT (POLLOUT | IO_URING_ERROR)
+
+struct uring_fd {
+	struct io_list list;
+	/* generation of the currently armed poll request */
+	uint32_t gen;
+	unsigned int poll_mask;
+
+	bool armed:1;
+	bool changed:1;
+};
+
+struct uring_event {
+	int fd;
+	unsigned int revents;
+};
+
+struct ioloop_handler_context {
+	int ring_fd;
+	void *ring_ptr;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_entries, sq_local_tail;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	ARRAY(struct uring_fd *) fd_index;
+	/* fds whose poll requests need to be updated */
+	ARRAY(int) changed_fds;
+	ARRAY(struct uring_event) events;
+	unsigned int active_fd_count;
+};
+
+enum uring_state {
+	URING_STATE_UNKNOWN = 0,
+	URING_STATE_ENABLED,
+	URING_STATE_DISABLED,
+};
+/* All ioloops in the process use the same handler. */
+static enum uring_state uring_state = URING_STATE_UNKNOWN;
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete,
+	    unsigned int flags, const void *arg, size_t arg_size)
+{
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+		       flags, arg, arg_size);
+}
+
+static int
+uring_init(struct ioloop_handler_context *ctx, const char **error_r)
+{
+	struct io_uring_params params;
+	size_t sq_size, cq_size;
+	void *ptr;
+
+	i_zero(&params);
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	params.cq_entries = URING_CQ_ENTRIES;
+	ctx->ring_fd = uring_setup(URING_SQ_ENTRIES, &params);
+	if (ctx->ring_fd < 0) {
+		*error_r = t_strdup_printf("io_uring_setup() failed: %m");
+		return -1;
+	}
+	fd_close_on_exec(ctx->ring_fd, TRUE);
+	if ((params.features & URING_REQUIRED_FEATURES) !=
+	    URING_REQUIRED_FEATURES) {
+		*error_r = "io_uring is missing required features";
+		return -1;
+	}
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	ctx->ring_size = I_MAX(sq_size, cq_size);
+	ptr = mmap(NULL, ctx->ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ctx->ring_fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) {
+		*error_r = t_strdup_printf("mmap(io_uring) failed: %m");
+		return -1;
+	}
+	ctx->ring_ptr = ptr;
+
+	ctx->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ctx->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ctx->ring_fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED) {
+		*error_r = t_strdup_printf("mmap(io_uring sqes) failed: %m");
+		return -1;
+	}
+	ctx->sqes = ptr;
+
+	ctx->sq_head = PTR_OFFSET(ctx->ring_ptr, params.sq_off.head);
+	ctx->sq_tail = PTR_OFFSET(ctx->ring_ptr, params.sq_off.tail);
+	ctx->sq_mask = PTR_OFFSET(ctx->ring_ptr, params.sq_off.ring_mask);
+	ctx->sq_array = PTR_OFFSET(ctx->ring_ptr, params.sq_off.array);
+	ctx->sq_entries = params.sq_entries;
+	ctx->sq_local_tail = *ctx->sq_tail;
+	ctx->cq_head = PTR_OFFSET(ctx->ring_ptr, params.cq_off.head);
+	ctx->cq_tail = PTR_OFFSET(ctx->ring_ptr, params.cq_off.tail);
+	ctx->cq_mask = PTR_OFFSET(ctx->ring_ptr, params.cq_off.ring_mask);
+	ctx->cqes = PTR_OFFSET(ctx->ring_ptr, params.cq_off.cqes);
+	return 0;
+}
+
+static void uring_deinit(struct ioloop_handler_context *ctx)
+{
+	if (ctx->sqes != NULL) {
+		if (munmap(ctx->sqes, ctx->sqes_size) < 0)
+			i_error("munmap(io_uring sqes) failed: %m");
+	}
+	if (ctx->ring_ptr != NULL) {
+		if (munmap(ctx->ring_ptr, ctx->ring_size) < 0)
+			i_error("munmap(io_uring) failed: %m");
+	}
+	if (ctx->ring_fd != -1) {
+		if (close(ctx->ring_fd) < 0)
+			i_error("close(io_uring) failed: %m");
+	}
+}
+
+static unsigned int
+uring_sq_pending_count(struct ioloop_handler_context *ctx)
+{
+	return ctx->sq_local_tail - __atomic_load_n(ctx->sq_head,
+						    __ATOMIC_ACQUIRE);
+}
+
+static int
+uring_submit(struct ioloop_handler_context *ctx, unsigned int min_complete,
+	     int msecs)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = 0;
+	int ret;
+
+	__atomic_store_n(ctx->sq_tail, ctx->sq_local_tail, __ATOMIC_RELEASE);
+	if (min_complete == 0) {
+		ret = uring_enter(ctx->ring_fd, uring_sq_pending_count(ctx),
+				  0, 0, NULL, 0);
+	} else {
+		i_zero(&arg);
+		if (msecs >= 0) {
+			ts.tv_sec = msecs / 1000;
+			ts.tv_nsec = (long long)(msecs % 1000) * 1000000;
+			arg.ts = (uintptr_t)&ts;
+		}
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		ret = uring_enter(ctx->ring_fd, uring_sq_pending_count(ctx),
+				  min_complete, flags, &arg, sizeof(arg));
+	}
+	if (ret < 0 && errno != EINTR && errno != ETIME &&
+	    errno != EAGAIN && errno != EBUSY)
+		i_fatal("io_uring_enter() failed: %m");
+	return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	while (uring_sq_pending_count(ctx) >= ctx->sq_entries) {
+		/* submission queue is full - submit it now */
+		(void)uring_submit(ctx, 0, 0);
+	}
+	idx = ctx->sq_local_tail & *ctx->sq_mask;
+	sqe = &ctx->sqes[idx];
+	i_zero(sqe);
+	ctx->sq_array[idx] = idx;
+	ctx->sq_local_tail++;
+	return sqe;
+}
+
+static uint64_t uring_user_data(int fd, uint32_t gen)
+{
+	return ((uint64_t)fd << 32) | gen;
+}
+
+static unsigned int uring_poll_mask(const struct io_list *list)
+{
+	unsigned int events = 0;
+	struct io_file *io;
+	int i;
+
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = list->ios[i];
+
+		if (io == NULL)
+			continue;
+
+		if ((io->io.condition & IO_READ) != 0)
+			events |= IO_URING_INPUT;
+		if ((io->io.condition & IO_WRITE) != 0)
+			events |= IO_URING_OUTPUT;
+		if ((io->io.condition & IO_ERROR) != 0)
+			events |= IO_URING_ERROR;
+	}
+	return events;
+}
+
+static void uring_fd_disarm(struct ioloop_handler_context *ctx, int fd,
+			    struct uring_fd *ufd)
+{
+	struct io_uring_sqe *sqe;
+
+	i_assert(ufd->armed);
+
+	sqe = uring_get_sqe(ctx);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = uring_user_data(fd, ufd->gen);
+	sqe->user_data = URING_USER_DATA_IGNORE;
+	ufd->armed = FALSE;
+}
+
+static void uring_fd_changed(struct ioloop_handler_context *ctx, int fd,
+			     struct uring_fd *ufd)
+{
+	if (!ufd->changed) {
+		ufd->changed = TRUE;
+		array_push_back(&ctx->changed_fds, &fd);
+	}
+}
+
+static void uring_update_polls(struct ioloop_handler_context *ctx)
+{
+	struct uring_fd *ufd;
+	struct io_uring_sqe *sqe;
+	unsigned int mask;
+	const int *fdp;
+
+	array_foreach(&ctx->changed_fds, fdp) {
+		ufd = *array_idx(&ctx->fd_index, *fdp);
+		ufd->changed = FALSE;
+		mask = uring_poll_mask(&ufd->list);
+		if (mask == 0) {
+			/* the poll was already removed along with the
+			   last io */
+			i_assert(!ufd->armed);
+			continue;
+		}
+
+		if (ufd->armed && ufd->poll_mask != mask)
+			uring_fd_disarm(ctx, *fdp, ufd);
+		if (!ufd->armed) {
+			ufd->gen++;
+			sqe = uring_get_sqe(ctx);
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = *fdp;
+			sqe->poll32_events = mask;
+			sqe->user_data = uring_user_data(*fdp, ufd->gen);
+			ufd->poll_mask = mask;
+			ufd->armed = TRUE;
+		}
+	}
+	array_clear(&ctx->changed_fds);
+}
+
+static int uring_event_cmp(const struct uring_event *e1,
+			   const struct uring_event *e2)
+{
+	return e1->fd - e2->fd;
+}
+
+static void uring_reap_completions(struct ioloop_handler_context *ctx)
+{
+	const struct io_uring_cqe *cqe;
+	struct uring_fd *ufd;
+	struct uring_event *event;
+	unsigned int head, tail;
+	int fd;
+
+	head = *ctx->cq_head;
+	tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &ctx->cqes[head & *ctx->cq_mask];
+		if (cqe->user_data == URING_USER_DATA_IGNORE)
+			continue;
+
+		fd = cqe->user_data >> 32;
+		i_assert(fd >= 0 && (unsigned int)fd <
+			 array_count(&ctx->fd_index));
+		ufd = *array_idx(&ctx->fd_index, fd);
+		if (!ufd->armed || ufd->gen != (uint32_t)cqe->user_data) {
+			/* completion for an already removed poll */
+			continue;
+		}
+		/* one-shot poll finished - re-arm it after the callbacks */
+		ufd->armed = FALSE;
+		uring_fd_changed(ctx, fd, ufd);
+		if (cqe->res == -ECANCELED)
+			continue;
+
+		event = array_append_space(&ctx->events);
+		event->fd = fd;
+		event->revents = cqe->res < 0 ? POLLERR : cqe->res;
+	}
+	__atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+
+	/* The completion order only tells in which order the polls were
+	   armed. Handle the events in fd order instead, the same as the
+	   poll and select handlers do. */
+	array_sort(&ctx->events, uring_event_cmp);
+}
+
+static void uring_handler_init(struct ioloop *ioloop,
+			       unsigned int initial_fd_count)
+{
+	struct ioloop_handler_context *ctx;
+	const char *error;
+
+	if (uring_state == URING_STATE_UNKNOWN &&
+	    getenv("IOLOOP_URING_DISABLE") != NULL) {
+		uring_state = URING_STATE_DISABLED;
+		return;
+	}
+
+	ctx = i_new(struct ioloop_handler_context, 1);
+	ctx->ring_fd = -1;
+	if (uring_init(ctx, &error) < 0) {
+		uring_deinit(ctx);
+		i_free(ctx);
+		if (uring_state == URING_STATE_ENABLED)
+			i_fatal("%s", error);
+		/* io_uring isn't available - use epoll */
+		uring_state = URING_STATE_DISABLED;
+		return;
+	}
+	uring_state = URING_STATE_ENABLED;
+
+	i_array_init(&ctx->fd_index, initial_fd_count);
+	i_array_init(&ctx->changed_fds, initial_fd_count);
+	i_array_init(&ctx->events, initial_fd_count);
+	ioloop->handler_context = ctx;
+}
+
+void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
+{
+	if (uring_state != URING_STATE_DISABLED)
+		uring_handler_init(ioloop, initial_fd_count);
+	if (uring_state == URING_STATE_DISABLED)
+		io_loop_epoll_handler_init(ioloop, initial_fd_count);
+}
+
+void io_loop_handler_deinit(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct uring_fd **ufds;
+	unsigned int i, count;
+
+	if (uring_state == URING_STATE_DISABLED) {
+		io_loop_epoll_handler_deinit(ioloop);
+		return;
+	}
+
+	ufds = array_get_modifiable(&ctx->fd_index, &count);
+	for (i = 0; i < count; i++)
+		i_free(ufds[i]);
+
+	uring_deinit(ctx);
+	array_free(&ctx->fd_index);
+	array_free(&ctx->changed_fds);
+	array_free(&ctx->events);
+	i_free(ioloop->handler_context);
+}
+
+void io_loop_handle_add(struct io_file *io)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct uring_fd **ufdp;
+
+	if (uring_state == URING_STATE_DISABLED) {
+		io_loop_epoll_handle_add(io);
+		return;
+	}
+
+	ufdp = array_idx_get_space(&ctx->fd_index, io->fd);
+	if (*ufdp == NULL)
+		*ufdp = i_new(struct uring_fd, 1);
+
+	if (ioloop_iolist_add(&(*ufdp)->list, io))
+		ctx->active_fd_count++;
+	uring_fd_changed(ctx, io->fd, *ufdp);
+}
+
+void io_loop_handle_remove(struct io_file *io, bool closed)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct uring_fd *ufd;
+
+	if (uring_state == URING_STATE_DISABLED) {
+		io_loop_epoll_handle_remove(io, closed);
+		return;
+	}
+
+	ufd = *array_idx(&ctx->fd_index, io->fd);
+	if (ioloop_iolist_del(&ufd->list, io)) {
+		/* Remove the poll immediately, even if the fd was already
+		   closed. The poll request keeps a reference to the file, so
+		   the file wouldn't otherwise be closed until the next
+		   ioloop iteration. */
+		i_assert(ctx->active_fd_count > 0);
+		ctx->active_fd_count--;
+		if (ufd->armed) {
+			uring_fd_disarm(ctx, io->fd, ufd);
+			(void)uring_submit(ctx, 0, 0);
+		}
+	} else {
+		uring_fd_changed(ctx, io->fd, ufd);
+	}
+	i_free(io);
+}
+
+void io_loop_handler_run_internal(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	const struct uring_event *event;
+	struct uring_fd *ufd;
+	struct io_file *io;
+	struct timeval tv;
+	unsigned int i, count;
+	int msecs, j;
+	bool call;
+
+	if (uring_state == URING_STATE_DISABLED) {
+		io_loop_epoll_handler_run_internal(ioloop);
+		return;
+	}
+	i_assert(ctx != NULL);
+
+	/* get the time left for next timeout task */
+	msecs = io_loop_run_get_wait_time(ioloop, &tv);
+
+	/* submit all the poll changes and wait for events with a single
+	   syscall */
+	uring_update_polls(ctx);
+	if (ioloop->io_files != NULL && ctx->active_fd_count > 0)
+		(void)uring_submit(ctx, 1, msecs);
+	else {
+		/* no I/Os, but we should have some timeouts.
+		   just wait for them. */
+		if (uring_sq_pending_count(ctx) > 0)
+			(void)uring_submit(ctx, 0, 0);
+		i_assert(msecs >= 0);
+		i_sleep_intr_msecs(msecs);
+	}
+	array_clear(&ctx->events);
+	uring_reap_completions(ctx);
+
+	/* execute timeout handlers */
+	io_loop_handle_timeouts(ioloop);
+
+	if (!ioloop->running)
+		return;
+
+	count = array_count(&ctx->events);
+	for (i = 0; i < count; i++) {
+		/* io_loop_handle_add() may cause fd_index reallocation,
+		   so we have to use array_idx() */
+		event = array_idx(&ctx->events, i);
+		ufd = *array_idx(&ctx->fd_index, event->fd);
+
+		for (j = 0; j < IOLOOP_IOLIST_IOS_PER_FD; j++) {
+			io = ufd->list.ios[j];
+			if (io == NULL)
+				continue;
+
+			call = FALSE;
+			if ((event->revents & (POLLHUP | POLLERR)) != 0)
+				call = TRUE;
+			else if ((io->io.condition & IO_READ) != 0)
+				call = (event->revents & POLLIN) != 0;
+			else if ((io->io.condition & IO_WRITE) != 0)
+				call = (event->revents & POLLOUT) != 0;
+			else if ((io->io.condition & IO_ERROR) != 0)
+				call = (event->revents & IO_URING_ERROR) != 0;
+
+			if (call) {
+				io_loop_call_io(&io->io);
+				if (!ioloop->running)
+					return;
+			}
+		}
+	}
+}
+
+#endif	/* IOLOOP_URING */
@@ -1080,8 +1080,12 @@ struct ostream * o_stream_create_fd_common(int fd, size_t max_buffer_size,
 		struct ip_addr local_ip;
 
 		if (net_getsockname(fd, &local_ip, NULL) < 0) {
-			/* not a socket */
+			/* not a socket. Linux sendfile() can still write to
+			   pipes, and it fails with EINVAL for anything else
+			   that it doesn't support. */
+#ifndef HAVE_LINUX_SENDFILE
 			fstream->no_sendfile = TRUE;
+#endif
 			fstream->no_socket_cork = TRUE;
 			fstream->no_socket_nodelay = TRUE;
 			fstream->no_socket_quickack = TRUE;
@@ -1209,6 +1209,83 @@ test_base64_random_lowlevel(void)
 	test_end();
 }
 
+static void
+test_base64_random_large_one(const struct base64_scheme *b64,
+			     unsigned int test_idx,
+			     const unsigned char *in_buf, size_t in_buf_size,
+			     buffer_t *buf1, buffer_t *buf2)
+{
+	struct base64_encoder enc;
+	struct base64_decoder dec;
+	buffer_t *out;
+	size_t i;
+
+	/* encoding large blocks at once uses the SIMD code (if available),
+	   while encoding a single byte at a time doesn't */
+	buffer_set_used_size(buf1, 0);
+	buffer_set_used_size(buf2, 0);
+	base64_encode_init(&enc, b64, BASE64_ENCODE_FLAG_CRLF, 76);
+	test_assert_idx(base64_encode_more(&enc, in_buf, in_buf_size, NULL,
+					   buf1), test_idx);
+	test_assert_idx(base64_encode_finish(&enc, buf1), test_idx);
+
+	base64_encode_init(&enc, b64, BASE64_ENCODE_FLAG_CRLF, 76);
+	for (i = 0; i < in_buf_size; i++)
+		test_assert_idx(base64_encode_more(&enc, in_buf + i, 1, NULL,
+						   buf2), test_idx);
+	test_assert_idx(base64_encode_finish(&enc, buf2), test_idx);
+	test_assert_idx(buffer_cmp(buf1, buf2), test_idx);
+
+	/* decode the whole block with the line breaks */
+	out = t_buffer_create(in_buf_size);
+	base64_decode_init(&dec, b64, 0);
+	test_assert_idx(base64_decode_more(&dec, buf1->data, buf1->used,
+					   NULL, out) >= 0, test_idx);
+	test_assert_idx(base64_decode_finish(&dec) == 0, test_idx);
+	test_assert_idx(out->used == in_buf_size &&
+			memcmp(out->data, in_buf, in_buf_size) == 0, test_idx);
+
+	/* invalid character somewhere in the middle of a long line */
+	if (buf1->used > 40) {
+		i = i_rand_limit(buf1->used - 4);
+		if (((unsigned char *)buf1->data)[i] != '\r' &&
+		    ((unsigned char *)buf1->data)[i] != '\n') {
+			buffer_write(buf1, i, "!", 1);
+			buffer_set_used_size(out, 0);
+			base64_decode_init(&dec, b64, 0);
+			test_assert_idx(base64_decode_more(&dec, buf1->data,
+							   buf1->used, NULL,
+							   out) < 0, test_idx);
+			test_assert_idx(out->used <= i / 78 * 57 + 57,
+					test_idx);
+		}
+	}
+}
+
+static void test_base64_random_large(void)
+{
+	unsigned char in_buf[4096];
+	size_t in_buf_size;
+	buffer_t *buf1, *buf2;
+	unsigned int i, j;
+
+	buf1 = t_buffer_create(MAX_BASE64_ENCODED_SIZE(sizeof(in_buf)) * 2);
+	buf2 = t_buffer_create(MAX_BASE64_ENCODED_SIZE(sizeof(in_buf)) * 2);
+
+	test_begin("base64 encode/decode with large random input");
+	for (i = 0; i < 200; i++) {
+		in_buf_size = i_rand_limit(sizeof(in_buf));
+		for (j = 0; j < in_buf_size; j++)
+			in_buf[j] = i_rand_uchar();
+
+		test_base64_random_large_one(&base64_scheme, i, in_buf,
+					     in_buf_size, buf1, buf2);
+		test_base64_random_large_one(&base64url_scheme, i, in_buf,
+					     in_buf_size, buf1, buf2);
+	}
+	test_end();
+}
+
 static void
 _add_lines(const char *in, size_t max_line_len, bool crlf, string_t *out)
 {
@@ -1313,5 +1390,6 @@ void test_base64(void)
 	test_base64_encode_lowlevel();
 	test_base64_decode_lowlevel();
 	test_base64_random_lowlevel();
+	test_base64_random_large();
 	test_base64_encode_lines();
 }
@@ -2,9 +2,10 @@
 
 #include "test-lib.h"
 #include "hash.h"
+#include "hash-flat.h"
 
 
-static void test_hash_random_pool(pool_t pool)
+static void test_hash_random_pool(pool_t pool, bool flat)
 {
 #define KEYMAX 100000
 	HASH_TABLE(void *, void *) hash;
@@ -12,7 +13,10 @@ static void test_hash_random_pool(pool_t pool)
 	unsigned int i, key, keyidx, delidx;
 
 	keys = i_new(unsigned int, KEYMAX); keyidx = 0;
-	hash_table_create_direct(&hash, pool, 0);
+	if (flat)
+		hash_table_create_direct_flat(&hash, pool, 0);
+	else
+		hash_table_create_direct(&hash, pool, 0);
 	for (i = 0; i < KEYMAX; i++) {
 		key = (i_rand_limit(KEYMAX)) + 1;
 		if (i_rand_limit(5) > 0) {
@@ -35,13 +39,169 @@ static void test_hash_random_pool(pool_t pool)
 	i_free(keys);
 }
 
+static void test_hash_flat_iterate(void)
+{
+#define ITER_KEYMAX 1000
+	HASH_TABLE(void *, void *) hash;
+	struct hash_iterate_context *iter;
+	unsigned int seen[ITER_KEYMAX*2 + 1];
+	void *key, *value;
+	unsigned int i, k, count = ITER_KEYMAX;
+
+	test_begin("hash flat iterate");
+	memset(seen, 0, sizeof(seen));
+	hash_table_create_direct_flat(&hash, default_pool, 0);
+	for (i = 1; i <= ITER_KEYMAX; i++)
+		hash_table_insert(hash, POINTER_CAST(i), POINTER_CAST(i));
+
+	/* remove the even keys and add new keys while iterating, which
+	   causes the table to grow */
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value)) {
+		k = POINTER_CAST_TO(key, unsigned int);
+		test_assert(k == POINTER_CAST_TO(value, unsigned int));
+		seen[k]++;
+		if (k <= ITER_KEYMAX) {
+			if (k % 2 == 0) {
+				hash_table_remove(hash, key);
+				count--;
+			} else if (k % 3 == 0) {
+				hash_table_update(hash, key, POINTER_CAST(k));
+			}
+			hash_table_insert(hash, POINTER_CAST(k + ITER_KEYMAX),
+					  POINTER_CAST(k + ITER_KEYMAX));
+			count++;
+			if (k + 1 <= ITER_KEYMAX && (k + 1) % 5 == 0 &&
+			    hash_table_lookup(hash, POINTER_CAST(k + 1)) != NULL) {
+				/* remove a key before it's iterated */
+				hash_table_remove(hash, POINTER_CAST(k + 1));
+				seen[k + 1] = 1;
+				count--;
+			}
+		}
+	}
+	hash_table_iterate_deinit(&iter);
+
+	for (i = 1; i <= ITER_KEYMAX; i++)
+		test_assert_idx(seen[i] == 1, i);
+	for (; i <= ITER_KEYMAX*2; i++)
+		test_assert_idx(seen[i] <= 1, i);
+	test_assert(hash_table_count(hash) == count);
+	for (i = 1; i <= ITER_KEYMAX; i += 2) {
+		if (i % 5 != 0) {
+			test_assert_idx(hash_table_lookup(hash, POINTER_CAST(i)) ==
+					POINTER_CAST(i), i);
+		}
+	}
+
+	/* shrinks after the removals */
+	for (i = 1; i <= ITER_KEYMAX*2; i++)
+		(void)hash_table_try_remove(hash, POINTER_CAST(i));
+	test_assert(hash_table_count(hash) == 0);
+	hash_table_destroy(&hash);
+	test_end();
+}
+
+static void test_hash_flat_strings(void)
+{
+	HASH_TABLE(const char *, const char *) hash;
+	const char *key, *orig_key, *value;
+	char *key_dup;
+	unsigned int i;
+
+	test_begin("hash flat strings");
+	hash_table_create_flat(&hash, default_pool, 0, str_hash, strcmp);
+	for (i = 0; i < 500; i++) {
+		key = i_strdup_printf("key%u", i);
+		hash_table_insert(hash, key, key);
+	}
+	test_assert(hash_table_count(hash) == 500);
+	key = "nonexistent";
+	test_assert(hash_table_lookup(hash, key) == NULL);
+
+	/* update keeps the original key */
+	key = key_dup = i_strdup("key10");
+	value = "updated";
+	hash_table_update(hash, key, value);
+	key = "key10";
+	test_assert(hash_table_lookup_full(hash, key, &orig_key, &value));
+	test_assert(orig_key != key_dup && strcmp(orig_key, "key10") == 0);
+	test_assert_strcmp(value, "updated");
+	i_free(key_dup);
+
+	for (i = 0; i < 500; i++) {
+		key = t_strdup_printf("key%u", i);
+		test_assert(hash_table_lookup_full(hash, key, &orig_key, &value));
+		hash_table_remove(hash, key);
+		key_dup = (char *)orig_key;
+		i_free(key_dup);
+	}
+	test_assert(hash_table_count(hash) == 0);
+
+	key = "a";
+	hash_table_insert(hash, key, key);
+	hash_table_clear(hash, TRUE);
+	test_assert(hash_table_count(hash) == 0);
+	test_assert(hash_table_lookup(hash, key) == NULL);
+	hash_table_destroy(&hash);
+	test_end();
+}
+
+static unsigned int test_direct_hash(const void *p)
+{
+	return POINTER_CAST_TO(p, unsigned int);
+}
+
+static int test_direct_cmp(const void *p1, const void *p2)
+{
+	return p1 == p2 ? 0 : 1;
+}
+
+static void test_hash_flat_frozen(void)
+{
+	struct hash_flat *flat;
+	struct hash_flat_iterate_context ctx;
+	unsigned int i;
+	void *key, *value;
+
+	test_begin("hash flat frozen");
+	flat = hash_flat_create(0, test_direct_hash, test_direct_cmp);
+	hash_flat_iterate_init(flat, &ctx);
+	test_assert(ctx.capacity == 32);
+	hash_flat_iterate_deinit(&ctx);
+
+	/* the table grows at the normal load limit also while frozen,
+	   instead of filling all the slots first */
+	hash_flat_freeze(flat);
+	for (i = 1; i <= 32; i++)
+		hash_flat_insert(flat, POINTER_CAST(i), POINTER_CAST(i), FALSE);
+	hash_flat_iterate_init(flat, &ctx);
+	test_assert(ctx.capacity == 64);
+	hash_flat_iterate_deinit(&ctx);
+	hash_flat_thaw(flat);
+
+	for (i = 1; i <= 32; i++) {
+		test_assert_idx(hash_flat_lookup(flat, POINTER_CAST(i),
+						 &key, &value) &&
+				value == POINTER_CAST(i), i);
+	}
+	hash_flat_destroy(&flat);
+	test_end();
+}
+
 void test_hash(void)
 {
 	pool_t pool;
 
-	test_hash_random_pool(default_pool);
+	test_hash_random_pool(default_pool, FALSE);
+	test_hash_random_pool(default_pool, TRUE);
 
 	pool = pool_alloconly_create("test hash", 1024);
-	test_hash_random_pool(pool);
+	test_hash_random_pool(pool, FALSE);
+	test_hash_random_pool(pool, TRUE);
 	pool_unref(&pool);
+
+	test_hash_flat_iterate();
+	test_hash_flat_strings();
+	test_hash_flat_frozen();
 }
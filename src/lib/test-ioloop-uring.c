@@ -0,0 +1,119 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "ioloop.h"
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/io_uring.h>
+
+/* The ioloop tests are run with the io_uring handler in this process and
+   with the epoll fallback in a child process. The handler is chosen once
+   per process, so both can't be tested in the same one. */
+
+static bool test_uring_disabled;
+
+static bool test_uring_is_supported(void)
+{
+	struct io_uring_params params;
+	int fd;
+
+	i_zero(&params);
+	fd = syscall(__NR_io_uring_setup, 1, &params);
+	if (fd == -1)
+		return FALSE;
+	i_close_fd(&fd);
+	/* the same features are required by the handler */
+	return (params.features & IORING_FEAT_SINGLE_MMAP) != 0 &&
+		(params.features & IORING_FEAT_NODROP) != 0 &&
+		(params.features & IORING_FEAT_EXT_ARG) != 0;
+}
+
+static bool test_have_fd_link(const char *target)
+{
+	DIR *dir;
+	struct dirent *d;
+	char path[PATH_MAX], link[PATH_MAX];
+	ssize_t ret;
+	bool found = FALSE;
+
+	dir = opendir("/proc/self/fd");
+	if (dir == NULL)
+		i_fatal("opendir(/proc/self/fd) failed: %m");
+	while ((d = readdir(dir)) != NULL && !found) {
+		if (i_snprintf(path, sizeof(path), "/proc/self/fd/%s",
+			       d->d_name) < 0)
+			continue;
+		ret = readlink(path, link, sizeof(link) - 1);
+		if (ret < 0)
+			continue;
+		link[ret] = '\0';
+		found = strcmp(link, target) == 0;
+	}
+	(void)closedir(dir);
+	return found;
+}
+
+static void test_io_callback(void *context ATTR_UNUSED)
+{
+}
+
+static void test_ioloop_uring_handler(void)
+{
+	struct ioloop *ioloop;
+	struct io *io;
+	int fds[2];
+	bool expect_uring;
+
+	test_begin(test_uring_disabled ?
+		   "ioloop uring handler (IOLOOP_URING_DISABLE)" :
+		   "ioloop uring handler");
+	expect_uring = !test_uring_disabled && test_uring_is_supported();
+	if (!test_uring_disabled && !expect_uring)
+		i_info("io_uring isn't supported - testing the fallback");
+
+	/* the handler is initialized when the first I/O is added */
+	if (pipe(fds) < 0)
+		i_fatal("pipe() failed: %m");
+	ioloop = io_loop_create();
+	io = io_add(fds[0], IO_READ, test_io_callback, NULL);
+	test_assert(test_have_fd_link("anon_inode:[io_uring]") ==
+		    expect_uring);
+	test_assert(test_have_fd_link("anon_inode:[eventpoll]") ==
+		    !expect_uring);
+	io_remove(&io);
+	io_loop_destroy(&ioloop);
+	i_close_fd(&fds[0]);
+	i_close_fd(&fds[1]);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_ioloop_uring_handler,
+		test_ioloop,
+		NULL
+	};
+	int status, ret;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		if (setenv("IOLOOP_URING_DISABLE", "1", 1) < 0)
+			i_fatal("setenv() failed: %m");
+		test_uring_disabled = TRUE;
+		return test_run(test_functions);
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+
+	ret = test_run(test_functions);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		ret = 1;
+	return ret;
+}
@@ -181,9 +181,47 @@ static void test_ostream_file_send_istream_sendfile(void)
 	test_end();
 }
 
+static void test_ostream_file_send_istream_pipe(void)
+{
+	struct istream *input, *input2;
+	struct ostream *output;
+	char buf[10];
+	int fd, pipe_fd[2];
+
+	test_begin("ostream file send istream to pipe");
+
+	fd = open(".temp.istream", O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("creat(.temp.istream) failed: %m");
+	test_assert(write(fd, "abcdefghij", 10) == 10);
+	test_assert(lseek(fd, 0, SEEK_SET) == 0);
+	input = i_stream_create_fd_autoclose(&fd, 1024);
+
+	if (pipe(pipe_fd) < 0)
+		i_fatal("pipe() failed: %m");
+	output = o_stream_create_fd_autoclose(&pipe_fd[1], 0);
+
+	i_stream_seek(input, 2);
+	input2 = i_stream_create_limit(input, 5);
+	test_assert(o_stream_send_istream(output, input2) == OSTREAM_SEND_ISTREAM_RESULT_FINISHED);
+	test_assert(output->offset == 5);
+	test_assert(input2->v_offset == 5);
+	test_assert(read(pipe_fd[0], buf, sizeof(buf)) == 5 &&
+		    memcmp(buf, "cdefg", 5) == 0);
+	i_stream_unref(&input2);
+
+	i_stream_unref(&input);
+	o_stream_destroy(&output);
+	i_close_fd(&pipe_fd[0]);
+
+	i_unlink(".temp.istream");
+	test_end();
+}
+
 void test_ostream_file(void)
 {
 	test_ostream_file_random();
 	test_ostream_file_send_istream_file();
 	test_ostream_file_send_istream_sendfile();
+	test_ostream_file_send_istream_pipe();
 }
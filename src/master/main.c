@@ -662,6 +662,9 @@ static void print_build_options(void)
 #ifdef IOLOOP_EPOLL
 		" ioloop=epoll"
 #endif
+#ifdef IOLOOP_URING
+		" ioloop=uring"
+#endif
 #ifdef IOLOOP_KQUEUE
 		" ioloop=kqueue"
 #endif
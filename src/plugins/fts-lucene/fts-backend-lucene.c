@@ -315,14 +315,9 @@ fts_backend_lucene_update_set_mailbox(struct fts_backend_update_context *_ctx,
 	ctx->last_indexed_uid_set = FALSE;
 }
 
-static void
-fts_backend_lucene_update_expunge(struct fts_backend_update_context *_ctx,
-				  uint32_t uid)
+static uint32_t
+fts_backend_lucene_get_last_indexed_uid(struct lucene_fts_backend_update_context *ctx)
 {
-	struct lucene_fts_backend_update_context *ctx =
-		(struct lucene_fts_backend_update_context *)_ctx;
-	struct lucene_fts_backend *backend =
-		(struct lucene_fts_backend *)_ctx->backend;
 	struct fts_index_header hdr;
 
 	if (!ctx->last_indexed_uid_set) {
@@ -332,15 +327,14 @@ fts_backend_lucene_update_expunge(struct fts_backend_update_context *_ctx,
 			ctx->last_indexed_uid = hdr.last_indexed_uid;
 		ctx->last_indexed_uid_set = TRUE;
 	}
-	if (ctx->last_indexed_uid == 0 ||
-	    uid > ctx->last_indexed_uid + 100) {
-		/* don't waste time adding expunge to log for a message that
-		   isn't even indexed. this check is racy, because indexer may
-		   just be in the middle of indexing this message. we'll
-		   attempt to avoid that by skipping the expunging only if
-		   indexing hasn't been done for a while (100 msgs). */
-		return;
-	}
+	return ctx->last_indexed_uid;
+}
+
+static void
+fts_backend_lucene_expunge_begin(struct lucene_fts_backend_update_context *ctx)
+{
+	struct lucene_fts_backend *backend =
+		(struct lucene_fts_backend *)ctx->ctx.backend;
 
 	if (ctx->expunge_ctx == NULL) {
 		ctx->expunge_ctx =
@@ -348,12 +342,60 @@ fts_backend_lucene_update_expunge(struct fts_backend_update_context *_ctx,
 	}
 
 	if (fts_backend_select(backend, ctx->box) < 0)
-		_ctx->failed = TRUE;
+		ctx->ctx.failed = TRUE;
+}
+
+static void
+fts_backend_lucene_update_expunge(struct fts_backend_update_context *_ctx,
+				  uint32_t uid)
+{
+	struct lucene_fts_backend_update_context *ctx =
+		(struct lucene_fts_backend_update_context *)_ctx;
+	struct lucene_fts_backend *backend =
+		(struct lucene_fts_backend *)_ctx->backend;
+	uint32_t last_indexed_uid;
+
+	last_indexed_uid = fts_backend_lucene_get_last_indexed_uid(ctx);
+	if (last_indexed_uid == 0 || uid > last_indexed_uid + 100) {
+		/* don't waste time adding expunge to log for a message that
+		   isn't even indexed. this check is racy, because indexer may
+		   just be in the middle of indexing this message. we'll
+		   attempt to avoid that by skipping the expunging only if
+		   indexing hasn't been done for a while (100 msgs). */
+		return;
+	}
 
+	fts_backend_lucene_expunge_begin(ctx);
 	fts_expunge_log_append_next(ctx->expunge_ctx,
 				    backend->selected_box_guid, uid);
 }
 
+static void
+fts_backend_lucene_update_expunge_range(struct fts_backend_update_context *_ctx,
+					const ARRAY_TYPE(seq_range) *uids)
+{
+	struct lucene_fts_backend_update_context *ctx =
+		(struct lucene_fts_backend_update_context *)_ctx;
+	struct lucene_fts_backend *backend =
+		(struct lucene_fts_backend *)_ctx->backend;
+	const struct seq_range *range;
+	uint32_t last_indexed_uid;
+
+	/* skip the UIDs that aren't indexed, as in update_expunge() */
+	last_indexed_uid = fts_backend_lucene_get_last_indexed_uid(ctx);
+	if (last_indexed_uid == 0 || array_count(uids) == 0 ||
+	    array_front(uids)->seq1 > last_indexed_uid + 100)
+		return;
+
+	fts_backend_lucene_expunge_begin(ctx);
+	array_foreach(uids, range) {
+		if (range->seq1 > last_indexed_uid + 100)
+			break;
+		fts_expunge_log_append_range(ctx->expunge_ctx,
+					     backend->selected_box_guid, range);
+	}
+}
+
 static bool
 fts_backend_lucene_update_set_build_key(struct fts_backend_update_context *_ctx,
 					const struct fts_backend_build_key *key)
@@ -462,6 +504,10 @@ static int fts_backend_lucene_optimize(struct fts_backend *_backend)
 		(struct lucene_fts_backend *)_backend;
 	int ret;
 
+	/* merge the log so that each mailbox's expunges are deleted with a
+	   single search. errors are logged, and a corrupted log is noticed
+	   again below. */
+	(void)fts_expunge_log_compact(backend->expunge_log);
 	ret = lucene_index_expunge_from_log(backend->index,
 					    backend->expunge_log);
 	if (ret == 0) {
@@ -473,6 +519,30 @@ static int fts_backend_lucene_optimize(struct fts_backend *_backend)
 	return ret;
 }
 
+static int
+fts_backend_lucene_get_fragmentation(struct fts_backend *_backend,
+				     struct mailbox *box,
+				     unsigned int *fragmentation_r)
+{
+	struct lucene_fts_backend *backend =
+		(struct lucene_fts_backend *)_backend;
+	unsigned int expunges;
+	uint32_t numdocs;
+
+	/* the index is shared by the whole namespace */
+	if (fts_backend_select(backend, box) < 0)
+		return -1;
+	if (lucene_index_get_doc_count(backend->index, &numdocs) < 0)
+		return -1;
+	if (fts_expunge_log_uid_count(backend->expunge_log, &expunges) < 0)
+		return -1;
+
+	/* update_deinit optimizes once >2% of the index has been expunged */
+	*fragmentation_r = numdocs == 0 ? 0 :
+		(uint64_t)expunges * 100 * 50 / numdocs;
+	return 0;
+}
+
 static int
 fts_backend_lucene_lookup(struct fts_backend *_backend, struct mailbox *box,
 			  struct mail_search_arg *args,
@@ -600,6 +670,8 @@ struct fts_backend fts_backend_lucene = {
 		fts_backend_default_can_lookup,
 		fts_backend_lucene_lookup,
 		fts_backend_lucene_lookup_multi,
-		fts_backend_lucene_lookup_done
+		fts_backend_lucene_lookup_done,
+		fts_backend_lucene_get_fragmentation,
+		fts_backend_lucene_update_expunge_range
 	}
 };
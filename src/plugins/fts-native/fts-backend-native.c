@@ -0,0 +1,598 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "mail-user.h"
+#include "mail-namespace.h"
+#include "mail-storage-private.h"
+#include "mailbox-list-iter.h"
+#include "mail-search.h"
+#include "fts-native-index.h"
+#include "fts-native-plugin.h"
+
+/* Term prefixes. Each token is indexed as a body or a header term. Tokens
+   of the commonly searched headers are additionally indexed with the
+   header name, so that searching them doesn't require verifying the
+   results. */
+#define FTS_NATIVE_TERM_BODY "b:"
+#define FTS_NATIVE_TERM_HEADER "h:"
+#define FTS_NATIVE_TERM_HEADER_NAME "n"
+
+struct native_fts_backend {
+	struct fts_backend backend;
+
+	struct fts_native_index *index;
+};
+
+struct native_fts_backend_update_context {
+	struct fts_backend_update_context ctx;
+
+	struct mailbox *box;
+	struct fts_native_index_build *build;
+	uint32_t last_uid;
+
+	uint32_t uid;
+	const char *term_prefix;
+	/* for headers indexed also with the header name */
+	string_t *hdr_term_prefix;
+	string_t *term;
+};
+
+static struct fts_backend *fts_backend_native_alloc(void)
+{
+	struct native_fts_backend *backend;
+
+	backend = i_new(struct native_fts_backend, 1);
+	backend->backend = fts_backend_native;
+	return &backend->backend;
+}
+
+static int
+fts_backend_native_init(struct fts_backend *_backend, const char **error_r)
+{
+	struct fts_native_user *fuser =
+		FTS_NATIVE_USER_CONTEXT(_backend->ns->user);
+
+	if (fuser == NULL) {
+		/* invalid settings */
+		*error_r = "Invalid fts_native settings";
+		return -1;
+	}
+	return 0;
+}
+
+static void fts_backend_native_unset_box(struct native_fts_backend *backend)
+{
+	if (backend->index != NULL)
+		fts_native_index_deinit(&backend->index);
+}
+
+static void fts_backend_native_deinit(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+
+	fts_backend_native_unset_box(backend);
+	i_free(backend);
+}
+
+static int
+fts_backend_native_set_box(struct native_fts_backend *backend,
+			   struct mailbox *box)
+{
+	struct fts_native_user *fuser =
+		FTS_NATIVE_USER_CONTEXT_REQUIRE(backend->backend.ns->user);
+	const struct mailbox_permissions *perm;
+	struct mail_storage *storage;
+	struct fts_native_index_settings set;
+	const char *path;
+
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX, &path) <= 0)
+		i_unreached(); /* fts already checked this */
+	path = t_strconcat(path, "/"FTS_NATIVE_INDEX_DIR_NAME, NULL);
+
+	if (backend->index != NULL) {
+		if (strcmp(fts_native_index_get_dir(backend->index), path) == 0)
+			return fts_native_index_refresh(backend->index);
+		fts_backend_native_unset_box(backend);
+	}
+
+	perm = mailbox_get_permissions(box);
+	storage = mailbox_get_storage(box);
+
+	i_zero(&set);
+	set.lock_method = storage->set->parsed_lock_method;
+	set.lock_timeout_secs =
+		mail_storage_get_lock_timeout(storage, UINT_MAX);
+	set.mail_set = storage->set;
+	set.file_mode = perm->file_create_mode;
+	set.dir_mode = perm->dir_create_mode;
+	set.gid = perm->file_create_gid;
+	set.gid_origin = perm->file_create_gid_origin;
+	set.max_segments = fuser->set.max_segments;
+	set.flush_postings = fuser->set.flush_postings;
+
+	backend->index = fts_native_index_init(path, &set);
+	return fts_native_index_refresh(backend->index);
+}
+
+static int
+fts_backend_native_get_last_uid(struct fts_backend *_backend,
+				struct mailbox *box, uint32_t *last_uid_r)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+	struct fts_index_header hdr;
+
+	if (fts_index_get_header(box, &hdr)) {
+		*last_uid_r = hdr.last_indexed_uid;
+		return 0;
+	}
+
+	/* the mailbox index doesn't know it, fall back to our own state */
+	if (fts_backend_native_set_box(backend, box) < 0)
+		return -1;
+	*last_uid_r = fts_native_index_get_last_uid(backend->index);
+	fts_index_set_last_uid(box, *last_uid_r);
+	return 0;
+}
+
+static struct fts_backend_update_context *
+fts_backend_native_update_init(struct fts_backend *_backend)
+{
+	struct native_fts_backend_update_context *ctx;
+
+	ctx = i_new(struct native_fts_backend_update_context, 1);
+	ctx->ctx.backend = _backend;
+	ctx->hdr_term_prefix = str_new(default_pool, 64);
+	ctx->term = str_new(default_pool, 128);
+	return &ctx->ctx;
+}
+
+static int
+fts_backend_native_update_finish_box(struct native_fts_backend_update_context *ctx)
+{
+	int ret = 0;
+
+	if (ctx->build != NULL) {
+		if (fts_native_index_build_deinit(&ctx->build) < 0)
+			ret = -1;
+	}
+	if (ret == 0 && ctx->last_uid != 0)
+		fts_index_set_last_uid(ctx->box, ctx->last_uid);
+	ctx->last_uid = 0;
+	ctx->uid = 0;
+	return ret;
+}
+
+static int
+fts_backend_native_update_deinit(struct fts_backend_update_context *_ctx)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+	int ret = _ctx->failed ? -1 : 0;
+
+	if (fts_backend_native_update_finish_box(ctx) < 0)
+		ret = -1;
+	str_free(&ctx->hdr_term_prefix);
+	str_free(&ctx->term);
+	i_free(ctx);
+	return ret;
+}
+
+static void
+fts_backend_native_update_set_mailbox(struct fts_backend_update_context *_ctx,
+				      struct mailbox *box)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+
+	if (fts_backend_native_update_finish_box(ctx) < 0)
+		_ctx->failed = TRUE;
+	ctx->box = box;
+}
+
+static struct fts_native_index_build *
+fts_backend_native_get_build(struct native_fts_backend_update_context *ctx)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)ctx->ctx.backend;
+
+	if (ctx->build == NULL) {
+		if (fts_backend_native_set_box(backend, ctx->box) < 0)
+			return NULL;
+		ctx->build = fts_native_index_build_init(backend->index);
+	}
+	return ctx->build;
+}
+
+static void
+fts_backend_native_update_expunge(struct fts_backend_update_context *_ctx,
+				  uint32_t uid)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+	struct fts_native_index_build *build;
+
+	if ((build = fts_backend_native_get_build(ctx)) == NULL)
+		_ctx->failed = TRUE;
+	else
+		fts_native_index_build_expunge(build, uid);
+}
+
+static void
+fts_backend_native_update_expunge_range(struct fts_backend_update_context *_ctx,
+					const ARRAY_TYPE(seq_range) *uids)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+	struct fts_native_index_build *build;
+
+	if ((build = fts_backend_native_get_build(ctx)) == NULL)
+		_ctx->failed = TRUE;
+	else
+		fts_native_index_build_expunge_range(build, uids);
+}
+
+static bool
+fts_backend_native_update_set_build_key(struct fts_backend_update_context *_ctx,
+					const struct fts_backend_build_key *key)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+
+	if (_ctx->failed)
+		return FALSE;
+	if (fts_backend_native_get_build(ctx) == NULL) {
+		_ctx->failed = TRUE;
+		return FALSE;
+	}
+
+	if (key->uid != ctx->uid) {
+		i_assert(key->uid >= ctx->uid);
+		ctx->uid = key->uid;
+		ctx->last_uid = key->uid;
+	}
+
+	str_truncate(ctx->hdr_term_prefix, 0);
+	switch (key->type) {
+	case FTS_BACKEND_BUILD_KEY_HDR:
+	case FTS_BACKEND_BUILD_KEY_MIME_HDR:
+		ctx->term_prefix = FTS_NATIVE_TERM_HEADER;
+		/* hdr_name is "" when indexing the header names themselves */
+		if (key->hdr_name[0] != '\0' &&
+		    fts_header_want_indexed(key->hdr_name)) {
+			str_append(ctx->hdr_term_prefix,
+				   FTS_NATIVE_TERM_HEADER_NAME);
+			str_append(ctx->hdr_term_prefix,
+				   t_str_lcase(key->hdr_name));
+			str_append_c(ctx->hdr_term_prefix, ':');
+		}
+		break;
+	case FTS_BACKEND_BUILD_KEY_BODY_PART:
+		ctx->term_prefix = FTS_NATIVE_TERM_BODY;
+		break;
+	case FTS_BACKEND_BUILD_KEY_BODY_PART_BINARY:
+		i_unreached();
+	}
+	return TRUE;
+}
+
+static void
+fts_backend_native_update_unset_build_key(struct fts_backend_update_context *_ctx ATTR_UNUSED)
+{
+}
+
+static void
+fts_backend_native_add_term(struct native_fts_backend_update_context *ctx,
+			    const char *prefix, const unsigned char *data,
+			    size_t size)
+{
+	str_truncate(ctx->term, 0);
+	str_append(ctx->term, prefix);
+	str_append_data(ctx->term, data, size);
+	fts_native_index_build_add(ctx->build, str_c(ctx->term), ctx->uid);
+}
+
+static int
+fts_backend_native_update_build_more(struct fts_backend_update_context *_ctx,
+				     const unsigned char *data, size_t size)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+
+	/* with tokenized input each call is a single token */
+	if (size == 0 || memchr(data, '\0', size) != NULL)
+		return 0;
+
+	fts_backend_native_add_term(ctx, ctx->term_prefix, data, size);
+	if (str_len(ctx->hdr_term_prefix) > 0) {
+		fts_backend_native_add_term(ctx, str_c(ctx->hdr_term_prefix),
+					    data, size);
+	}
+	return 0;
+}
+
+static int fts_backend_native_refresh(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+
+	if (backend->index == NULL)
+		return 0;
+	return fts_native_index_refresh(backend->index);
+}
+
+static int fts_backend_native_rescan(struct fts_backend *backend)
+{
+	/* the postings are sets of UIDs, so re-indexing already indexed
+	   messages doesn't produce duplicates */
+	return fts_backend_reset_last_uids(backend);
+}
+
+static int
+fts_backend_native_get_fragmentation(struct fts_backend *_backend,
+				     struct mailbox *box,
+				     unsigned int *fragmentation_r)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+
+	if (fts_backend_native_set_box(backend, box) < 0)
+		return -1;
+	*fragmentation_r = fts_native_index_get_fragmentation(backend->index);
+	return 0;
+}
+
+static int fts_backend_native_optimize(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+	struct mailbox_list_iterate_context *iter;
+	const struct mailbox_info *info;
+	struct mailbox *box;
+	int ret = 0;
+
+	iter = mailbox_list_iter_init(_backend->ns->list, "*",
+				      MAILBOX_LIST_ITER_SKIP_ALIASES |
+				      MAILBOX_LIST_ITER_NO_AUTO_BOXES);
+	while ((info = mailbox_list_iter_next(iter)) != NULL) {
+		if ((info->flags &
+		     (MAILBOX_NOSELECT | MAILBOX_NONEXISTENT)) != 0)
+			continue;
+
+		box = mailbox_alloc(_backend->ns->list, info->vname, 0);
+		T_BEGIN {
+			if (fts_backend_native_set_box(backend, box) < 0 ||
+			    fts_native_index_optimize(backend->index) < 0)
+				ret = -1;
+		} T_END;
+		fts_backend_native_unset_box(backend);
+		mailbox_free(&box);
+	}
+	if (mailbox_list_iter_deinit(&iter) < 0)
+		ret = -1;
+	return ret;
+}
+
+static int
+fts_backend_native_lookup_term(struct native_fts_backend *backend,
+			       const char *prefix, const char *token,
+			       ARRAY_TYPE(seq_range) *uids)
+{
+	struct fts_native_user *fuser =
+		FTS_NATIVE_USER_CONTEXT_REQUIRE(backend->backend.ns->user);
+	const char *term = t_strconcat(prefix, token, NULL);
+
+	return fts_native_index_lookup(backend->index, term,
+				       !fuser->set.no_prefix, uids);
+}
+
+static int
+native_lookup_arg(struct native_fts_backend *backend,
+		  const struct mail_search_arg *arg, bool and_args,
+		  enum fts_lookup_flags flags,
+		  ARRAY_TYPE(seq_range) *definite_uids,
+		  ARRAY_TYPE(seq_range) *maybe_uids)
+{
+	ARRAY_TYPE(seq_range) tmp_definite_uids, tmp_maybe_uids;
+	ARRAY_TYPE(seq_range) *uids;
+	uint32_t last_uid;
+	bool maybe;
+	int ret;
+
+	switch (arg->type) {
+	case SEARCH_TEXT:
+	case SEARCH_BODY:
+		break;
+	case SEARCH_HEADER:
+	case SEARCH_HEADER_ADDRESS:
+	case SEARCH_HEADER_COMPRESS_LWSP:
+		if (arg->value.str[0] == '\0') {
+			/* header existence isn't indexed */
+			return 0;
+		}
+		break;
+	default:
+		return 0;
+	}
+
+	t_array_init(&tmp_definite_uids, 128);
+	t_array_init(&tmp_maybe_uids, 128);
+
+	/* the tokens are matched as word prefixes, which isn't exactly
+	   IMAP's substring matching */
+	maybe = (flags & FTS_LOOKUP_FLAG_NO_AUTO_FUZZY) != 0 && !arg->fuzzy;
+	uids = maybe ? &tmp_maybe_uids : &tmp_definite_uids;
+
+	switch (arg->type) {
+	case SEARCH_TEXT:
+		ret = fts_backend_native_lookup_term(backend,
+				FTS_NATIVE_TERM_BODY, arg->value.str, uids);
+		if (ret == 0) {
+			ret = fts_backend_native_lookup_term(backend,
+				FTS_NATIVE_TERM_HEADER, arg->value.str, uids);
+		}
+		break;
+	case SEARCH_BODY:
+		ret = fts_backend_native_lookup_term(backend,
+				FTS_NATIVE_TERM_BODY, arg->value.str, uids);
+		break;
+	default:
+		if (fts_header_want_indexed(arg->hdr_field_name)) {
+			ret = fts_backend_native_lookup_term(backend,
+				t_strconcat(FTS_NATIVE_TERM_HEADER_NAME,
+					    t_str_lcase(arg->hdr_field_name),
+					    ":", NULL),
+				arg->value.str, uids);
+		} else {
+			/* the token exists in some header, but we don't know
+			   if it's the wanted one */
+			ret = fts_backend_native_lookup_term(backend,
+				FTS_NATIVE_TERM_HEADER, arg->value.str,
+				&tmp_maybe_uids);
+			seq_range_array_merge(&tmp_maybe_uids,
+					      &tmp_definite_uids);
+			array_clear(&tmp_definite_uids);
+		}
+		break;
+	}
+	if (ret < 0)
+		return -1;
+
+	if (arg->match_not) {
+		/* definite -> non-match
+		   maybe -> maybe
+		   non-match -> maybe (the substring may exist within
+		   some word) */
+		last_uid = fts_native_index_get_last_uid(backend->index);
+		array_clear(&tmp_maybe_uids);
+		if (last_uid > 0) {
+			seq_range_array_add_range(&tmp_maybe_uids,
+						  1, last_uid);
+		}
+		seq_range_array_remove_seq_range(&tmp_maybe_uids,
+						 &tmp_definite_uids);
+		array_clear(&tmp_definite_uids);
+	}
+
+	if (and_args) {
+		/* AND:
+		   definite && definite -> definite
+		   definite && maybe -> maybe
+		   maybe && maybe -> maybe */
+
+		/* put definites among maybies, so they can be intersected */
+		seq_range_array_merge(maybe_uids, definite_uids);
+		seq_range_array_merge(&tmp_maybe_uids, &tmp_definite_uids);
+
+		seq_range_array_intersect(maybe_uids, &tmp_maybe_uids);
+		seq_range_array_intersect(definite_uids, &tmp_definite_uids);
+		/* remove duplicate maybies that are also definites */
+		seq_range_array_remove_seq_range(maybe_uids, definite_uids);
+	} else {
+		/* OR:
+		   definite || definite -> definite
+		   definite || maybe -> definite
+		   maybe || maybe -> maybe */
+
+		/* remove maybies that are now definites */
+		seq_range_array_remove_seq_range(&tmp_maybe_uids,
+						 definite_uids);
+		seq_range_array_remove_seq_range(maybe_uids,
+						 &tmp_definite_uids);
+
+		seq_range_array_merge(definite_uids, &tmp_definite_uids);
+		seq_range_array_merge(maybe_uids, &tmp_maybe_uids);
+	}
+	return 1;
+}
+
+static int
+fts_backend_native_lookup(struct fts_backend *_backend, struct mailbox *box,
+			  struct mail_search_arg *args,
+			  enum fts_lookup_flags flags,
+			  struct fts_result *result)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+	bool and_args = (flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0;
+	bool first = TRUE;
+	int ret;
+
+	if (fts_backend_native_set_box(backend, box) < 0)
+		return -1;
+
+	for (; args != NULL; args = args->next) {
+		T_BEGIN {
+			ret = native_lookup_arg(backend, args,
+						first ? FALSE : and_args,
+						flags, &result->definite_uids,
+						&result->maybe_uids);
+		} T_END;
+		if (ret < 0)
+			return -1;
+		if (ret > 0) {
+			args->match_always = TRUE;
+			first = FALSE;
+		}
+	}
+	return 0;
+}
+
+static int
+fts_backend_native_lookup_multi(struct fts_backend *backend,
+				struct mailbox *const boxes[],
+				struct mail_search_arg *args,
+				enum fts_lookup_flags flags,
+				struct fts_multi_result *result)
+{
+	ARRAY(struct fts_result) box_results;
+	struct fts_result *box_result;
+	unsigned int i;
+
+	/* each mailbox has its own index, so the lookup is cheap to do
+	   separately for each of them */
+	p_array_init(&box_results, result->pool, 8);
+	for (i = 0; boxes[i] != NULL; i++) {
+		box_result = array_append_space(&box_results);
+		box_result->box = boxes[i];
+		p_array_init(&box_result->definite_uids, result->pool, 32);
+		p_array_init(&box_result->maybe_uids, result->pool, 32);
+		if (fts_backend_native_lookup(backend, boxes[i], args,
+					      flags, box_result) < 0)
+			return -1;
+	}
+	array_append_zero(&box_results);
+	result->box_results = array_front_modifiable(&box_results);
+	return 0;
+}
+
+struct fts_backend fts_backend_native = {
+	.name = "native",
+	.flags = FTS_BACKEND_FLAG_TOKENIZED_INPUT,
+
+	{
+		fts_backend_native_alloc,
+		fts_backend_native_init,
+		fts_backend_native_deinit,
+		fts_backend_native_get_last_uid,
+		fts_backend_native_update_init,
+		fts_backend_native_update_deinit,
+		fts_backend_native_update_set_mailbox,
+		fts_backend_native_update_expunge,
+		fts_backend_native_update_set_build_key,
+		fts_backend_native_update_unset_build_key,
+		fts_backend_native_update_build_more,
+		fts_backend_native_refresh,
+		fts_backend_native_rescan,
+		fts_backend_native_optimize,
+		fts_backend_default_can_lookup,
+		fts_backend_native_lookup,
+		fts_backend_native_lookup_multi,
+		NULL,
+		fts_backend_native_get_fragmentation,
+		fts_backend_native_update_expunge_range
+	}
+};
@@ -0,0 +1,845 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "hash.h"
+#include "sort.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "safe-mkstemp.h"
+#include "mkdir-parents.h"
+#include "file-create-locked.h"
+#include "mail-storage-private.h"
+#include "fts-native-segment.h"
+#include "fts-native-index.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define FTS_NATIVE_STATE_FNAME "state"
+#define FTS_NATIVE_LOCK_FNAME "lock"
+#define FTS_NATIVE_SEGMENT_PREFIX "seg."
+#define FTS_NATIVE_TEMP_PREFIX "tmp."
+
+#define FTS_NATIVE_STATE_MAGIC 0x53535446 /* "FTSS" */
+#define FTS_NATIVE_STATE_VERSION 1
+
+/* The state file lists the segments that currently make up the index and
+   the UIDs that have been expunged since the segments were written. It's
+   only replaced (write to temp + rename) while the index is locked. */
+struct fts_native_state_header {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t unused[3];
+
+	uint32_t next_segment_id;
+	uint32_t last_uid;
+	uint32_t segment_count;
+	uint32_t expunge_range_count;
+	/* uint32_t segment_ids[segment_count];
+	   struct seq_range expunged_uids[expunge_range_count]; */
+};
+
+struct fts_native_index_state {
+	uint32_t next_segment_id;
+	uint32_t last_uid;
+	ARRAY_TYPE(uint32_t) segment_ids;
+	ARRAY_TYPE(seq_range) expunged_uids;
+};
+
+struct fts_native_open_segment {
+	uint32_t id;
+	struct fts_native_segment *segment;
+};
+
+struct fts_native_index {
+	char *dir, *state_path, *gid_origin;
+	struct fts_native_index_settings set;
+
+	struct fts_native_index_state state;
+	ARRAY(struct fts_native_open_segment) segments;
+
+	/* for detecting state file changes */
+	ino_t state_ino;
+	off_t state_size;
+	time_t state_mtime;
+	unsigned long state_mtime_nsec;
+};
+
+struct fts_native_build_term {
+	const char *term;
+	uint32_t last_uid;
+	unsigned int idx;
+};
+
+struct fts_native_build_posting {
+	struct fts_native_build_term *term;
+	uint32_t uid;
+};
+
+struct fts_native_index_build {
+	struct fts_native_index *index;
+
+	pool_t term_pool;
+	HASH_TABLE(const char *, struct fts_native_build_term *) terms;
+	ARRAY(struct fts_native_build_posting) postings;
+
+	ARRAY(char *) temp_paths;
+	ARRAY_TYPE(seq_range) expunged_uids;
+	uint32_t max_uid;
+
+	bool failed:1;
+};
+
+struct fts_native_index *
+fts_native_index_init(const char *dir,
+		      const struct fts_native_index_settings *set)
+{
+	struct fts_native_index *index;
+
+	index = i_new(struct fts_native_index, 1);
+	index->dir = i_strdup(dir);
+	index->state_path = i_strconcat(dir, "/"FTS_NATIVE_STATE_FNAME, NULL);
+	index->set = *set;
+	index->gid_origin = i_strdup(set->gid_origin);
+	index->set.gid_origin = index->gid_origin;
+	if (index->set.max_segments == 0)
+		index->set.max_segments = FTS_NATIVE_DEFAULT_MAX_SEGMENTS;
+	if (index->set.flush_postings == 0)
+		index->set.flush_postings = FTS_NATIVE_DEFAULT_FLUSH_POSTINGS;
+	i_array_init(&index->state.segment_ids, 16);
+	i_array_init(&index->state.expunged_uids, 16);
+	i_array_init(&index->segments, 16);
+	return index;
+}
+
+static void fts_native_index_close_segments(struct fts_native_index *index)
+{
+	struct fts_native_open_segment *seg;
+
+	array_foreach_modifiable(&index->segments, seg)
+		fts_native_segment_close(&seg->segment);
+	array_clear(&index->segments);
+}
+
+void fts_native_index_deinit(struct fts_native_index **_index)
+{
+	struct fts_native_index *index = *_index;
+
+	*_index = NULL;
+	fts_native_index_close_segments(index);
+	array_free(&index->segments);
+	array_free(&index->state.segment_ids);
+	array_free(&index->state.expunged_uids);
+	i_free(index->gid_origin);
+	i_free(index->state_path);
+	i_free(index->dir);
+	i_free(index);
+}
+
+const char *fts_native_index_get_dir(struct fts_native_index *index)
+{
+	return index->dir;
+}
+
+static const char *
+fts_native_index_segment_path(struct fts_native_index *index, uint32_t id)
+{
+	return t_strdup_printf("%s/"FTS_NATIVE_SEGMENT_PREFIX"%u",
+			       index->dir, id);
+}
+
+static void fts_native_index_state_clear(struct fts_native_index *index)
+{
+	index->state.next_segment_id = 1;
+	index->state.last_uid = 0;
+	array_clear(&index->state.segment_ids);
+	array_clear(&index->state.expunged_uids);
+}
+
+static bool
+fts_native_index_state_has_segment(struct fts_native_index *index,
+				   uint32_t id)
+{
+	const uint32_t *idp;
+
+	array_foreach(&index->state.segment_ids, idp) {
+		if (*idp == id)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void
+fts_native_index_drop_stale_segments(struct fts_native_index *index)
+{
+	struct fts_native_open_segment *segs;
+	unsigned int i, count;
+
+	segs = array_get_modifiable(&index->segments, &count);
+	for (i = 0; i < count; ) {
+		if (fts_native_index_state_has_segment(index, segs[i].id))
+			i++;
+		else {
+			fts_native_segment_close(&segs[i].segment);
+			array_delete(&index->segments, i, 1);
+			segs = array_get_modifiable(&index->segments, &count);
+		}
+	}
+}
+
+static int
+fts_native_index_parse_state(struct fts_native_index *index,
+			     const unsigned char *data, size_t size)
+{
+	const struct fts_native_state_header *hdr = (const void *)data;
+	const uint32_t *ids;
+	const struct seq_range *ranges;
+	size_t ids_size, ranges_size;
+
+	if (size < sizeof(*hdr) || hdr->magic != FTS_NATIVE_STATE_MAGIC ||
+	    hdr->version != FTS_NATIVE_STATE_VERSION)
+		return -1;
+	ids_size = hdr->segment_count * sizeof(uint32_t);
+	ranges_size = hdr->expunge_range_count * sizeof(struct seq_range);
+	if (size != sizeof(*hdr) + ids_size + ranges_size)
+		return -1;
+
+	ids = CONST_PTR_OFFSET(data, sizeof(*hdr));
+	ranges = CONST_PTR_OFFSET(data, sizeof(*hdr) + ids_size);
+
+	fts_native_index_state_clear(index);
+	index->state.next_segment_id = hdr->next_segment_id;
+	index->state.last_uid = hdr->last_uid;
+	array_append(&index->state.segment_ids, ids, hdr->segment_count);
+	array_append(&index->state.expunged_uids, ranges,
+		     hdr->expunge_range_count);
+	return 0;
+}
+
+static int fts_native_index_read_state(struct fts_native_index *index)
+{
+	buffer_t *buf;
+	struct stat st;
+	int fd, ret;
+
+	fd = open(index->state_path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			i_error("open(%s) failed: %m", index->state_path);
+			return -1;
+		}
+		fts_native_index_state_clear(index);
+		index->state_ino = 0;
+		fts_native_index_drop_stale_segments(index);
+		return 0;
+	}
+	if (fstat(fd, &st) < 0) {
+		i_error("fstat(%s) failed: %m", index->state_path);
+		i_close_fd(&fd);
+		return -1;
+	}
+
+	buf = t_buffer_create(st.st_size);
+	ret = read_full(fd, buffer_append_space_unsafe(buf, st.st_size),
+			st.st_size);
+	if (ret < 0)
+		i_error("read(%s) failed: %m", index->state_path);
+	else if (ret == 0 ||
+		 fts_native_index_parse_state(index, buf->data, buf->used) < 0) {
+		i_error("Corrupted fts-native state file %s",
+			index->state_path);
+		ret = -1;
+	}
+	i_close_fd(&fd);
+	if (ret < 0)
+		return -1;
+
+	index->state_ino = st.st_ino;
+	index->state_size = st.st_size;
+	index->state_mtime = st.st_mtime;
+	index->state_mtime_nsec = ST_MTIME_NSEC(st);
+	fts_native_index_drop_stale_segments(index);
+	return 0;
+}
+
+int fts_native_index_refresh(struct fts_native_index *index)
+{
+	struct stat st;
+	int ret;
+
+	if (stat(index->state_path, &st) < 0) {
+		if (errno != ENOENT) {
+			i_error("stat(%s) failed: %m", index->state_path);
+			return -1;
+		}
+		if (index->state_ino == 0 &&
+		    array_count(&index->state.segment_ids) == 0)
+			return 0;
+	} else if (st.st_ino == index->state_ino &&
+		   st.st_size == index->state_size &&
+		   st.st_mtime == index->state_mtime &&
+		   ST_MTIME_NSEC(st) == index->state_mtime_nsec) {
+		/* unchanged */
+		return 0;
+	}
+	T_BEGIN {
+		ret = fts_native_index_read_state(index);
+	} T_END;
+	return ret;
+}
+
+uint32_t fts_native_index_get_last_uid(struct fts_native_index *index)
+{
+	return index->state.last_uid;
+}
+
+unsigned int fts_native_index_get_segment_count(struct fts_native_index *index)
+{
+	return array_count(&index->state.segment_ids);
+}
+
+unsigned int fts_native_index_get_fragmentation(struct fts_native_index *index)
+{
+	unsigned int segments = array_count(&index->state.segment_ids);
+	unsigned int max_segments = I_MAX(index->set.max_segments, 1);
+	uint64_t expunged;
+	unsigned int seg_frag, exp_frag;
+
+	if (segments <= 1 && array_count(&index->state.expunged_uids) == 0)
+		return 0;
+
+	/* the segments are merged automatically once there are more than
+	   max_segments of them */
+	seg_frag = segments <= 1 ? 0 : (segments - 1) * 100 / max_segments;
+	/* count 10% of the UIDs being expunged as fully fragmented */
+	expunged = seq_range_count(&index->state.expunged_uids);
+	exp_frag = expunged * 1000 / I_MAX(index->state.last_uid, 1);
+	return I_MIN(I_MAX(seg_frag, exp_frag), 100);
+}
+
+static int
+fts_native_index_write_state(struct fts_native_index *index)
+{
+	struct fts_native_state_header hdr;
+	string_t *temp_path;
+	buffer_t *buf;
+	int fd;
+
+	i_zero(&hdr);
+	hdr.magic = FTS_NATIVE_STATE_MAGIC;
+	hdr.version = FTS_NATIVE_STATE_VERSION;
+	hdr.next_segment_id = index->state.next_segment_id;
+	hdr.last_uid = index->state.last_uid;
+	hdr.segment_count = array_count(&index->state.segment_ids);
+	hdr.expunge_range_count = array_count(&index->state.expunged_uids);
+
+	buf = t_buffer_create(256);
+	buffer_append(buf, &hdr, sizeof(hdr));
+	if (hdr.segment_count > 0) {
+		buffer_append(buf, array_front(&index->state.segment_ids),
+			      hdr.segment_count * sizeof(uint32_t));
+	}
+	if (hdr.expunge_range_count > 0) {
+		buffer_append(buf, array_front(&index->state.expunged_uids),
+			      hdr.expunge_range_count *
+			      sizeof(struct seq_range));
+	}
+
+	temp_path = t_str_new(256);
+	str_printfa(temp_path, "%s/"FTS_NATIVE_TEMP_PREFIX, index->dir);
+	fd = safe_mkstemp_group(temp_path, index->set.file_mode,
+				index->set.gid, index->set.gid_origin);
+	if (fd == -1) {
+		i_error("safe_mkstemp(%s) failed: %m", str_c(temp_path));
+		return -1;
+	}
+	if (write_full(fd, buf->data, buf->used) < 0) {
+		i_error("write(%s) failed: %m", str_c(temp_path));
+	} else if (fdatasync(fd) < 0) {
+		i_error("fdatasync(%s) failed: %m", str_c(temp_path));
+	} else if (rename(str_c(temp_path), index->state_path) < 0) {
+		i_error("rename(%s, %s) failed: %m",
+			str_c(temp_path), index->state_path);
+	} else {
+		i_close_fd(&fd);
+		/* make sure the next refresh doesn't re-read our own write */
+		index->state_ino = 0;
+		return fts_native_index_refresh(index);
+	}
+	i_close_fd(&fd);
+	i_unlink(str_c(temp_path));
+	return -1;
+}
+
+static int
+fts_native_index_lock(struct fts_native_index *index,
+		      struct file_lock **lock_r)
+{
+	struct file_create_settings lock_set;
+	const char *lock_path, *error;
+	int ret;
+
+	i_zero(&lock_set);
+	lock_set.lock_timeout_secs = index->set.lock_timeout_secs;
+	lock_set.lock_method = index->set.lock_method;
+	lock_set.mode = index->set.file_mode;
+	lock_set.gid = index->set.gid;
+	lock_set.gid_origin = index->set.gid_origin;
+
+	lock_path = t_strdup_printf("%s/"FTS_NATIVE_LOCK_FNAME, index->dir);
+	ret = mail_storage_lock_create(lock_path, &lock_set,
+				       index->set.mail_set, lock_r, &error);
+	if (ret <= 0) {
+		i_error("fts-native: Couldn't lock %s: %s", lock_path, error);
+		return -1;
+	}
+	return 0;
+}
+
+static int fts_native_index_mkdir(struct fts_native_index *index)
+{
+	if (mkdir_parents_chgrp(index->dir, index->set.dir_mode,
+				index->set.gid, index->set.gid_origin) < 0 &&
+	    errno != EEXIST) {
+		i_error("mkdir(%s) failed: %m", index->dir);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+fts_native_index_get_segment(struct fts_native_index *index, uint32_t id,
+			     struct fts_native_segment **segment_r)
+{
+	struct fts_native_open_segment *seg;
+	const char *error;
+	int ret;
+
+	array_foreach_modifiable(&index->segments, seg) {
+		if (seg->id == id) {
+			*segment_r = seg->segment;
+			return 1;
+		}
+	}
+
+	ret = fts_native_segment_open(fts_native_index_segment_path(index, id),
+				      segment_r, &error);
+	if (ret < 0)
+		i_error("fts-native: %s", error);
+	if (ret <= 0)
+		return ret;
+
+	seg = array_append_space(&index->segments);
+	seg->id = id;
+	seg->segment = *segment_r;
+	return 1;
+}
+
+static int
+fts_native_index_lookup_try(struct fts_native_index *index, const char *term,
+			    bool prefix_match, ARRAY_TYPE(seq_range) *uids)
+{
+	struct fts_native_segment *segment;
+	const uint32_t *idp;
+	const char *error;
+	int ret;
+
+	array_foreach(&index->state.segment_ids, idp) {
+		if ((ret = fts_native_index_get_segment(index, *idp,
+							&segment)) <= 0)
+			return ret;
+		if (fts_native_segment_lookup(segment, term, prefix_match,
+					      uids, &error) < 0) {
+			i_error("fts-native: %s", error);
+			return -1;
+		}
+	}
+	return 1;
+}
+
+int fts_native_index_lookup(struct fts_native_index *index, const char *term,
+			    bool prefix_match, ARRAY_TYPE(seq_range) *uids)
+{
+	ARRAY_TYPE(seq_range) term_uids;
+	int ret;
+
+	t_array_init(&term_uids, 128);
+	ret = fts_native_index_lookup_try(index, term, prefix_match,
+					  &term_uids);
+	if (ret == 0) {
+		/* a segment was merged away after we read the state */
+		array_clear(&term_uids);
+		if (fts_native_index_refresh(index) < 0)
+			return -1;
+		ret = fts_native_index_lookup_try(index, term, prefix_match,
+						  &term_uids);
+		if (ret == 0) {
+			i_error("fts-native: %s: Segment listed in state "
+				"file is missing", index->dir);
+		}
+	}
+	if (ret <= 0)
+		return -1;
+
+	seq_range_array_remove_seq_range(&term_uids,
+					 &index->state.expunged_uids);
+	seq_range_array_merge(uids, &term_uids);
+	return 0;
+}
+
+static int
+fts_native_index_add_segment(struct fts_native_index *index,
+			     const char *temp_path)
+{
+	uint32_t id = index->state.next_segment_id++;
+	const char *path = fts_native_index_segment_path(index, id);
+
+	if (rename(temp_path, path) < 0) {
+		i_error("rename(%s, %s) failed: %m", temp_path, path);
+		return -1;
+	}
+	array_push_back(&index->state.segment_ids, &id);
+	return 0;
+}
+
+static int fts_native_index_merge_locked(struct fts_native_index *index)
+{
+	struct fts_native_segment_writer *writer;
+	ARRAY(struct fts_native_segment *) segments;
+	ARRAY_TYPE(uint32_t) old_ids;
+	struct fts_native_segment *segment;
+	const uint32_t *idp;
+	const char *temp_prefix, *temp_path, *error;
+	int ret;
+
+	if (array_count(&index->state.segment_ids) <= 1 &&
+	    array_count(&index->state.expunged_uids) == 0)
+		return 0;
+
+	t_array_init(&segments, array_count(&index->state.segment_ids));
+	array_foreach(&index->state.segment_ids, idp) {
+		ret = fts_native_index_get_segment(index, *idp, &segment);
+		if (ret == 0) {
+			i_error("fts-native: %s: Segment %u listed in state "
+				"file is missing", index->dir, *idp);
+		}
+		if (ret <= 0)
+			return -1;
+		array_push_back(&segments, &segment);
+	}
+
+	temp_prefix = t_strdup_printf("%s/"FTS_NATIVE_TEMP_PREFIX, index->dir);
+	if (fts_native_segment_writer_init(temp_prefix, index->set.file_mode,
+					   index->set.gid,
+					   index->set.gid_origin,
+					   &writer, &error) < 0) {
+		i_error("fts-native: %s", error);
+		return -1;
+	}
+	if (fts_native_segments_merge(array_front(&segments),
+				      array_count(&segments),
+				      &index->state.expunged_uids,
+				      writer, &error) < 0) {
+		i_error("fts-native: %s", error);
+		fts_native_segment_writer_abort(&writer);
+		return -1;
+	}
+	if (fts_native_segment_writer_finish(&writer, &temp_path,
+					     &error) < 0) {
+		i_error("fts-native: %s", error);
+		return -1;
+	}
+
+	t_array_init(&old_ids, array_count(&index->state.segment_ids));
+	array_append_array(&old_ids, &index->state.segment_ids);
+	array_clear(&index->state.segment_ids);
+	array_clear(&index->state.expunged_uids);
+	if (fts_native_index_add_segment(index, temp_path) < 0) {
+		i_unlink(temp_path);
+		return -1;
+	}
+	if (fts_native_index_write_state(index) < 0)
+		return -1;
+
+	/* readers that still use the old segments will notice that they're
+	   gone and refresh the state */
+	array_foreach(&old_ids, idp)
+		i_unlink_if_exists(fts_native_index_segment_path(index, *idp));
+	return 0;
+}
+
+int fts_native_index_optimize(struct fts_native_index *index)
+{
+	struct file_lock *lock;
+	struct stat st;
+	int ret;
+
+	if (stat(index->dir, &st) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		i_error("stat(%s) failed: %m", index->dir);
+		return -1;
+	}
+	if (fts_native_index_lock(index, &lock) < 0)
+		return -1;
+	T_BEGIN {
+		ret = fts_native_index_read_state(index);
+		if (ret == 0)
+			ret = fts_native_index_merge_locked(index);
+	} T_END;
+	file_lock_free(&lock);
+	return ret;
+}
+
+struct fts_native_index_build *
+fts_native_index_build_init(struct fts_native_index *index)
+{
+	struct fts_native_index_build *build;
+
+	build = i_new(struct fts_native_index_build, 1);
+	build->index = index;
+	build->term_pool = pool_alloconly_create("fts-native terms", 1024*64);
+	hash_table_create(&build->terms, default_pool, 0, str_hash,
+			  strcmp);
+	i_array_init(&build->postings, 1024);
+	i_array_init(&build->temp_paths, 4);
+	i_array_init(&build->expunged_uids, 16);
+	return build;
+}
+
+static int
+fts_native_build_term_cmp(struct fts_native_build_term *const *t1,
+			  struct fts_native_build_term *const *t2)
+{
+	return strcmp((*t1)->term, (*t2)->term);
+}
+
+static void uids_sort_unique(uint32_t *uids, unsigned int *count)
+{
+	unsigned int i, j;
+
+	i_qsort(uids, *count, sizeof(*uids), uint32_cmp);
+	for (i = j = 1; i < *count; i++) {
+		if (uids[i] != uids[j-1])
+			uids[j++] = uids[i];
+	}
+	*count = j;
+}
+
+static void
+fts_native_index_build_write(struct fts_native_index_build *build,
+			     struct fts_native_segment_writer *writer)
+{
+	ARRAY(struct fts_native_build_term *) sorted_terms;
+	struct fts_native_build_term *const *termp, *term;
+	const struct fts_native_build_posting *postings;
+	struct hash_iterate_context *iter;
+	const char *key;
+	unsigned int i, count, term_count, *offsets, start, uid_count;
+	uint32_t *uids;
+	bool sorted;
+
+	term_count = hash_table_count(build->terms);
+	t_array_init(&sorted_terms, term_count);
+	iter = hash_table_iterate_init(build->terms);
+	while (hash_table_iterate(iter, build->terms, &key, &term))
+		array_push_back(&sorted_terms, &term);
+	hash_table_iterate_deinit(&iter);
+	array_sort(&sorted_terms, fts_native_build_term_cmp);
+	i = 0;
+	array_foreach(&sorted_terms, termp)
+		(*termp)->idx = i++;
+
+	/* counting sort the postings by the term. The UIDs stay in the
+	   order they were added, which is normally already ascending. */
+	postings = array_get(&build->postings, &count);
+	offsets = t_new(unsigned int, term_count + 1);
+	for (i = 0; i < count; i++)
+		offsets[postings[i].term->idx + 1]++;
+	for (i = 0; i < term_count; i++)
+		offsets[i + 1] += offsets[i];
+	uids = t_new(uint32_t, I_MAX(count, 1));
+	for (i = 0; i < count; i++)
+		uids[offsets[postings[i].term->idx]++] = postings[i].uid;
+
+	start = 0;
+	array_foreach(&sorted_terms, termp) {
+		/* offsets[idx] now points to the end of the term's UIDs */
+		uid_count = offsets[(*termp)->idx] - start;
+		sorted = TRUE;
+		for (i = 1; i < uid_count && sorted; i++) {
+			if (uids[start + i] <= uids[start + i - 1])
+				sorted = FALSE;
+		}
+		if (!sorted)
+			uids_sort_unique(uids + start, &uid_count);
+		fts_native_segment_writer_add(writer, (*termp)->term,
+					      uids + start, uid_count);
+		start = offsets[(*termp)->idx];
+	}
+}
+
+static int fts_native_index_build_flush(struct fts_native_index_build *build)
+{
+	struct fts_native_index *index = build->index;
+	struct fts_native_segment_writer *writer;
+	const char *temp_prefix, *temp_path, *error;
+	char *path;
+	int ret = 0;
+
+	if (array_count(&build->postings) == 0)
+		return 0;
+
+	if (fts_native_index_mkdir(index) < 0)
+		ret = -1;
+	else T_BEGIN {
+		temp_prefix = t_strdup_printf("%s/"FTS_NATIVE_TEMP_PREFIX,
+					      index->dir);
+		if (fts_native_segment_writer_init(temp_prefix,
+						   index->set.file_mode,
+						   index->set.gid,
+						   index->set.gid_origin,
+						   &writer, &error) < 0) {
+			i_error("fts-native: %s", error);
+			ret = -1;
+		} else {
+			fts_native_index_build_write(build, writer);
+			if (fts_native_segment_writer_finish(&writer,
+							     &temp_path,
+							     &error) < 0) {
+				i_error("fts-native: %s", error);
+				ret = -1;
+			} else {
+				path = i_strdup(temp_path);
+				array_push_back(&build->temp_paths, &path);
+			}
+		}
+	} T_END;
+
+	hash_table_clear(build->terms, TRUE);
+	p_clear(build->term_pool);
+	array_clear(&build->postings);
+	return ret;
+}
+
+void fts_native_index_build_add(struct fts_native_index_build *build,
+				const char *term, uint32_t uid)
+{
+	struct fts_native_build_term *bterm;
+	struct fts_native_build_posting *posting;
+
+	i_assert(uid > 0);
+
+	if (build->failed)
+		return;
+
+	bterm = hash_table_lookup(build->terms, term);
+	if (bterm == NULL) {
+		bterm = p_new(build->term_pool,
+			      struct fts_native_build_term, 1);
+		bterm->term = p_strdup(build->term_pool, term);
+		hash_table_insert(build->terms, bterm->term, bterm);
+	} else if (bterm->last_uid == uid) {
+		return;
+	}
+	bterm->last_uid = uid;
+
+	posting = array_append_space(&build->postings);
+	posting->term = bterm;
+	posting->uid = uid;
+	if (uid > build->max_uid)
+		build->max_uid = uid;
+
+	if (array_count(&build->postings) >= build->index->set.flush_postings) {
+		if (fts_native_index_build_flush(build) < 0)
+			build->failed = TRUE;
+	}
+}
+
+void fts_native_index_build_expunge(struct fts_native_index_build *build,
+				    uint32_t uid)
+{
+	seq_range_array_add(&build->expunged_uids, uid);
+}
+
+void fts_native_index_build_expunge_range(struct fts_native_index_build *build,
+					  const ARRAY_TYPE(seq_range) *uids)
+{
+	seq_range_array_merge(&build->expunged_uids, uids);
+}
+
+static int
+fts_native_index_build_commit(struct fts_native_index_build *build)
+{
+	struct fts_native_index *index = build->index;
+	struct file_lock *lock;
+	char *const *pathp;
+	struct stat st;
+	int ret = 0;
+
+	if (array_count(&build->temp_paths) == 0) {
+		if (array_count(&build->expunged_uids) == 0)
+			return 0;
+		if (stat(index->dir, &st) < 0 && errno == ENOENT) {
+			/* nothing indexed yet, so the expunges don't matter */
+			return 0;
+		}
+	}
+
+	if (fts_native_index_lock(index, &lock) < 0)
+		return -1;
+	T_BEGIN {
+		ret = fts_native_index_read_state(index);
+		array_foreach(&build->temp_paths, pathp) {
+			if (ret == 0 &&
+			    fts_native_index_add_segment(index, *pathp) < 0)
+				ret = -1;
+		}
+		if (ret == 0 && array_count(&index->state.segment_ids) > 0) {
+			seq_range_array_merge(&index->state.expunged_uids,
+					      &build->expunged_uids);
+		}
+		if (ret == 0 && build->max_uid > index->state.last_uid)
+			index->state.last_uid = build->max_uid;
+		if (ret == 0)
+			ret = fts_native_index_write_state(index);
+		if (ret == 0 && array_count(&index->state.segment_ids) >
+		    index->set.max_segments)
+			ret = fts_native_index_merge_locked(index);
+	} T_END;
+	file_lock_free(&lock);
+	return ret;
+}
+
+int fts_native_index_build_deinit(struct fts_native_index_build **_build)
+{
+	struct fts_native_index_build *build = *_build;
+	char **pathp;
+	int ret = build->failed ? -1 : 0;
+
+	*_build = NULL;
+
+	if (ret == 0 && fts_native_index_build_flush(build) < 0)
+		ret = -1;
+	if (ret == 0 && fts_native_index_build_commit(build) < 0)
+		ret = -1;
+
+	array_foreach_modifiable(&build->temp_paths, pathp) {
+		/* the segments that weren't committed are still in temp */
+		if (ret < 0)
+			i_unlink_if_exists(*pathp);
+		i_free(*pathp);
+	}
+	array_free(&build->temp_paths);
+	array_free(&build->expunged_uids);
+	array_free(&build->postings);
+	hash_table_destroy(&build->terms);
+	pool_unref(&build->term_pool);
+	i_free(build);
+	return ret;
+}
@@ -0,0 +1,72 @@
+#ifndef FTS_NATIVE_INDEX_H
+#define FTS_NATIVE_INDEX_H
+
+#include "file-lock.h"
+#include "seq-range-array.h"
+
+struct mail_storage_settings;
+
+#define FTS_NATIVE_INDEX_DIR_NAME "dovecot.fts-native"
+
+/* Merge all segments once there are more than this many of them */
+#define FTS_NATIVE_DEFAULT_MAX_SEGMENTS 8
+/* Write a new segment once this many postings have been buffered */
+#define FTS_NATIVE_DEFAULT_FLUSH_POSTINGS (1024*1024)
+
+struct fts_native_index_settings {
+	enum file_lock_method lock_method;
+	unsigned int lock_timeout_secs;
+	const struct mail_storage_settings *mail_set;
+
+	mode_t file_mode, dir_mode;
+	gid_t gid;
+	const char *gid_origin;
+
+	unsigned int max_segments;
+	unsigned int flush_postings;
+};
+
+struct fts_native_index;
+struct fts_native_index_build;
+
+struct fts_native_index *
+fts_native_index_init(const char *dir,
+		      const struct fts_native_index_settings *set);
+void fts_native_index_deinit(struct fts_native_index **index);
+
+const char *fts_native_index_get_dir(struct fts_native_index *index);
+
+/* Re-read the index state if it has changed. Returns 0 if ok, -1 if error. */
+int fts_native_index_refresh(struct fts_native_index *index);
+/* Returns the highest UID that has been added to the index. */
+uint32_t fts_native_index_get_last_uid(struct fts_native_index *index);
+/* Returns the number of segments the index currently consists of. */
+unsigned int fts_native_index_get_segment_count(struct fts_native_index *index);
+/* Returns how fragmented the index is as a percentage, based on the number
+   of segments and the expunged messages that haven't been merged away. */
+unsigned int fts_native_index_get_fragmentation(struct fts_native_index *index);
+
+/* Add UIDs of messages containing the term to uids. With prefix_match
+   all the terms beginning with the term are matched. Expunged messages
+   are never returned. Returns 0 if ok, -1 if error. */
+int fts_native_index_lookup(struct fts_native_index *index, const char *term,
+			    bool prefix_match, ARRAY_TYPE(seq_range) *uids);
+
+/* Merge all segments into one and drop expunged messages from it.
+   Returns 0 if ok, -1 if error. */
+int fts_native_index_optimize(struct fts_native_index *index);
+
+struct fts_native_index_build *
+fts_native_index_build_init(struct fts_native_index *index);
+/* Add a term for the UID. The UIDs should be added in ascending order. */
+void fts_native_index_build_add(struct fts_native_index_build *build,
+				const char *term, uint32_t uid);
+void fts_native_index_build_expunge(struct fts_native_index_build *build,
+				    uint32_t uid);
+void fts_native_index_build_expunge_range(struct fts_native_index_build *build,
+					  const ARRAY_TYPE(seq_range) *uids);
+/* Write the remaining buffered terms and commit the changes. Returns 0 if
+   ok, -1 if error. */
+int fts_native_index_build_deinit(struct fts_native_index_build **build);
+
+#endif
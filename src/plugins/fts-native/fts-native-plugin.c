@@ -0,0 +1,97 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "mail-user.h"
+#include "mail-storage-hooks.h"
+#include "fts-user.h"
+#include "fts-native-index.h"
+#include "fts-native-plugin.h"
+
+const char *fts_native_plugin_version = DOVECOT_ABI_VERSION;
+
+struct fts_native_user_module fts_native_user_module =
+	MODULE_CONTEXT_INIT(&mail_user_module_register);
+
+static int
+fts_native_plugin_init_settings(struct fts_native_settings *set,
+				const char *str)
+{
+	const char *const *tmp;
+
+	set->max_segments = FTS_NATIVE_DEFAULT_MAX_SEGMENTS;
+	set->flush_postings = FTS_NATIVE_DEFAULT_FLUSH_POSTINGS;
+	if (str == NULL)
+		return 0;
+
+	for (tmp = t_strsplit_spaces(str, " "); *tmp != NULL; tmp++) {
+		if (str_begins(*tmp, "max_segments=")) {
+			if (str_to_uint(*tmp + 13, &set->max_segments) < 0 ||
+			    set->max_segments == 0) {
+				i_error("fts_native: max_segments must be a positive integer");
+				return -1;
+			}
+		} else if (str_begins(*tmp, "flush_postings=")) {
+			if (str_to_uint(*tmp + 15, &set->flush_postings) < 0 ||
+			    set->flush_postings == 0) {
+				i_error("fts_native: flush_postings must be a positive integer");
+				return -1;
+			}
+		} else if (strcmp(*tmp, "no_prefix") == 0) {
+			set->no_prefix = TRUE;
+		} else {
+			i_error("fts_native: Invalid setting: %s", *tmp);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void fts_native_mail_user_deinit(struct mail_user *user)
+{
+	struct fts_native_user *fuser = FTS_NATIVE_USER_CONTEXT_REQUIRE(user);
+
+	fts_mail_user_deinit(user);
+	fuser->module_ctx.super.deinit(user);
+}
+
+static void fts_native_mail_user_created(struct mail_user *user)
+{
+	struct mail_user_vfuncs *v = user->vlast;
+	struct fts_native_user *fuser;
+	const char *error;
+
+	fuser = p_new(user->pool, struct fts_native_user, 1);
+	if (fts_native_plugin_init_settings(&fuser->set,
+			mail_user_plugin_getenv(user, "fts_native")) < 0) {
+		/* invalid settings, disabling */
+		return;
+	}
+	/* the index always consists of lib-fts tokens */
+	if (fts_mail_user_init(user, &error) < 0) {
+		i_error("fts-native: %s", error);
+		return;
+	}
+
+	fuser->module_ctx.super = *v;
+	user->vlast = &fuser->module_ctx.super;
+	v->deinit = fts_native_mail_user_deinit;
+	MODULE_CONTEXT_SET(user, fts_native_user_module, fuser);
+}
+
+static struct mail_storage_hooks fts_native_mail_storage_hooks = {
+	.mail_user_created = fts_native_mail_user_created
+};
+
+void fts_native_plugin_init(struct module *module)
+{
+	fts_backend_register(&fts_backend_native);
+	mail_storage_hooks_add(module, &fts_native_mail_storage_hooks);
+}
+
+void fts_native_plugin_deinit(void)
+{
+	fts_backend_unregister(fts_backend_native.name);
+	mail_storage_hooks_remove(&fts_native_mail_storage_hooks);
+}
+
+const char *fts_native_plugin_dependencies[] = { "fts", NULL };
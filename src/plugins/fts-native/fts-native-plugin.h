@@ -0,0 +1,32 @@
+#ifndef FTS_NATIVE_PLUGIN_H
+#define FTS_NATIVE_PLUGIN_H
+
+#include "module-context.h"
+#include "mail-user.h"
+#include "fts-api-private.h"
+
+#define FTS_NATIVE_USER_CONTEXT(obj) \
+	MODULE_CONTEXT(obj, fts_native_user_module)
+#define FTS_NATIVE_USER_CONTEXT_REQUIRE(obj) \
+	MODULE_CONTEXT_REQUIRE(obj, fts_native_user_module)
+
+struct fts_native_settings {
+	unsigned int max_segments;
+	unsigned int flush_postings;
+	/* match search tokens only as complete words */
+	bool no_prefix;
+};
+
+struct fts_native_user {
+	union mail_user_module_context module_ctx;
+	struct fts_native_settings set;
+};
+
+extern const char *fts_native_plugin_dependencies[];
+extern struct fts_backend fts_backend_native;
+extern MODULE_CONTEXT_DEFINE(fts_native_user_module, &mail_user_module_register);
+
+void fts_native_plugin_init(struct module *module);
+void fts_native_plugin_deinit(void);
+
+#endif
@@ -0,0 +1,512 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "sort.h"
+#include "numpack.h"
+#include "mmap-util.h"
+#include "safe-mkstemp.h"
+#include "ostream.h"
+#include "write-full.h"
+#include "fts-native-segment.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+struct fts_native_segment_writer {
+	char *temp_path;
+	int fd;
+	struct ostream *output;
+
+	buffer_t *terms;
+	string_t *strings;
+	buffer_t *postings;
+
+	uint32_t term_count;
+	uint32_t min_uid, max_uid;
+	size_t last_term_offset;
+};
+
+struct fts_native_segment {
+	char *path;
+
+	void *mmap_base;
+	size_t mmap_size;
+
+	const struct fts_native_segment_header *hdr;
+	const struct fts_native_segment_term *terms;
+	const char *strings;
+	size_t strings_size;
+};
+
+int fts_native_segment_writer_init(const char *temp_prefix, mode_t mode,
+				   gid_t gid, const char *gid_origin,
+				   struct fts_native_segment_writer **writer_r,
+				   const char **error_r)
+{
+	struct fts_native_segment_writer *writer;
+	struct fts_native_segment_header hdr;
+	string_t *temp_path;
+	int fd;
+
+	temp_path = t_str_new(256);
+	str_append(temp_path, temp_prefix);
+	fd = safe_mkstemp_hostpid_group(temp_path, mode, gid, gid_origin);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("safe_mkstemp(%s) failed: %m",
+					   str_c(temp_path));
+		return -1;
+	}
+
+	writer = i_new(struct fts_native_segment_writer, 1);
+	writer->temp_path = i_strdup(str_c(temp_path));
+	writer->fd = fd;
+	writer->output = o_stream_create_fd_file(fd, 0, FALSE);
+	o_stream_set_name(writer->output, writer->temp_path);
+	o_stream_cork(writer->output);
+	writer->terms = buffer_create_dynamic(default_pool, 1024);
+	writer->strings = str_new(default_pool, 4096);
+	writer->postings = buffer_create_dynamic(default_pool, 1024);
+	writer->min_uid = (uint32_t)-1;
+
+	/* the header is rewritten when finishing */
+	i_zero(&hdr);
+	o_stream_nsend(writer->output, &hdr, sizeof(hdr));
+	*writer_r = writer;
+	return 0;
+}
+
+void fts_native_segment_writer_add(struct fts_native_segment_writer *writer,
+				   const char *term, const uint32_t *uids,
+				   unsigned int uid_count)
+{
+	struct fts_native_segment_term rec;
+	uint32_t prev_uid = 0;
+	unsigned int i;
+
+	i_assert(uid_count > 0);
+	i_assert(writer->term_count == 0 ||
+		 strcmp(str_c(writer->strings) + writer->last_term_offset,
+			term) < 0);
+
+	i_zero(&rec);
+	rec.str_offset = str_len(writer->strings);
+	rec.postings_offset = writer->output->offset;
+	rec.uid_count = uid_count;
+	buffer_append(writer->terms, &rec, sizeof(rec));
+
+	writer->last_term_offset = str_len(writer->strings);
+	str_append(writer->strings, term);
+	str_append_c(writer->strings, '\0');
+
+	buffer_set_used_size(writer->postings, 0);
+	for (i = 0; i < uid_count; i++) {
+		i_assert(uids[i] > prev_uid);
+		numpack_encode(writer->postings, uids[i] - prev_uid);
+		prev_uid = uids[i];
+	}
+	o_stream_nsend(writer->output, writer->postings->data,
+		       writer->postings->used);
+
+	if (uids[0] < writer->min_uid)
+		writer->min_uid = uids[0];
+	if (prev_uid > writer->max_uid)
+		writer->max_uid = prev_uid;
+	writer->term_count++;
+}
+
+unsigned int
+fts_native_segment_writer_get_term_count(struct fts_native_segment_writer *writer)
+{
+	return writer->term_count;
+}
+
+static void
+fts_native_segment_writer_free(struct fts_native_segment_writer *writer)
+{
+	o_stream_destroy(&writer->output);
+	i_close_fd(&writer->fd);
+	buffer_free(&writer->terms);
+	str_free(&writer->strings);
+	buffer_free(&writer->postings);
+	i_free(writer->temp_path);
+	i_free(writer);
+}
+
+int fts_native_segment_writer_finish(struct fts_native_segment_writer **_writer,
+				     const char **temp_path_r,
+				     const char **error_r)
+{
+	struct fts_native_segment_writer *writer = *_writer;
+	struct fts_native_segment_header hdr;
+	uoff_t size;
+
+	*_writer = NULL;
+
+	i_zero(&hdr);
+	hdr.magic = FTS_NATIVE_SEGMENT_MAGIC;
+	hdr.version = FTS_NATIVE_SEGMENT_VERSION;
+	hdr.term_count = writer->term_count;
+	if (writer->term_count > 0) {
+		hdr.min_uid = writer->min_uid;
+		hdr.max_uid = writer->max_uid;
+	}
+	/* keep the term records 32bit aligned */
+	buffer_set_used_size(writer->postings, 0);
+	buffer_append_zero(writer->postings,
+		(sizeof(uint32_t) - writer->output->offset % sizeof(uint32_t)) %
+		sizeof(uint32_t));
+	o_stream_nsend(writer->output, writer->postings->data,
+		       writer->postings->used);
+	hdr.terms_offset = writer->output->offset;
+	o_stream_nsend(writer->output, writer->terms->data,
+		       writer->terms->used);
+	hdr.strings_offset = writer->output->offset;
+	o_stream_nsend(writer->output, str_data(writer->strings),
+		       str_len(writer->strings));
+	size = writer->output->offset;
+	hdr.file_size = size;
+
+	if (size > (uint32_t)-1) {
+		*error_r = t_strdup_printf("%s: Segment grew too large",
+					   writer->temp_path);
+	} else if (o_stream_finish(writer->output) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %s",
+			writer->temp_path, o_stream_get_error(writer->output));
+	} else if (pwrite_full(writer->fd, &hdr, sizeof(hdr), 0) < 0) {
+		*error_r = t_strdup_printf("pwrite(%s) failed: %m",
+					   writer->temp_path);
+	} else if (fdatasync(writer->fd) < 0) {
+		*error_r = t_strdup_printf("fdatasync(%s) failed: %m",
+					   writer->temp_path);
+	} else {
+		*temp_path_r = t_strdup(writer->temp_path);
+		fts_native_segment_writer_free(writer);
+		return 0;
+	}
+	i_unlink(writer->temp_path);
+	fts_native_segment_writer_free(writer);
+	return -1;
+}
+
+void fts_native_segment_writer_abort(struct fts_native_segment_writer **_writer)
+{
+	struct fts_native_segment_writer *writer = *_writer;
+
+	*_writer = NULL;
+	o_stream_abort(writer->output);
+	i_unlink(writer->temp_path);
+	fts_native_segment_writer_free(writer);
+}
+
+static const char *
+fts_native_segment_validate(struct fts_native_segment *segment)
+{
+	const struct fts_native_segment_header *hdr = segment->mmap_base;
+
+	if (segment->mmap_size < sizeof(*hdr))
+		return "File too small";
+	if (hdr->magic != FTS_NATIVE_SEGMENT_MAGIC)
+		return "Invalid magic";
+	if (hdr->version != FTS_NATIVE_SEGMENT_VERSION) {
+		return t_strdup_printf("Unsupported version %u",
+				       hdr->version);
+	}
+	if (hdr->file_size != segment->mmap_size)
+		return "File size mismatch";
+	if (hdr->terms_offset < sizeof(*hdr) ||
+	    hdr->terms_offset > hdr->strings_offset ||
+	    hdr->strings_offset > hdr->file_size)
+		return "Invalid offsets";
+	if (hdr->terms_offset % sizeof(uint32_t) != 0)
+		return "Unaligned term records";
+	if ((hdr->strings_offset - hdr->terms_offset) !=
+	    hdr->term_count * sizeof(struct fts_native_segment_term))
+		return "Invalid term count";
+	if (hdr->term_count > 0 &&
+	    (hdr->strings_offset == hdr->file_size ||
+	     ((const char *)segment->mmap_base)[hdr->file_size - 1] != '\0'))
+		return "Term strings not NUL-terminated";
+
+	segment->hdr = hdr;
+	segment->terms = CONST_PTR_OFFSET(segment->mmap_base,
+					  hdr->terms_offset);
+	segment->strings = CONST_PTR_OFFSET(segment->mmap_base,
+					    hdr->strings_offset);
+	segment->strings_size = hdr->file_size - hdr->strings_offset;
+	return NULL;
+}
+
+int fts_native_segment_open(const char *path,
+			    struct fts_native_segment **segment_r,
+			    const char **error_r)
+{
+	struct fts_native_segment *segment;
+	const char *error;
+	void *base;
+	size_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		*error_r = t_strdup_printf("open(%s) failed: %m", path);
+		return -1;
+	}
+	base = mmap_ro_file(fd, &size);
+	if (base == MAP_FAILED) {
+		*error_r = t_strdup_printf("mmap(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	i_close_fd(&fd);
+
+	segment = i_new(struct fts_native_segment, 1);
+	segment->path = i_strdup(path);
+	segment->mmap_base = base;
+	segment->mmap_size = size;
+	if ((error = fts_native_segment_validate(segment)) != NULL) {
+		*error_r = t_strdup_printf("Corrupted segment file %s: %s",
+					   path, error);
+		fts_native_segment_close(&segment);
+		return -1;
+	}
+	*segment_r = segment;
+	return 1;
+}
+
+void fts_native_segment_close(struct fts_native_segment **_segment)
+{
+	struct fts_native_segment *segment = *_segment;
+
+	*_segment = NULL;
+	if (segment->mmap_base != NULL) {
+		if (munmap(segment->mmap_base, segment->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", segment->path);
+	}
+	i_free(segment->path);
+	i_free(segment);
+}
+
+const char *fts_native_segment_get_path(struct fts_native_segment *segment)
+{
+	return segment->path;
+}
+
+uint32_t fts_native_segment_get_max_uid(struct fts_native_segment *segment)
+{
+	return segment->hdr->max_uid;
+}
+
+static const char *
+fts_native_segment_term_str(struct fts_native_segment *segment,
+			    unsigned int idx)
+{
+	uint32_t offset = segment->terms[idx].str_offset;
+
+	/* the strings area is NUL-terminated, so this is safe */
+	return offset < segment->strings_size ?
+		segment->strings + offset : NULL;
+}
+
+static int
+fts_native_segment_decode(struct fts_native_segment *segment,
+			  unsigned int idx, ARRAY_TYPE(uint32_t) *uids,
+			  const char **error_r)
+{
+	const struct fts_native_segment_term *term = &segment->terms[idx];
+	const uint8_t *p, *end;
+	uint32_t i, delta, end_offset, uid = 0;
+
+	end_offset = idx + 1 < segment->hdr->term_count ?
+		segment->terms[idx + 1].postings_offset :
+		segment->hdr->terms_offset;
+	if (term->postings_offset < sizeof(*segment->hdr) ||
+	    term->postings_offset > end_offset ||
+	    end_offset > segment->hdr->terms_offset) {
+		*error_r = t_strdup_printf(
+			"Corrupted segment file %s: Invalid postings offset",
+			segment->path);
+		return -1;
+	}
+
+	p = CONST_PTR_OFFSET(segment->mmap_base, term->postings_offset);
+	end = CONST_PTR_OFFSET(segment->mmap_base, end_offset);
+	for (i = 0; i < term->uid_count; i++) {
+		if (numpack_decode32(&p, end, &delta) < 0 || delta == 0 ||
+		    uid > (uint32_t)-1 - delta) {
+			*error_r = t_strdup_printf(
+				"Corrupted segment file %s: Invalid postings",
+				segment->path);
+			return -1;
+		}
+		uid += delta;
+		array_push_back(uids, &uid);
+	}
+	return 0;
+}
+
+static unsigned int
+fts_native_segment_find(struct fts_native_segment *segment, const char *term)
+{
+	const char *str;
+	unsigned int idx, left_idx = 0, right_idx = segment->hdr->term_count;
+
+	/* find the first term that is >= the wanted term */
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		str = fts_native_segment_term_str(segment, idx);
+		if (str == NULL || strcmp(str, term) < 0)
+			left_idx = idx + 1;
+		else
+			right_idx = idx;
+	}
+	return left_idx;
+}
+
+int fts_native_segment_lookup(struct fts_native_segment *segment,
+			      const char *term, bool prefix_match,
+			      ARRAY_TYPE(seq_range) *uids,
+			      const char **error_r)
+{
+	ARRAY_TYPE(uint32_t) term_uids;
+	const uint32_t *uidp;
+	const char *str;
+	size_t term_len = strlen(term);
+	unsigned int idx;
+	int ret = 0;
+
+	t_array_init(&term_uids, 128);
+	idx = fts_native_segment_find(segment, term);
+	for (; idx < segment->hdr->term_count; idx++) {
+		str = fts_native_segment_term_str(segment, idx);
+		if (str == NULL) {
+			*error_r = t_strdup_printf(
+				"Corrupted segment file %s: Invalid term offset",
+				segment->path);
+			return -1;
+		}
+		if (prefix_match ? strncmp(str, term, term_len) != 0 :
+		    strcmp(str, term) != 0)
+			break;
+
+		array_clear(&term_uids);
+		if (fts_native_segment_decode(segment, idx, &term_uids,
+					      error_r) < 0) {
+			ret = -1;
+			break;
+		}
+		array_foreach(&term_uids, uidp)
+			seq_range_array_add(uids, *uidp);
+	}
+	return ret;
+}
+
+static void uids_sort_unique(ARRAY_TYPE(uint32_t) *uids)
+{
+	uint32_t *data;
+	unsigned int i, j, count;
+
+	array_sort(uids, uint32_cmp);
+	data = array_get_modifiable(uids, &count);
+	for (i = j = 1; i < count; i++) {
+		if (data[i] != data[j-1])
+			data[j++] = data[i];
+	}
+	if (count > 0)
+		array_delete(uids, j, count - j);
+}
+
+static void
+uids_remove_expunged(ARRAY_TYPE(uint32_t) *uids,
+		     const ARRAY_TYPE(seq_range) *expunged_uids)
+{
+	uint32_t *data;
+	unsigned int i, j, count;
+
+	data = array_get_modifiable(uids, &count);
+	for (i = j = 0; i < count; i++) {
+		if (!seq_range_exists(expunged_uids, data[i]))
+			data[j++] = data[i];
+	}
+	array_delete(uids, j, count - j);
+}
+
+int fts_native_segments_merge(struct fts_native_segment *const *segments,
+			      unsigned int count,
+			      const ARRAY_TYPE(seq_range) *expunged_uids,
+			      struct fts_native_segment_writer *writer,
+			      const char **error_r)
+{
+	ARRAY_TYPE(uint32_t) uids;
+	unsigned int *pos, i, contributors;
+	const char *str, *min_term;
+	int ret = 0;
+
+	pos = t_new(unsigned int, count);
+	i_array_init(&uids, 1024);
+	for (;;) {
+		/* find the smallest term among the segments */
+		min_term = NULL;
+		for (i = 0; i < count; i++) {
+			if (pos[i] >= segments[i]->hdr->term_count)
+				continue;
+			str = fts_native_segment_term_str(segments[i], pos[i]);
+			if (str == NULL) {
+				*error_r = t_strdup_printf(
+					"Corrupted segment file %s: "
+					"Invalid term offset",
+					segments[i]->path);
+				ret = -1;
+				break;
+			}
+			if (min_term == NULL || strcmp(str, min_term) < 0)
+				min_term = str;
+		}
+		if (ret < 0 || min_term == NULL)
+			break;
+
+		/* union the postings of all the segments having the term */
+		array_clear(&uids);
+		contributors = 0;
+		for (i = 0; i < count && ret == 0; i++) {
+			if (pos[i] >= segments[i]->hdr->term_count)
+				continue;
+			str = fts_native_segment_term_str(segments[i], pos[i]);
+			if (strcmp(str, min_term) != 0)
+				continue;
+			if (fts_native_segment_decode(segments[i], pos[i],
+						      &uids, error_r) < 0)
+				ret = -1;
+			contributors++;
+		}
+		if (ret < 0)
+			break;
+		if (contributors > 1)
+			uids_sort_unique(&uids);
+		if (expunged_uids != NULL && array_is_created(expunged_uids) &&
+		    array_count(expunged_uids) > 0)
+			uids_remove_expunged(&uids, expunged_uids);
+		if (array_count(&uids) > 0) {
+			fts_native_segment_writer_add(writer, min_term,
+				array_front(&uids), array_count(&uids));
+		}
+
+		/* min_term points to one of the mmaped segments, so it
+		   stays valid while advancing the positions */
+		for (i = 0; i < count; i++) {
+			if (pos[i] < segments[i]->hdr->term_count &&
+			    strcmp(fts_native_segment_term_str(segments[i],
+							       pos[i]),
+				   min_term) == 0)
+				pos[i]++;
+		}
+	}
+	array_free(&uids);
+	return ret;
+}
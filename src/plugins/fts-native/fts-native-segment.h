@@ -0,0 +1,90 @@
+#ifndef FTS_NATIVE_SEGMENT_H
+#define FTS_NATIVE_SEGMENT_H
+
+#include "seq-range-array.h"
+
+#define FTS_NATIVE_SEGMENT_MAGIC 0x4e535446 /* "FTSN" */
+#define FTS_NATIVE_SEGMENT_VERSION 1
+
+/* Segment files are immutable once written. The layout is:
+
+   [header][postings][term records][NUL-terminated term strings]
+
+   Term records are sorted by the term string (strcmp() order), so lookups
+   can binary search them directly from the mmaped file. Each term's
+   postings are a list of UIDs stored as numpack-encoded deltas. All the
+   fields are in host byte order. */
+struct fts_native_segment_header {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t unused[3];
+
+	uint32_t term_count;
+	uint32_t min_uid, max_uid;
+
+	uint32_t terms_offset;
+	uint32_t strings_offset;
+	uint32_t file_size;
+};
+
+struct fts_native_segment_term {
+	/* relative to strings_offset */
+	uint32_t str_offset;
+	/* postings end where the next term's postings begin */
+	uint32_t postings_offset;
+	uint32_t uid_count;
+};
+
+struct fts_native_segment;
+struct fts_native_segment_writer;
+
+/* Start writing a new segment into a temporary file, which is created using
+   temp_prefix as the prefix. */
+int fts_native_segment_writer_init(const char *temp_prefix, mode_t mode,
+				   gid_t gid, const char *gid_origin,
+				   struct fts_native_segment_writer **writer_r,
+				   const char **error_r);
+/* Add a term with its sorted and unique UIDs. The terms must be added in
+   strcmp() order. */
+void fts_native_segment_writer_add(struct fts_native_segment_writer *writer,
+				   const char *term, const uint32_t *uids,
+				   unsigned int uid_count);
+/* Returns the number of terms added so far. */
+unsigned int
+fts_native_segment_writer_get_term_count(struct fts_native_segment_writer *writer);
+/* Finish writing the segment. On success the temporary file's path is
+   returned and the caller is responsible for renaming it. On failure the
+   temporary file is deleted. */
+int fts_native_segment_writer_finish(struct fts_native_segment_writer **writer,
+				     const char **temp_path_r,
+				     const char **error_r);
+void fts_native_segment_writer_abort(struct fts_native_segment_writer **writer);
+
+/* Open and mmap the segment. Returns 1 if ok, 0 if the file doesn't exist,
+   -1 if it's broken or some other error happened. */
+int fts_native_segment_open(const char *path,
+			    struct fts_native_segment **segment_r,
+			    const char **error_r);
+void fts_native_segment_close(struct fts_native_segment **segment);
+
+const char *fts_native_segment_get_path(struct fts_native_segment *segment);
+uint32_t fts_native_segment_get_max_uid(struct fts_native_segment *segment);
+
+/* Add UIDs of all the terms beginning with the given prefix to uids.
+   If prefix_match is FALSE, only the exact term is looked up. Returns 0 if
+   ok, -1 if the segment is corrupted. */
+int fts_native_segment_lookup(struct fts_native_segment *segment,
+			      const char *term, bool prefix_match,
+			      ARRAY_TYPE(seq_range) *uids,
+			      const char **error_r);
+
+/* Write all the terms from the given segments into writer. UIDs that exist
+   in the expunged list are dropped. Returns 0 if ok, -1 if some of the
+   segments are corrupted. */
+int fts_native_segments_merge(struct fts_native_segment *const *segments,
+			      unsigned int count,
+			      const ARRAY_TYPE(seq_range) *expunged_uids,
+			      struct fts_native_segment_writer *writer,
+			      const char **error_r);
+
+#endif
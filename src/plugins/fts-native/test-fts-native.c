@@ -0,0 +1,303 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-storage-settings.h"
+#include "fts-native-segment.h"
+#include "fts-native-index.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-fts-native"
+
+static const struct mail_storage_settings test_mail_set;
+
+static const char *seq_range_to_str(const ARRAY_TYPE(seq_range) *uids)
+{
+	const struct seq_range *range;
+	string_t *str = t_str_new(64);
+
+	array_foreach(uids, range) {
+		if (str_len(str) > 0)
+			str_append_c(str, ',');
+		if (range->seq1 == range->seq2)
+			str_printfa(str, "%u", range->seq1);
+		else
+			str_printfa(str, "%u:%u", range->seq1, range->seq2);
+	}
+	return str_c(str);
+}
+
+static void test_dir_init(void)
+{
+	const char *error;
+
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+}
+
+static void test_dir_deinit(void)
+{
+	const char *error;
+
+	if (unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_error("unlink_directory(%s) failed: %s", TEST_DIR, error);
+}
+
+static const char *
+test_segment_write(const char *const *terms, const uint32_t *const *uids,
+		   const unsigned int *uid_counts)
+{
+	struct fts_native_segment_writer *writer;
+	const char *temp_path, *path, *error;
+	unsigned int i;
+
+	test_assert(fts_native_segment_writer_init(TEST_DIR"/tmp.", 0600,
+						   (gid_t)-1, NULL, &writer,
+						   &error) == 0);
+	for (i = 0; terms[i] != NULL; i++) {
+		fts_native_segment_writer_add(writer, terms[i], uids[i],
+					      uid_counts[i]);
+	}
+	test_assert(fts_native_segment_writer_finish(&writer, &temp_path,
+						     &error) == 0);
+	path = t_strdup_printf(TEST_DIR"/seg.test%u", i_rand());
+	if (rename(temp_path, path) < 0)
+		i_fatal("rename(%s, %s) failed: %m", temp_path, path);
+	return path;
+}
+
+static void test_fts_native_segment(void)
+{
+	static const uint32_t uids_apple[] = { 1, 2, 3, 100000 };
+	static const uint32_t uids_apricot[] = { 5 };
+	static const uint32_t uids_banana[] = { 2, 7 };
+	static const uint32_t *const uids[] = {
+		uids_apple, uids_apricot, uids_banana
+	};
+	static const unsigned int uid_counts[] = { 4, 1, 2 };
+	static const char *const terms[] = {
+		"b:apple", "b:apricot", "b:banana", NULL
+	};
+	struct fts_native_segment *segment;
+	ARRAY_TYPE(seq_range) result;
+	const char *path, *error;
+
+	test_begin("fts-native segment");
+	test_dir_init();
+	t_array_init(&result, 8);
+
+	path = test_segment_write(terms, uids, uid_counts);
+	test_assert(fts_native_segment_open(path, &segment, &error) == 1);
+	test_assert(fts_native_segment_get_max_uid(segment) == 100000);
+
+	test_assert(fts_native_segment_lookup(segment, "b:apple", FALSE,
+					      &result, &error) == 0);
+	test_assert_strcmp(seq_range_to_str(&result), "1:3,100000");
+
+	array_clear(&result);
+	test_assert(fts_native_segment_lookup(segment, "b:ap", FALSE,
+					      &result, &error) == 0);
+	test_assert(array_count(&result) == 0);
+	test_assert(fts_native_segment_lookup(segment, "b:ap", TRUE,
+					      &result, &error) == 0);
+	test_assert_strcmp(seq_range_to_str(&result), "1:3,5,100000");
+
+	array_clear(&result);
+	test_assert(fts_native_segment_lookup(segment, "b:", TRUE,
+					      &result, &error) == 0);
+	test_assert_strcmp(seq_range_to_str(&result), "1:3,5,7,100000");
+
+	array_clear(&result);
+	test_assert(fts_native_segment_lookup(segment, "b:cherry", TRUE,
+					      &result, &error) == 0);
+	test_assert(fts_native_segment_lookup(segment, "a", TRUE,
+					      &result, &error) == 0);
+	test_assert(fts_native_segment_lookup(segment, "c", TRUE,
+					      &result, &error) == 0);
+	test_assert(array_count(&result) == 0);
+	fts_native_segment_close(&segment);
+
+	test_assert(fts_native_segment_open(TEST_DIR"/nonexistent",
+					    &segment, &error) == 0);
+	test_dir_deinit();
+	test_end();
+}
+
+static void test_fts_native_segment_corrupted(void)
+{
+	static const uint32_t uids_a[] = { 1 };
+	static const uint32_t *const uids[] = { uids_a };
+	static const unsigned int uid_counts[] = { 1 };
+	static const char *const terms[] = { "b:a", NULL };
+	struct fts_native_segment *segment;
+	const char *path, *error;
+	struct stat st;
+	int fd;
+
+	test_begin("fts-native segment corrupted");
+	test_dir_init();
+
+	path = test_segment_write(terms, uids, uid_counts);
+	if (stat(path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+	if (truncate(path, st.st_size - 1) < 0)
+		i_fatal("truncate(%s) failed: %m", path);
+	test_assert(fts_native_segment_open(path, &segment, &error) == -1);
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write(fd, "garbage", 7) != 7)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+	test_assert(fts_native_segment_open(path, &segment, &error) == -1);
+
+	test_dir_deinit();
+	test_end();
+}
+
+static struct fts_native_index *
+test_index_init(unsigned int max_segments, unsigned int flush_postings)
+{
+	const struct fts_native_index_settings set = {
+		.lock_method = FILE_LOCK_METHOD_FCNTL,
+		.lock_timeout_secs = 1,
+		.mail_set = &test_mail_set,
+		.file_mode = 0600,
+		.dir_mode = 0700,
+		.gid = (gid_t)-1,
+		.max_segments = max_segments,
+		.flush_postings = flush_postings,
+	};
+	return fts_native_index_init(TEST_DIR"/"FTS_NATIVE_INDEX_DIR_NAME,
+				     &set);
+}
+
+static const char *
+test_index_lookup(struct fts_native_index *index, const char *term,
+		  bool prefix_match)
+{
+	ARRAY_TYPE(seq_range) result;
+
+	t_array_init(&result, 8);
+	test_assert(fts_native_index_lookup(index, term, prefix_match,
+					    &result) == 0);
+	return seq_range_to_str(&result);
+}
+
+static void test_fts_native_index(void)
+{
+	struct fts_native_index *index, *index2;
+	struct fts_native_index_build *build;
+	uint32_t uid;
+
+	test_begin("fts-native index");
+	test_dir_init();
+
+	/* flush a new segment after every 10 postings, and merge when there
+	   are more than 5 segments */
+	index = test_index_init(5, 10);
+	index2 = test_index_init(5, 10);
+	test_assert(fts_native_index_refresh(index) == 0);
+	test_assert_strcmp(test_index_lookup(index, "b:foo", TRUE), "");
+
+	build = fts_native_index_build_init(index);
+	for (uid = 1; uid <= 20; uid++) {
+		fts_native_index_build_add(build, "b:all", uid);
+		/* duplicates are ignored */
+		fts_native_index_build_add(build, "b:all", uid);
+		if (uid % 2 == 0)
+			fts_native_index_build_add(build, "b:even", uid);
+		else
+			fts_native_index_build_add(build, "b:odd", uid);
+	}
+	fts_native_index_build_add(build, "h:foo", 3);
+	test_assert(fts_native_index_build_deinit(&build) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 5);
+	test_assert(fts_native_index_get_last_uid(index) == 20);
+	test_assert(fts_native_index_get_fragmentation(index) == 80);
+
+	test_assert_strcmp(test_index_lookup(index, "b:all", FALSE), "1:20");
+	test_assert_strcmp(test_index_lookup(index, "b:even", FALSE),
+			   "2,4,6,8,10,12,14,16,18,20");
+	test_assert_strcmp(test_index_lookup(index, "b:", TRUE), "1:20");
+	test_assert_strcmp(test_index_lookup(index, "h:f", TRUE), "3");
+
+	/* the other instance sees the changes after refreshing */
+	test_assert(fts_native_index_refresh(index2) == 0);
+	test_assert(fts_native_index_get_last_uid(index2) == 20);
+	test_assert_strcmp(test_index_lookup(index2, "b:odd", FALSE),
+			   "1,3,5,7,9,11,13,15,17,19");
+
+	/* expunges are hidden immediately */
+	build = fts_native_index_build_init(index);
+	fts_native_index_build_expunge(build, 3);
+	fts_native_index_build_expunge(build, 4);
+	test_assert(fts_native_index_build_deinit(&build) == 0);
+	test_assert_strcmp(test_index_lookup(index, "b:all", FALSE),
+			   "1:2,5:20");
+	test_assert_strcmp(test_index_lookup(index, "h:foo", FALSE), "");
+	/* 10% of UIDs expunged */
+	test_assert(fts_native_index_get_fragmentation(index) == 100);
+
+	/* adding more segments triggers a merge */
+	build = fts_native_index_build_init(index);
+	for (uid = 21; uid <= 30; uid++)
+		fts_native_index_build_add(build, "b:new", uid);
+	test_assert(fts_native_index_build_deinit(&build) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 1);
+	test_assert(fts_native_index_get_fragmentation(index) == 0);
+	test_assert_strcmp(test_index_lookup(index, "b:all", FALSE),
+			   "1:2,5:20");
+	test_assert_strcmp(test_index_lookup(index, "b:new", FALSE), "21:30");
+	test_assert_strcmp(test_index_lookup(index, "b:", TRUE), "1:2,5:30");
+
+	/* index2 still has the old segments mmaped, but it switches to the
+	   merged segment after refreshing */
+	test_assert(fts_native_index_get_segment_count(index2) == 5);
+	test_assert(fts_native_index_refresh(index2) == 0);
+	test_assert(fts_native_index_get_segment_count(index2) == 1);
+	test_assert_strcmp(test_index_lookup(index2, "b:new", FALSE), "21:30");
+	test_assert_strcmp(test_index_lookup(index2, "b:all", FALSE),
+			   "1:2,5:20");
+
+	/* UIDs given out of order */
+	build = fts_native_index_build_init(index);
+	fts_native_index_build_add(build, "b:zz", 40);
+	fts_native_index_build_add(build, "b:zz", 35);
+	fts_native_index_build_add(build, "b:zz", 40);
+	test_assert(fts_native_index_build_deinit(&build) == 0);
+	test_assert_strcmp(test_index_lookup(index, "b:zz", FALSE), "35,40");
+	test_assert(fts_native_index_get_fragmentation(index) == 20);
+
+	test_assert(fts_native_index_optimize(index) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 1);
+	test_assert(fts_native_index_get_fragmentation(index) == 0);
+	test_assert_strcmp(test_index_lookup(index, "b:", TRUE),
+			   "1:2,5:30,35,40");
+
+	fts_native_index_deinit(&index);
+	fts_native_index_deinit(&index2);
+	test_dir_deinit();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_fts_native_segment,
+		test_fts_native_segment_corrupted,
+		test_fts_native_index,
+		NULL
+	};
+	return test_run(test_functions);
+}
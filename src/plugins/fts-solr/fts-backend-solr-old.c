@@ -246,6 +246,7 @@ fts_backend_solr_init(struct fts_backend *_backend, const char **error_r)
 	struct solr_fts_backend *backend = (struct solr_fts_backend *)_backend;
 	struct fts_solr_user *fuser = FTS_SOLR_USER_CONTEXT(_backend->ns->user);
 	struct ssl_iostream_settings ssl_set;
+	string_t *temp_prefix;
 	const char *str;
 
 	if (fuser == NULL) {
@@ -255,9 +256,11 @@ fts_backend_solr_init(struct fts_backend *_backend, const char **error_r)
 
 	i_zero(&ssl_set);
 	mail_user_init_ssl_client_settings(_backend->ns->user, &ssl_set);
+	temp_prefix = t_str_new(128);
+	mail_user_set_get_temp_prefix(temp_prefix, _backend->ns->user->set);
 
 	if (solr_connection_init(&fuser->set, &ssl_set,
-				 _backend->ns->user->event,
+				 _backend->ns->user->event, str_c(temp_prefix),
 				 &backend->solr_conn, error_r) < 0)
 		return -1;
 
@@ -469,6 +472,8 @@ fts_backend_solr_update_deinit(struct fts_backend_update_context *_ctx)
 	int ret;
 
 	ret = fts_backed_solr_build_commit(ctx);
+	if (solr_connection_post_wait(backend->solr_conn) < 0)
+		ret = -1;
 
 	/* commit and wait until the documents we just indexed are
 	   visible to the following search */
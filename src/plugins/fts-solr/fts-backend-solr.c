@@ -182,6 +182,7 @@ fts_backend_solr_init(struct fts_backend *_backend, const char **error_r)
 	struct solr_fts_backend *backend = (struct solr_fts_backend *)_backend;
 	struct fts_solr_user *fuser = FTS_SOLR_USER_CONTEXT(_backend->ns->user);
 	struct ssl_iostream_settings ssl_set;
+	string_t *temp_prefix;
 
 	if (fuser == NULL) {
 		*error_r = "Invalid fts_solr setting";
@@ -195,9 +196,12 @@ fts_backend_solr_init(struct fts_backend *_backend, const char **error_r)
 
 	i_zero(&ssl_set);
 	mail_user_init_ssl_client_settings(_backend->ns->user, &ssl_set);
+	temp_prefix = t_str_new(128);
+	mail_user_set_get_temp_prefix(temp_prefix, _backend->ns->user->set);
 
 	return solr_connection_init(&fuser->set, &ssl_set,
 				    _backend->ns->user->event,
+				    str_c(temp_prefix),
 				    &backend->solr_conn, error_r);
 }
 
@@ -398,6 +402,8 @@ fts_backend_solr_update_deinit(struct fts_backend_update_context *_ctx)
 
 	if (fts_backed_solr_build_flush(ctx) < 0)
 		ret = -1;
+	if (solr_connection_post_wait(backend->solr_conn) < 0)
+		ret = -1;
 
 	if (ctx->documents_added || ctx->expunges) {
 		/* commit and wait until the documents we just indexed are
@@ -429,6 +435,8 @@ fts_backend_solr_update_set_mailbox(struct fts_backend_update_context *_ctx,
 {
 	struct solr_fts_backend_update_context *ctx =
 		(struct solr_fts_backend_update_context *)_ctx;
+	struct solr_fts_backend *backend =
+		(struct solr_fts_backend *)_ctx->backend;
 	const char *box_guid;
 
 	if (ctx->prev_uid != 0) {
@@ -436,7 +444,8 @@ fts_backend_solr_update_set_mailbox(struct fts_backend_update_context *_ctx,
 
 		/* flush solr between mailboxes, so we don't wrongly update
 		   last_uid before we know it has succeeded */
-		if (fts_backed_solr_build_flush(ctx) < 0)
+		if (fts_backed_solr_build_flush(ctx) < 0 ||
+		    solr_connection_post_wait(backend->solr_conn) < 0)
 			_ctx->failed = TRUE;
 		else if (!_ctx->failed)
 			fts_index_set_last_uid(ctx->cur_box, ctx->prev_uid);
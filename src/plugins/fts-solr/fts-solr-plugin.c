@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "http-client.h"
+#include "compression.h"
 #include "mail-user.h"
 #include "mail-storage-hooks.h"
 #include "solr-connection.h"
@@ -10,6 +11,8 @@
 #include "fts-solr-plugin.h"
 
 #define DEFAULT_SOLR_BATCH_SIZE 1000
+#define DEFAULT_SOLR_MAX_INFLIGHT 1
+#define DEFAULT_SOLR_COMPRESS_LEVEL 6
 
 const char *fts_solr_plugin_version = DOVECOT_ABI_VERSION;
 struct http_client *solr_http_client = NULL;
@@ -27,6 +30,8 @@ fts_solr_plugin_init_settings(struct mail_user *user,
 		str = "";
 
 	set->batch_size = DEFAULT_SOLR_BATCH_SIZE;
+	set->max_inflight = DEFAULT_SOLR_MAX_INFLIGHT;
+	set->compress_level = DEFAULT_SOLR_COMPRESS_LEVEL;
 	set->soft_commit = TRUE;
 
 	for (tmp = t_strsplit_spaces(str, " "); *tmp != NULL; tmp++) {
@@ -47,6 +52,29 @@ fts_solr_plugin_init_settings(struct mail_user *user,
 				i_error("fts_solr: batch_size must be a positive integer");
 					return -1;
 			}
+		} else if (str_begins(*tmp, "max_inflight=")) {
+			if (str_to_uint(*tmp+13, &set->max_inflight) < 0 ||
+			    set->max_inflight == 0) {
+				i_error("fts_solr: max_inflight must be a positive integer");
+				return -1;
+			}
+		} else if (str_begins(*tmp, "compress=")) {
+			/* only gzip can be used as HTTP Content-Encoding.
+			   "deflate" would require zlib (RFC 1950) framing,
+			   but the deflate handler writes a raw stream. */
+			if (strcmp(*tmp + 9, "gz") != 0 ||
+			    compression_lookup_handler(*tmp + 9,
+						       &set->compress) <= 0) {
+				i_error("fts_solr: Unsupported compress method: %s",
+					*tmp + 9);
+				return -1;
+			}
+		} else if (str_begins(*tmp, "compress_level=")) {
+			if (str_to_int(*tmp+15, &set->compress_level) < 0 ||
+			    set->compress_level < 1 || set->compress_level > 9) {
+				i_error("fts_solr: compress_level must be between 1..9");
+				return -1;
+			}
 		} else if (str_begins(*tmp, "soft_commit=")) {
 			if (strcmp(*tmp + 12, "yes") == 0) {
 				set->soft_commit = TRUE;
@@ -13,6 +13,12 @@
 struct fts_solr_settings {
 	const char *url, *default_ns_prefix, *rawlog_dir;
 	unsigned int batch_size;
+	/* Also used as the HTTP client's max_parallel_connections. The client
+	   is shared by all the users in the process, so the value comes from
+	   the user that created it first. */
+	unsigned int max_inflight;
+	const struct compression_handler *compress;
+	int compress_level;
 	bool use_libfts;
 	bool debug;
 	bool soft_commit;
@@ -6,7 +6,11 @@
 #include "str.h"
 #include "strescape.h"
 #include "ioloop.h"
+#include "time-util.h"
 #include "istream.h"
+#include "ostream.h"
+#include "iostream-temp.h"
+#include "compression.h"
 #include "http-url.h"
 #include "http-client.h"
 #include "fts-solr-plugin.h"
@@ -14,6 +18,12 @@
 
 #include <expat.h>
 
+/* Update posts larger than this are buffered to a temporary file */
+#define SOLR_POST_MAX_MEM_SIZE (1024*128)
+/* While an update post is being built, get the earlier posts forward at
+   most this often. */
+#define SOLR_POST_RUN_INTERVAL_MSECS 10
+
 struct solr_lookup_context {
 	pool_t result_pool;
 	struct istream *payload;
@@ -27,11 +37,13 @@ struct solr_lookup_context {
 
 struct solr_connection_post {
 	struct solr_connection *conn;
+	struct event *event;
 
 	struct http_client_request *http_req;
 	int request_status;
 
-	bool failed:1;
+	struct ostream *temp_output, *output;
+	uoff_t size;
 };
 
 struct solr_connection {
@@ -42,8 +54,18 @@ struct solr_connection {
 	char *http_failure;
 	char *http_user;
 	char *http_password;
+	char *temp_prefix;
+
+	const struct compression_handler *compress_handler;
+	int compress_level;
+	unsigned int max_inflight;
+	unsigned int posts_inflight;
+	struct ioloop *post_ioloop;
+	/* when the pending posts were last run */
+	struct timeval posts_run_time;
 
 	bool debug:1;
+	bool posts_failed:1;
 	bool posting:1;
 	bool http_ssl:1;
 };
@@ -64,7 +86,7 @@ static char *solr_connection_create_http_base_url(struct http_url *http_url)
 
 int solr_connection_init(const struct fts_solr_settings *solr_set,
 			 const struct ssl_iostream_settings *ssl_client_set,
-			 struct event *event_parent,
+			 struct event *event_parent, const char *temp_prefix,
 			 struct solr_connection **conn_r, const char **error_r)
 {
 	struct http_client_settings http_set;
@@ -92,12 +114,19 @@ int solr_connection_init(const struct fts_solr_settings *solr_set,
 					       http_url->password : "");
 	}
 
+	conn->temp_prefix = i_strdup(temp_prefix);
+	conn->compress_handler = solr_set->compress;
+	conn->compress_level = solr_set->compress_level;
+	conn->max_inflight = solr_set->max_inflight;
 	conn->debug = solr_set->debug;
 
 	if (solr_http_client == NULL) {
+		/* the client is shared by all the users in this process, so
+		   max_inflight of later users doesn't change the number of
+		   parallel connections */
 		i_zero(&http_set);
 		http_set.max_idle_time_msecs = 5*1000;
-		http_set.max_parallel_connections = 1;
+		http_set.max_parallel_connections = solr_set->max_inflight;
 		http_set.max_pipelined_requests = 1;
 		http_set.max_redirects = 1;
 		http_set.max_attempts = 3;
@@ -126,11 +155,13 @@ void solr_connection_deinit(struct solr_connection **_conn)
 	struct solr_connection *conn = *_conn;
 
 	*_conn = NULL;
+	(void)solr_connection_post_wait(conn);
 	event_unref(&conn->event);
 	i_free(conn->http_host);
 	i_free(conn->http_base_url);
 	i_free(conn->http_user);
 	i_free(conn->http_password);
+	i_free(conn->temp_prefix);
 	i_free(conn);
 }
 
@@ -217,6 +248,56 @@ int solr_connection_select(struct solr_connection *conn, const char *query,
 	return 0;
 }
 
+static void
+solr_connection_posts_run(struct solr_connection *conn,
+			  unsigned int max_inflight)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+	struct ioloop *ioloop;
+	struct timeout *to;
+
+	if (conn->posts_inflight == 0)
+		return;
+
+	ioloop = io_loop_create();
+	(void)http_client_switch_ioloop(solr_http_client);
+	conn->post_ioloop = ioloop;
+	if (conn->posts_inflight <= max_inflight) {
+		/* send whatever can be sent without waiting. the timeouts
+		   are run before the IOs, so stop only after the IOs of
+		   this iteration are handled. */
+		to = timeout_add_short(0, io_loop_stop_delayed, ioloop);
+		io_loop_run(ioloop);
+		timeout_remove(&to);
+	}
+	while (conn->posts_inflight > max_inflight)
+		io_loop_run(ioloop);
+	conn->post_ioloop = NULL;
+
+	io_loop_set_current(prev_ioloop);
+	(void)http_client_switch_ioloop(solr_http_client);
+	io_loop_set_current(ioloop);
+	io_loop_destroy(&ioloop);
+	i_gettimeofday(&conn->posts_run_time);
+}
+
+static void solr_connection_post_free(struct solr_connection_post **_post)
+{
+	struct solr_connection_post *post = *_post;
+
+	*_post = NULL;
+	if (post->output != NULL) {
+		o_stream_abort(post->output);
+		o_stream_unref(&post->output);
+	}
+	if (post->temp_output != NULL) {
+		o_stream_abort(post->temp_output);
+		o_stream_destroy(&post->temp_output);
+	}
+	event_unref(&post->event);
+	i_free(post);
+}
+
 static void
 solr_connection_update_response(const struct http_response *response,
 				struct solr_connection_post *post)
@@ -228,18 +309,37 @@ solr_connection_update_response(const struct http_response *response,
 	}
 }
 
-static struct http_client_request *
-solr_connection_post_request(struct solr_connection_post *post)
+static void
+solr_connection_post_response(const struct http_response *response,
+			      struct solr_connection_post *post)
 {
 	struct solr_connection *conn = post->conn;
-	struct http_client_request *http_req;
-	const char *url;
+	struct event_passthrough *e =
+		event_create_passthrough(post->event)->
+		set_name("fts_solr_batch_finished")->
+		add_int("status_code", response->status);
 
-	url = t_strconcat(conn->http_base_url, "update", NULL);
+	if (response->status / 100 != 2) {
+		e->add_str("error", http_response_get_message(response));
+		e_error(e->event(), "fts_solr: Indexing failed: %s",
+			http_response_get_message(response));
+		conn->posts_failed = TRUE;
+	} else {
+		e_debug(e->event(), "fts_solr: Indexed batch of %"PRIuUOFF_T
+			" bytes", post->size);
+	}
 
-	http_req = http_client_request(solr_http_client, "POST",
-				       conn->http_host, url,
-				       solr_connection_update_response, post);
+	i_assert(conn->posts_inflight > 0);
+	conn->posts_inflight--;
+	if (conn->post_ioloop != NULL)
+		io_loop_stop(conn->post_ioloop);
+	solr_connection_post_free(&post);
+}
+
+static void
+solr_connection_post_request_init(struct solr_connection *conn,
+				  struct http_client_request *http_req)
+{
 	if (conn->http_user != NULL) {
 		http_client_request_set_auth_simple(
 			http_req, conn->http_user, conn->http_password);
@@ -247,7 +347,6 @@ solr_connection_post_request(struct solr_connection_post *post)
 	http_client_request_set_port(http_req, conn->http_port);
 	http_client_request_set_ssl(http_req, conn->http_ssl);
 	http_client_request_add_header(http_req, "Content-Type", "text/xml");
-	return http_req;
 }
 
 struct solr_connection_post *
@@ -258,49 +357,125 @@ solr_connection_post_begin(struct solr_connection *conn)
 	i_assert(!conn->posting);
 	conn->posting = TRUE;
 
+	/* get the earlier posts forward while this one is being built */
+	solr_connection_posts_run(conn, conn->max_inflight);
+
 	post = i_new(struct solr_connection_post, 1);
 	post->conn = conn;
-	post->http_req = solr_connection_post_request(post);
+	post->event = event_create(conn->event);
+	post->temp_output =
+		iostream_temp_create_sized(conn->temp_prefix, 0,
+					   "fts solr update",
+					   SOLR_POST_MAX_MEM_SIZE);
+	if (conn->compress_handler == NULL) {
+		post->output = post->temp_output;
+		o_stream_ref(post->output);
+	} else {
+		post->output = conn->compress_handler->create_ostream(
+			post->temp_output, conn->compress_level);
+	}
 	return post;
 }
 
 void solr_connection_post_more(struct solr_connection_post *post,
 			       const unsigned char *data, size_t size)
 {
-	i_assert(post->conn->posting);
+	struct solr_connection *conn = post->conn;
+	struct timeval now;
 
-	if (post->failed)
-		return;
+	i_assert(conn->posting);
 
-	if (post->request_status == 0) {
-		(void)http_client_request_send_payload(
-			&post->http_req, data, size);
+	o_stream_nsend(post->output, data, size);
+	post->size += size;
+
+	/* The http client runs only in the posts' own ioloop. Run it now
+	   and then while the post is being built, so the pending posts
+	   keep being sent and their responses handled. This doesn't wait
+	   for anything. */
+	if (conn->posts_inflight > 0) {
+		i_gettimeofday(&now);
+		if (timeval_diff_msecs(&now, &conn->posts_run_time) >=
+		    SOLR_POST_RUN_INTERVAL_MSECS)
+			solr_connection_posts_run(conn, conn->max_inflight);
 	}
-	if (post->request_status < 0)
-		post->failed = TRUE;
+}
+
+static int solr_connection_post_finish(struct solr_connection_post *post)
+{
+	if (post->output != post->temp_output) {
+		if (o_stream_finish(post->output) < 0) {
+			i_error("fts_solr: write(%s) failed: %s",
+				o_stream_get_name(post->output),
+				o_stream_get_error(post->output));
+			return -1;
+		}
+		o_stream_unref(&post->output);
+	}
+	if (o_stream_flush(post->temp_output) < 0) {
+		i_error("fts_solr: write(%s) failed: %s",
+			o_stream_get_name(post->temp_output),
+			o_stream_get_error(post->temp_output));
+		return -1;
+	}
+	return 0;
 }
 
 int solr_connection_post_end(struct solr_connection_post **_post)
 {
 	struct solr_connection_post *post = *_post;
 	struct solr_connection *conn = post->conn;
-	int ret = post->failed ? -1 : 0;
+	struct istream *payload;
+	const char *url;
 
 	i_assert(conn->posting);
 
 	*_post = NULL;
+	conn->posting = FALSE;
 
-	if (!post->failed) {
-		if (http_client_request_finish_payload(&post->http_req) < 0 ||
-		    post->request_status < 0) {
-			ret = -1;
-		}
-	} else {
-		http_client_request_abort(&post->http_req);
+	if (solr_connection_post_finish(post) < 0) {
+		solr_connection_post_free(&post);
+		return -1;
 	}
-	i_free(post);
 
-	conn->posting = FALSE;
+	event_add_int(post->event, "bytes", post->size);
+	if (conn->compress_handler != NULL) {
+		event_add_int(post->event, "compressed_bytes",
+			      post->temp_output->offset);
+	}
+	o_stream_unref(&post->output);
+	payload = iostream_temp_finish(&post->temp_output, IO_BLOCK_SIZE);
+
+	url = t_strconcat(conn->http_base_url, "update", NULL);
+	post->http_req = http_client_request(solr_http_client, "POST",
+					     conn->http_host, url,
+					     solr_connection_post_response,
+					     post);
+	solr_connection_post_request_init(conn, post->http_req);
+	if (conn->compress_handler != NULL) {
+		/* gz is the only allowed compress method */
+		http_client_request_add_header(post->http_req,
+					       "Content-Encoding", "gzip");
+	}
+	http_client_request_set_event(post->http_req, post->event);
+	http_client_request_set_payload(post->http_req, payload, FALSE);
+	i_stream_unref(&payload);
+	http_client_request_submit(post->http_req);
+	conn->posts_inflight++;
+
+	/* wait until there's room in the window for the next post */
+	solr_connection_posts_run(conn, conn->max_inflight - 1);
+	return conn->posts_failed ? -1 : 0;
+}
+
+int solr_connection_post_wait(struct solr_connection *conn)
+{
+	int ret;
+
+	i_assert(!conn->posting);
+
+	solr_connection_posts_run(conn, 0);
+	ret = conn->posts_failed ? -1 : 0;
+	conn->posts_failed = FALSE;
 	return ret;
 }
 
@@ -308,13 +483,22 @@ int solr_connection_post(struct solr_connection *conn, const char *cmd)
 {
 	struct istream *post_payload;
 	struct solr_connection_post post;
+	const char *url;
 
 	i_assert(!conn->posting);
 
+	/* the command must not be handled before the pending updates */
+	solr_connection_posts_run(conn, 0);
+
 	i_zero(&post);
 	post.conn = conn;
 
-	post.http_req = solr_connection_post_request(&post);
+	url = t_strconcat(conn->http_base_url, "update", NULL);
+	post.http_req = http_client_request(solr_http_client, "POST",
+					    conn->http_host, url,
+					    solr_connection_update_response,
+					    &post);
+	solr_connection_post_request_init(conn, post.http_req);
 	post_payload = i_stream_create_from_data(cmd, strlen(cmd));
 	http_client_request_set_payload(post.http_req, post_payload, TRUE);
 	i_stream_unref(&post_payload);
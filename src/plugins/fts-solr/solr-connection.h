@@ -8,19 +8,31 @@ struct fts_solr_settings;
 
 int solr_connection_init(const struct fts_solr_settings *solr_set,
 			 const struct ssl_iostream_settings *ssl_client_set,
-			 struct event *event_parent,
+			 struct event *event_parent, const char *temp_prefix,
 			 struct solr_connection **conn_r,
 			 const char **error_r);
 void solr_connection_deinit(struct solr_connection **conn);
 
 int solr_connection_select(struct solr_connection *conn, const char *query,
 			   pool_t pool, struct solr_result ***box_results_r);
+/* Post the command and wait for it to finish. Any pending update posts are
+   finished before the command is sent. */
 int solr_connection_post(struct solr_connection *conn, const char *cmd);
 
+/* Update posts are buffered and sent asynchronously once finished. Up to
+   the configured max_inflight posts may be pending at the same time. The
+   pending posts progress only while these functions are called:
+   solr_connection_post_more() runs them without waiting every few
+   milliseconds, and the other functions wait for them as needed. */
 struct solr_connection_post *
 solr_connection_post_begin(struct solr_connection *conn);
 void solr_connection_post_more(struct solr_connection_post *post,
 			       const unsigned char *data, size_t size);
+/* Submit the post. Returns -1 if it or any earlier post has already
+   failed. */
 int solr_connection_post_end(struct solr_connection_post **post);
+/* Wait for all the pending update posts to finish. Returns -1 if any of them
+   failed since the last call. */
+int solr_connection_post_wait(struct solr_connection *conn);
 
 #endif
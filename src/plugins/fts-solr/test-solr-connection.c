@@ -0,0 +1,458 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "ioloop.h"
+#include "sleep.h"
+#include "write-full.h"
+#include "istream.h"
+#include "iostream-ssl.h"
+#include "compression.h"
+#include "http-url.h"
+#include "http-request.h"
+#include "http-server.h"
+#include "http-client.h"
+#include "test-common.h"
+#include "test-subprocess.h"
+#include "fts-solr-plugin.h"
+#include "solr-connection.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define SERVER_KILL_TIMEOUT_SECS 20
+/* Delay the responses, so the client has time to send the following posts
+   while the earlier ones are still being processed. */
+#define SERVER_RESPONSE_DELAY_MSECS 20
+
+struct http_client *solr_http_client = NULL;
+
+static bool debug = FALSE;
+
+static struct ip_addr bind_ip;
+static in_port_t bind_port = 0;
+static int fd_listen = -1;
+static int fd_stats[2] = { -1, -1 };
+
+/*
+ * Stub Solr server
+ */
+
+struct test_server_request {
+	struct http_server_request *req;
+	buffer_t *payload;
+	struct timeout *to;
+	unsigned int status;
+};
+
+static struct http_server *http_server;
+static struct io *io_listen;
+static unsigned int server_docs_count;
+static unsigned int server_concurrent_count, server_max_concurrent_count;
+
+static void test_server_report_stats(void)
+{
+	const char *stats =
+		t_strdup_printf("%u %u\n", server_docs_count,
+				server_max_concurrent_count);
+
+	if (write_full(fd_stats[1], stats, strlen(stats)) < 0)
+		i_fatal("write(stats) failed: %m");
+	server_docs_count = 0;
+	server_max_concurrent_count = 0;
+}
+
+static const char *
+test_server_decompress(const struct http_request *hreq, buffer_t *payload)
+{
+	const struct compression_handler *handler;
+	const char *encoding, *name;
+	struct istream *input, *dec_input;
+	const unsigned char *data;
+	size_t size;
+	string_t *str;
+
+	encoding = http_request_header_get(hreq, "Content-Encoding");
+	if (encoding == NULL)
+		return str_c(payload);
+
+	name = strcmp(encoding, "gzip") == 0 ? "gz" : encoding;
+	if (compression_lookup_handler(name, &handler) <= 0)
+		i_fatal("test server: Unknown Content-Encoding: %s", encoding);
+
+	str = t_str_new(payload->used * 4);
+	input = i_stream_create_from_data(payload->data, payload->used);
+	dec_input = handler->create_istream(input);
+	i_stream_unref(&input);
+	while (i_stream_read_more(dec_input, &data, &size) > 0) {
+		str_append_data(str, data, size);
+		i_stream_skip(dec_input, size);
+	}
+	if (dec_input->stream_errno != 0) {
+		i_fatal("test server: Decompression failed: %s",
+			i_stream_get_error(dec_input));
+	}
+	i_stream_unref(&dec_input);
+	return str_c(str);
+}
+
+static void test_server_respond(struct test_server_request *sreq)
+{
+	struct http_server_response *resp;
+
+	timeout_remove(&sreq->to);
+	resp = http_server_response_create(sreq->req, sreq->status,
+					   sreq->status == 200 ? "OK" : "Failed");
+	http_server_response_submit(resp);
+	http_server_request_unref(&sreq->req);
+	buffer_free(&sreq->payload);
+	i_free(sreq);
+
+	i_assert(server_concurrent_count > 0);
+	server_concurrent_count--;
+}
+
+static void test_server_payload_finished(struct test_server_request *sreq)
+{
+	const struct http_request *hreq = http_server_request_get(sreq->req);
+	const char *cmd, *p;
+	size_t len;
+
+	cmd = test_server_decompress(hreq, sreq->payload);
+	len = strlen(cmd);
+	sreq->status = 200;
+	if (str_begins(cmd, "<commit"))
+		test_server_report_stats();
+	else if (strstr(cmd, "FAIL") != NULL)
+		sreq->status = 500;
+	else if (!str_begins(cmd, "<add>") ||
+		 len < 6 || strcmp(cmd + len - 6, "</add>") != 0)
+		sreq->status = 400;
+	else {
+		for (p = cmd; (p = strstr(p, "<doc>")) != NULL; p++)
+			server_docs_count++;
+	}
+	sreq->to = timeout_add_short(SERVER_RESPONSE_DELAY_MSECS,
+				     test_server_respond, sreq);
+}
+
+static void test_server_handle_request(void *context ATTR_UNUSED,
+				       struct http_server_request *req)
+{
+	struct test_server_request *sreq;
+
+	if (++server_concurrent_count > server_max_concurrent_count)
+		server_max_concurrent_count = server_concurrent_count;
+
+	sreq = i_new(struct test_server_request, 1);
+	sreq->req = req;
+	sreq->payload = buffer_create_dynamic(default_pool, 1024);
+	http_server_request_ref(req);
+	http_server_request_buffer_payload(req, sreq->payload, SIZE_MAX,
+					   test_server_payload_finished, sreq);
+}
+
+static const struct http_server_callbacks test_server_callbacks = {
+	.handle_request = test_server_handle_request,
+};
+
+static void test_server_accept(void *context ATTR_UNUSED)
+{
+	int fd;
+
+	for (;;) {
+		if ((fd = net_accept(fd_listen, NULL, NULL)) < 0) {
+			if (errno == EAGAIN)
+				break;
+			if (errno == ECONNABORTED)
+				continue;
+			i_fatal("test server: accept() failed: %m");
+		}
+		net_set_nonblock(fd, TRUE);
+		(void)http_server_connection_create(http_server, fd, fd, FALSE,
+						    &test_server_callbacks,
+						    NULL);
+	}
+}
+
+static int test_run_server(void *context ATTR_UNUSED)
+{
+	struct http_server_settings server_set;
+	struct ioloop *ioloop;
+
+	i_set_failure_prefix("SERVER: ");
+	i_close_fd(&fd_stats[0]);
+
+	i_zero(&server_set);
+	server_set.request_limits.max_payload_size = UOFF_T_MAX;
+	server_set.debug = debug;
+
+	ioloop = io_loop_create();
+	http_server = http_server_init(&server_set);
+	io_listen = io_add(fd_listen, IO_READ, test_server_accept, NULL);
+	io_loop_run(ioloop);
+	io_remove(&io_listen);
+	http_server_deinit(&http_server);
+	io_loop_destroy(&ioloop);
+
+	i_close_fd(&fd_listen);
+	i_close_fd(&fd_stats[1]);
+	return 0;
+}
+
+/*
+ * Client
+ */
+
+static void test_server_start(void)
+{
+	fd_listen = net_listen(&bind_ip, &bind_port, 128);
+	if (fd_listen == -1) {
+		i_fatal("listen(%s:%u) failed: %m",
+			net_ip2addr(&bind_ip), bind_port);
+	}
+	net_set_nonblock(fd_listen, TRUE);
+	if (pipe(fd_stats) < 0)
+		i_fatal("pipe() failed: %m");
+
+	test_subprocess_fork(test_run_server, NULL, FALSE);
+	i_close_fd(&fd_listen);
+	i_close_fd(&fd_stats[1]);
+}
+
+static void test_server_stop(void)
+{
+	test_subprocess_kill_all(SERVER_KILL_TIMEOUT_SECS);
+	i_close_fd(&fd_stats[0]);
+}
+
+static struct solr_connection *
+test_solr_connection_init(const struct fts_solr_settings *set)
+{
+	struct fts_solr_settings solr_set = *set;
+	struct ssl_iostream_settings ssl_set;
+	struct solr_connection *conn;
+	const char *error;
+
+	solr_set.url = t_strdup_printf("http://%s:%u/solr/",
+				       net_ip2addr(&bind_ip), bind_port);
+	solr_set.debug = debug;
+	i_zero(&ssl_set);
+	if (solr_connection_init(&solr_set, &ssl_set, NULL,
+				 ".test-solr-connection.", &conn, &error) < 0)
+		i_fatal("solr_connection_init() failed: %s", error);
+	return conn;
+}
+
+static void test_solr_connection_deinit(struct solr_connection **conn)
+{
+	solr_connection_deinit(conn);
+	http_client_deinit(&solr_http_client);
+}
+
+static int
+test_solr_post_batch(struct solr_connection *conn, unsigned int batch,
+		     unsigned int docs_count, bool fail)
+{
+	struct solr_connection_post *post;
+	const char *doc;
+	unsigned int i;
+
+	post = solr_connection_post_begin(conn);
+	solr_connection_post_more(post, (const unsigned char *)"<add>", 5);
+	for (i = 0; i < docs_count; i++) {
+		doc = t_strdup_printf("<doc><field name=\"id\">%u/%u</field>"
+				      "<field name=\"body\">%s</field></doc>",
+				      batch, i, fail ? "FAIL" :
+				      "some text that compresses well, "
+				      "some text that compresses well");
+		solr_connection_post_more(post, (const unsigned char *)doc,
+					  strlen(doc));
+	}
+	solr_connection_post_more(post, (const unsigned char *)"</add>", 6);
+	return solr_connection_post_end(&post);
+}
+
+static void
+test_solr_commit_stats(struct solr_connection *conn,
+		       unsigned int *docs_count_r,
+		       unsigned int *max_concurrent_r)
+{
+	char buf[64];
+	ssize_t ret;
+
+	test_assert(solr_connection_post(conn, "<commit/>") == 0);
+	ret = read(fd_stats[0], buf, sizeof(buf) - 1);
+	if (ret <= 0)
+		i_fatal("read(stats) failed: %m");
+	buf[ret] = '\0';
+	if (sscanf(buf, "%u %u", docs_count_r, max_concurrent_r) != 2)
+		i_fatal("Invalid stats: %s", buf);
+}
+
+static void
+test_solr_connection_batches(const struct fts_solr_settings *set,
+			     unsigned int batch_count)
+{
+	struct solr_connection *conn;
+	unsigned int i, docs_count, max_concurrent;
+
+	test_server_start();
+	conn = test_solr_connection_init(set);
+	for (i = 0; i < batch_count; i++) T_BEGIN {
+		test_assert_idx(test_solr_post_batch(conn, i, 10, FALSE) == 0, i);
+	} T_END;
+	test_assert(solr_connection_post_wait(conn) == 0);
+	test_solr_commit_stats(conn, &docs_count, &max_concurrent);
+	test_assert(docs_count == batch_count * 10);
+	test_assert(max_concurrent <= set->max_inflight);
+	if (set->max_inflight > 1)
+		test_assert(max_concurrent > 1);
+	test_solr_connection_deinit(&conn);
+	test_server_stop();
+}
+
+static void test_solr_connection_post_serial(void)
+{
+	struct fts_solr_settings set = {
+		.max_inflight = 1,
+	};
+
+	test_begin("solr connection post serial");
+	test_solr_connection_batches(&set, 5);
+	test_end();
+}
+
+static void test_solr_connection_post_pipelined(void)
+{
+	struct fts_solr_settings set = {
+		.max_inflight = 4,
+	};
+
+	test_begin("solr connection post pipelined");
+	test_solr_connection_batches(&set, 20);
+	test_end();
+}
+
+static void test_solr_connection_post_compressed(void)
+{
+	struct fts_solr_settings set = {
+		.max_inflight = 2,
+		.compress_level = 6,
+	};
+
+	test_begin("solr connection post compressed");
+	if (compression_lookup_handler("gz", &set.compress) <= 0) {
+		test_end();
+		return;
+	}
+	test_solr_connection_batches(&set, 10);
+	test_end();
+}
+
+static void test_solr_connection_post_failure(void)
+{
+	struct fts_solr_settings set = {
+		.max_inflight = 2,
+	};
+	struct solr_connection *conn;
+	unsigned int docs_count, max_concurrent;
+
+	test_begin("solr connection post failure");
+	test_server_start();
+	conn = test_solr_connection_init(&set);
+	test_expect_error_string("Indexing failed");
+	test_assert(test_solr_post_batch(conn, 0, 10, FALSE) == 0);
+	test_assert(test_solr_post_batch(conn, 1, 10, TRUE) == 0);
+	/* this may already see the failure, but is still sent */
+	(void)test_solr_post_batch(conn, 2, 10, FALSE);
+	test_assert(solr_connection_post_wait(conn) < 0);
+	test_expect_no_more_errors();
+	/* the failure is reported only once */
+	test_assert(solr_connection_post_wait(conn) == 0);
+	test_solr_commit_stats(conn, &docs_count, &max_concurrent);
+	test_assert(docs_count == 20);
+	test_solr_connection_deinit(&conn);
+	test_server_stop();
+	test_end();
+}
+
+static void test_solr_connection_post_progress(void)
+{
+	struct fts_solr_settings set = {
+		.max_inflight = 2,
+	};
+	struct solr_connection *conn;
+	struct solr_connection_post *post;
+	unsigned int i, docs_count, max_concurrent;
+	const char *doc;
+
+	test_begin("solr connection post progress while building");
+	test_server_start();
+	conn = test_solr_connection_init(&set);
+	test_expect_error_string("Indexing failed");
+	test_assert(test_solr_post_batch(conn, 0, 10, TRUE) == 0);
+
+	/* build the next post slowly, as if reading the mails took time.
+	   the pending post is sent and its failure is handled meanwhile. */
+	post = solr_connection_post_begin(conn);
+	solr_connection_post_more(post, (const unsigned char *)"<add>", 5);
+	for (i = 0; i < 50; i++) {
+		doc = t_strdup_printf("<doc><field name=\"id\">1/%u</field>"
+				      "</doc>", i);
+		solr_connection_post_more(post, (const unsigned char *)doc,
+					  strlen(doc));
+		i_sleep_msecs(SERVER_RESPONSE_DELAY_MSECS / 2);
+	}
+	solr_connection_post_more(post, (const unsigned char *)"</add>", 6);
+	test_expect_no_more_errors();
+	test_assert(solr_connection_post_end(&post) < 0);
+	test_assert(solr_connection_post_wait(conn) < 0);
+
+	test_solr_commit_stats(conn, &docs_count, &max_concurrent);
+	test_assert(docs_count == 50);
+	test_solr_connection_deinit(&conn);
+	test_server_stop();
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	int c, ret;
+
+	static void (*const test_functions[])(void) = {
+		test_solr_connection_post_serial,
+		test_solr_connection_post_pipelined,
+		test_solr_connection_post_compressed,
+		test_solr_connection_post_failure,
+		test_solr_connection_post_progress,
+		NULL
+	};
+
+	lib_init();
+	while ((c = getopt(argc, argv, "D")) > 0) {
+		switch (c) {
+		case 'D':
+			debug = TRUE;
+			break;
+		default:
+			i_fatal("Usage: %s [-D]", argv[0]);
+		}
+	}
+
+	test_subprocesses_init(debug);
+
+	/* listen on localhost */
+	i_zero(&bind_ip);
+	bind_ip.family = AF_INET;
+	bind_ip.u.ip4.s_addr = htonl(INADDR_LOOPBACK);
+
+	ioloop = io_loop_create();
+	ret = test_run(test_functions);
+	io_loop_destroy(&ioloop);
+
+	test_subprocesses_deinit();
+	lib_deinit();
+	return ret;
+}
@@ -50,6 +50,12 @@ struct fts_backend_vfuncs {
 			    enum fts_lookup_flags flags,
 			    struct fts_multi_result *result);
 	void (*lookup_done)(struct fts_backend *backend);
+
+	int (*get_fragmentation)(struct fts_backend *backend,
+				 struct mailbox *box,
+				 unsigned int *fragmentation_r);
+	void (*update_expunge_range)(struct fts_backend_update_context *ctx,
+				     const ARRAY_TYPE(seq_range) *uids);
 };
 
 enum fts_backend_flags {
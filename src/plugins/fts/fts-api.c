@@ -168,6 +168,24 @@ void fts_backend_update_expunge(struct fts_backend_update_context *ctx,
 	ctx->backend->v.update_expunge(ctx, uid);
 }
 
+void fts_backend_update_expunge_range(struct fts_backend_update_context *ctx,
+				      const ARRAY_TYPE(seq_range) *uids)
+{
+	struct seq_range_iter iter;
+	unsigned int n = 0;
+	uint32_t uid;
+
+	fts_backend_set_cur_mailbox(ctx);
+	if (ctx->backend->v.update_expunge_range != NULL) {
+		ctx->backend->v.update_expunge_range(ctx, uids);
+		return;
+	}
+
+	seq_range_array_iter_init(&iter, uids);
+	while (seq_range_array_iter_nth(&iter, n++, &uid))
+		ctx->backend->v.update_expunge(ctx, uid);
+}
+
 bool fts_backend_update_set_build_key(struct fts_backend_update_context *ctx,
 				      const struct fts_backend_build_key *key)
 {
@@ -253,6 +271,18 @@ int fts_backend_optimize(struct fts_backend *backend)
 		backend->v.optimize(backend);
 }
 
+int fts_backend_get_fragmentation(struct fts_backend *backend,
+				  struct mailbox *box,
+				  unsigned int *fragmentation_r)
+{
+	if (backend->v.get_fragmentation == NULL)
+		return 0;
+	if (backend->v.get_fragmentation(backend, box, fragmentation_r) < 0)
+		return -1;
+	*fragmentation_r = I_MIN(*fragmentation_r, 100);
+	return 1;
+}
+
 static void
 fts_merge_maybies(ARRAY_TYPE(seq_range) *dest_maybe,
 		  const ARRAY_TYPE(seq_range) *dest_definite,
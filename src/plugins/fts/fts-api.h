@@ -99,6 +99,9 @@ void fts_backend_update_set_mailbox(struct fts_backend_update_context *ctx,
 /* Expunge the specified mail. */
 void fts_backend_update_expunge(struct fts_backend_update_context *ctx,
 				uint32_t uid);
+/* Expunge all the mails in the UID ranges at once. */
+void fts_backend_update_expunge_range(struct fts_backend_update_context *ctx,
+				      const ARRAY_TYPE(seq_range) *uids);
 
 /* Switch to building index for specified key. If backend doesn't want to
    index this key, it can return FALSE and caller will skip to next key. */
@@ -123,6 +126,13 @@ int fts_backend_refresh(struct fts_backend *backend);
 int fts_backend_rescan(struct fts_backend *backend);
 /* Optimize the index. This can be a somewhat heavy operation. */
 int fts_backend_optimize(struct fts_backend *backend);
+/* Get how fragmented the mailbox's index is as a percentage. 0 means that
+   optimizing wouldn't help and 100 that the index is as fragmented as the
+   backend normally allows before optimizing it by itself. Returns 1 if ok,
+   0 if the backend doesn't track this, -1 if error. */
+int fts_backend_get_fragmentation(struct fts_backend *backend,
+				  struct mailbox *box,
+				  unsigned int *fragmentation_r);
 
 /* Returns TRUE if fts_backend_lookup() should even be tried for the
    given args. */
@@ -308,7 +308,8 @@ fts_detect_language(struct fts_mail_build_context *ctx,
 	switch (fts_language_detect(lang_list, data, size, &lang, &error)) {
 	case FTS_LANGUAGE_RESULT_SHORT:
 		/* save the input so far and try again later */
-		buffer_append(ctx->pending_input, data, size);
+		if (ctx->pending_input->used == 0)
+			buffer_append(ctx->pending_input, data, size);
 		if (last) {
 			/* we've run out of data. use the default language. */
 			*lang_r = fts_language_list_get_first(lang_list);
@@ -344,23 +345,34 @@ fts_build_tokenized(struct fts_mail_build_context *ctx,
 
 	if (ctx->cur_user_lang != NULL) {
 		/* we already have a language */
-	} else if ((ret = fts_detect_language(ctx, data, size, last, &lang)) < 0) {
-		return -1;
-	} else if (ret == 0) {
-		/* wait for more data */
-		return 0;
 	} else {
+		if (ctx->pending_input->used > 0) {
+			/* Detect the language from all the input that was
+			   too short so far. Only its beginning is classified,
+			   so this is done at most a few times per field. */
+			buffer_append(ctx->pending_input, data, size);
+			data = ctx->pending_input->data;
+			size = ctx->pending_input->used;
+		}
+		if ((ret = fts_detect_language(ctx, data, size, last, &lang)) < 0)
+			return -1;
+		if (ret == 0) {
+			/* wait for more data */
+			return 0;
+		}
 		fts_mail_build_ctx_set_lang(ctx, fts_user_language_find(user, lang));
 
 		if (ctx->pending_input->used > 0) {
+			/* data now points to pending_input */
 			if (fts_build_add_tokens_with_filter(ctx,
 					ctx->pending_input->data,
 					ctx->pending_input->used) < 0)
 				return -1;
 			buffer_set_used_size(ctx->pending_input, 0);
+			size = 0;
 		}
 	}
-	if (fts_build_add_tokens_with_filter(ctx, data, size) < 0)
+	if (size > 0 && fts_build_add_tokens_with_filter(ctx, data, size) < 0)
 		return -1;
 	if (last) {
 		if (fts_build_add_tokens_with_filter(ctx, NULL, 0) < 0)
@@ -492,7 +504,8 @@ static int fts_body_parser_finish(struct fts_mail_build_context *ctx,
 
 static int
 fts_build_mail_real(struct fts_backend_update_context *update_ctx,
-		    struct mail *mail,
+		    struct mail *mail, pool_t parts_pool,
+		    struct message_part **parts_r,
 		    const char **retriable_err_msg_r,
 		    bool *may_need_retry_r)
 {
@@ -526,7 +539,8 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 		ctx.pending_input = buffer_create_dynamic(default_pool, 128);
 
 	prev_part = NULL;
-	parser = message_parser_init(pool_datastack_create(), input, &parser_set);
+	parser = message_parser_init(parts_pool != NULL ? parts_pool :
+				     pool_datastack_create(), input, &parser_set);
 
 	decoder = message_decoder_init(update_ctx->normalizer, 0);
 	for (;;) {
@@ -617,6 +631,8 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 	}
 	if (message_parser_deinit_from_parts(&parser, &parts, &error) < 0)
 		index_mail_set_message_parts_corrupted(mail, error);
+	if (parts_r != NULL)
+		*parts_r = parts;
 	message_decoder_deinit(&decoder);
 	i_free(ctx.content_type);
 	i_free(ctx.content_disposition);
@@ -625,8 +641,9 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 	return ret < 0 ? -1 : 1;
 }
 
-int fts_build_mail(struct fts_backend_update_context *update_ctx,
-		   struct mail *mail)
+int fts_build_mail_parts(struct fts_backend_update_context *update_ctx,
+			 struct mail *mail, pool_t parts_pool,
+			 struct message_part **parts_r)
 {
 	int ret;
 	/* Number of attempts to be taken if retry is needed */
@@ -634,8 +651,11 @@ int fts_build_mail(struct fts_backend_update_context *update_ctx,
 	const char *retriable_err_msg;
 	bool may_need_retry;
 
+	if (parts_r != NULL)
+		*parts_r = NULL;
 	T_BEGIN {
 		while ((ret = fts_build_mail_real(update_ctx, mail,
+						  parts_pool, parts_r,
 						  &retriable_err_msg,
 						  &may_need_retry)) < 0 &&
 		       may_need_retry) {
@@ -652,3 +672,9 @@ int fts_build_mail(struct fts_backend_update_context *update_ctx,
 	} T_END;
 	return ret;
 }
+
+int fts_build_mail(struct fts_backend_update_context *update_ctx,
+		   struct mail *mail)
+{
+	return fts_build_mail_parts(update_ctx, mail, NULL, NULL);
+}
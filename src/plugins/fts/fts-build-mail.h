@@ -1,9 +1,17 @@
 #ifndef FTS_BUILD_MAIL_H
 #define FTS_BUILD_MAIL_H
 
+struct message_part;
+
 /* Build indexes for the given mail. Returns 0 on success, -1 on error.
    The error is set to mail's storage. */
 int fts_build_mail(struct fts_backend_update_context *update_ctx,
 		   struct mail *mail);
+/* Like fts_build_mail(), but also return the mail's parsed message parts
+   allocated from parts_pool. parts_r is set to NULL if the mail couldn't be
+   parsed. */
+int fts_build_mail_parts(struct fts_backend_update_context *update_ctx,
+			 struct mail *mail, pool_t parts_pool,
+			 struct message_part **parts_r);
 
 #endif
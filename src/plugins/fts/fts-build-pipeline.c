@@ -0,0 +1,847 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "fd-util.h"
+#include "istream.h"
+#include "str.h"
+#include "strescape.h"
+#include "execv-const.h"
+#include "write-full.h"
+#include "message-part.h"
+#include "message-part-serialize.h"
+#include "mail-storage-private.h"
+#include "raw-storage.h"
+#include "fts-api-private.h"
+#include "fts-build-mail.h"
+#include "fts-build-pipeline.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/* The pipeline sends each helper the user's fts_* settings as tab-escaped
+   "key=value" lines, followed by an empty line. Each mail is then sent as a
+   mail header followed by the mail's data. The helper reads all of its
+   input before it writes anything, so the pipeline can write the whole
+   batch without reading the helper's output.
+
+   The helper records the calls it would have made to the backend. Each mail
+   in its output begins with a result header, followed by the serialized
+   message parts and the records. The output ends with a result header that
+   has seq=0. */
+enum fts_build_mail_flags {
+	/* The mail is already expunged. It has no data. */
+	FTS_BUILD_MAIL_FLAG_EXPUNGED = 0x01,
+};
+
+struct fts_build_mail_header {
+	uint32_t seq;
+	uint32_t flags;
+	uint32_t size;
+};
+
+enum fts_build_record_type {
+	FTS_BUILD_RECORD_KEY = 'K',
+	FTS_BUILD_RECORD_UNSET_KEY = 'U',
+	FTS_BUILD_RECORD_DATA = 'D',
+};
+
+struct fts_build_result_header {
+	uint32_t seq;
+	int32_t ret;
+	uint32_t parts_size;
+	uint32_t records_size;
+};
+
+struct fts_build_batch {
+	uint32_t seq1, seq2;
+	pid_t pid;
+	/* the helper's stdout */
+	int fd;
+};
+
+struct fts_build_record_context {
+	struct fts_backend_update_context ctx;
+	struct fts_backend backend;
+	buffer_t *records;
+};
+
+struct fts_build_pipeline {
+	struct mailbox_transaction_context *trans;
+	struct fts_backend_update_context *update_ctx;
+	struct fts_build_pipeline_settings set;
+	char *helper_path;
+	/* settings lines sent to each helper */
+	string_t *settings;
+	buffer_t *mail_buf;
+
+	/* first mail that isn't in any batch yet */
+	uint32_t next_batch_seq;
+	/* first mail that hasn't been given to the backend yet */
+	uint32_t next_build_seq;
+	uint32_t last_seq;
+	/* running batches in sequence order */
+	ARRAY(struct fts_build_batch) batches;
+};
+
+static void
+fts_build_record_set_mailbox(struct fts_backend_update_context *ctx ATTR_UNUSED,
+			     struct mailbox *box ATTR_UNUSED)
+{
+}
+
+static void fts_build_record_append_str(buffer_t *buf, const char *str)
+{
+	if (str == NULL)
+		buffer_append_c(buf, 0);
+	else {
+		buffer_append_c(buf, 1);
+		buffer_append(buf, str, strlen(str) + 1);
+	}
+}
+
+static bool
+fts_build_record_set_build_key(struct fts_backend_update_context *_ctx,
+			       const struct fts_backend_build_key *key)
+{
+	struct fts_build_record_context *ctx =
+		container_of(_ctx, struct fts_build_record_context, ctx);
+	uint32_t type = key->type;
+	uint32_t part_idx = key->part == NULL ? (uint32_t)-1 :
+		message_part_to_idx(key->part);
+
+	/* The backend may still reject the key. That's checked when the
+	   records are replayed. The key's UID is the raw mail's, so it's not
+	   recorded. */
+	buffer_append_c(ctx->records, FTS_BUILD_RECORD_KEY);
+	buffer_append(ctx->records, &type, sizeof(type));
+	buffer_append(ctx->records, &part_idx, sizeof(part_idx));
+	fts_build_record_append_str(ctx->records, key->hdr_name);
+	fts_build_record_append_str(ctx->records, key->body_content_type);
+	fts_build_record_append_str(ctx->records,
+				    key->body_content_disposition);
+	return TRUE;
+}
+
+static void
+fts_build_record_unset_build_key(struct fts_backend_update_context *_ctx)
+{
+	struct fts_build_record_context *ctx =
+		container_of(_ctx, struct fts_build_record_context, ctx);
+
+	buffer_append_c(ctx->records, FTS_BUILD_RECORD_UNSET_KEY);
+}
+
+static int
+fts_build_record_build_more(struct fts_backend_update_context *_ctx,
+			    const unsigned char *data, size_t size)
+{
+	struct fts_build_record_context *ctx =
+		container_of(_ctx, struct fts_build_record_context, ctx);
+	uint32_t size32 = size;
+
+	i_assert(size32 == size);
+
+	buffer_append_c(ctx->records, FTS_BUILD_RECORD_DATA);
+	buffer_append(ctx->records, &size32, sizeof(size32));
+	buffer_append(ctx->records, data, size);
+	return 0;
+}
+
+static void
+fts_build_pipeline_settings_init(struct fts_build_pipeline *pipeline,
+				 struct mail_user *user)
+{
+	const char *const *envs, *p;
+	string_t *line = t_str_new(128);
+	unsigned int i, count;
+
+	pipeline->settings = str_new(default_pool, 256);
+	if (array_is_created(&user->set->plugin_envs)) {
+		envs = array_get(&user->set->plugin_envs, &count);
+		for (i = 0; i + 1 < count; i += 2) {
+			if (!str_begins(envs[i], "fts_"))
+				continue;
+			/* the values are already expanded. don't let the
+			   helper expand them again. */
+			str_truncate(line, 0);
+			str_printfa(line, "%s=", envs[i]);
+			for (p = envs[i+1]; *p != '\0'; p++) {
+				if (*p == '%')
+					str_append_c(line, '%');
+				str_append_c(line, *p);
+			}
+			str_append_tabescaped(pipeline->settings, str_c(line));
+			str_append_c(pipeline->settings, '\n');
+		}
+	}
+	str_append_c(pipeline->settings, '\n');
+}
+
+static void fts_build_batch_kill(struct fts_build_batch *batch)
+{
+	if (batch->pid != -1) {
+		if (kill(batch->pid, SIGKILL) < 0 && errno != ESRCH)
+			i_error("kill(%ld) failed: %m", (long)batch->pid);
+		if (waitpid(batch->pid, NULL, 0) < 0 && errno != ECHILD)
+			i_error("waitpid(%ld) failed: %m", (long)batch->pid);
+		batch->pid = -1;
+	}
+	i_close_fd(&batch->fd);
+}
+
+static void
+fts_build_pipeline_stop(struct fts_build_pipeline *pipeline, const char *error)
+{
+	struct fts_build_batch *batch;
+
+	if (error != NULL) {
+		i_error("fts: Indexing mails in %s without %s from seq=%u: %s",
+			pipeline->trans->box->vname, pipeline->set.helper_path,
+			pipeline->next_build_seq, error);
+	}
+	array_foreach_modifiable(&pipeline->batches, batch)
+		fts_build_batch_kill(batch);
+	array_clear(&pipeline->batches);
+	pipeline->last_seq = pipeline->next_build_seq - 1;
+	pipeline->next_batch_seq = pipeline->next_build_seq;
+}
+
+/* Send the mail to the helper. Returns 1 if ok, 0 if the mail couldn't be
+   read, -1 if writing failed. */
+static int
+fts_build_batch_write_mail(struct fts_build_pipeline *pipeline, int fd,
+			   struct mail *mail, uoff_t *size_r,
+			   const char **error_r)
+{
+	struct fts_build_mail_header hdr;
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	int ret;
+
+	i_zero(&hdr);
+	hdr.seq = mail->seq;
+	buffer_set_used_size(pipeline->mail_buf, 0);
+	if (mail_get_stream_because(mail, NULL, NULL, "fts indexing",
+				    &input) < 0) {
+		/* if the mail is expunged, fts_build_mail() just skips it.
+		   otherwise let it report the error. */
+		if (!mail->expunged)
+			return 0;
+		hdr.flags |= FTS_BUILD_MAIL_FLAG_EXPUNGED;
+	} else {
+		while ((ret = i_stream_read_more(input, &data, &size)) > 0) {
+			buffer_append(pipeline->mail_buf, data, size);
+			i_stream_skip(input, size);
+		}
+		i_assert(ret == -1);
+		if (input->stream_errno != 0 ||
+		    pipeline->mail_buf->used > (uint32_t)-1)
+			return 0;
+		hdr.size = pipeline->mail_buf->used;
+	}
+
+	if (write_full(fd, &hdr, sizeof(hdr)) < 0 ||
+	    write_full(fd, pipeline->mail_buf->data,
+		       pipeline->mail_buf->used) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %m",
+					   pipeline->set.helper_path);
+		return -1;
+	}
+	*size_r = hdr.size;
+	return 1;
+}
+
+static int
+fts_build_batch_write(struct fts_build_pipeline *pipeline,
+		      struct fts_build_batch *batch, int fd,
+		      const char **error_r)
+{
+	struct mail *mail;
+	uoff_t size, total_size = 0;
+	uint32_t seq;
+	int ret = 1;
+
+	if (write_full(fd, str_data(pipeline->settings),
+		       str_len(pipeline->settings)) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %m",
+					   pipeline->set.helper_path);
+		return -1;
+	}
+
+	mail = mail_alloc(pipeline->trans, 0, NULL);
+	seq = batch->seq1;
+	while (seq <= pipeline->last_seq &&
+	       seq - batch->seq1 < pipeline->set.batch_max_mails &&
+	       total_size < pipeline->set.batch_max_size) {
+		mail_set_seq(mail, seq);
+		ret = fts_build_batch_write_mail(pipeline, fd, mail,
+						 &size, error_r);
+		if (ret <= 0)
+			break;
+		total_size += size;
+		seq++;
+	}
+	mail_free(&mail);
+
+	batch->seq2 = seq - 1;
+	if (ret == 0) {
+		/* the mail couldn't be read. stop the pipeline before it, so
+		   fts_build_mail() handles it. */
+		pipeline->last_seq = batch->seq2;
+	}
+	return ret < 0 ? -1 : 0;
+}
+
+static int
+fts_build_pipeline_start_batch(struct fts_build_pipeline *pipeline,
+			       const char **error_r)
+{
+	struct fts_build_batch *batch;
+	const char *argv[3];
+	int fd_in[2], fd_out[2], ret;
+
+	argv[0] = pipeline->set.helper_path;
+	argv[1] = dec2str(pipeline->update_ctx->backend->flags);
+	argv[2] = NULL;
+
+	if (pipe(fd_in) < 0) {
+		*error_r = t_strdup_printf("pipe() failed: %m");
+		return -1;
+	}
+	if (pipe(fd_out) < 0) {
+		*error_r = t_strdup_printf("pipe() failed: %m");
+		i_close_fd(&fd_in[0]);
+		i_close_fd(&fd_in[1]);
+		return -1;
+	}
+	/* the helpers must see only their own pipes */
+	fd_close_on_exec(fd_in[0], TRUE);
+	fd_close_on_exec(fd_in[1], TRUE);
+	fd_close_on_exec(fd_out[0], TRUE);
+	fd_close_on_exec(fd_out[1], TRUE);
+
+	batch = array_append_space(&pipeline->batches);
+	batch->seq1 = batch->seq2 = pipeline->next_batch_seq;
+	batch->fd = fd_out[0];
+	batch->pid = fork();
+	if (batch->pid < 0) {
+		*error_r = t_strdup_printf("fork() failed: %m");
+		batch->pid = -1;
+		i_close_fd(&fd_in[0]);
+		i_close_fd(&fd_in[1]);
+		i_close_fd(&fd_out[1]);
+		return -1;
+	}
+	if (batch->pid == 0) {
+		if (dup2(fd_in[0], STDIN_FILENO) < 0 ||
+		    dup2(fd_out[1], STDOUT_FILENO) < 0)
+			i_fatal("dup2() failed: %m");
+		fd_close_on_exec(STDIN_FILENO, FALSE);
+		fd_close_on_exec(STDOUT_FILENO, FALSE);
+		execv_const(argv[0], argv);
+	}
+	i_close_fd(&fd_in[0]);
+	i_close_fd(&fd_out[1]);
+
+	ret = fts_build_batch_write(pipeline, batch, fd_in[1], error_r);
+	i_close_fd(&fd_in[1]);
+	if (ret < 0)
+		return -1;
+	pipeline->next_batch_seq = batch->seq2 + 1;
+	return 0;
+}
+
+static int
+fts_build_pipeline_start_batches(struct fts_build_pipeline *pipeline,
+				 const char **error_r)
+{
+	/* keep all the helpers busy */
+	while (array_count(&pipeline->batches) < pipeline->set.max_processes &&
+	       pipeline->next_batch_seq <= pipeline->last_seq) {
+		if (fts_build_pipeline_start_batch(pipeline, error_r) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+fts_build_batch_read(struct fts_build_batch *batch, const char *helper_path,
+		     buffer_t *output, const char **error_r)
+{
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	int status, ret = 0;
+
+	input = i_stream_create_fd(batch->fd, SIZE_MAX);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		buffer_append(output, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		*error_r = t_strdup_printf("read(%s) failed: %s", helper_path,
+					   i_stream_get_error(input));
+		ret = -1;
+	}
+	i_stream_destroy(&input);
+	i_close_fd(&batch->fd);
+	if (ret < 0)
+		return -1;
+
+	while (waitpid(batch->pid, &status, 0) < 0) {
+		if (errno == EINTR)
+			continue;
+		if (errno == ECHILD) {
+			/* already reaped by someone else. the output's end
+			   header tells if it finished. */
+			batch->pid = -1;
+			return 0;
+		}
+		*error_r = t_strdup_printf("waitpid(%ld) failed: %m",
+					   (long)batch->pid);
+		return -1;
+	}
+	batch->pid = -1;
+	if (WIFSIGNALED(status)) {
+		*error_r = t_strdup_printf("%s killed with signal %d",
+					   helper_path, WTERMSIG(status));
+		return -1;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		*error_r = t_strdup_printf("%s exited with status %d",
+					   helper_path, WEXITSTATUS(status));
+		return -1;
+	}
+	return 0;
+}
+
+static bool
+fts_build_record_read_u32(const unsigned char **p, const unsigned char *end,
+			  uint32_t *num_r)
+{
+	if ((size_t)(end - *p) < sizeof(*num_r))
+		return FALSE;
+	memcpy(num_r, *p, sizeof(*num_r));
+	*p += sizeof(*num_r);
+	return TRUE;
+}
+
+static bool
+fts_build_record_read_str(const unsigned char **p, const unsigned char *end,
+			  const char **str_r)
+{
+	const unsigned char *nul;
+
+	if (*p == end)
+		return FALSE;
+	if (*(*p)++ == 0) {
+		*str_r = NULL;
+		return TRUE;
+	}
+	nul = memchr(*p, '\0', end - *p);
+	if (nul == NULL)
+		return FALSE;
+	*str_r = (const char *)*p;
+	*p = nul + 1;
+	return TRUE;
+}
+
+/* Give the mail's records to the backend. If update_ctx is NULL, only
+   verify that the records are valid. Returns 1 if ok, 0 if the records are
+   invalid, -1 if the backend failed. */
+static int
+fts_build_pipeline_replay(struct fts_backend_update_context *update_ctx,
+			  uint32_t uid, struct message_part *parts,
+			  const unsigned char *p, const unsigned char *end,
+			  const char **error_r)
+{
+	struct fts_backend_build_key key;
+	uint32_t type, part_idx, size;
+	bool key_accepted = FALSE;
+
+	while (p < end) {
+		switch (*p++) {
+		case FTS_BUILD_RECORD_KEY:
+			i_zero(&key);
+			key.uid = uid;
+			if (!fts_build_record_read_u32(&p, end, &type) ||
+			    !fts_build_record_read_u32(&p, end, &part_idx) ||
+			    !fts_build_record_read_str(&p, end, &key.hdr_name) ||
+			    !fts_build_record_read_str(&p, end,
+						       &key.body_content_type) ||
+			    !fts_build_record_read_str(&p, end,
+						       &key.body_content_disposition)) {
+				*error_r = "Truncated key record";
+				return 0;
+			}
+			key.type = type;
+			if (part_idx != (uint32_t)-1) {
+				key.part = parts == NULL ? NULL :
+					message_part_by_idx(parts, part_idx);
+				if (key.part == NULL) {
+					*error_r = "Invalid message part index";
+					return 0;
+				}
+			}
+			if (update_ctx != NULL) {
+				key_accepted = fts_backend_update_set_build_key(
+					update_ctx, &key);
+			}
+			break;
+		case FTS_BUILD_RECORD_UNSET_KEY:
+			if (update_ctx != NULL)
+				fts_backend_update_unset_build_key(update_ctx);
+			key_accepted = FALSE;
+			break;
+		case FTS_BUILD_RECORD_DATA:
+			if (!fts_build_record_read_u32(&p, end, &size) ||
+			    (size_t)(end - p) < size) {
+				*error_r = "Truncated data record";
+				return 0;
+			}
+			/* backends reject keys only after they've failed, so
+			   it's enough to just not add data for them */
+			if (key_accepted &&
+			    fts_backend_update_build_more(update_ctx, p, size) < 0)
+				return -1;
+			p += size;
+			break;
+		default:
+			*error_r = "Invalid record type";
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Returns 1 if the whole batch was given to the backend, 0 if the pipeline
+   must be stopped before next_build_seq (error_r is set if the helper
+   failed), -1 if the backend failed. */
+static int
+fts_build_pipeline_replay_batch(struct fts_build_pipeline *pipeline,
+				struct fts_build_batch *batch,
+				const char **error_r)
+{
+	struct mailbox_transaction_context *trans = pipeline->trans;
+	struct fts_build_result_header hdr;
+	struct message_part *parts;
+	buffer_t *output;
+	pool_t parts_pool;
+	const unsigned char *p, *end, *records;
+	const char *error;
+	uint32_t uid;
+	int ret = 1;
+
+	*error_r = NULL;
+	output = buffer_create_dynamic(default_pool, 1024*64);
+	if (fts_build_batch_read(batch, pipeline->set.helper_path,
+				 output, error_r) < 0) {
+		buffer_free(&output);
+		return 0;
+	}
+	p = output->data;
+	end = p + output->used;
+
+	parts_pool = pool_alloconly_create("fts build batch parts", 1024);
+	while (ret > 0) {
+		if ((size_t)(end - p) < sizeof(hdr)) {
+			*error_r = "Output is truncated";
+			ret = 0;
+			break;
+		}
+		memcpy(&hdr, p, sizeof(hdr));
+		p += sizeof(hdr);
+		if (hdr.seq == 0) {
+			/* end of batch */
+			if (pipeline->next_build_seq != batch->seq2 + 1) {
+				*error_r = "Output ended too early";
+				ret = 0;
+			}
+			break;
+		}
+		if (hdr.seq != pipeline->next_build_seq ||
+		    (size_t)(end - p) < hdr.parts_size ||
+		    (size_t)(end - p) - hdr.parts_size < hdr.records_size) {
+			*error_r = "Output is corrupted";
+			ret = 0;
+			break;
+		}
+		if (hdr.ret < 0) {
+			/* let fts_build_mail() log the error */
+			ret = 0;
+			break;
+		}
+
+		p_clear(parts_pool);
+		parts = NULL;
+		if (hdr.parts_size > 0) {
+			parts = message_part_deserialize(parts_pool, p,
+							 hdr.parts_size, &error);
+			if (parts == NULL) {
+				*error_r = t_strdup_printf(
+					"Invalid message parts: %s", error);
+				ret = 0;
+				break;
+			}
+		}
+		records = p + hdr.parts_size;
+		p = records + hdr.records_size;
+
+		/* verify all the records before giving any of them to the
+		   backend. if they're invalid, the mail is indexed again
+		   without the pipeline. */
+		mail_index_lookup_uid(trans->view, hdr.seq, &uid);
+		ret = fts_build_pipeline_replay(NULL, uid, parts, records, p,
+						error_r);
+		if (ret > 0) {
+			ret = fts_build_pipeline_replay(pipeline->update_ctx,
+							uid, parts, records, p,
+							error_r);
+		}
+		if (ret > 0)
+			pipeline->next_build_seq = hdr.seq + 1;
+	}
+	pool_unref(&parts_pool);
+	buffer_free(&output);
+	if (ret < 0)
+		mail_storage_set_internal_error(trans->box->storage);
+	return ret;
+}
+
+struct fts_build_pipeline *
+fts_build_pipeline_init(struct mailbox_transaction_context *trans,
+			struct fts_backend_update_context *update_ctx,
+			uint32_t seq1, uint32_t seq2,
+			const struct fts_build_pipeline_settings *set)
+{
+	struct fts_build_pipeline *pipeline;
+
+	i_assert(seq1 > 0 && seq1 <= seq2);
+	i_assert(set->max_processes > 0);
+	i_assert(set->batch_max_mails > 0);
+
+	pipeline = i_new(struct fts_build_pipeline, 1);
+	pipeline->trans = trans;
+	pipeline->update_ctx = update_ctx;
+	pipeline->set = *set;
+	pipeline->helper_path = i_strdup(set->helper_path);
+	pipeline->set.helper_path = pipeline->helper_path;
+	pipeline->mail_buf = buffer_create_dynamic(default_pool, 1024*64);
+	pipeline->next_batch_seq = seq1;
+	pipeline->next_build_seq = seq1;
+	pipeline->last_seq = seq2;
+	i_array_init(&pipeline->batches, set->max_processes);
+	fts_build_pipeline_settings_init(pipeline, trans->box->storage->user);
+	return pipeline;
+}
+
+void fts_build_pipeline_deinit(struct fts_build_pipeline **_pipeline)
+{
+	struct fts_build_pipeline *pipeline = *_pipeline;
+	struct fts_build_batch *batch;
+
+	*_pipeline = NULL;
+
+	array_foreach_modifiable(&pipeline->batches, batch)
+		fts_build_batch_kill(batch);
+	array_free(&pipeline->batches);
+	buffer_free(&pipeline->mail_buf);
+	str_free(&pipeline->settings);
+	i_free(pipeline->helper_path);
+	i_free(pipeline);
+}
+
+int fts_build_pipeline_build(struct fts_build_pipeline *pipeline,
+			     uint32_t seq)
+{
+	struct fts_build_batch batch;
+	const char *error;
+	int ret;
+
+	i_assert(seq <= pipeline->last_seq);
+
+	while (pipeline->next_build_seq <= seq &&
+	       pipeline->next_build_seq <= pipeline->last_seq) {
+		if (fts_build_pipeline_start_batches(pipeline, &error) < 0) {
+			fts_build_pipeline_stop(pipeline, error);
+			return 0;
+		}
+		batch = *array_front(&pipeline->batches);
+		array_pop_front(&pipeline->batches);
+
+		ret = fts_build_pipeline_replay_batch(pipeline, &batch, &error);
+		fts_build_batch_kill(&batch);
+		if (ret <= 0) {
+			fts_build_pipeline_stop(pipeline, ret < 0 ? NULL : error);
+			return ret < 0 ? -1 : 0;
+		}
+	}
+	/* start parsing the next batches while the caller is busy */
+	if (fts_build_pipeline_start_batches(pipeline, &error) < 0)
+		fts_build_pipeline_stop(pipeline, error);
+	return 0;
+}
+
+uint32_t fts_build_pipeline_get_next_seq(struct fts_build_pipeline *pipeline)
+{
+	return pipeline->next_build_seq;
+}
+
+uint32_t fts_build_pipeline_get_last_seq(struct fts_build_pipeline *pipeline)
+{
+	return pipeline->last_seq;
+}
+
+int fts_build_pipeline_helper_read_settings(const unsigned char **input,
+					    size_t *input_size,
+					    const char *const **settings_r)
+{
+	ARRAY_TYPE(const_string) settings;
+	const unsigned char *p = *input, *end = p + *input_size, *lf;
+	const char *line;
+
+	t_array_init(&settings, 16);
+	while ((lf = memchr(p, '\n', end - p)) != p) {
+		if (lf == NULL)
+			return -1;
+		line = t_str_tabunescape(t_strdup_until(p, lf));
+		if (strchr(line, '=') == NULL)
+			return -1;
+		array_push_back(&settings, &line);
+		p = lf + 1;
+	}
+	p++;
+	array_append_zero(&settings);
+
+	*settings_r = array_front(&settings);
+	*input_size = end - p;
+	*input = p;
+	return 0;
+}
+
+static int
+fts_build_helper_mail(struct fts_build_record_context *ctx,
+		      struct mail_user *user, const unsigned char *data,
+		      size_t size, pool_t parts_pool, buffer_t *parts_buf)
+{
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	struct message_part *parts;
+	struct istream *input;
+	int ret;
+
+	input = i_stream_create_from_data(data, size);
+	i_stream_set_name(input, "fts-build");
+	ret = raw_mailbox_alloc_stream(user, input, (time_t)-1,
+				       "MAILER-DAEMON", &box);
+	i_stream_unref(&input);
+	if (ret < 0) {
+		i_error("Can't open mail as raw: %s",
+			mailbox_get_last_internal_error(box, NULL));
+		mailbox_free(&box);
+		return -1;
+	}
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, 1);
+	ctx->ctx.cur_box = ctx->ctx.backend_box = box;
+	ret = fts_build_mail_parts(&ctx->ctx, mail, parts_pool, &parts);
+	if (ret < 0) {
+		i_error("Failed to index mail: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	if (parts != NULL)
+		message_part_serialize(parts, parts_buf);
+	ctx->ctx.cur_box = ctx->ctx.backend_box = NULL;
+	mail_free(&mail);
+	mailbox_transaction_rollback(&trans);
+	mailbox_free(&box);
+	return ret;
+}
+
+int fts_build_pipeline_helper_run(struct mail_user *user,
+				  enum fts_backend_flags backend_flags,
+				  const unsigned char *input, size_t input_size,
+				  int out_fd)
+{
+	struct fts_build_record_context ctx;
+	struct fts_build_mail_header hdr;
+	struct fts_build_result_header result;
+	const unsigned char *p = input, *end = input + input_size;
+	buffer_t *output, *parts_buf;
+	pool_t parts_pool;
+	int ret = 0;
+
+	i_zero(&ctx);
+	ctx.backend.name = "fts-build";
+	ctx.backend.flags = backend_flags;
+	ctx.backend.ns = user->namespaces;
+	ctx.backend.v.update_set_mailbox = fts_build_record_set_mailbox;
+	ctx.backend.v.update_set_build_key = fts_build_record_set_build_key;
+	ctx.backend.v.update_unset_build_key = fts_build_record_unset_build_key;
+	ctx.backend.v.update_build_more = fts_build_record_build_more;
+	ctx.ctx.backend = &ctx.backend;
+	if ((backend_flags & FTS_BACKEND_FLAG_NORMALIZE_INPUT) != 0)
+		ctx.ctx.normalizer = user->default_normalizer;
+	ctx.records = buffer_create_dynamic(default_pool, 1024*64);
+	output = buffer_create_dynamic(default_pool, 1024*64);
+	parts_buf = buffer_create_dynamic(default_pool, 256);
+	parts_pool = pool_alloconly_create("fts build parts", 1024);
+
+	while (p < end) {
+		if ((size_t)(end - p) < sizeof(hdr)) {
+			i_error("Invalid input: Truncated mail header");
+			ret = -1;
+			break;
+		}
+		memcpy(&hdr, p, sizeof(hdr));
+		p += sizeof(hdr);
+		if (hdr.seq == 0 || (size_t)(end - p) < hdr.size) {
+			i_error("Invalid input: Truncated mail seq=%u", hdr.seq);
+			ret = -1;
+			break;
+		}
+
+		buffer_set_used_size(ctx.records, 0);
+		buffer_set_used_size(parts_buf, 0);
+		p_clear(parts_pool);
+		i_zero(&result);
+		result.seq = hdr.seq;
+		if ((hdr.flags & FTS_BUILD_MAIL_FLAG_EXPUNGED) == 0) T_BEGIN {
+			result.ret = fts_build_helper_mail(&ctx, user, p,
+							   hdr.size, parts_pool,
+							   parts_buf);
+		} T_END;
+		p += hdr.size;
+		result.parts_size = parts_buf->used;
+		result.records_size = ctx.records->used;
+
+		buffer_set_used_size(output, 0);
+		buffer_append(output, &result, sizeof(result));
+		buffer_append_buf(output, parts_buf, 0, SIZE_MAX);
+		buffer_append_buf(output, ctx.records, 0, SIZE_MAX);
+		if (write_full(out_fd, output->data, output->used) < 0) {
+			i_error("write(stdout) failed: %m");
+			ret = -1;
+			break;
+		}
+	}
+	if (ret == 0) {
+		i_zero(&result);
+		if (write_full(out_fd, &result, sizeof(result)) < 0) {
+			i_error("write(stdout) failed: %m");
+			ret = -1;
+		}
+	}
+	pool_unref(&parts_pool);
+	buffer_free(&parts_buf);
+	buffer_free(&output);
+	buffer_free(&ctx.records);
+	return ret;
+}
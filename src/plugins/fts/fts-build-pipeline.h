@@ -0,0 +1,75 @@
+#ifndef FTS_BUILD_PIPELINE_H
+#define FTS_BUILD_PIPELINE_H
+
+#include "fts-api-private.h"
+
+struct mail_user;
+struct mailbox_transaction_context;
+struct fts_backend_update_context;
+
+/* Defaults used by fts_index_processes */
+#define FTS_BUILD_PIPELINE_BATCH_MAILS 100
+#define FTS_BUILD_PIPELINE_BATCH_SIZE (1024*1024*8)
+
+struct fts_build_pipeline_settings {
+	/* Path to the fts-build helper binary */
+	const char *helper_path;
+	/* Maximum number of helper processes running at the same time */
+	unsigned int max_processes;
+	/* A batch ends when it has this many mails or when the mails'
+	   total size reaches batch_max_size. */
+	unsigned int batch_max_mails;
+	uoff_t batch_max_size;
+};
+
+/* Index mails seq1..seq2 in the transaction's mailbox. The mails are split
+   into batches, which are parsed, decoded and tokenized by up to
+   max_processes fts-build helper processes in parallel. The helpers are
+   exec()ed, so they share nothing with this process. This process reads the
+   mails and sends them to the helpers through a pipe, and it gives the
+   helpers' results to the backend in the sequence order. The result is the
+   same as calling fts_build_mail() for each mail.
+
+   The user's fts_* settings are sent to the helpers, so the settings that
+   need an external service (fts_tika, fts_decoder) can't be used. */
+struct fts_build_pipeline *
+fts_build_pipeline_init(struct mailbox_transaction_context *trans,
+			struct fts_backend_update_context *update_ctx,
+			uint32_t seq1, uint32_t seq2,
+			const struct fts_build_pipeline_settings *set);
+/* Stop any running helpers. Mails that haven't been given to the backend
+   yet are left unindexed. */
+void fts_build_pipeline_deinit(struct fts_build_pipeline **pipeline);
+
+/* Give all the mails up to and including seq to the backend. More mails may
+   be given if they were in the same batch. Returns 0 if ok, -1 if the
+   backend failed. The error is set to the mailbox's storage.
+
+   If a mail can't be read or a helper fails, the pipeline stops before the
+   mail. The remaining mails should then be indexed with fts_build_mail(),
+   which also reports the error the same way as without the pipeline. */
+int fts_build_pipeline_build(struct fts_build_pipeline *pipeline,
+			     uint32_t seq);
+/* Returns the first sequence that hasn't been given to the backend yet. */
+uint32_t fts_build_pipeline_get_next_seq(struct fts_build_pipeline *pipeline);
+/* Returns the last sequence handled by the pipeline. */
+uint32_t fts_build_pipeline_get_last_seq(struct fts_build_pipeline *pipeline);
+
+/* Run the fts-build helper: read the mails sent by the pipeline from
+   in_fd and write the results to out_fd. The fts_* settings sent by the
+   pipeline must already be in the user's plugin settings. backend_flags
+   are the flags of the backend the results are for. Returns 0 if ok, -1 if
+   error. */
+int fts_build_pipeline_helper_run(struct mail_user *user,
+				  enum fts_backend_flags backend_flags,
+				  const unsigned char *input, size_t input_size,
+				  int out_fd);
+/* Parse the settings sent by the pipeline at the beginning of the input.
+   The settings are returned as "key=value" strings. The input is updated
+   to point to the mails following the settings. Returns 0 if ok, -1 if the
+   input is invalid. */
+int fts_build_pipeline_helper_read_settings(const unsigned char **input,
+					    size_t *input_size,
+					    const char *const **settings_r);
+
+#endif
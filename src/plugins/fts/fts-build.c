@@ -0,0 +1,120 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "strnum.h"
+#include "master-service.h"
+#include "mail-storage-service.h"
+#include "raw-storage.h"
+#include "fts-library.h"
+#include "fts-parser.h"
+#include "fts-user.h"
+#include "fts-build-pipeline.h"
+
+#include <unistd.h>
+
+/* Parses, decodes and tokenizes the mails sent by the fts build pipeline.
+   See fts-build-pipeline.h. */
+
+static buffer_t *fts_build_read_input(void)
+{
+	struct istream *input;
+	const unsigned char *data;
+	buffer_t *buf;
+	size_t size;
+
+	buf = buffer_create_dynamic(default_pool, 1024*64);
+	input = i_stream_create_fd(STDIN_FILENO, SIZE_MAX);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		buffer_append(buf, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0)
+		i_fatal("read(stdin) failed: %s", i_stream_get_error(input));
+	i_stream_destroy(&input);
+	return buf;
+}
+
+int main(int argc, char *argv[])
+{
+	const enum master_service_flags service_flags =
+		MASTER_SERVICE_FLAG_STANDALONE |
+		MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+		MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+		MASTER_SERVICE_FLAG_NO_SSL_INIT;
+	const enum mail_storage_service_flags storage_service_flags =
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_NAMESPACES |
+		MAIL_STORAGE_SERVICE_FLAG_NO_CHDIR;
+	struct mail_storage_service_ctx *storage_service;
+	struct mail_storage_service_user *service_user;
+	struct mail_storage_service_input service_input;
+	struct mail_user *user, *raw_user;
+	struct ioloop *ioloop;
+	buffer_t *input_buf;
+	const unsigned char *input;
+	const char *const *settings, *error;
+	unsigned int backend_flags;
+	size_t input_size;
+	int ret;
+
+	master_service = master_service_init("fts-build", service_flags,
+					     &argc, &argv, "");
+	if (master_getopt(master_service) > 0)
+		return FATAL_DEFAULT;
+	if (argv[optind] == NULL ||
+	    str_to_uint(argv[optind], &backend_flags) < 0)
+		i_fatal("Usage: fts-build <backend flags>");
+	master_service_init_finish(master_service);
+
+	/* read all the input before writing anything */
+	input_buf = fts_build_read_input();
+	input = input_buf->data;
+	input_size = input_buf->used;
+	if (fts_build_pipeline_helper_read_settings(&input, &input_size,
+						    &settings) < 0)
+		i_fatal("Invalid input: Settings are missing");
+
+	ioloop = io_loop_create();
+	fts_library_init();
+	storage_service = mail_storage_service_init(master_service, NULL,
+						    storage_service_flags);
+	i_zero(&service_input);
+	service_input.module = "fts-build";
+	service_input.service = "fts-build";
+	service_input.username = "fts-build";
+	service_input.no_userdb_lookup = TRUE;
+	service_input.userdb_fields = settings;
+	if (mail_storage_service_lookup_next(storage_service, &service_input,
+					     &service_user, &user,
+					     &error) <= 0)
+		i_fatal("User initialization failed: %s", error);
+
+	/* create the raw user from the unexpanded settings, so the settings
+	   are expanded only once */
+	raw_user = raw_storage_create_from_set(user->set_info,
+					       user->unexpanded_set);
+	if ((backend_flags & FTS_BACKEND_FLAG_TOKENIZED_INPUT) != 0 &&
+	    fts_mail_user_init(raw_user, &error) < 0)
+		i_fatal("fts: %s", error);
+
+	ret = fts_build_pipeline_helper_run(raw_user, backend_flags,
+					    input, input_size, STDOUT_FILENO);
+
+	if ((backend_flags & FTS_BACKEND_FLAG_TOKENIZED_INPUT) != 0)
+		fts_mail_user_deinit(raw_user);
+	mail_user_unref(&raw_user);
+	mail_user_deinit(&user);
+	mail_storage_service_user_unref(&service_user);
+	mail_storage_service_deinit(&storage_service);
+	fts_parsers_unload();
+	fts_library_deinit();
+	io_loop_destroy(&ioloop);
+	buffer_free(&input_buf);
+	master_service_deinit(&master_service);
+	return ret < 0 ? FATAL_DEFAULT : 0;
+}
@@ -5,15 +5,26 @@
 #include "crc32.h"
 #include "hash.h"
 #include "istream.h"
+#include "mmap-util.h"
+#include "file-create-locked.h"
 #include "write-full.h"
 #include "seq-range-array.h"
 #include "mail-storage.h"
 #include "fts-expunge-log.h"
 
+#include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+/* Compact the log whenever it grows past a power of two that is at least
+   this large. This keeps the compaction work proportional to the amount of
+   data written to the log. */
+#define FTS_EXPUNGE_LOG_COMPACT_MIN_SIZE (8*1024)
+/* How long to wait for a compaction to finish before unlinking a log that
+   was fully read. */
+#define FTS_EXPUNGE_LOG_UNLINK_LOCK_TIMEOUT_SECS 30
+
 struct fts_expunge_log_record {
 	/* CRC32 of this entire record (except this checksum) */
 	uint32_t checksum;
@@ -34,6 +45,8 @@ struct fts_expunge_log {
 
 	int fd;
 	struct stat st;
+
+	bool compacting;
 };
 
 struct fts_expunge_log_mailbox {
@@ -301,6 +314,7 @@ fts_expunge_log_write(struct fts_expunge_log_append_ctx *ctx)
 {
 	struct fts_expunge_log *log = ctx->log;
 	buffer_t *buf;
+	uoff_t old_size, new_size;
 	uint32_t expunge_count, *e;
 	int ret;
 
@@ -314,8 +328,10 @@ fts_expunge_log_write(struct fts_expunge_log_append_ctx *ctx)
 	if (fts_expunge_log_read_expunge_count(log, &expunge_count) < 0)
 		return -1;
 
+	old_size = log->st.st_size;
 	buf = buffer_create_dynamic(default_pool, 1024);
 	fts_expunge_log_export(ctx, expunge_count, buf);
+	new_size = old_size + buf->used;
 	/* the file was opened with O_APPEND, so this write() should be
 	   appended atomically without any need for locking. */
 	for (;;) {
@@ -349,6 +365,13 @@ fts_expunge_log_write(struct fts_expunge_log_append_ctx *ctx)
 		}
 		log->fd = -1;
 	}
+	if (ret == 0 && !log->compacting &&
+	    new_size >= FTS_EXPUNGE_LOG_COMPACT_MIN_SIZE &&
+	    nearest_power(old_size + 1) <= new_size) {
+		/* the log grew past a power of two */
+		if (fts_expunge_log_compact(log) < 0)
+			ret = -1;
+	}
 	return ret;
 }
 
@@ -434,6 +457,52 @@ fts_expunge_log_read_failure(struct fts_expunge_log_read_ctx *ctx,
 	}
 }
 
+static int
+fts_expunge_log_lock(struct fts_expunge_log *log, unsigned int timeout_secs,
+		     struct file_lock **lock_r)
+{
+	struct file_create_settings lock_set;
+	const char *lock_path, *error;
+	bool created;
+
+	i_zero(&lock_set);
+	lock_set.lock_timeout_secs = timeout_secs;
+	lock_set.lock_method = FILE_LOCK_METHOD_FCNTL;
+	lock_path = t_strconcat(log->path, ".lock", NULL);
+	if (file_create_locked(lock_path, &lock_set, lock_r,
+			       &created, &error) == -1) {
+		if (errno == EAGAIN)
+			return 0;
+		i_error("file_create_locked(%s) failed: %s", lock_path, error);
+		return -1;
+	}
+	file_lock_set_close_on_free(*lock_r, TRUE);
+	file_lock_set_unlink_on_free(*lock_r, TRUE);
+	return 1;
+}
+
+static void fts_expunge_log_unlink_if_unchanged(struct fts_expunge_log *log)
+{
+	struct file_lock *lock;
+	struct stat st;
+
+	/* don't unlink the log if it was replaced by compaction. the new log
+	   may already contain new expunges. keep the compaction lock while
+	   checking and unlinking, so the log can't be replaced in between.
+	   if the lock can't be got, leave the log. its records are just
+	   read again later. */
+	if (fts_expunge_log_lock(log, FTS_EXPUNGE_LOG_UNLINK_LOCK_TIMEOUT_SECS,
+				 &lock) <= 0)
+		return;
+	if (stat(log->path, &st) < 0) {
+		if (errno != ENOENT)
+			i_error("stat(%s) failed: %m", log->path);
+	} else if (st.st_ino == log->st.st_ino &&
+		   CMP_DEV_T(st.st_dev, log->st.st_dev))
+		i_unlink_if_exists(log->path);
+	file_lock_free(&lock);
+}
+
 const struct fts_expunge_log_read_record *
 fts_expunge_log_read_next(struct fts_expunge_log_read_ctx *ctx)
 {
@@ -451,7 +520,7 @@ fts_expunge_log_read_next(struct fts_expunge_log_read_ctx *ctx)
 	if (size == 0 && ctx->input->stream_errno == 0) {
 		/* expected EOF - mark the file as read by unlinking it */
 		if (ctx->unlink)
-			i_unlink_if_exists(ctx->log->path);
+			fts_expunge_log_unlink_if_unchanged(ctx->log);
 
 		/* try reading again, in case something new was written */
 		i_stream_sync(ctx->input);
@@ -615,3 +684,175 @@ int fts_expunge_log_flat_write(const struct fts_expunge_log_append_ctx *read_log
 
 	return ret;
 }
+
+static int
+fts_expunge_log_flatten_data(const char *path, const unsigned char *data,
+			     size_t size,
+			     struct fts_expunge_log_append_ctx *append,
+			     unsigned int *records_r)
+{
+	const struct fts_expunge_log_record *rec;
+	struct fts_expunge_log_read_record read_rec;
+	buffer_t buf;
+	unsigned int uids_size;
+	uint32_t checksum;
+	size_t pos;
+
+	*records_r = 0;
+	for (pos = 0; pos < size; pos += rec->record_size) {
+		rec = CONST_PTR_OFFSET(data, pos);
+		if (size - pos < sizeof(*rec) ||
+		    !fts_expunge_log_record_size_is_valid(rec, &uids_size) ||
+		    uids_size % sizeof(struct seq_range) != 0 ||
+		    rec->record_size > size - pos) {
+			i_error("Corrupted fts expunge log %s: "
+				"Invalid record at offset %zu", path, pos);
+			return 0;
+		}
+		checksum = crc32_data(&rec->record_size,
+				      rec->record_size - sizeof(rec->checksum));
+		if (checksum != rec->checksum) {
+			i_error("Corrupted fts expunge log %s: "
+				"Record checksum mismatch: %u != %u",
+				path, checksum, rec->checksum);
+			return 0;
+		}
+
+		memcpy(read_rec.mailbox_guid, rec->guid,
+		       sizeof(read_rec.mailbox_guid));
+		buffer_create_from_const_data(&buf, rec + 1, uids_size);
+		array_create_from_buffer(&read_rec.uids, &buf,
+					 sizeof(struct seq_range));
+		fts_expunge_log_append_record(append, &read_rec);
+		*records_r += 1;
+	}
+	return 1;
+}
+
+static int
+fts_expunge_log_compact_tail(struct fts_expunge_log *log, uoff_t offset)
+{
+	struct fts_expunge_log_append_ctx *append;
+	struct stat st;
+	unsigned int records;
+	unsigned char *data;
+	ssize_t ret;
+	int ret2;
+
+	/* copy the records that were appended to the old log after it was
+	   read. writers that notice the log was replaced will write their
+	   records again, so some of these may become duplicates. */
+	if (fstat(log->fd, &st) < 0) {
+		i_error("fstat(%s) failed: %m", log->path);
+		return -1;
+	}
+	if ((uoff_t)st.st_size <= offset)
+		return 1;
+
+	data = i_malloc(st.st_size - offset);
+	ret = pread(log->fd, data, st.st_size - offset, offset);
+	if (ret < 0) {
+		i_error("pread(%s) failed: %m", log->path);
+		i_free(data);
+		return -1;
+	}
+	append = fts_expunge_log_append_begin(log);
+	ret2 = fts_expunge_log_flatten_data(log->path, data, ret,
+					    append, &records);
+	i_free(data);
+	if (ret2 <= 0) {
+		(void)fts_expunge_log_append_abort(&append);
+		return ret2;
+	}
+	return fts_expunge_log_append_commit(&append) < 0 ? -1 : 1;
+}
+
+static int fts_expunge_log_compact_locked(struct fts_expunge_log *log)
+{
+	struct fts_expunge_log_append_ctx *append;
+	const char *temp_path;
+	buffer_t *buf;
+	void *data;
+	size_t size;
+	unsigned int records;
+	int fd, ret;
+
+	if ((ret = fts_expunge_log_reopen_if_needed(log, FALSE)) < 0)
+		return -1;
+	if (log->fd == -1)
+		return 1;
+
+	data = mmap_ro_file(log->fd, &size);
+	if (data == MAP_FAILED) {
+		i_error("mmap(%s) failed: %m", log->path);
+		return -1;
+	}
+	if (data == NULL) {
+		/* empty log */
+		return 1;
+	}
+
+	append = fts_expunge_log_append_begin(NULL);
+	ret = fts_expunge_log_flatten_data(log->path, data, size,
+					   append, &records);
+	if (munmap(data, size) < 0)
+		i_error("munmap(%s) failed: %m", log->path);
+	if (ret <= 0 || records == hash_table_count(append->mailboxes)) {
+		/* corrupted or already compacted */
+		(void)fts_expunge_log_append_abort(&append);
+		return ret;
+	}
+
+	buf = buffer_create_dynamic(default_pool, 1024);
+	fts_expunge_log_export(append, 0, buf);
+	(void)fts_expunge_log_append_abort(&append);
+
+	temp_path = t_strconcat(log->path, ".tmp", NULL);
+	fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		i_error("open(%s) failed: %m", temp_path);
+		ret = -1;
+	} else if (write_full(fd, buf->data, buf->used) < 0) {
+		i_error("write(%s) failed: %m", temp_path);
+		ret = -1;
+	} else if (close(fd) < 0) {
+		fd = -1;
+		i_error("close(%s) failed: %m", temp_path);
+		ret = -1;
+	} else {
+		fd = -1;
+		if (rename(temp_path, log->path) < 0) {
+			i_error("rename(%s, %s) failed: %m",
+				temp_path, log->path);
+			ret = -1;
+		}
+	}
+	buffer_free(&buf);
+	if (ret < 0) {
+		i_close_fd(&fd);
+		i_unlink_if_exists(temp_path);
+		return -1;
+	}
+	ret = fts_expunge_log_compact_tail(log, size);
+	i_close_fd(&log->fd);
+	return ret;
+}
+
+int fts_expunge_log_compact(struct fts_expunge_log *log)
+{
+	struct file_lock *lock;
+	int ret;
+
+	if ((ret = fts_expunge_log_lock(log, 0, &lock)) <= 0) {
+		/* another process is already compacting it */
+		return ret < 0 ? -1 : 1;
+	}
+
+	log->compacting = TRUE;
+	T_BEGIN {
+		ret = fts_expunge_log_compact_locked(log);
+	} T_END;
+	log->compacting = FALSE;
+	file_lock_free(&lock);
+	return ret;
+}
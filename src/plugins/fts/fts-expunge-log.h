@@ -33,6 +33,11 @@ int fts_expunge_log_append_abort(struct fts_expunge_log_append_ctx **ctx);
 
 int fts_expunge_log_uid_count(struct fts_expunge_log *log,
 			      unsigned int *expunges_r);
+/* Rewrite the log so that it has only a single record for each mailbox,
+   containing all of its expunged UID ranges. This is done automatically
+   whenever the log grows large enough. Returns 1 if ok, 0 if the log is
+   corrupted (and wasn't modified), -1 if error. */
+int fts_expunge_log_compact(struct fts_expunge_log *log);
 
 struct fts_expunge_log_read_ctx *
 fts_expunge_log_read_begin(struct fts_expunge_log *log);
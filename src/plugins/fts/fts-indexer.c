@@ -58,6 +58,20 @@ int fts_indexer_cmd(struct mail_user *user, const char *cmd,
 	return fd;
 }
 
+void fts_indexer_report_fragmentation(struct mailbox *box,
+				      unsigned int fragmentation)
+{
+	struct mail_user *user = box->storage->user;
+	const char *cmd, *path;
+	int fd;
+
+	cmd = t_strdup_printf("FRAGMENTATION\t0\t%s\t%s\t%u\n",
+			      str_tabescape(user->username),
+			      str_tabescape(box->vname), fragmentation);
+	fd = fts_indexer_cmd(user, cmd, &path);
+	i_close_fd(&fd);
+}
+
 static void fts_indexer_notify(struct fts_indexer_context *ctx)
 {
 	unsigned long long elapsed_msecs, est_total_msecs;
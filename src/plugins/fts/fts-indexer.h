@@ -18,5 +18,9 @@ int fts_indexer_more(struct fts_indexer_context *ctx);
 /* Returns fd, which you can either read from or close. */
 int fts_indexer_cmd(struct mail_user *user, const char *cmd,
 		    const char **path_r);
+/* Tell indexer how fragmented the mailbox's FTS index is, so it can optimize
+   it when it's otherwise idle. */
+void fts_indexer_report_fragmentation(struct mailbox *box,
+				      unsigned int fragmentation);
 
 #endif
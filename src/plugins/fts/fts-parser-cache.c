@@ -0,0 +1,386 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "sha2.h"
+#include "hex-binary.h"
+#include "istream.h"
+#include "ostream.h"
+#include "iostream-temp.h"
+#include "iostream-ssl.h"
+#include "module-context.h"
+#include "message-parser.h"
+#include "mail-user.h"
+#include "fs-api.h"
+#include "fts-api.h"
+#include "fts-parser.h"
+
+#define FTS_PARSER_CACHE_USER_CONTEXT(obj) \
+	MODULE_CONTEXT(obj, fts_parser_cache_user_module)
+#define FTS_PARSER_CACHE_USER_CONTEXT_REQUIRE(obj) \
+	MODULE_CONTEXT_REQUIRE(obj, fts_parser_cache_user_module)
+
+/* Parser input larger than this is buffered to a temporary file */
+#define FTS_PARSER_CACHE_MAX_MEM_SIZE (1024*1024)
+
+struct fts_parser_cache_user {
+	union mail_user_module_context module_ctx;
+
+	const char *fs_str;
+	struct fs *fs;
+	struct event *event;
+	bool fs_failed;
+};
+
+enum fts_parser_cache_state {
+	/* Buffering and hashing the parser input */
+	FTS_PARSER_CACHE_STATE_INPUT = 0,
+	/* Returning the cached output */
+	FTS_PARSER_CACHE_STATE_HIT,
+	/* Returning the parser's output and saving it to the cache */
+	FTS_PARSER_CACHE_STATE_PARSE,
+};
+
+struct cache_fts_parser {
+	struct fts_parser parser;
+	/* Initialized only if the output isn't found from the cache */
+	struct fts_parser *inner;
+	const struct fts_parser_vfuncs *inner_v;
+	struct fts_parser_context inner_context;
+	char *content_type, *content_disposition;
+	struct fts_parser_cache_user *cuser;
+	struct event *event;
+
+	struct sha256_ctx hash_ctx;
+	struct ostream *temp_output;
+	uoff_t input_size;
+
+	enum fts_parser_cache_state state;
+	struct fs_file *file;
+	struct istream *cache_input;
+	struct ostream *cache_output;
+
+	bool failed;
+};
+
+static MODULE_CONTEXT_DEFINE_INIT(fts_parser_cache_user_module,
+				  &mail_user_module_register);
+
+static struct fs *fts_parser_cache_get_fs(struct fts_parser_cache_user *cuser,
+					  struct mail_user *user)
+{
+	struct fs_settings fs_set;
+	struct ssl_iostream_settings ssl_set;
+	const char *error;
+
+	if (cuser->fs != NULL || cuser->fs_failed)
+		return cuser->fs;
+
+	i_zero(&ssl_set);
+	i_zero(&fs_set);
+	mail_user_init_fs_settings(user, &fs_set, &ssl_set);
+	fs_set.event_parent = cuser->event;
+	if (fs_init_from_string(cuser->fs_str, &fs_set, &cuser->fs,
+				&error) < 0) {
+		e_error(cuser->event, "fs_init(%s) failed: %s",
+			cuser->fs_str, error);
+		cuser->fs_failed = TRUE;
+	}
+	return cuser->fs;
+}
+
+static void fts_parser_cache_user_deinit(struct mail_user *user)
+{
+	struct fts_parser_cache_user *cuser =
+		FTS_PARSER_CACHE_USER_CONTEXT_REQUIRE(user);
+
+	fs_deinit(&cuser->fs);
+	event_unref(&cuser->event);
+	cuser->module_ctx.super.deinit(user);
+}
+
+void fts_parser_cache_mail_user_created(struct mail_user *user)
+{
+	struct mail_user_vfuncs *v = user->vlast;
+	struct fts_parser_cache_user *cuser;
+	const char *str;
+
+	str = mail_user_plugin_getenv(user, "fts_parser_cache");
+	if (str == NULL || str[0] == '\0')
+		return;
+
+	cuser = p_new(user->pool, struct fts_parser_cache_user, 1);
+	cuser->module_ctx.super = *v;
+	user->vlast = &cuser->module_ctx.super;
+	v->deinit = fts_parser_cache_user_deinit;
+
+	cuser->fs_str = str;
+	cuser->event = event_create(user->event);
+	event_add_category(cuser->event, &event_category_fts);
+	event_set_append_log_prefix(cuser->event, "fts-parser-cache: ");
+	MODULE_CONTEXT_SET(user, fts_parser_cache_user_module, cuser);
+}
+
+bool fts_parser_cache_is_enabled(struct mail_user *user)
+{
+	struct fts_parser_cache_user *cuser =
+		FTS_PARSER_CACHE_USER_CONTEXT(user);
+
+	return cuser != NULL && fts_parser_cache_get_fs(cuser, user) != NULL;
+}
+
+struct fts_parser *
+fts_parser_cache_init(struct fts_parser_context *parser_context,
+		      const struct fts_parser_vfuncs *vfuncs,
+		      const char *cache_key)
+{
+	struct fts_parser_cache_user *cuser =
+		FTS_PARSER_CACHE_USER_CONTEXT_REQUIRE(parser_context->user);
+	struct cache_fts_parser *parser;
+	string_t *temp_prefix;
+
+	i_assert(cuser->fs != NULL);
+
+	parser = i_new(struct cache_fts_parser, 1);
+	parser->parser.v = fts_parser_cache;
+	parser->inner_v = vfuncs;
+	parser->content_type = i_strdup(parser_context->content_type);
+	parser->content_disposition =
+		i_strdup(parser_context->content_disposition);
+	parser->inner_context.user = parser_context->user;
+	parser->inner_context.content_type = parser->content_type;
+	parser->inner_context.content_disposition =
+		parser->content_disposition;
+	parser->cuser = cuser;
+	parser->event = event_create(cuser->event);
+	event_add_str(parser->event, "parser", vfuncs->name);
+	event_add_str(parser->event, "content_type",
+		      parser_context->content_type);
+
+	/* The output depends on the parser, its configuration and the
+	   content type in addition to the input itself. */
+	sha256_init(&parser->hash_ctx);
+	sha256_loop(&parser->hash_ctx, vfuncs->name, strlen(vfuncs->name) + 1);
+	sha256_loop(&parser->hash_ctx, cache_key, strlen(cache_key) + 1);
+	sha256_loop(&parser->hash_ctx, parser_context->content_type,
+		    strlen(parser_context->content_type) + 1);
+
+	temp_prefix = t_str_new(128);
+	mail_user_set_get_temp_prefix(temp_prefix, parser_context->user->set);
+	parser->temp_output =
+		iostream_temp_create_sized(str_c(temp_prefix), 0,
+					   "fts parser cache input",
+					   FTS_PARSER_CACHE_MAX_MEM_SIZE);
+	return &parser->parser;
+}
+
+static void
+fts_parser_cache_input(struct cache_fts_parser *parser,
+		       const struct message_block *block)
+{
+	sha256_loop(&parser->hash_ctx, block->data, block->size);
+	o_stream_nsend(parser->temp_output, block->data, block->size);
+	parser->input_size += block->size;
+}
+
+static const char *fts_parser_cache_get_path(struct cache_fts_parser *parser)
+{
+	unsigned char digest[SHA256_RESULTLEN];
+	const char *hash;
+
+	sha256_result(&parser->hash_ctx, digest);
+	hash = binary_to_hex(digest, sizeof(digest));
+	event_add_str(parser->event, "hash", hash);
+	return t_strdup_printf("%c%c/%s", hash[0], hash[1], hash);
+}
+
+static bool fts_parser_cache_lookup(struct cache_fts_parser *parser,
+				    const char *path)
+{
+	struct fs *fs = parser->cuser->fs;
+	const unsigned char *data;
+	size_t size;
+
+	parser->file = fs_file_init(fs, path, FS_OPEN_MODE_READONLY);
+	parser->cache_input = fs_read_stream(parser->file, IO_BLOCK_SIZE);
+	if (i_stream_read_more(parser->cache_input, &data, &size) != -1 ||
+	    parser->cache_input->stream_errno == 0) {
+		/* found - possibly empty */
+		return TRUE;
+	}
+	if (parser->cache_input->stream_errno != ENOENT) {
+		e_error(parser->event, "read(%s) failed: %s",
+			i_stream_get_name(parser->cache_input),
+			i_stream_get_error(parser->cache_input));
+	}
+	i_stream_unref(&parser->cache_input);
+	fs_file_deinit(&parser->file);
+	return FALSE;
+}
+
+static void fts_parser_cache_parse_begin(struct cache_fts_parser *parser,
+					 const char *path)
+{
+	struct fts_parser *inner;
+	struct message_block block;
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+
+	inner = parser->inner_v->try_init(&parser->inner_context);
+	if (inner == NULL) {
+		/* the parser couldn't be started (e.g. the script couldn't
+		   be connected to). Index the part without its text, the
+		   same as if there was no parser. */
+		o_stream_destroy(&parser->temp_output);
+		return;
+	}
+	parser->inner = inner;
+
+	/* give the buffered input to the parser */
+	i_zero(&block);
+	input = iostream_temp_finish(&parser->temp_output, IO_BLOCK_SIZE);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		block.data = data;
+		block.size = size;
+		inner->v.more(inner, &block);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		e_error(parser->event, "read(%s) failed: %s",
+			i_stream_get_name(input), i_stream_get_error(input));
+		parser->failed = TRUE;
+	}
+	i_stream_unref(&input);
+
+	if (!parser->failed) {
+		parser->file = fs_file_init(parser->cuser->fs, path,
+					    FS_OPEN_MODE_REPLACE);
+		parser->cache_output = fs_write_stream(parser->file);
+	}
+}
+
+static void fts_parser_cache_lookup_or_parse(struct cache_fts_parser *parser)
+{
+	const char *path = fts_parser_cache_get_path(parser);
+
+	if (fts_parser_cache_lookup(parser, path)) {
+		e_debug(event_create_passthrough(parser->event)->
+			set_name("fts_parser_cache_hit")->
+			add_int("input_size", parser->input_size)->event(),
+			"Using cached output for %s", path);
+		o_stream_destroy(&parser->temp_output);
+		parser->state = FTS_PARSER_CACHE_STATE_HIT;
+	} else {
+		e_debug(event_create_passthrough(parser->event)->
+			set_name("fts_parser_cache_miss")->
+			add_int("input_size", parser->input_size)->event(),
+			"No cached output for %s", path);
+		fts_parser_cache_parse_begin(parser, path);
+		parser->state = FTS_PARSER_CACHE_STATE_PARSE;
+	}
+}
+
+static void
+fts_parser_cache_read_hit(struct cache_fts_parser *parser,
+			  struct message_block *block)
+{
+	const unsigned char *data;
+	size_t size;
+
+	if (i_stream_read_more(parser->cache_input, &data, &size) > 0) {
+		block->data = data;
+		block->size = size;
+		i_stream_skip(parser->cache_input, size);
+	} else if (parser->cache_input->stream_errno != 0) {
+		e_error(parser->event, "read(%s) failed: %s",
+			i_stream_get_name(parser->cache_input),
+			i_stream_get_error(parser->cache_input));
+		parser->failed = TRUE;
+	}
+}
+
+static void fts_parser_cache_more(struct fts_parser *_parser,
+				  struct message_block *block)
+{
+	struct cache_fts_parser *parser = (struct cache_fts_parser *)_parser;
+
+	if (block->size > 0) {
+		/* nothing can be returned until all of the input is hashed */
+		i_assert(parser->state == FTS_PARSER_CACHE_STATE_INPUT);
+		fts_parser_cache_input(parser, block);
+		block->size = 0;
+		return;
+	}
+
+	if (parser->state == FTS_PARSER_CACHE_STATE_INPUT)
+		fts_parser_cache_lookup_or_parse(parser);
+	if (parser->failed)
+		return;
+
+	switch (parser->state) {
+	case FTS_PARSER_CACHE_STATE_INPUT:
+		i_unreached();
+	case FTS_PARSER_CACHE_STATE_HIT:
+		fts_parser_cache_read_hit(parser, block);
+		break;
+	case FTS_PARSER_CACHE_STATE_PARSE:
+		if (parser->inner == NULL)
+			break;
+		parser->inner->v.more(parser->inner, block);
+		if (parser->cache_output != NULL && block->size > 0) {
+			o_stream_nsend(parser->cache_output,
+				       block->data, block->size);
+		}
+		break;
+	}
+}
+
+static void
+fts_parser_cache_save(struct cache_fts_parser *parser, bool success)
+{
+	if (!success) {
+		fs_write_stream_abort_error(parser->file, &parser->cache_output,
+					    "Parsing failed");
+	} else if (fs_write_stream_finish(parser->file,
+					  &parser->cache_output) < 0) {
+		e_error(parser->event, "write(%s) failed: %s",
+			fs_file_path(parser->file),
+			fs_file_last_error(parser->file));
+	}
+}
+
+static int fts_parser_cache_deinit(struct fts_parser *_parser,
+				   const char **retriable_err_msg_r)
+{
+	struct cache_fts_parser *parser = (struct cache_fts_parser *)_parser;
+	int ret;
+
+	/* on a cache hit the inner parser was never initialized */
+	if (parser->inner != NULL)
+		ret = fts_parser_deinit(&parser->inner, retriable_err_msg_r);
+	else
+		ret = 1;
+	if (parser->failed)
+		ret = -1;
+
+	if (parser->cache_output != NULL)
+		fts_parser_cache_save(parser, ret > 0);
+	i_stream_unref(&parser->cache_input);
+	fs_file_deinit(&parser->file);
+	o_stream_destroy(&parser->temp_output);
+	event_unref(&parser->event);
+	i_free(parser->content_type);
+	i_free(parser->content_disposition);
+	i_free(parser);
+	return ret;
+}
+
+struct fts_parser_vfuncs fts_parser_cache = {
+	"cache",
+	NULL,
+	fts_parser_cache_more,
+	fts_parser_cache_deinit,
+	NULL,
+	NULL
+};
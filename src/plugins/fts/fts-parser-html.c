@@ -57,8 +57,12 @@ static int fts_parser_html_deinit(struct fts_parser *_parser,
 }
 
 struct fts_parser_vfuncs fts_parser_html = {
+	"html",
 	fts_parser_html_try_init,
 	fts_parser_html_more,
 	fts_parser_html_deinit,
+	NULL,
+	/* HTML is parsed internally faster than the cache could be
+	   accessed */
 	NULL
 };
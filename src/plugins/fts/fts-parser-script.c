@@ -42,17 +42,28 @@ struct script_fts_parser {
 static MODULE_CONTEXT_DEFINE_INIT(fts_parser_script_user_module,
 				  &mail_user_module_register);
 
-static int script_connect(struct mail_user *user, const char **path_r)
+static const char *script_get_path(struct mail_user *user)
 {
 	const char *path;
-	int fd;
 
 	path = mail_user_plugin_getenv(user, "fts_decoder");
 	if (path == NULL)
-		return -1;
+		return NULL;
 
 	if (*path != '/')
 		path = t_strconcat(user->set->base_dir, "/", path, NULL);
+	return path;
+}
+
+static int script_connect(struct mail_user *user, const char **path_r)
+{
+	const char *path;
+	int fd;
+
+	path = script_get_path(user);
+	if (path == NULL)
+		return -1;
+
 	fd = net_connect_unix_with_retries(path, 1000);
 	if (fd == -1)
 		i_error("net_connect_unix(%s) failed: %m", path);
@@ -269,9 +280,25 @@ static int fts_parser_script_deinit(struct fts_parser *_parser,
 	return ret;
 }
 
+static const char *
+fts_parser_script_get_cache_key(struct fts_parser_context *parser_context)
+{
+	const char *filename, *content_type = parser_context->content_type;
+
+	parse_content_disposition(parser_context->content_disposition, &filename);
+	if (!script_support_content(parser_context->user, &content_type, filename))
+		return NULL;
+	/* the script is given the content type that was looked up based on
+	   the filename */
+	return t_strconcat(script_get_path(parser_context->user), "\n",
+			   content_type, NULL);
+}
+
 struct fts_parser_vfuncs fts_parser_script = {
+	"script",
 	fts_parser_script_try_init,
 	fts_parser_script_more,
 	fts_parser_script_deinit,
-	NULL
+	NULL,
+	fts_parser_script_get_cache_key
 };
@@ -271,9 +271,24 @@ static void fts_parser_tika_unload(void)
 		http_client_deinit(&tika_http_client);
 }
 
+static const char *
+fts_parser_tika_get_cache_key(struct fts_parser_context *parser_context)
+{
+	struct http_url *http_url;
+
+	if (tika_get_http_client_url(parser_context->user, &http_url) < 0)
+		return NULL;
+	/* Tika may use the filename to detect the content type */
+	return t_strconcat(mail_user_plugin_getenv(parser_context->user,
+						   "fts_tika"), "\n",
+			   parser_context->content_disposition, NULL);
+}
+
 struct fts_parser_vfuncs fts_parser_tika = {
+	"tika",
 	fts_parser_tika_try_init,
 	fts_parser_tika_more,
 	fts_parser_tika_deinit,
-	fts_parser_tika_unload
+	fts_parser_tika_unload,
+	fts_parser_tika_get_cache_key
 };
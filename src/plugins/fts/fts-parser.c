@@ -23,6 +23,7 @@ static const char *plaintext_content_types[] = {
 bool fts_parser_init(struct fts_parser_context *parser_context,
 		     struct fts_parser **parser_r)
 {
+	const char *cache_key;
 	unsigned int i;
 	i_assert(parser_context->user != NULL);
 	i_assert(parser_context->content_type != NULL);
@@ -34,6 +35,18 @@ bool fts_parser_init(struct fts_parser_context *parser_context,
 	}
 
 	for (i = 0; i < N_ELEMENTS(parsers); i++) {
+		if (parsers[i]->get_cache_key != NULL &&
+		    fts_parser_cache_is_enabled(parser_context->user)) {
+			/* the parser is started only if the output isn't
+			   found from the cache */
+			cache_key = parsers[i]->get_cache_key(parser_context);
+			if (cache_key == NULL)
+				continue;
+			*parser_r = fts_parser_cache_init(parser_context,
+							  parsers[i],
+							  cache_key);
+			return TRUE;
+		}
 		*parser_r = parsers[i]->try_init(parser_context);
 		if (*parser_r != NULL)
 			return TRUE;
@@ -13,10 +13,16 @@ struct fts_parser_context {
 };
 
 struct fts_parser_vfuncs {
+	const char *name;
+
 	struct fts_parser *(*try_init)(struct fts_parser_context *parser_context);
 	void (*more)(struct fts_parser *parser, struct message_block *block);
 	int (*deinit)(struct fts_parser *parser, const char **retriable_err_msg_r);
 	void (*unload)(void);
+	/* Returns a string identifying the parser's configuration for the
+	   content, or NULL if the parser doesn't handle it. This must not
+	   start parsing. Parsers without this function aren't cached. */
+	const char *(*get_cache_key)(struct fts_parser_context *parser_context);
 };
 
 struct fts_parser {
@@ -29,6 +35,7 @@ struct fts_parser {
 extern struct fts_parser_vfuncs fts_parser_html;
 extern struct fts_parser_vfuncs fts_parser_script;
 extern struct fts_parser_vfuncs fts_parser_tika;
+extern struct fts_parser_vfuncs fts_parser_cache;
 
 bool fts_parser_init(struct fts_parser_context *parser_context,
 		     struct fts_parser **parser_r);
@@ -45,4 +52,20 @@ int fts_parser_deinit(struct fts_parser **parser, const char **retriable_err_msg
 
 void fts_parsers_unload(void);
 
+/* If fts_parser_cache setting is set, the output of the external parsers is
+   saved to the given fs, keyed by a hash of the parser, its configuration,
+   the content type and the input. The same input is then given to the
+   parser only once. */
+void fts_parser_cache_mail_user_created(struct mail_user *user);
+/* Returns TRUE if the parser cache is enabled for the user. */
+bool fts_parser_cache_is_enabled(struct mail_user *user);
+/* Returns a parser that looks up the output from the cache once all of the
+   input is seen. The parser is initialized with the given vfuncs only if
+   the output isn't in the cache. cache_key is the parser's
+   get_cache_key() result. */
+struct fts_parser *
+fts_parser_cache_init(struct fts_parser_context *parser_context,
+		      const struct fts_parser_vfuncs *vfuncs,
+		      const char *cache_key);
+
 #endif
@@ -0,0 +1,458 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "sha2.h"
+#include "hex-binary.h"
+#include "strnum.h"
+#include "istream.h"
+#include "safe-mkstemp.h"
+#include "mkdir-parents.h"
+#include "write-full.h"
+#include "imap-util.h"
+#include "imap-seqset.h"
+#include "mail-search.h"
+#include "mailbox-list-private.h"
+#include "fts-search-serialize.h"
+#include "fts-storage.h"
+#include "fts-search-cache.h"
+
+#include <stdio.h>
+#include <dirent.h>
+
+#define FTS_SEARCH_CACHE_DIRNAME "dovecot.fts.search-cache"
+#define FTS_SEARCH_CACHE_VERSION 2
+/* Remember at most this many searches per mailbox */
+#define FTS_SEARCH_CACHE_MAX_ENTRIES 32
+/* Don't cache results that take more space than this */
+#define FTS_SEARCH_CACHE_MAX_ENTRY_SIZE (256*1024)
+
+/* Each cached search is in its own file in the cache directory, named by
+   a hash of the search args. The file contains a version line, followed
+   by a single line:
+
+   <uidvalidity> <last uid> <level count>
+         [<args matches> <definite uids> <maybe uids> <scores>]*
+
+   The fields are separated by TABs. The args matches are the serialized
+   fts_search_level.args_matches in hex and the scores are
+   "<uid>:<score as hex float bits>" separated by ','. The file is replaced
+   atomically, so other searches' files are never rewritten. When there are
+   too many files, the least recently written ones are deleted. */
+
+static bool
+fts_search_args_append_key(string_t *dest, const struct mail_search_arg *args)
+{
+	struct mail_search_arg arg;
+	const char *error;
+
+	for (; args != NULL; args = args->next) {
+		str_append_c(dest, '(');
+		if (args->match_not)
+			str_append(dest, "NOT ");
+		if (args->fuzzy)
+			str_append(dest, "FUZZY ");
+		if (args->no_fts)
+			str_append(dest, "NOFTS ");
+		switch (args->type) {
+		case SEARCH_OR:
+			str_append(dest, "OR ");
+			/* fall through */
+		case SEARCH_SUB:
+			if (!fts_search_args_append_key(dest,
+							args->value.subargs))
+				return FALSE;
+			break;
+		case SEARCH_MAILBOX:
+		case SEARCH_MAILBOX_GUID:
+		case SEARCH_MAILBOX_GLOB:
+			/* not expressible in IMAP, but added by doveadm */
+			str_printfa(dest, "MAILBOX%d ", args->type);
+			str_append(dest, args->value.str);
+			break;
+		default:
+			arg = *args;
+			arg.match_not = FALSE;
+			if (!mail_search_arg_to_imap(dest, &arg, &error))
+				return FALSE;
+			break;
+		}
+		str_append_c(dest, ')');
+	}
+	return TRUE;
+}
+
+static const char *fts_search_cache_get_key(struct fts_search_context *fctx)
+{
+	unsigned char digest[SHA256_RESULTLEN];
+	string_t *str = t_str_new(256);
+
+	str_printfa(str, "%x ", fctx->flags);
+	if (!fts_search_args_append_key(str, fctx->args->args))
+		return NULL;
+	sha256_get_digest(str_data(str), str_len(str), digest);
+	return binary_to_hex(digest, sizeof(digest));
+}
+
+static const char *fts_search_cache_get_dir(struct mailbox *box)
+{
+	const char *dir;
+
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX, &dir) <= 0)
+		return NULL;
+	return t_strconcat(dir, "/"FTS_SEARCH_CACHE_DIRNAME, NULL);
+}
+
+static void
+fts_search_cache_get_level_sizes(const struct mail_search_arg *args,
+				 ARRAY_TYPE(uint32_t) *sizes)
+{
+	buffer_t *buf = t_buffer_create(32);
+	uint32_t size;
+
+	/* the levels are in the same order as fts_search_lookup_level()
+	   creates them */
+	fts_search_serialize(buf, args);
+	size = buf->used;
+	array_push_back(sizes, &size);
+	for (; args != NULL; args = args->next) {
+		if (args->type == SEARCH_OR || args->type == SEARCH_SUB) {
+			fts_search_cache_get_level_sizes(args->value.subargs,
+							 sizes);
+		}
+	}
+}
+
+static int fts_search_cache_parse_uids(const char *str,
+				       ARRAY_TYPE(seq_range) *uids)
+{
+	t_array_init(uids, 32);
+	if (str[0] == '\0')
+		return 0;
+	return imap_seq_set_nostar_parse(str, uids);
+}
+
+static int
+fts_search_cache_parse_scores(struct fts_search_context *fctx,
+			      const char *str, ARRAY_TYPE(fts_score_map) *scores)
+{
+	const char *const *items, *p;
+	struct fts_score_map *score;
+	uint32_t bits;
+
+	p_array_init(scores, fctx->result_pool, 32);
+	if (str[0] == '\0')
+		return 0;
+
+	for (items = t_strsplit(str, ","); *items != NULL; items++) {
+		p = strchr(*items, ':');
+		if (p == NULL)
+			return -1;
+		score = array_append_space(scores);
+		if (str_to_uint32(t_strdup_until(*items, p), &score->uid) < 0 ||
+		    str_to_uint32_hex(p + 1, &bits) < 0)
+			return -1;
+		memcpy(&score->score, &bits, sizeof(bits));
+	}
+	return 0;
+}
+
+static int
+fts_search_cache_parse_levels(struct fts_search_context *fctx,
+			      const char *const *args)
+{
+	ARRAY_TYPE(uint32_t) sizes;
+	ARRAY_TYPE(seq_range) definite_uids, maybe_uids;
+	struct fts_search_level *level;
+	const uint32_t *size;
+	unsigned int count;
+
+	t_array_init(&sizes, 8);
+	fts_search_cache_get_level_sizes(fctx->args->args, &sizes);
+	if (str_to_uint(args[0], &count) < 0 ||
+	    count != array_count(&sizes) ||
+	    str_array_length(args + 1) != count * 4)
+		return -1;
+	args++;
+
+	array_foreach(&sizes, size) {
+		level = array_append_space(&fctx->levels);
+		level->args_matches =
+			buffer_create_dynamic(fctx->result_pool, 16);
+		if (hex_to_binary(args[0], level->args_matches) < 0 ||
+		    level->args_matches->used != *size)
+			return -1;
+		if (fts_search_cache_parse_uids(args[1], &definite_uids) < 0 ||
+		    fts_search_cache_parse_uids(args[2], &maybe_uids) < 0)
+			return -1;
+		fts_search_uids_to_seqs(fctx, &definite_uids,
+					&level->definite_seqs);
+		fts_search_uids_to_seqs(fctx, &maybe_uids,
+					&level->maybe_seqs);
+		if (fts_search_cache_parse_scores(fctx, args[3],
+						  &level->score_map) < 0)
+			return -1;
+		args += 4;
+	}
+	return 0;
+}
+
+static bool
+fts_search_cache_parse_entry(struct fts_search_context *fctx,
+			     const char *line, uint32_t last_uid)
+{
+	struct mailbox_status status;
+	const char *const *args = t_strsplit(line, "\t");
+	uint32_t uidvalidity, cached_last_uid;
+
+	if (str_array_length(args) < 3 ||
+	    str_to_uint32(args[0], &uidvalidity) < 0 ||
+	    str_to_uint32(args[1], &cached_last_uid) < 0)
+		return FALSE;
+
+	mailbox_get_open_status(fctx->box, STATUS_UIDVALIDITY, &status);
+	if (uidvalidity != status.uidvalidity ||
+	    cached_last_uid != last_uid) {
+		/* mails were indexed after the results were cached, or the
+		   index was rebuilt. The results can't be used even
+		   partially, because fts_enforced may require the newer mails
+		   to be searched via the backend. */
+		return FALSE;
+	}
+
+	if (fts_search_cache_parse_levels(fctx, args + 2) < 0) {
+		array_clear(&fctx->levels);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static bool
+fts_search_cache_find(struct fts_search_context *fctx, const char *path,
+		      uint32_t last_uid)
+{
+	struct istream *input;
+	const char *line;
+	bool found = FALSE;
+
+	input = i_stream_create_file(path, FTS_SEARCH_CACHE_MAX_ENTRY_SIZE + 1);
+	line = i_stream_read_next_line(input);
+	if (line != NULL && atoi(line) == FTS_SEARCH_CACHE_VERSION) {
+		line = i_stream_read_next_line(input);
+		if (line != NULL)
+			found = fts_search_cache_parse_entry(fctx, line, last_uid);
+	}
+	if (input->stream_errno != 0 && input->stream_errno != ENOENT) {
+		e_error(fctx->box->event, "fts: read(%s) failed: %s",
+			i_stream_get_name(input), i_stream_get_error(input));
+	}
+	i_stream_destroy(&input);
+	return found;
+}
+
+bool fts_search_cache_lookup(struct fts_search_context *fctx,
+			     uint32_t last_uid)
+{
+	const char *key, *dir;
+	bool found;
+
+	if (!fctx->search_cache)
+		return FALSE;
+
+	T_BEGIN {
+		key = fts_search_cache_get_key(fctx);
+		dir = fts_search_cache_get_dir(fctx->box);
+		if (key == NULL || dir == NULL)
+			found = FALSE;
+		else {
+			fctx->search_cache_key =
+				p_strdup(fctx->result_pool, key);
+			found = fts_search_cache_find(fctx,
+				t_strdup_printf("%s/%s", dir, key), last_uid);
+		}
+	} T_END;
+	if (found)
+		e_debug(fctx->box->event, "fts: Using cached search results");
+	return found;
+}
+
+static void
+fts_search_cache_append_uids(struct fts_search_context *fctx, string_t *str,
+			     const ARRAY_TYPE(seq_range) *seqs)
+{
+	ARRAY_TYPE(seq_range) uids;
+
+	t_array_init(&uids, 32);
+	if (array_is_created(seqs))
+		mailbox_get_uid_range(fctx->box, seqs, &uids);
+	imap_write_seq_range(str, &uids);
+}
+
+static const char *
+fts_search_cache_get_data(struct fts_search_context *fctx, uint32_t last_uid)
+{
+	const struct fts_search_level *level;
+	const struct fts_score_map *score;
+	struct mailbox_status status;
+	uint32_t bits;
+	string_t *str = t_str_new(1024);
+
+	mailbox_get_open_status(fctx->box, STATUS_UIDVALIDITY, &status);
+	str_printfa(str, "%u\n%u\t%u\t%u", FTS_SEARCH_CACHE_VERSION,
+		    status.uidvalidity, last_uid, array_count(&fctx->levels));
+	array_foreach(&fctx->levels, level) {
+		str_append_c(str, '\t');
+		binary_to_hex_append(str, level->args_matches->data,
+				     level->args_matches->used);
+		str_append_c(str, '\t');
+		fts_search_cache_append_uids(fctx, str, &level->definite_seqs);
+		str_append_c(str, '\t');
+		fts_search_cache_append_uids(fctx, str, &level->maybe_seqs);
+		str_append_c(str, '\t');
+		if (array_is_created(&level->score_map)) {
+			array_foreach(&level->score_map, score) {
+				if (score != array_front(&level->score_map))
+					str_append_c(str, ',');
+				memcpy(&bits, &score->score, sizeof(bits));
+				str_printfa(str, "%u:%x", score->uid, bits);
+			}
+		}
+		if (str_len(str) > FTS_SEARCH_CACHE_MAX_ENTRY_SIZE)
+			return NULL;
+	}
+	str_append_c(str, '\n');
+	return str_c(str);
+}
+
+static void
+fts_search_cache_drop_oldest(struct mailbox *box, const char *dir,
+			     const char *new_key)
+{
+	DIR *dirp;
+	struct dirent *d;
+	struct stat st;
+	const char *path, *oldest_path = NULL;
+	time_t oldest_mtime = 0;
+	unsigned int count = 0;
+
+	dirp = opendir(dir);
+	if (dirp == NULL) {
+		e_error(box->event, "fts: opendir(%s) failed: %m", dir);
+		return;
+	}
+	for (errno = 0; (d = readdir(dirp)) != NULL; errno = 0) {
+		if (d->d_name[0] == '.') {
+			/* ".", ".." or a temp file */
+			continue;
+		}
+		count++;
+		if (strcmp(d->d_name, new_key) == 0)
+			continue;
+
+		path = t_strdup_printf("%s/%s", dir, d->d_name);
+		if (stat(path, &st) < 0) {
+			if (errno != ENOENT) {
+				e_error(box->event,
+					"fts: stat(%s) failed: %m", path);
+			}
+			continue;
+		}
+		if (oldest_path == NULL || st.st_mtime < oldest_mtime) {
+			oldest_path = path;
+			oldest_mtime = st.st_mtime;
+		}
+	}
+	if (errno != 0)
+		e_error(box->event, "fts: readdir(%s) failed: %m", dir);
+	if (closedir(dirp) < 0)
+		e_error(box->event, "fts: closedir(%s) failed: %m", dir);
+
+	/* each new search adds at most one file, so dropping the oldest one
+	   keeps the count within the limit */
+	if (count > FTS_SEARCH_CACHE_MAX_ENTRIES && oldest_path != NULL)
+		i_unlink_if_exists(oldest_path);
+}
+
+static int
+fts_search_cache_create_temp(struct mailbox *box, const char *dir,
+			     string_t *temp_path)
+{
+	const struct mailbox_permissions *perm = mailbox_get_permissions(box);
+	int fd;
+
+	str_printfa(temp_path, "%s/%s", dir,
+		    mailbox_list_get_temp_prefix(box->list));
+	fd = safe_mkstemp_hostpid_group(temp_path, perm->file_create_mode,
+					perm->file_create_gid,
+					perm->file_create_gid_origin);
+	if (fd == -1 && errno == ENOENT) {
+		/* the cache directory doesn't exist yet */
+		if (mkdir_parents_chgrp(dir, perm->dir_create_mode,
+					perm->file_create_gid,
+					perm->file_create_gid_origin) < 0 &&
+		    errno != EEXIST) {
+			e_error(box->event, "fts: mkdir_parents(%s) failed: %m",
+				dir);
+			return -1;
+		}
+		fd = safe_mkstemp_hostpid_group(temp_path,
+						perm->file_create_mode,
+						perm->file_create_gid,
+						perm->file_create_gid_origin);
+	}
+	if (fd == -1) {
+		e_error(box->event, "fts: safe_mkstemp(%s) failed: %m",
+			str_c(temp_path));
+	}
+	return fd;
+}
+
+static void
+fts_search_cache_write(struct fts_search_context *fctx, const char *dir,
+		       const char *data)
+{
+	struct mailbox *box = fctx->box;
+	string_t *temp_path = t_str_new(256);
+	const char *path;
+	int fd;
+
+	fd = fts_search_cache_create_temp(box, dir, temp_path);
+	if (fd == -1)
+		return;
+	if (write_full(fd, data, strlen(data)) < 0) {
+		e_error(box->event, "fts: write_full(%s) failed: %m",
+			str_c(temp_path));
+		i_close_fd(&fd);
+		i_unlink(str_c(temp_path));
+		return;
+	}
+	i_close_fd(&fd);
+
+	/* replace only this search's file - concurrent updates of the same
+	   search don't need locking, since either one of them is fine */
+	path = t_strdup_printf("%s/%s", dir, fctx->search_cache_key);
+	if (rename(str_c(temp_path), path) < 0) {
+		e_error(box->event, "fts: rename(%s, %s) failed: %m",
+			str_c(temp_path), path);
+		i_unlink(str_c(temp_path));
+		return;
+	}
+	fts_search_cache_drop_oldest(box, dir, fctx->search_cache_key);
+}
+
+void fts_search_cache_update(struct fts_search_context *fctx,
+			     uint32_t last_uid)
+{
+	const char *dir, *data;
+
+	if (fctx->search_cache_key == NULL)
+		return;
+
+	T_BEGIN {
+		dir = fts_search_cache_get_dir(fctx->box);
+		data = fts_search_cache_get_data(fctx, last_uid);
+		if (dir != NULL && data != NULL)
+			fts_search_cache_write(fctx, dir, data);
+	} T_END;
+}
@@ -0,0 +1,16 @@
+#ifndef FTS_SEARCH_CACHE_H
+#define FTS_SEARCH_CACHE_H
+
+struct fts_search_context;
+
+/* Look up the FTS results for the search from the mailbox's search cache.
+   last_uid is the last UID currently indexed by the backend. Returns TRUE
+   and fills fctx->levels if the cached results can be used, i.e. no mails
+   have been indexed after they were cached. */
+bool fts_search_cache_lookup(struct fts_search_context *fctx,
+			     uint32_t last_uid);
+/* Add the FTS results in fctx->levels to the search cache. */
+void fts_search_cache_update(struct fts_search_context *fctx,
+			     uint32_t last_uid);
+
+#endif
@@ -8,12 +8,12 @@
 #include "fts-api-private.h"
 #include "fts-search-args.h"
 #include "fts-search-serialize.h"
+#include "fts-search-cache.h"
 #include "fts-storage.h"
 
-static void
-uid_range_to_seqs(struct fts_search_context *fctx,
-		  const ARRAY_TYPE(seq_range) *uid_range,
-		  ARRAY_TYPE(seq_range) *seq_range)
+void fts_search_uids_to_seqs(struct fts_search_context *fctx,
+			     const ARRAY_TYPE(seq_range) *uid_range,
+			     ARRAY_TYPE(seq_range) *seq_range)
 {
 	const struct seq_range *range;
 	unsigned int i, count;
@@ -55,8 +55,9 @@ static int fts_search_lookup_level_single(struct fts_search_context *fctx,
 	level->args_matches = buffer_create_dynamic(fctx->result_pool, 16);
 	fts_search_serialize(level->args_matches, args);
 
-	uid_range_to_seqs(fctx, &result.definite_uids, &level->definite_seqs);
-	uid_range_to_seqs(fctx, &result.maybe_uids, &level->maybe_seqs);
+	fts_search_uids_to_seqs(fctx, &result.definite_uids,
+				&level->definite_seqs);
+	fts_search_uids_to_seqs(fctx, &result.maybe_uids, &level->maybe_seqs);
 	level->score_map = result.scores;
 	return 0;
 }
@@ -133,14 +134,14 @@ multi_add_lookup_result(struct fts_search_context *fctx,
 			fctx->box->virtual_vfuncs->get_virtual_uids(fctx->box,
 				br->box, &br->definite_uids, &vuids);
 		}
-		uid_range_to_seqs(fctx, &vuids, &level->definite_seqs);
+		fts_search_uids_to_seqs(fctx, &vuids, &level->definite_seqs);
 
 		array_clear(&vuids);
 		if (array_is_created(&br->maybe_uids)) {
 			fctx->box->virtual_vfuncs->get_virtual_uids(fctx->box,
 				br->box, &br->maybe_uids, &vuids);
 		}
-		uid_range_to_seqs(fctx, &vuids, &level->maybe_seqs);
+		fts_search_uids_to_seqs(fctx, &vuids, &level->maybe_seqs);
 
 		if (array_is_created(&br->scores))
 			level_scores_add_vuids(fctx->box, level, br);
@@ -357,9 +358,13 @@ void fts_search_lookup(struct fts_search_context *fctx)
 	}
 	fts_search_serialize(fctx->orig_matches, fctx->args->args);
 
-	if (fts_search_lookup_level(fctx, fctx->args->args, TRUE) == 0) {
+	if (fts_search_cache_lookup(fctx, last_uid)) {
+		fctx->fts_lookup_success = TRUE;
+		fts_search_merge_scores(fctx);
+	} else if (fts_search_lookup_level(fctx, fctx->args->args, TRUE) == 0) {
 		fctx->fts_lookup_success = TRUE;
 		fts_search_merge_scores(fctx);
+		fts_search_cache_update(fctx, last_uid);
 	}
 
 	fts_search_deserialize(fctx->args->args, fctx->orig_matches);
@@ -14,6 +14,7 @@
 #include "fts-tokenizer.h"
 #include "fts-indexer.h"
 #include "fts-build-mail.h"
+#include "fts-build-pipeline.h"
 #include "fts-search-serialize.h"
 #include "fts-plugin.h"
 #include "fts-storage.h"
@@ -47,6 +48,8 @@ struct fts_mailbox_list {
 struct fts_mailbox {
 	union mailbox_module_context module_ctx;
 	struct fts_backend_update_context *sync_update_ctx;
+	/* UIDs expunged by the current sync */
+	ARRAY_TYPE(seq_range) sync_expunged_uids;
 	bool fts_mailbox_excluded;
 };
 
@@ -54,6 +57,7 @@ struct fts_transaction_context {
 	union mailbox_transaction_module_context module_ctx;
 
 	struct fts_scores *scores;
+	struct fts_build_pipeline *build_pipeline;
 	uint32_t next_index_seq;
 	uint32_t highest_virtual_uid;
 	unsigned int precache_extra_count;
@@ -61,6 +65,7 @@ struct fts_transaction_context {
 	bool indexing:1;
 	bool precached:1;
 	bool mails_saved:1;
+	bool build_pipeline_checked:1;
 	const char *failure_reason;
 };
 
@@ -232,6 +237,9 @@ fts_mailbox_search_init(struct mailbox_transaction_context *t,
 	fctx->result_pool = pool_alloconly_create("fts results", 1024*64);
 	fctx->orig_matches = buffer_create_dynamic(default_pool, 64);
 	fctx->virtual_mailbox = t->box->virtual_vfuncs != NULL;
+	fctx->search_cache = !fctx->virtual_mailbox &&
+		mail_user_plugin_getenv_bool(t->box->storage->user,
+					     "fts_search_cache");
 	fctx->enforced = fts_enforced_parse(
 		mail_user_plugin_getenv(t->box->storage->user, "fts_enforced"));
 	i_array_init(&fctx->levels, 8);
@@ -488,6 +496,79 @@ static int fts_mail_precache_init(struct mail *_mail)
 	return 0;
 }
 
+static void fts_mail_build_pipeline_init(struct mail *_mail)
+{
+	struct fts_transaction_context *ft = FTS_CONTEXT_REQUIRE(_mail->transaction);
+	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT_REQUIRE(_mail->box->list);
+	struct mail_user *user = _mail->box->storage->user;
+	struct fts_build_pipeline_settings set;
+	const char *value;
+	unsigned int processes;
+	uint32_t messages_count;
+
+	ft->build_pipeline_checked = TRUE;
+
+	value = mail_user_plugin_getenv(user, "fts_index_processes");
+	if (value == NULL || value[0] == '\0')
+		return;
+	if (str_to_uint(value, &processes) < 0) {
+		i_error("fts: Invalid fts_index_processes setting: %s", value);
+		return;
+	}
+	if (processes == 0)
+		return;
+	if (mail_user_plugin_getenv(user, "fts_tika") != NULL ||
+	    mail_user_plugin_getenv(user, "fts_decoder") != NULL) {
+		/* the helpers can't connect to the external parsers */
+		return;
+	}
+	messages_count = mail_index_view_get_messages_count(_mail->box->view);
+	if (messages_count < _mail->seq ||
+	    messages_count - _mail->seq < FTS_BUILD_PIPELINE_BATCH_MAILS*2) {
+		/* not enough mails to make it worth it */
+		return;
+	}
+
+	i_zero(&set);
+	set.helper_path = PKG_LIBEXECDIR"/fts-build";
+	set.max_processes = processes;
+	set.batch_max_mails = FTS_BUILD_PIPELINE_BATCH_MAILS;
+	set.batch_max_size = FTS_BUILD_PIPELINE_BATCH_SIZE;
+	ft->build_pipeline = fts_build_pipeline_init(_mail->transaction,
+						     flist->update_ctx,
+						     _mail->seq, messages_count,
+						     &set);
+}
+
+static int fts_mail_build(struct mail *_mail)
+{
+	struct fts_transaction_context *ft = FTS_CONTEXT_REQUIRE(_mail->transaction);
+	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT_REQUIRE(_mail->box->list);
+
+	if (!ft->build_pipeline_checked)
+		fts_mail_build_pipeline_init(_mail);
+	if (ft->build_pipeline == NULL ||
+	    _mail->seq > fts_build_pipeline_get_last_seq(ft->build_pipeline)) {
+		if (fts_build_mail(flist->update_ctx, _mail) < 0)
+			return -1;
+		ft->next_index_seq = _mail->seq + 1;
+		return 0;
+	}
+
+	/* this may index also the following mails */
+	if (fts_build_pipeline_build(ft->build_pipeline, _mail->seq) < 0)
+		return -1;
+	ft->next_index_seq =
+		fts_build_pipeline_get_next_seq(ft->build_pipeline);
+	if (ft->next_index_seq == _mail->seq) {
+		/* the pipeline stopped before this mail */
+		if (fts_build_mail(flist->update_ctx, _mail) < 0)
+			return -1;
+		ft->next_index_seq = _mail->seq + 1;
+	}
+	return 0;
+}
+
 static int fts_mail_index(struct mail *_mail)
 {
 	struct fts_transaction_context *ft = FTS_CONTEXT_REQUIRE(_mail->transaction);
@@ -538,9 +619,8 @@ static int fts_mail_index(struct mail *_mail)
 
 	if (ft->next_index_seq == _mail->seq) {
 		fts_backend_update_set_mailbox(flist->update_ctx, _mail->box);
-		if (fts_build_mail(flist->update_ctx, _mail) < 0)
+		if (fts_mail_build(_mail) < 0)
 			return -1;
-		ft->next_index_seq = _mail->seq + 1;
 	}
 	return 0;
 }
@@ -602,6 +682,20 @@ fts_transaction_begin(struct mailbox *box,
 	return t;
 }
 
+static void
+fts_transaction_report_fragmentation(struct mailbox *box,
+				     struct fts_backend *backend)
+{
+	unsigned int fragmentation;
+
+	/* only indexer-worker reports it, so indexer can optimize the
+	   mailboxes it has been indexing */
+	if (null_strcmp(box->storage->user->service, "indexer-worker") != 0)
+		return;
+	if (fts_backend_get_fragmentation(backend, box, &fragmentation) > 0)
+		fts_indexer_report_fragmentation(box, fragmentation);
+}
+
 static int fts_transaction_end(struct mailbox_transaction_context *t, const char **error_r)
 {
 	struct fts_transaction_context *ft = FTS_CONTEXT_REQUIRE(t);
@@ -613,12 +707,17 @@ static int fts_transaction_end(struct mailbox_transaction_context *t, const char
 		ret = -1;
 	}
 
+	if (ft->build_pipeline != NULL)
+		fts_build_pipeline_deinit(&ft->build_pipeline);
 	if (ft->precached) {
 		i_assert(flist->update_ctx_refcount > 0);
 		if (--flist->update_ctx_refcount == 0) {
 			if (fts_backend_update_deinit(&flist->update_ctx) < 0) {
 				ret = -1;
 				*error_r = "backend deinit";
+			} else {
+				fts_transaction_report_fragmentation(
+					t->box, flist->backend);
 			}
 		}
 	} else if (ft->highest_virtual_uid > 0) {
@@ -726,7 +825,14 @@ static void fts_mailbox_sync_notify(struct mailbox *box, uint32_t uid,
 
 	if (sync_type != MAILBOX_SYNC_TYPE_EXPUNGE) {
 		if (uid == 0 && fbox->sync_update_ctx != NULL) {
-			/* this sync is finished */
+			/* this sync is finished. expunge all the mails from
+			   the backend at once. */
+			if (array_count(&fbox->sync_expunged_uids) > 0) {
+				fts_backend_update_expunge_range(
+					fbox->sync_update_ctx,
+					&fbox->sync_expunged_uids);
+				array_clear(&fbox->sync_expunged_uids);
+			}
 			(void)fts_backend_update_deinit(&fbox->sync_update_ctx);
 		}
 		return;
@@ -741,8 +847,10 @@ static void fts_mailbox_sync_notify(struct mailbox *box, uint32_t uid,
 		}
 		fbox->sync_update_ctx = fts_backend_update_init(flist->backend);
 		fts_backend_update_set_mailbox(fbox->sync_update_ctx, box);
+		if (!array_is_created(&fbox->sync_expunged_uids))
+			p_array_init(&fbox->sync_expunged_uids, box->pool, 32);
 	}
-	fts_backend_update_expunge(fbox->sync_update_ctx, uid);
+	seq_range_array_add(&fbox->sync_expunged_uids, uid);
 }
 
 static int fts_sync_deinit(struct mailbox_sync_context *ctx,
@@ -36,6 +36,9 @@ struct fts_search_context {
 	buffer_t *orig_matches;
 
 	uint32_t first_unindexed_seq;
+	/* Key for the search in the search cache, or NULL if the search
+	   can't be cached */
+	const char *search_cache_key;
 
 	/* final scores, combined from all levels */
 	struct fts_scores *scores;
@@ -43,6 +46,7 @@ struct fts_search_context {
 	struct fts_indexer_context *indexer_ctx;
 
 	bool virtual_mailbox:1;
+	bool search_cache:1;
 	bool fts_lookup_success:1;
 	bool indexing_timed_out:1;
 };
@@ -52,6 +56,10 @@ struct fts_search_context {
 void fts_search_analyze(struct fts_search_context *fctx);
 /* Perform the actual index lookup and update definite_uids and maybe_uids. */
 void fts_search_lookup(struct fts_search_context *fctx);
+/* Add the existing mails in uid_range to seq_range. */
+void fts_search_uids_to_seqs(struct fts_search_context *fctx,
+			     const ARRAY_TYPE(seq_range) *uid_range,
+			     ARRAY_TYPE(seq_range) *seq_range);
 /* Returns FTS backend for the given mailbox (assumes it has one). */
 struct fts_backend *fts_mailbox_backend(struct mailbox *box);
 /* Returns FTS backend for the given mailbox list, or NULL if it has none. */
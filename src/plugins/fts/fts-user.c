@@ -11,6 +11,11 @@
 #define FTS_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, fts_user_module)
 
+/* Default number of tokens whose filtered result is cached for each
+   language. Token frequencies are very skewed, so even a small cache avoids
+   most of the stemming and normalization work. */
+#define FTS_USER_DEFAULT_FILTER_CACHE_SIZE 4096
+
 struct fts_user {
 	union mail_user_module_context module_ctx;
 	int refcount;
@@ -88,9 +93,18 @@ fts_user_create_filters(struct mail_user *user, const struct fts_language *lang,
 	struct fts_filter *filter = NULL, *parent = NULL;
 	const char *filters_key, *const *filters, *filter_set_name;
 	const char *str, *error, *set_key;
-	unsigned int i;
+	unsigned int i, cache_size;
 	int ret = 0;
 
+	str = mail_user_plugin_getenv(user, "fts_filter_cache_size");
+	if (str == NULL)
+		cache_size = FTS_USER_DEFAULT_FILTER_CACHE_SIZE;
+	else if (str_to_uint(str, &cache_size) < 0) {
+		*error_r = t_strdup_printf(
+			"Invalid fts_filter_cache_size: %s", str);
+		return -1;
+	}
+
 	/* try to get the language-specific filters first */
 	filters_key = t_strconcat("fts_filters_", lang->name, NULL);
 	str = mail_user_plugin_getenv(user, filters_key);
@@ -141,6 +155,8 @@ fts_user_create_filters(struct mail_user *user, const struct fts_language *lang,
 			fts_filter_unref(&parent);
 		return -1;
 	}
+	if (filter != NULL)
+		fts_filter_set_cache_size(filter, cache_size);
 	*filter_r = filter;
 	return 0;
 }
@@ -336,17 +352,27 @@ struct fts_user_language *fts_user_get_data_lang(struct mail_user *user)
 	return fuser->data_lang;
 }
 
-static void fts_user_language_free(struct fts_user_language *user_lang)
+static void fts_user_language_free(struct mail_user *user,
+				   struct fts_user_language *user_lang)
 {
-	if (user_lang->filter != NULL)
+	uint64_t hits, misses;
+
+	if (user_lang->filter != NULL) {
+		fts_filter_get_cache_stats(user_lang->filter, &hits, &misses);
+		if (hits + misses > 0) {
+			e_debug(user->event, "fts: Language %s filter cache: "
+				"%"PRIu64" hits, %"PRIu64" misses",
+				user_lang->lang->name, hits, misses);
+		}
 		fts_filter_unref(&user_lang->filter);
+	}
 	if (user_lang->index_tokenizer != NULL)
 		fts_tokenizer_unref(&user_lang->index_tokenizer);
 	if (user_lang->search_tokenizer != NULL)
 		fts_tokenizer_unref(&user_lang->search_tokenizer);
 }
 
-static void fts_user_free(struct fts_user *fuser)
+static void fts_user_free(struct mail_user *user, struct fts_user *fuser)
 {
 	struct fts_user_language *const *user_langp;
 
@@ -354,7 +380,7 @@ static void fts_user_free(struct fts_user *fuser)
 		fts_language_list_deinit(&fuser->lang_list);
 
 	array_foreach(&fuser->languages, user_langp)
-		fts_user_language_free(*user_langp);
+		fts_user_language_free(user, *user_langp);
 }
 
 int fts_mail_user_init(struct mail_user *user, const char **error_r)
@@ -373,11 +399,11 @@ int fts_mail_user_init(struct mail_user *user, const char **error_r)
 
 	if (fts_user_init_languages(user, fuser, error_r) < 0 ||
 	    fts_user_init_data_language(user, fuser, error_r) < 0) {
-		fts_user_free(fuser);
+		fts_user_free(user, fuser);
 		return -1;
 	}
 	if (fts_user_languages_fill_all(user, fuser, error_r) < 0) {
-		fts_user_free(fuser);
+		fts_user_free(user, fuser);
 		return -1;
 	}
 
@@ -392,6 +418,6 @@ void fts_mail_user_deinit(struct mail_user *user)
 	if (fuser != NULL) {
 		i_assert(fuser->refcount > 0);
 		if (--fuser->refcount == 0)
-			fts_user_free(fuser);
+			fts_user_free(user, fuser);
 	}
 }
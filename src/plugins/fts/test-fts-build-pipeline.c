@@ -0,0 +1,362 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "istream.h"
+#include "path-util.h"
+#include "str.h"
+#include "master-service.h"
+#include "message-part.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+#include "fts-library.h"
+#include "fts-user.h"
+#include "fts-api-private.h"
+#include "fts-build-mail.h"
+#include "fts-build-pipeline.h"
+
+#define TEST_MAIL_COPIES 4
+
+/* Records the backend calls, so the serial and the pipeline builds can be
+   compared. */
+struct test_backend_update_context {
+	struct fts_backend_update_context ctx;
+	struct fts_backend backend;
+	string_t *str;
+};
+
+static const char *const test_mails[] = {
+	"From: User <user@example.com>\n"
+	"To: Other <other@example.org>, third@example.net\n"
+	"Subject: simple\n"
+	"\n"
+	"Hello world, this is a plain text body.\n",
+
+	"From: user@example.com\n"
+	"Subject: =?utf-8?q?encoded_w=C3=B6rd?=\n"
+	"X-Mailer: test mailer 1.0\n"
+	"MIME-Version: 1.0\n"
+	"Content-Type: multipart/alternative; boundary=\"alt\"\n"
+	"\n"
+	"--alt\n"
+	"Content-Type: text/plain; charset=iso-8859-1\n"
+	"Content-Transfer-Encoding: quoted-printable\n"
+	"\n"
+	"Caf=E9 au lait and croissants.\n"
+	"--alt\n"
+	"Content-Type: text/html\n"
+	"\n"
+	"<html><body><p>Caf&eacute; <b>au lait</b></p>"
+	"<script>ignored()</script></body></html>\n"
+	"--alt--\n",
+
+	"From: user@example.com\n"
+	"Subject: attachments\n"
+	"MIME-Version: 1.0\n"
+	"Content-Type: multipart/mixed; boundary=\"mix\"\n"
+	"\n"
+	"--mix\n"
+	"Content-Type: text/plain; charset=utf-8\n"
+	"Content-Transfer-Encoding: base64\n"
+	"\n"
+	"QmFzZTY0IGVuY29kZWQgdGV4dCB3aXRoIMO8bWxhdXRzLgo=\n"
+	"--mix\n"
+	"Content-Type: application/octet-stream\n"
+	"Content-Disposition: attachment; filename=\"data.bin\"\n"
+	"Content-Transfer-Encoding: base64\n"
+	"\n"
+	"AAECAwQFBgcICQ==\n"
+	"--mix\n"
+	"Content-Type: message/rfc822\n"
+	"\n"
+	"From: inner@example.com\n"
+	"Subject: inner message\n"
+	"\n"
+	"The attached message body.\n"
+	"--mix--\n",
+
+	"From: r\xc3\xa4ksm\xc3\xb6rg\xc3\xa5s <user@example.com>\n"
+	"Subject: 8bit h\xc3\xa9\x61\x64\x65r\n"
+	"Cc: undisclosed-recipients:;\n"
+	"\n"
+	"8bit body: \xc3\xa5\xc3\xa4\xc3\xb6 and a very-long-hyphenated-word.\n",
+
+	"Subject: no body\n",
+};
+
+static struct test_mail_storage_ctx *test_ctx;
+static struct mailbox *test_box;
+static char *test_helper_path;
+
+static void
+test_backend_set_mailbox(struct fts_backend_update_context *ctx ATTR_UNUSED,
+			 struct mailbox *box ATTR_UNUSED)
+{
+}
+
+static bool
+test_backend_set_build_key(struct fts_backend_update_context *_ctx,
+			   const struct fts_backend_build_key *key)
+{
+	struct test_backend_update_context *ctx =
+		container_of(_ctx, struct test_backend_update_context, ctx);
+
+	str_printfa(ctx->str, "K %u %d %d %s %s %s\n", key->uid, key->type,
+		    key->part == NULL ? -1 : (int)message_part_to_idx(key->part),
+		    key->hdr_name, key->body_content_type,
+		    key->body_content_disposition);
+	return TRUE;
+}
+
+static void
+test_backend_unset_build_key(struct fts_backend_update_context *_ctx)
+{
+	struct test_backend_update_context *ctx =
+		container_of(_ctx, struct test_backend_update_context, ctx);
+
+	str_append(ctx->str, "U\n");
+}
+
+static int
+test_backend_build_more(struct fts_backend_update_context *_ctx,
+			const unsigned char *data, size_t size)
+{
+	struct test_backend_update_context *ctx =
+		container_of(_ctx, struct test_backend_update_context, ctx);
+
+	str_append(ctx->str, "D ");
+	str_append_data(ctx->str, data, size);
+	str_append_c(ctx->str, '\n');
+	return 0;
+}
+
+static void
+test_backend_init(struct test_backend_update_context *ctx,
+		  enum fts_backend_flags flags)
+{
+	i_zero(ctx);
+	ctx->backend.name = "test";
+	ctx->backend.flags = flags;
+	ctx->backend.ns = test_ctx->user->namespaces;
+	ctx->backend.v.update_set_mailbox = test_backend_set_mailbox;
+	ctx->backend.v.update_set_build_key = test_backend_set_build_key;
+	ctx->backend.v.update_unset_build_key = test_backend_unset_build_key;
+	ctx->backend.v.update_build_more = test_backend_build_more;
+	ctx->ctx.backend = &ctx->backend;
+	if ((flags & FTS_BACKEND_FLAG_NORMALIZE_INPUT) != 0)
+		ctx->ctx.normalizer = test_ctx->user->default_normalizer;
+	ctx->str = t_str_new(1024*64);
+	fts_backend_update_set_mailbox(&ctx->ctx, test_box);
+}
+
+static const char *test_build_serial(enum fts_backend_flags flags)
+{
+	struct test_backend_update_context ctx;
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	uint32_t seq, count;
+
+	test_backend_init(&ctx, flags);
+	trans = mailbox_transaction_begin(test_box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	count = mail_index_view_get_messages_count(test_box->view);
+	for (seq = 1; seq <= count; seq++) {
+		mail_set_seq(mail, seq);
+		test_assert_idx(fts_build_mail(&ctx.ctx, mail) == 1, seq);
+	}
+	mail_free(&mail);
+	mailbox_transaction_rollback(&trans);
+	return str_c(ctx.str);
+}
+
+static const char *
+test_build_pipeline(enum fts_backend_flags flags,
+		    const struct fts_build_pipeline_settings *set,
+		    uint32_t *last_seq_r)
+{
+	struct test_backend_update_context ctx;
+	struct mailbox_transaction_context *trans;
+	struct fts_build_pipeline *pipeline;
+	struct mail *mail;
+	uint32_t seq, next_seq, count;
+
+	test_backend_init(&ctx, flags);
+	trans = mailbox_transaction_begin(test_box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	count = mail_index_view_get_messages_count(test_box->view);
+	pipeline = fts_build_pipeline_init(trans, &ctx.ctx, 1, count, set);
+	/* the same as fts_mail_build() */
+	for (seq = 1; seq <= count; seq = next_seq) {
+		next_seq = seq;
+		if (seq <= fts_build_pipeline_get_last_seq(pipeline)) {
+			test_assert(fts_build_pipeline_build(pipeline, seq) == 0);
+			next_seq = fts_build_pipeline_get_next_seq(pipeline);
+		}
+		if (next_seq == seq) {
+			mail_set_seq(mail, seq);
+			test_assert_idx(fts_build_mail(&ctx.ctx, mail) == 1, seq);
+			next_seq = seq + 1;
+		}
+	}
+	*last_seq_r = fts_build_pipeline_get_last_seq(pipeline);
+	fts_build_pipeline_deinit(&pipeline);
+	mail_free(&mail);
+	mailbox_transaction_rollback(&trans);
+	return str_c(ctx.str);
+}
+
+static void test_fts_build_pipeline_compare(void)
+{
+	static const enum fts_backend_flags flags[] = {
+		0,
+		FTS_BACKEND_FLAG_NORMALIZE_INPUT |
+			FTS_BACKEND_FLAG_BINARY_MIME_PARTS,
+		FTS_BACKEND_FLAG_BUILD_FULL_WORDS,
+		FTS_BACKEND_FLAG_TOKENIZED_INPUT,
+	};
+	struct fts_build_pipeline_settings set = {
+		.helper_path = test_helper_path,
+		.max_processes = 2,
+		.batch_max_mails = 3,
+		.batch_max_size = (uoff_t)-1,
+	};
+	const char *serial, *parallel;
+	uint32_t last_seq, count;
+	unsigned int i;
+
+	test_begin("fts build pipeline compare");
+	count = mail_index_view_get_messages_count(test_box->view);
+	for (i = 0; i < N_ELEMENTS(flags); i++) {
+		serial = test_build_serial(flags[i]);
+		test_assert_idx(strstr(serial, "K 1 ") != NULL, i);
+		parallel = test_build_pipeline(flags[i], &set, &last_seq);
+		test_assert_idx(last_seq == count, i);
+		test_assert_strcmp_idx(parallel, serial, i);
+	}
+
+	/* a batch per mail, as many helpers as mails */
+	set.batch_max_size = 1;
+	set.max_processes = count;
+	serial = test_build_serial(FTS_BACKEND_FLAG_TOKENIZED_INPUT);
+	parallel = test_build_pipeline(FTS_BACKEND_FLAG_TOKENIZED_INPUT,
+				       &set, &last_seq);
+	test_assert(last_seq == count);
+	test_assert_strcmp(parallel, serial);
+	test_end();
+}
+
+static void test_fts_build_pipeline_helper_failure(void)
+{
+	struct fts_build_pipeline_settings set = {
+		.helper_path = "/bin/false",
+		.max_processes = 2,
+		.batch_max_mails = 3,
+		.batch_max_size = (uoff_t)-1,
+	};
+	const char *serial, *parallel;
+	uint32_t last_seq;
+
+	test_begin("fts build pipeline helper failure");
+	/* the mails are indexed without the pipeline */
+	serial = test_build_serial(0);
+	test_expect_error_string("Indexing mails in INBOX without /bin/false");
+	parallel = test_build_pipeline(0, &set, &last_seq);
+	test_expect_no_more_errors();
+	test_assert(last_seq == 0);
+	test_assert_strcmp(parallel, serial);
+	test_end();
+}
+
+static void test_setup(void)
+{
+	const char *const extra_input[] = {
+		"fts_languages=en",
+		"fts_tokenizers=generic email-address",
+		"fts_tokenizer_generic=algorithm=simple maxlen=10",
+		"fts_filters=lowercase",
+		NULL
+	};
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+		.extra_input = extra_input,
+	};
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	const char *data, *error;
+	unsigned int i, j;
+
+	test_ctx = test_mail_storage_init();
+	test_mail_storage_init_user(test_ctx, &set);
+	if (fts_mail_user_init(test_ctx->user, &error) < 0)
+		i_fatal("fts_mail_user_init() failed: %s", error);
+
+	test_box = mailbox_alloc(test_ctx->user->namespaces->list, "INBOX", 0);
+	if (mailbox_open(test_box) < 0)
+		i_fatal("mailbox_open() failed");
+	trans = mailbox_transaction_begin(test_box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	for (j = 0; j < TEST_MAIL_COPIES; j++) {
+		for (i = 0; i < N_ELEMENTS(test_mails); i++) {
+			data = t_strdup_printf(
+				"Message-ID: <%u.%u@example.com>\n%s",
+				j, i, test_mails[i]);
+			input = i_stream_create_from_data(data, strlen(data));
+			save_ctx = mailbox_save_alloc(trans);
+			if (mailbox_save_begin(&save_ctx, input) < 0)
+				i_fatal("mailbox_save_begin() failed");
+			while (i_stream_read(input) > 0) {
+				if (mailbox_save_continue(save_ctx) < 0)
+					i_fatal("mailbox_save_continue() failed");
+			}
+			if (mailbox_save_finish(&save_ctx) < 0)
+				i_fatal("mailbox_save_finish() failed");
+			i_stream_unref(&input);
+		}
+	}
+	if (mailbox_transaction_commit(&trans) < 0)
+		i_fatal("mailbox_transaction_commit() failed");
+	if (mailbox_sync(test_box, 0) < 0)
+		i_fatal("mailbox_sync() failed");
+}
+
+static void test_teardown(void)
+{
+	mailbox_free(&test_box);
+	fts_mail_user_deinit(test_ctx->user);
+	test_mail_storage_deinit_user(test_ctx);
+	test_mail_storage_deinit(&test_ctx);
+}
+
+int main(int argc, char **argv)
+{
+	void (*const tests[])(void) = {
+		test_setup,
+		test_fts_build_pipeline_compare,
+		test_fts_build_pipeline_helper_failure,
+		test_teardown,
+		NULL
+	};
+	int ret;
+
+	master_service = master_service_init("test-fts-build-pipeline",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	/* the user's home directory becomes the current directory */
+	T_BEGIN {
+		const char *path, *error;
+
+		if (t_abspath("fts-build", &path, &error) < 0)
+			i_fatal("t_abspath() failed: %s", error);
+		test_helper_path = i_strdup(path);
+	} T_END;
+	fts_library_init();
+	ret = test_run(tests);
+	fts_library_deinit();
+	i_free(test_helper_path);
+	master_service_deinit(&master_service);
+	return ret;
+}
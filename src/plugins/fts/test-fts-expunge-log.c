@@ -0,0 +1,238 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "test-common.h"
+#include "fts-expunge-log.h"
+
+#include <sys/stat.h>
+
+#define TEST_LOG_PATH ".test-fts-expunge-log"
+
+static void test_guid(guid_128_t guid_r, unsigned int idx)
+{
+	guid_128_empty(guid_r);
+	guid_r[0] = idx;
+}
+
+static void
+test_log_append(struct fts_expunge_log *log, unsigned int guid_idx,
+		uint32_t uid1, uint32_t uid2)
+{
+	struct fts_expunge_log_append_ctx *ctx;
+	struct seq_range range = { .seq1 = uid1, .seq2 = uid2 };
+	guid_128_t guid;
+
+	test_guid(guid, guid_idx);
+	ctx = fts_expunge_log_append_begin(log);
+	if (uid1 == uid2)
+		fts_expunge_log_append_next(ctx, guid, uid1);
+	else
+		fts_expunge_log_append_range(ctx, guid, &range);
+	test_assert(fts_expunge_log_append_commit(&ctx) == 0);
+}
+
+static const char *
+test_log_record_to_str(const struct fts_expunge_log_read_record *record)
+{
+	const struct seq_range *range;
+	string_t *str = t_str_new(64);
+
+	str_printfa(str, "%u:", record->mailbox_guid[0]);
+	array_foreach(&record->uids, range) {
+		if (range != array_front(&record->uids))
+			str_append_c(str, ',');
+		str_printfa(str, "%u", range->seq1);
+		if (range->seq1 != range->seq2)
+			str_printfa(str, "-%u", range->seq2);
+	}
+	return str_c(str);
+}
+
+/* Read the whole log, which unlinks it. Returns the records as
+   "guid:uid-ranges" strings. If sorted is TRUE, the records are sorted,
+   since compaction writes the mailboxes in hash table order. */
+static const char *test_log_read(struct fts_expunge_log *log, bool sorted)
+{
+	struct fts_expunge_log_read_ctx *ctx;
+	const struct fts_expunge_log_read_record *record;
+	ARRAY_TYPE(const_string) records;
+	const char *const *recp;
+	string_t *str = t_str_new(128);
+
+	t_array_init(&records, 8);
+	ctx = fts_expunge_log_read_begin(log);
+	while ((record = fts_expunge_log_read_next(ctx)) != NULL) {
+		const char *rec_str = test_log_record_to_str(record);
+		array_push_back(&records, &rec_str);
+	}
+	test_assert(fts_expunge_log_read_end(&ctx) == 1);
+
+	if (sorted)
+		array_sort(&records, i_strcmp_p);
+	array_foreach(&records, recp)
+		str_printfa(str, "%s ", *recp);
+	return str_c(str);
+}
+
+static unsigned int test_log_uid_count(struct fts_expunge_log *log)
+{
+	unsigned int count;
+
+	test_assert(fts_expunge_log_uid_count(log, &count) >= 0);
+	return count;
+}
+
+static void test_fts_expunge_log_append_read(void)
+{
+	struct fts_expunge_log *log;
+	struct stat st;
+
+	test_begin("fts expunge log append and read");
+	i_unlink_if_exists(TEST_LOG_PATH);
+	log = fts_expunge_log_init(TEST_LOG_PATH);
+	test_assert(test_log_uid_count(log) == 0);
+	test_assert_strcmp(test_log_read(log, FALSE), "");
+
+	test_log_append(log, 1, 5, 5);
+	test_log_append(log, 2, 1, 10);
+	test_log_append(log, 1, 6, 8);
+	/* already expunged UIDs aren't counted twice within a record */
+	test_log_append(log, 2, 10, 10);
+	test_assert(test_log_uid_count(log) == 1 + 10 + 3 + 1);
+
+	test_assert_strcmp(test_log_read(log, FALSE),
+			   "1:5 2:1-10 1:6-8 2:10 ");
+	/* reading the whole log unlinked it */
+	test_assert(stat(TEST_LOG_PATH, &st) < 0 && errno == ENOENT);
+	test_assert(test_log_uid_count(log) == 0);
+
+	/* appending after reading starts a new log */
+	test_log_append(log, 3, 1, 2);
+	test_assert(test_log_uid_count(log) == 2);
+	test_assert_strcmp(test_log_read(log, FALSE), "3:1-2 ");
+
+	fts_expunge_log_deinit(&log);
+	test_end();
+}
+
+static void test_fts_expunge_log_compact(void)
+{
+	struct fts_expunge_log *log;
+	string_t *expected = t_str_new(1024*8);
+	struct stat st;
+	unsigned int i, uid;
+
+	test_begin("fts expunge log compact");
+	i_unlink_if_exists(TEST_LOG_PATH);
+	log = fts_expunge_log_init(TEST_LOG_PATH);
+
+	/* compacting a nonexistent log does nothing */
+	test_assert(fts_expunge_log_compact(log) == 1);
+	test_assert(stat(TEST_LOG_PATH, &st) < 0 && errno == ENOENT);
+
+	test_log_append(log, 1, 1, 3);
+	test_log_append(log, 2, 10, 10);
+	test_log_append(log, 1, 4, 4);
+	test_log_append(log, 1, 10, 12);
+	test_log_append(log, 2, 11, 20);
+	test_log_append(log, 1, 2, 3);
+	test_assert(test_log_uid_count(log) == 3 + 1 + 1 + 3 + 10 + 2);
+
+	/* the runs of each mailbox are merged into a single record */
+	test_assert(fts_expunge_log_compact(log) == 1);
+	test_assert(test_log_uid_count(log) == 4 + 3 + 11);
+	/* compacting again is a no-op */
+	test_assert(stat(TEST_LOG_PATH, &st) == 0);
+	test_assert(fts_expunge_log_compact(log) == 1);
+	test_assert_strcmp(test_log_read(log, TRUE), "1:1-4,10-12 2:10-20 ");
+
+	/* the log is compacted automatically when it grows past
+	   FTS_EXPUNGE_LOG_COMPACT_MIN_SIZE */
+	for (i = 0; i < 1000; i++)
+		test_log_append(log, i % 2 + 1, i*2 + 1, i*2 + 1);
+	test_assert(stat(TEST_LOG_PATH, &st) == 0);
+	test_assert(st.st_size < 8*1024);
+	test_assert(test_log_uid_count(log) == 1000);
+	test_assert(fts_expunge_log_compact(log) == 1);
+	test_assert(test_log_uid_count(log) == 1000);
+	str_truncate(expected, 0);
+	for (i = 0; i < 2; i++) {
+		str_printfa(expected, "%u:", i + 1);
+		for (uid = i*2 + 1; uid < 2000; uid += 4)
+			str_printfa(expected, "%u,", uid);
+		str_truncate(expected, str_len(expected) - 1);
+		str_append_c(expected, ' ');
+	}
+	test_assert_strcmp(test_log_read(log, TRUE), str_c(expected));
+
+	fts_expunge_log_deinit(&log);
+	test_end();
+}
+
+static void test_fts_expunge_log_compact_concurrent(void)
+{
+	struct fts_expunge_log *log, *log2;
+	struct fts_expunge_log_append_ctx *append;
+	struct fts_expunge_log_read_ctx *read;
+	const struct fts_expunge_log_read_record *record;
+	struct stat st;
+	guid_128_t guid;
+
+	test_begin("fts expunge log compact concurrently");
+	i_unlink_if_exists(TEST_LOG_PATH);
+	log = fts_expunge_log_init(TEST_LOG_PATH);
+	log2 = fts_expunge_log_init(TEST_LOG_PATH);
+
+	/* log2 opens the log before it's compacted and appends to it after
+	   the compaction. the append is written again to the new log. */
+	test_log_append(log, 1, 1, 1);
+	test_log_append(log, 1, 2, 2);
+	append = fts_expunge_log_append_begin(log2);
+	test_guid(guid, 2);
+	fts_expunge_log_append_next(append, guid, 5);
+	test_assert(fts_expunge_log_compact(log) == 1);
+	test_assert(fts_expunge_log_append_commit(&append) == 0);
+	test_assert(test_log_uid_count(log) == 3);
+	test_assert_strcmp(test_log_read(log, TRUE), "1:1-2 2:5 ");
+
+	/* log2 reads the log before it's compacted. when it reaches the end
+	   of the old log, it must not unlink the new compacted log, which
+	   may contain expunges that log2 never saw. */
+	test_log_append(log, 1, 1, 1);
+	test_log_append(log, 1, 2, 2);
+	read = fts_expunge_log_read_begin(log2);
+	record = fts_expunge_log_read_next(read);
+	test_assert(record != NULL &&
+		    strcmp(test_log_record_to_str(record), "1:1") == 0);
+	test_assert(fts_expunge_log_compact(log) == 1);
+	test_log_append(log, 3, 7, 7);
+	record = fts_expunge_log_read_next(read);
+	test_assert(record != NULL &&
+		    strcmp(test_log_record_to_str(record), "1:2") == 0);
+	test_assert(fts_expunge_log_read_next(read) == NULL);
+	test_assert(fts_expunge_log_read_end(&read) == 1);
+	test_assert(stat(TEST_LOG_PATH, &st) == 0);
+	test_assert_strcmp(test_log_read(log, TRUE), "1:1-2 3:7 ");
+	test_assert(stat(TEST_LOG_PATH ".lock", &st) < 0 && errno == ENOENT);
+
+	fts_expunge_log_deinit(&log);
+	fts_expunge_log_deinit(&log2);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_fts_expunge_log_append_read,
+		test_fts_expunge_log_compact,
+		test_fts_expunge_log_compact_concurrent,
+		NULL
+	};
+	int ret;
+
+	ret = test_run(test_functions);
+	i_unlink_if_exists(TEST_LOG_PATH);
+	return ret;
+}
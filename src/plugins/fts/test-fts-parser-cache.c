@@ -0,0 +1,256 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "master-service.h"
+#include "mail-storage-hooks.h"
+#include "message-parser.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+#include "fts-parser.h"
+
+struct test_fts_parser {
+	struct fts_parser parser;
+	string_t *input, *output;
+	bool output_sent;
+};
+
+struct event_category event_category_fts = {
+	.name = "fts",
+};
+
+static struct mail_storage_hooks test_hooks = {
+	.mail_user_created = fts_parser_cache_mail_user_created,
+};
+
+static struct test_mail_storage_ctx *test_ctx;
+static unsigned int test_parser_init_count;
+static bool test_parser_init_fail;
+static int test_parser_deinit_ret;
+
+static const struct fts_parser_vfuncs test_parser_vfuncs;
+
+static struct fts_parser *
+test_parser_try_init(struct fts_parser_context *parser_context)
+{
+	struct test_fts_parser *parser;
+
+	test_parser_init_count++;
+	if (test_parser_init_fail)
+		return NULL;
+
+	test_assert(parser_context->user == test_ctx->user);
+	parser = i_new(struct test_fts_parser, 1);
+	parser->parser.v = test_parser_vfuncs;
+	parser->input = str_new(default_pool, 128);
+	parser->output = str_new(default_pool, 128);
+	return &parser->parser;
+}
+
+static void test_parser_more(struct fts_parser *_parser,
+			     struct message_block *block)
+{
+	struct test_fts_parser *parser = (struct test_fts_parser *)_parser;
+
+	if (block->size > 0) {
+		str_append_data(parser->input, block->data, block->size);
+		block->size = 0;
+		return;
+	}
+	if (parser->output_sent)
+		return;
+	parser->output_sent = TRUE;
+
+	str_printfa(parser->output, "text of %s", str_c(parser->input));
+	block->data = str_data(parser->output);
+	block->size = str_len(parser->output);
+}
+
+static int test_parser_deinit(struct fts_parser *_parser,
+			      const char **retriable_err_msg_r)
+{
+	struct test_fts_parser *parser = (struct test_fts_parser *)_parser;
+
+	str_free(&parser->input);
+	str_free(&parser->output);
+	i_free(parser);
+	if (test_parser_deinit_ret == 0)
+		*retriable_err_msg_r = "test failure";
+	return test_parser_deinit_ret;
+}
+
+static const struct fts_parser_vfuncs test_parser_vfuncs = {
+	"test",
+	test_parser_try_init,
+	test_parser_more,
+	test_parser_deinit,
+	NULL,
+	NULL
+};
+
+static const char *
+test_parse(const char *cache_key, const char *content_type,
+	   const char *input, int *ret_r)
+{
+	struct fts_parser_context parser_context = {
+		.user = test_ctx->user,
+		.content_type = content_type,
+	};
+	struct fts_parser *parser;
+	struct message_block block;
+	string_t *output = t_str_new(128);
+	const char *error;
+
+	parser = fts_parser_cache_init(&parser_context, &test_parser_vfuncs,
+				       cache_key);
+	i_zero(&block);
+	block.data = (const unsigned char *)input;
+	block.size = strlen(input);
+	fts_parser_more(parser, &block);
+	test_assert(block.size == 0);
+
+	for (;;) {
+		block.size = 0;
+		fts_parser_more(parser, &block);
+		if (block.size == 0)
+			break;
+		str_append_data(output, block.data, block.size);
+	}
+	*ret_r = fts_parser_deinit(&parser, &error);
+	return str_c(output);
+}
+
+static void test_fts_parser_cache_hit(void)
+{
+	int ret;
+
+	test_begin("fts parser cache hit");
+	test_parser_init_count = 0;
+
+	test_assert_strcmp(test_parse("key1", "application/pdf", "hit", &ret),
+			   "text of hit");
+	test_assert(ret == 1);
+	test_assert(test_parser_init_count == 1);
+
+	/* the parser isn't started on a cache hit */
+	test_assert_strcmp(test_parse("key1", "application/pdf", "hit", &ret),
+			   "text of hit");
+	test_assert(ret == 1);
+	test_assert(test_parser_init_count == 1);
+	test_end();
+}
+
+static void test_fts_parser_cache_key(void)
+{
+	int ret;
+
+	test_begin("fts parser cache key");
+	test_parser_init_count = 0;
+
+	test_assert_strcmp(test_parse("key1", "application/pdf", "key", &ret),
+			   "text of key");
+	test_assert(test_parser_init_count == 1);
+	/* a different parser configuration */
+	test_assert_strcmp(test_parse("key2", "application/pdf", "key", &ret),
+			   "text of key");
+	test_assert(test_parser_init_count == 2);
+	/* a different content type */
+	test_assert_strcmp(test_parse("key1", "application/msword", "key",
+				      &ret), "text of key");
+	test_assert(test_parser_init_count == 3);
+	/* a different input */
+	test_assert_strcmp(test_parse("key1", "application/pdf", "key2", &ret),
+			   "text of key2");
+	test_assert(test_parser_init_count == 4);
+
+	/* all of them are cached now */
+	test_assert_strcmp(test_parse("key2", "application/pdf", "key", &ret),
+			   "text of key");
+	test_assert_strcmp(test_parse("key1", "application/msword", "key",
+				      &ret), "text of key");
+	test_assert(test_parser_init_count == 4);
+	test_end();
+}
+
+static void test_fts_parser_cache_failures(void)
+{
+	int ret;
+
+	test_begin("fts parser cache failures");
+	test_parser_init_count = 0;
+
+	/* the parser couldn't be started - nothing is cached */
+	test_parser_init_fail = TRUE;
+	test_assert_strcmp(test_parse("key1", "application/pdf", "fail", &ret),
+			   "");
+	test_assert(ret == 1);
+	test_assert(test_parser_init_count == 1);
+	test_parser_init_fail = FALSE;
+
+	/* parsing failed - nothing is cached */
+	test_parser_deinit_ret = 0;
+	test_assert_strcmp(test_parse("key1", "application/pdf", "fail", &ret),
+			   "text of fail");
+	test_assert(ret == 0);
+	test_assert(test_parser_init_count == 2);
+	test_parser_deinit_ret = 1;
+
+	test_assert_strcmp(test_parse("key1", "application/pdf", "fail", &ret),
+			   "text of fail");
+	test_assert(ret == 1);
+	test_assert(test_parser_init_count == 3);
+	test_assert_strcmp(test_parse("key1", "application/pdf", "fail", &ret),
+			   "text of fail");
+	test_assert(test_parser_init_count == 3);
+	test_end();
+}
+
+static void test_setup(void)
+{
+	test_ctx = test_mail_storage_init();
+	const char *const extra_input[] = {
+		t_strdup_printf("fts_parser_cache=posix:prefix=%s/fts-cache/",
+				test_ctx->home_root),
+		NULL
+	};
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+		.extra_input = extra_input,
+	};
+	/* plugins aren't loaded, so add the hook directly */
+	mail_storage_hooks_add_internal(&test_hooks);
+	test_mail_storage_init_user(test_ctx, &set);
+	test_assert(fts_parser_cache_is_enabled(test_ctx->user));
+	test_parser_deinit_ret = 1;
+}
+
+static void test_teardown(void)
+{
+	test_mail_storage_deinit_user(test_ctx);
+	mail_storage_hooks_remove_internal(&test_hooks);
+	test_mail_storage_deinit(&test_ctx);
+}
+
+int main(int argc, char **argv)
+{
+	void (*const tests[])(void) = {
+		test_setup,
+		test_fts_parser_cache_hit,
+		test_fts_parser_cache_key,
+		test_fts_parser_cache_failures,
+		test_teardown,
+		NULL
+	};
+	int ret;
+
+	master_service = master_service_init("test-fts-parser-cache",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	ret = test_run(tests);
+	master_service_deinit(&master_service);
+	return ret;
+}
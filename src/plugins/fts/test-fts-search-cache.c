@@ -0,0 +1,291 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "istream.h"
+#include "master-service.h"
+#include "mail-search-build.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+#include "fts-search-serialize.h"
+#include "fts-search-cache.h"
+#include "fts-storage.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+static struct test_mail_storage_ctx *test_ctx;
+static struct mailbox *test_box;
+
+/* the real one is in fts-search.c, which requires the whole plugin */
+void fts_search_uids_to_seqs(struct fts_search_context *fctx,
+			     const ARRAY_TYPE(seq_range) *uid_range,
+			     ARRAY_TYPE(seq_range) *seq_range)
+{
+	const struct seq_range *range;
+	uint32_t seq1, seq2;
+
+	if (!array_is_created(seq_range))
+		p_array_init(seq_range, fctx->result_pool, 8);
+	array_foreach(uid_range, range) {
+		mailbox_get_seq_range(fctx->box, range->seq1, range->seq2,
+				      &seq1, &seq2);
+		if (seq1 != 0)
+			seq_range_array_add_range(seq_range, seq1, seq2);
+	}
+}
+
+static struct fts_search_context *test_fctx_init(const char *word)
+{
+	struct fts_search_context *fctx;
+	struct mail_search_arg *arg;
+	pool_t pool;
+
+	pool = pool_alloconly_create("test fts search context", 1024);
+	fctx = p_new(pool, struct fts_search_context, 1);
+	fctx->result_pool = pool;
+	fctx->box = test_box;
+	fctx->search_cache = TRUE;
+	fctx->first_unindexed_seq = (uint32_t)-1;
+	p_array_init(&fctx->levels, pool, 4);
+
+	fctx->args = mail_search_build_init();
+	arg = mail_search_build_add(fctx->args, SEARCH_BODY);
+	arg->value.str = p_strdup(fctx->args->pool, word);
+	return fctx;
+}
+
+static void test_fctx_deinit(struct fts_search_context **_fctx)
+{
+	struct fts_search_context *fctx = *_fctx;
+
+	*_fctx = NULL;
+	mail_search_args_unref(&fctx->args);
+	pool_unref(&fctx->result_pool);
+}
+
+static void test_fctx_add_results(struct fts_search_context *fctx)
+{
+	struct fts_search_level *level;
+	struct fts_score_map *score;
+
+	level = array_append_space(&fctx->levels);
+	level->args_matches = buffer_create_dynamic(fctx->result_pool, 16);
+	fts_search_serialize(level->args_matches, fctx->args->args);
+	p_array_init(&level->definite_seqs, fctx->result_pool, 4);
+	seq_range_array_add(&level->definite_seqs, 1);
+	seq_range_array_add(&level->definite_seqs, 3);
+	p_array_init(&level->maybe_seqs, fctx->result_pool, 4);
+	seq_range_array_add(&level->maybe_seqs, 2);
+	p_array_init(&level->score_map, fctx->result_pool, 4);
+	score = array_append_space(&level->score_map);
+	score->uid = 3;
+	score->score = 0.5;
+}
+
+static bool test_cache_lookup(const char *word, uint32_t last_uid)
+{
+	struct fts_search_context *fctx = test_fctx_init(word);
+	const struct fts_search_level *level;
+	const struct fts_score_map *score;
+	bool found;
+
+	found = fts_search_cache_lookup(fctx, last_uid);
+	test_assert(fctx->search_cache_key != NULL);
+	if (found) {
+		test_assert(array_count(&fctx->levels) == 1);
+		level = array_front(&fctx->levels);
+		test_assert(seq_range_exists(&level->definite_seqs, 1));
+		test_assert(!seq_range_exists(&level->definite_seqs, 2));
+		test_assert(seq_range_exists(&level->definite_seqs, 3));
+		test_assert(seq_range_exists(&level->maybe_seqs, 2));
+		test_assert(array_count(&level->maybe_seqs) == 1);
+		test_assert(array_count(&level->score_map) == 1);
+		score = array_front(&level->score_map);
+		test_assert(score->uid == 3 && score->score == 0.5);
+		/* all the mails are searched using the cached results */
+		test_assert(fctx->first_unindexed_seq == (uint32_t)-1);
+	} else {
+		test_assert(array_count(&fctx->levels) == 0);
+	}
+	test_fctx_deinit(&fctx);
+	return found;
+}
+
+static void test_cache_update(const char *word, uint32_t last_uid)
+{
+	struct fts_search_context *fctx = test_fctx_init(word);
+
+	test_assert(!fts_search_cache_lookup(fctx, last_uid));
+	test_fctx_add_results(fctx);
+	fts_search_cache_update(fctx, last_uid);
+	test_fctx_deinit(&fctx);
+}
+
+static const char *test_cache_get_dir(void)
+{
+	const char *dir;
+
+	test_assert(mailbox_get_path_to(test_box, MAILBOX_LIST_PATH_TYPE_INDEX,
+					&dir) > 0);
+	return t_strconcat(dir, "/dovecot.fts.search-cache", NULL);
+}
+
+static unsigned int test_cache_get_file_count(void)
+{
+	const char *dir = test_cache_get_dir();
+	unsigned int count = 0;
+	struct dirent *d;
+	DIR *dirp;
+
+	dirp = opendir(dir);
+	if (dirp == NULL)
+		i_fatal("opendir(%s) failed: %m", dir);
+	while ((d = readdir(dirp)) != NULL) {
+		if (d->d_name[0] != '.')
+			count++;
+	}
+	(void)closedir(dirp);
+	return count;
+}
+
+static void test_fts_search_cache_last_uid(void)
+{
+	test_begin("fts search cache last uid");
+	test_assert(!test_cache_lookup("foo", 3));
+	test_cache_update("foo", 3);
+	test_assert(test_cache_lookup("foo", 3));
+	test_assert(!test_cache_lookup("bar", 3));
+
+	/* newer mails were indexed - with fts_enforced they must not be
+	   searched without FTS, so the cached results can't be used */
+	test_assert(!test_cache_lookup("foo", 4));
+	/* the index was rebuilt */
+	test_assert(!test_cache_lookup("foo", 2));
+
+	/* updating replaces the old results */
+	test_cache_update("foo", 4);
+	test_assert(test_cache_lookup("foo", 4));
+	test_assert(!test_cache_lookup("foo", 3));
+	test_end();
+}
+
+static void test_fts_search_cache_entries(void)
+{
+	const char *dir = test_cache_get_dir();
+	struct fts_search_context *fctx;
+	const char *path;
+	struct stat st1, st2;
+	unsigned int i;
+
+	test_begin("fts search cache entries");
+	test_cache_update("entry1", 3);
+	fctx = test_fctx_init("entry1");
+	test_assert(fts_search_cache_lookup(fctx, 3));
+	path = t_strdup_printf("%s/%s", dir, fctx->search_cache_key);
+	test_fctx_deinit(&fctx);
+	if (stat(path, &st1) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+
+	/* adding another search doesn't rewrite the existing ones */
+	test_cache_update("entry2", 3);
+	if (stat(path, &st2) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+	test_assert(st1.st_ino == st2.st_ino);
+	test_assert(test_cache_lookup("entry1", 3));
+	test_assert(test_cache_lookup("entry2", 3));
+
+	/* the number of cached searches is limited */
+	for (i = 0; i < 40; i++)
+		test_cache_update(t_strdup_printf("limit%u", i), 3);
+	test_assert(test_cache_get_file_count() == 32);
+	test_assert(test_cache_lookup("limit39", 3));
+	test_end();
+}
+
+static void test_mail_save(const char *mail_input)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	int ret;
+
+	input = i_stream_create_from_data(mail_input, strlen(mail_input));
+	trans = mailbox_transaction_begin(test_box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	save_ctx = mailbox_save_alloc(trans);
+	if (mailbox_save_begin(&save_ctx, input) < 0)
+		ret = -1;
+	else {
+		do {
+			ret = mailbox_save_continue(save_ctx);
+		} while (ret == 0 && i_stream_read(input) > 0);
+		if (ret < 0)
+			mailbox_save_cancel(&save_ctx);
+		else
+			ret = mailbox_save_finish(&save_ctx);
+	}
+	if (ret < 0)
+		mailbox_transaction_rollback(&trans);
+	else
+		ret = mailbox_transaction_commit(&trans);
+	if (ret < 0) {
+		i_fatal("Failed to save mail: %s",
+			mailbox_get_last_internal_error(test_box, NULL));
+	}
+	i_stream_unref(&input);
+}
+
+static void test_setup(void)
+{
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+	};
+	unsigned int i;
+
+	test_ctx = test_mail_storage_init();
+	test_mail_storage_init_user(test_ctx, &set);
+
+	test_box = mailbox_alloc(test_ctx->user->namespaces->list,
+				 "INBOX", 0);
+	if (mailbox_open(test_box) < 0) {
+		i_fatal("mailbox_open() failed: %s",
+			mailbox_get_last_internal_error(test_box, NULL));
+	}
+	for (i = 0; i < 3; i++)
+		test_mail_save("Subject: test\n\nfoo bar\n");
+	if (mailbox_sync(test_box, 0) < 0) {
+		i_fatal("mailbox_sync() failed: %s",
+			mailbox_get_last_internal_error(test_box, NULL));
+	}
+}
+
+static void test_teardown(void)
+{
+	mailbox_free(&test_box);
+	test_mail_storage_deinit_user(test_ctx);
+	test_mail_storage_deinit(&test_ctx);
+}
+
+int main(int argc, char **argv)
+{
+	void (*const tests[])(void) = {
+		test_setup,
+		test_fts_search_cache_last_uid,
+		test_fts_search_cache_entries,
+		test_teardown,
+		NULL
+	};
+	int ret;
+
+	master_service = master_service_init("test-fts-search-cache",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	ret = test_run(tests);
+	master_service_deinit(&master_service);
+	return ret;
+}